@@ -0,0 +1,174 @@
+#include "archive.h"
+#include "data_types.h"
+#include "file.h"
+#include "decompress.h"
+#include "directory.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "debugmalloc.h"
+
+/*
+ * Walks the serialized directory in the image, filling members when it is not NULL.
+ * Returns the number of members or FILE_READ_ERROR if an item is malformed.
+ */
+static long index_members(const char *image, size_t image_size, Archive_member *members) {
+    long count = 0;
+    size_t offset = 0;
+    while (offset < image_size) {
+        Directory_item item = {0};
+        long used = parse_item(&item, image + offset, image_size - offset);
+        if (used <= 0) return FILE_READ_ERROR;
+        if (members != NULL) {
+            if (item.is_dir) {
+                members[count] = (Archive_member){item.dir_path, true, item.perms, NULL, 0};
+            } else {
+                members[count] = (Archive_member){item.file_path, false, 0, item.file_data, item.file_size};
+            }
+        }
+        count++;
+        offset += used;
+    }
+    return count;
+}
+
+/*
+ * Finds raw[offset, offset + size) of a block-format archive inside a single unfiltered stored block.
+ * Returns those bytes in the archive itself, or NULL if any of them were coded (or the format has no blocks).
+ */
+static const char *stored_span(const Compressed_file *compressed, size_t offset, size_t size) {
+    const char *current = compressed->block_data;
+    const char *end = current + compressed->block_data_size;
+    size_t produced = 0;
+    while (compressed->block_data != NULL && current + sizeof(Block_header) <= end) {
+        Block_header header;
+        memcpy(&header, current, sizeof(Block_header));
+        current += sizeof(Block_header);
+        if (header.payload_size > (size_t)(end - current)) return NULL;
+        if (offset < produced + header.raw_size) {
+            bool stored = header.method == BLOCK_STORED && header.flags == 0 && header.payload_size == header.raw_size;
+            return (stored && offset + size <= produced + header.raw_size) ? current + (offset - produced) : NULL;
+        }
+        produced += header.raw_size;
+        current += header.payload_size;
+    }
+    return NULL;
+}
+
+/*
+ * Opens a compressed file or directory for in-memory access: the payload is decoded once into an
+ * anonymous mapping and every member is a span into it, so nothing is written to the filesystem.
+ * Files kept whole in a stored block are spans into the archive mapping instead: a payload stored in
+ * one block is not decoded at all, and a decoded directory hands back the pages of such members.
+ * Returns SUCCESS or a negative code; on failure the archive holds nothing that needs closing.
+ */
+int archive_open(char *file_name, Archive *archive) {
+    int ret = SUCCESS;
+    Compressed_file compressed = {0};
+    const char *mmap_ptr = NULL;
+    long mmap_size = 0;
+    *archive = (Archive){0};
+
+    while (true) {
+        mmap_size = read_compressed(file_name, &compressed, &mmap_ptr);
+        if (mmap_size < 0) {
+            ret = mmap_size;
+            mmap_ptr = NULL;
+            break;
+        }
+        if (compressed.original_size == 0) {
+            ret = FILE_MAGIC_ERROR;
+            break;
+        }
+
+        archive->is_dir = compressed.is_dir;
+        archive->name = strdup(compressed.original_file);
+        if (archive->name == NULL) {
+            ret = MALLOC_ERROR;
+            break;
+        }
+        archive->mapping = mmap_ptr;
+        archive->mapping_size = mmap_size;
+        mmap_ptr = NULL;
+
+        /* A payload kept whole in one stored block is used where it lies; anything else is decoded. */
+        const char *payload = stored_span(&compressed, 0, compressed.original_size);
+        if (payload == NULL) {
+            archive->image = mmap(NULL, compressed.original_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (archive->image == MAP_FAILED) {
+                archive->image = NULL;
+                ret = MALLOC_ERROR;
+                break;
+            }
+            archive->image_size = compressed.original_size;
+            if (decompress(&compressed, archive->image) != 0) {
+                ret = DECOMPRESSION_ERROR;
+                break;
+            }
+            payload = archive->image;
+        }
+
+        long count = archive->is_dir ? index_members(payload, compressed.original_size, NULL) : 1;
+        if (count < 0) {
+            ret = count;
+            break;
+        }
+        archive->members = malloc(count * sizeof(Archive_member));
+        if (archive->members == NULL) {
+            ret = MALLOC_ERROR;
+            break;
+        }
+        archive->member_count = count;
+        if (!archive->is_dir) {
+            archive->members[0] = (Archive_member){archive->name, false, 0, payload, compressed.original_size};
+            break;
+        }
+        index_members(payload, compressed.original_size, archive->members);
+
+        /* Members of a decoded directory that one stored block holds whole point into the archive instead. */
+        long page = sysconf(_SC_PAGESIZE);
+        for (long i = 0; archive->image != NULL && i < count; i++) {
+            Archive_member *member = &archive->members[i];
+            if (member->size == 0) continue;
+            size_t offset = member->data - archive->image;
+            const char *span = stored_span(&compressed, offset, member->size);
+            if (span == NULL) continue;
+            // Only whole pages of the member are handed back; its neighbours' bytes stay decoded.
+            size_t first = (offset + page - 1) / page * page;
+            size_t last = (offset + member->size) / page * page;
+            if (first < last) madvise(archive->image + first, last - first, MADV_DONTNEED);
+            member->data = span;
+        }
+        break;
+    }
+
+    if (mmap_ptr != NULL) munmap((void*)mmap_ptr, mmap_size);
+    free(compressed.file_name);
+    free(compressed.original_file);
+    if (ret != SUCCESS) archive_close(archive);
+    return ret;
+}
+
+/*
+ * Looks up a member by its archived path (for example "dir/sub/file.txt").
+ * Returns the member or NULL if the archive has no such path.
+ */
+const Archive_member *archive_find(const Archive *archive, const char *path) {
+    for (size_t i = 0; i < archive->member_count; i++) {
+        if (strcmp(archive->members[i].path, path) == 0) return &archive->members[i];
+    }
+    return NULL;
+}
+
+/*
+ * Releases everything archive_open allocated; the member spans become invalid.
+ */
+void archive_close(Archive *archive) {
+    if (archive->image != NULL) munmap(archive->image, archive->image_size);
+    if (archive->mapping != NULL) munmap((void *)archive->mapping, archive->mapping_size);
+    free(archive->members);
+    free(archive->name);
+    *archive = (Archive){0};
+}
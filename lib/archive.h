@@ -0,0 +1,10 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "data_types.h"
+
+int archive_open(char *file_name, Archive *archive);
+const Archive_member *archive_find(const Archive *archive, const char *path);
+void archive_close(Archive *archive);
+
+#endif // ARCHIVE_H
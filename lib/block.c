@@ -0,0 +1,788 @@
+#define _GNU_SOURCE
+#include "block.h"
+#include "data_types.h"
+#include "compress.h"
+#include "table_cache.h"
+#include "file.h"
+#include "throttle.h"
+#include "cm.h"
+#include "recompress.h"
+#include "filter.h"
+#include "words.h"
+#include "workers.h"
+#include "volume.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "debugmalloc.h"
+
+// Smallest unit the splitter places boundaries between.
+#define SPLIT_UNIT_MIN 4096
+// At most this many units are scanned; larger inputs get larger units.
+#define SPLIT_UNITS_MAX 4096
+// The optimal (level 9) split keeps a histogram per unit, so it uses fewer, larger units.
+#define OPTIMAL_UNITS_MAX 512
+// While consuming the input, blocks and batches are kept this small, bounding the extra disk space.
+#define CONSUME_BATCH_SIZE (8 * 1024 * 1024)
+// Under a deadline the input is split and coded this much at a time, so the level can drop in between.
+#define DEADLINE_SEGMENT_SIZE (1024 * 1024)
+// At CM_LEVEL ELF files of one machine this close together (a member header apart) share their blocks.
+#define ELF_RUN_GAP (8 * 1024)
+
+// Whether Huffman blocks are coded as interleaved lanes (see set_lanes).
+static bool lanes_enabled = false;
+// Whether blocks are also tried as words (see set_words).
+static bool words_enabled = false;
+
+/*
+ * Progress of an encode against the deadline (see set_deadline).
+ * The rate since the level was last chosen predicts whether the rest of the input finishes in time.
+ */
+typedef struct {
+    int level;          // Level the rest of the input is split at; 0 stores it.
+    size_t offset;      // Input coded when the level was chosen.
+    double remaining;   // Seconds left then.
+} Pace;
+
+// What next_blocks has found ahead of the blocks coded so far: deflate streams and ELF files.
+typedef struct {
+    Deflate_scan deflate;
+    Elf_span elf;
+    size_t elf_scanned;
+} Block_scan;
+
+/*
+ * Packs 256 code lengths (each at most BLOCK_MAX_CODE_LENGTH) two per byte, the even symbol in the high nibble.
+ */
+void pack_lengths(const unsigned char *lengths, unsigned char *packed) {
+    for (int i = 0; i < PACKED_LENGTHS_SIZE; i++) {
+        packed[i] = (unsigned char)((lengths[2 * i] << 4) | lengths[2 * i + 1]);
+    }
+}
+
+void unpack_lengths(const unsigned char *packed, unsigned char *lengths) {
+    for (int i = 0; i < PACKED_LENGTHS_SIZE; i++) {
+        lengths[2 * i] = packed[i] >> 4;
+        lengths[2 * i + 1] = packed[i] & 0x0F;
+    }
+}
+
+/*
+ * Estimates the size in bits of a block with the given histogram, header included,
+ * as the cheapest of the methods encode_block chooses from.
+ */
+static size_t block_cost(const long *histogram, size_t count) {
+    unsigned long long work[256];
+    unsigned long long scratch[256];
+    unsigned char lengths[256];
+    size_t header = sizeof(Block_header) * 8;
+    if (count == 0) return 0;
+
+    int symbols = compute_code_lengths(histogram, 256, work, scratch, lengths, BLOCK_MAX_CODE_LENGTH);
+    if (symbols == 1) return header + 8;
+    size_t bits = PACKED_LENGTHS_SIZE * 8;
+    for (int i = 0; i < 256; i++) {
+        bits += (size_t)histogram[i] * lengths[i];
+    }
+    return header + (bits < count * 8 ? bits : count * 8);
+}
+
+static void add_histogram(long *histogram, const unsigned char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) histogram[data[i]]++;
+}
+
+/*
+ * Greedy split: extends the current block one unit at a time while coding them together
+ * is no more expensive than closing the block and starting a new one.
+ */
+static long split_greedy(const unsigned char *data, size_t data_len, size_t unit, size_t *ends) {
+    long count = 0;
+    long current[256] = {0};
+    add_histogram(current, data, unit < data_len ? unit : data_len);
+    size_t current_cost = block_cost(current, unit < data_len ? unit : data_len);
+    size_t current_len = unit < data_len ? unit : data_len;
+
+    for (size_t start = unit; start < data_len; start += unit) {
+        size_t length = data_len - start < unit ? data_len - start : unit;
+        long next[256] = {0};
+        long merged[256];
+        add_histogram(next, data + start, length);
+        for (int i = 0; i < 256; i++) merged[i] = current[i] + next[i];
+        size_t next_cost = block_cost(next, length);
+        size_t merged_cost = block_cost(merged, current_len + length);
+
+        if (merged_cost <= current_cost + next_cost) {
+            memcpy(current, merged, sizeof(merged));
+            current_cost = merged_cost;
+            current_len += length;
+        } else {
+            ends[count++] = start;
+            memcpy(current, next, sizeof(next));
+            current_cost = next_cost;
+            current_len = length;
+        }
+    }
+    ends[count++] = data_len;
+    return count;
+}
+
+/*
+ * Optimal split over unit boundaries by dynamic programming: best[j] is the cheapest coding
+ * of the first j units, trying every earlier boundary as the start of the last block.
+ */
+static long split_optimal(const unsigned char *data, size_t data_len, size_t unit, size_t *ends) {
+    long ret = 0;
+    size_t units = (data_len + unit - 1) / unit;
+    unsigned int *unit_histograms = malloc(units * 256 * sizeof(unsigned int));
+    size_t *best = malloc((units + 1) * sizeof(size_t));
+    size_t *previous = malloc((units + 1) * sizeof(size_t));
+
+    while (true) {
+        if (unit_histograms == NULL || best == NULL || previous == NULL) {
+            ret = MALLOC_ERROR;
+            break;
+        }
+        memset(unit_histograms, 0, units * 256 * sizeof(unsigned int));
+        for (size_t i = 0; i < data_len; i++) {
+            unit_histograms[(i / unit) * 256 + data[i]]++;
+        }
+
+        best[0] = 0;
+        for (size_t j = 1; j <= units; j++) {
+            long histogram[256] = {0};
+            size_t end = j * unit < data_len ? j * unit : data_len;
+            best[j] = (size_t)-1;
+            for (size_t i = j; i-- > 0;) {
+                for (int s = 0; s < 256; s++) histogram[s] += unit_histograms[i * 256 + s];
+                size_t cost = best[i] + block_cost(histogram, end - i * unit);
+                if (cost < best[j]) {
+                    best[j] = cost;
+                    previous[j] = i;
+                }
+            }
+        }
+
+        /* Walk the choices back from the end, then reverse them into ascending order. */
+        for (size_t j = units; j > 0; j = previous[j]) {
+            ends[ret++] = j * unit < data_len ? j * unit : data_len;
+        }
+        for (long i = 0; i < ret / 2; i++) {
+            size_t swap = ends[i];
+            ends[i] = ends[ret - 1 - i];
+            ends[ret - 1 - i] = swap;
+        }
+        break;
+    }
+
+    free(unit_histograms);
+    free(best);
+    free(previous);
+    return ret;
+}
+
+/*
+ * Cuts every block longer than max_block into max_block-sized pieces, growing the ends array.
+ * Returns the new number of blocks or MALLOC_ERROR.
+ */
+static long cap_blocks(size_t **ends, long count, size_t max_block) {
+    long capped = 0;
+    size_t start = 0;
+    for (long i = 0; i < count; i++) {
+        capped += ((*ends)[i] - start + max_block - 1) / max_block;
+        start = (*ends)[i];
+    }
+    if (capped == count) return count;
+
+    size_t *pieces = malloc(capped * sizeof(size_t));
+    if (pieces == NULL) return MALLOC_ERROR;
+    long next = 0;
+    start = 0;
+    for (long i = 0; i < count; i++) {
+        for (size_t end = start + max_block; end < (*ends)[i]; end += max_block) pieces[next++] = end;
+        pieces[next++] = (*ends)[i];
+        start = (*ends)[i];
+    }
+    free(*ends);
+    *ends = pieces;
+    return capped;
+}
+
+/*
+ * Chooses block boundaries for the data at the given level: fixed-size blocks at level 1,
+ * greedy cost-based merging of units up to level 8, the optimal split at level 9,
+ * and fixed CM_BLOCK_SIZE blocks, one per core, at CM_LEVEL.
+ * No block is longer than max_block unless it is 0.
+ * Stores the exclusive end offset of every block in a newly allocated *ends (caller frees).
+ * Returns the number of blocks or MALLOC_ERROR.
+ */
+long split_blocks(const unsigned char *data, size_t data_len, int level, size_t max_block, size_t **ends) {
+    size_t unit = (level >= CM_LEVEL) ? CM_BLOCK_SIZE : FIXED_BLOCK_SIZE;
+    if (level > 1 && level < CM_LEVEL) {
+        size_t max_units = (level >= MAX_LEVEL) ? OPTIMAL_UNITS_MAX : SPLIT_UNITS_MAX;
+        unit = (data_len + max_units - 1) / max_units;
+        if (unit < SPLIT_UNIT_MIN) unit = SPLIT_UNIT_MIN;
+    }
+    size_t units = data_len > 0 ? (data_len + unit - 1) / unit : 1;
+
+    *ends = malloc(units * sizeof(size_t));
+    if (*ends == NULL) return MALLOC_ERROR;
+    if (data_len == 0) {
+        (*ends)[0] = 0;
+        return 1;
+    }
+
+    long count = 0;
+    if (level <= 1 || level >= CM_LEVEL) {
+        for (size_t start = 0; start < data_len; start += unit) {
+            (*ends)[count++] = data_len - start < unit ? data_len : start + unit;
+        }
+    } else if (level < MAX_LEVEL) {
+        count = split_greedy(data, data_len, unit, *ends);
+    } else {
+        count = split_optimal(data, data_len, unit, *ends);
+    }
+    if (count > 0 && max_block > 0) count = cap_blocks(ends, count, max_block);
+    if (count < 0) {
+        free(*ends);
+        *ends = NULL;
+    }
+    return count;
+}
+
+/*
+ * Makes encode_block code Huffman blocks as BLOCK_LANES, which wide (SIMD) decoders read several lanes
+ * at a time, instead of one bitstream. Set it before compressing; it applies to the whole process.
+ */
+void set_lanes(bool enabled) {
+    lanes_enabled = enabled;
+}
+
+/*
+ * Text mode: makes encode_block also code blocks by words (BLOCK_WORDS, see encode_words) and keep that
+ * where it comes out smaller. Set it before compressing; it applies to the whole process.
+ */
+void set_words(bool enabled) {
+    words_enabled = enabled;
+}
+
+/*
+ * Codes data in LANE_SEGMENT_SYMBOLS segments of LANE_COUNT interleaved bitstreams (the BLOCK_LANES layout)
+ * into out, which must hold lanes_bound() bytes. Returns the number of bytes written.
+ */
+static size_t encode_lanes(const unsigned char *data, size_t data_len, const Huffman_code *codes, unsigned char *out) {
+    size_t written = 0;
+    for (size_t first = 0; first < data_len; first += LANE_SEGMENT_SYMBOLS) {
+        size_t count = data_len - first < LANE_SEGMENT_SYMBOLS ? data_len - first : LANE_SEGMENT_SYMBOLS;
+        unsigned short sizes[LANE_COUNT];
+        unsigned char *lane = out + written + LANE_SEGMENT_HEADER;
+        for (int i = 0; i < LANE_COUNT; i++) {
+            unsigned long long acc = 0;
+            int acc_bits = 0;
+            size_t lane_pos = 0;
+            for (size_t j = i; j < count; j += LANE_COUNT) {
+                Huffman_code code = codes[data[first + j]];
+                acc = (acc << code.length) | code.bits;
+                acc_bits += code.length;
+                while (acc_bits >= 8) {
+                    acc_bits -= 8;
+                    lane[lane_pos++] = (unsigned char)(acc >> acc_bits);
+                }
+            }
+            if (acc_bits > 0) lane[lane_pos++] = (unsigned char)(acc << (8 - acc_bits));
+            sizes[i] = (unsigned short)lane_pos;
+            lane += lane_pos;
+        }
+        memcpy(out + written, sizes, sizeof(sizes));
+        written = lane - out;
+    }
+    return written;
+}
+
+// Most bytes encode_lanes writes for data_len bytes coded in `bits` bits: each lane rounds up to a byte.
+static size_t lanes_bound(size_t bits, size_t data_len) {
+    size_t segments = (data_len + LANE_SEGMENT_SYMBOLS - 1) / LANE_SEGMENT_SYMBOLS;
+    return bits / 8 + segments * (LANE_SEGMENT_HEADER + LANE_COUNT);
+}
+
+/*
+ * Copies one block into out verbatim behind its header. Returns the number of bytes written.
+ */
+static size_t store_block(const unsigned char *data, size_t data_len, unsigned char *out) {
+    Block_header header;
+    memset(&header, 0, sizeof(header));
+    header.method = BLOCK_STORED;
+    header.raw_size = data_len;
+    header.payload_size = data_len;
+    memcpy(out, &header, sizeof(Block_header));
+    memcpy(out + sizeof(Block_header), data, data_len);
+    return sizeof(Block_header) + data_len;
+}
+
+/*
+ * Codes one block into out (header and payload) with the cheapest method:
+ * a fill for a single repeated byte, Huffman with length-limited canonical codes,
+ * or stored when the Huffman payload would not be smaller than the data.
+ * After set_lanes(true) Huffman blocks are written as BLOCK_LANES where that still beats storing them.
+ * At CM_LEVEL the block is context-mixed (BLOCK_CM) when that comes out smaller than the others, and after
+ * set_words(true) coded by words (BLOCK_WORDS) when that does.
+ * Level 1 takes the code lengths from approximate_code_lengths rather than computing optimal ones.
+ * out must hold sizeof(Block_header) + data_len + 1 bytes. pair_table is scratch for the byte-pair coder
+ * (PAIR_TABLE_ENTRIES entries) or NULL to code one byte at a time; nothing is allocated (context mixing
+ * and word coding map their scratch), so it is safe on worker threads.
+ * Returns the number of bytes written.
+ */
+size_t encode_block(const unsigned char *data, size_t data_len, int level, unsigned char *out, Huffman_code *pair_table) {
+    Block_header header;
+    memset(&header, 0, sizeof(header)); // Padding bytes are written too.
+    header.raw_size = data_len;
+    unsigned char *payload = out + sizeof(Block_header);
+
+    long histogram[256] = {0};
+    unsigned long long work[256];
+    unsigned long long scratch[256];
+    unsigned char lengths[256];
+    add_histogram(histogram, data, data_len);
+    int symbols = (level <= MIN_LEVEL) ? approximate_code_lengths(histogram, lengths, BLOCK_MAX_CODE_LENGTH)
+                                       : compute_code_lengths(histogram, 256, work, scratch, lengths, BLOCK_MAX_CODE_LENGTH);
+
+    size_t bits = 0;
+    int max_length = 0;
+    for (int i = 0; i < 256; i++) {
+        bits += (size_t)histogram[i] * lengths[i];
+        if (lengths[i] > max_length) max_length = lengths[i];
+    }
+
+    // Context mixing has to beat whichever of Huffman and storing comes next.
+    size_t cm_size = 0;
+    if (level >= CM_LEVEL && symbols > 1) {
+        size_t rival = PACKED_LENGTHS_SIZE + (bits + 7) / 8 < data_len ? PACKED_LENGTHS_SIZE + (bits + 7) / 8 : data_len;
+        cm_size = cm_encode(data, data_len, payload, rival - 1);
+    }
+    size_t words_size = 0;
+    if (words_enabled && cm_size == 0 && symbols > 1) {
+        size_t rival = PACKED_LENGTHS_SIZE + (bits + 7) / 8 < data_len ? PACKED_LENGTHS_SIZE + (bits + 7) / 8 : data_len;
+        words_size = encode_words(data, data_len, payload, rival - 1);
+    }
+
+    if (symbols == 1) {
+        header.method = BLOCK_FILL;
+        header.payload_size = 1;
+        payload[0] = data[0];
+    } else if (cm_size > 0) {
+        header.method = BLOCK_CM;
+        header.payload_size = cm_size;
+    } else if (words_size > 0) {
+        header.method = BLOCK_WORDS;
+        header.payload_size = words_size;
+    } else if (symbols == 0 || PACKED_LENGTHS_SIZE + (bits + 7) / 8 >= data_len) {
+        return store_block(data, data_len, out);
+    } else {
+        header.method = BLOCK_HUFFMAN;
+        header.payload_size = PACKED_LENGTHS_SIZE + (bits + 7) / 8;
+        pack_lengths(lengths, payload);
+
+        Huffman_code codes[256];
+        if (!lookup_tables(lengths, NULL, NULL, codes)) {
+            canonical_codes(lengths, codes);
+            store_tables(lengths, NULL, 0, codes);
+        }
+        char *stream = (char *)payload + PACKED_LENGTHS_SIZE;
+        if (lanes_enabled && PACKED_LENGTHS_SIZE + lanes_bound(bits, data_len) < data_len) {
+            header.method = BLOCK_LANES;
+            header.payload_size = PACKED_LENGTHS_SIZE + encode_lanes(data, data_len, codes, (unsigned char *)stream);
+        } else if (pair_table != NULL && data_len >= PAIR_TABLE_MIN_SIZE && max_length <= PAIR_MAX_CODE_LENGTH) {
+            build_pair_table(codes, pair_table);
+            compress_pairs(data, data_len, codes, pair_table, stream);
+        } else {
+            compress_codes(data, data_len, codes, stream);
+        }
+    }
+
+    memcpy(out, &header, sizeof(Block_header));
+    return sizeof(Block_header) + header.payload_size;
+}
+
+/*
+ * Codes at most FIXED_BLOCK_SIZE bytes as blocks without allocating, so it is safe on worker threads:
+ * levels 1 and CM_LEVEL code a single block, the others split greedily over SPLIT_UNIT_MIN units.
+ * out must hold blocks_bound(data_len) bytes; pair_table is as for encode_block.
+ * Returns the number of bytes written.
+ */
+size_t encode_chunk(const unsigned char *data, size_t data_len, int level, unsigned char *out, Huffman_code *pair_table) {
+    size_t ends[FIXED_BLOCK_SIZE / SPLIT_UNIT_MIN];
+    long count = 1;
+    ends[0] = data_len;
+    if (level > 1 && level < CM_LEVEL && data_len > SPLIT_UNIT_MIN) count = split_greedy(data, data_len, SPLIT_UNIT_MIN, ends);
+
+    size_t written = 0;
+    size_t start = 0;
+    for (long i = 0; i < count; i++) {
+        written += encode_block(data + start, ends[i] - start, level, out + written, pair_table);
+        start = ends[i];
+    }
+    return written;
+}
+
+/*
+ * Upper bound of the coded size of data_len bytes split into blocks no shorter than SPLIT_UNIT_MIN,
+ * each of which at worst is stored behind its header and one byte of slack.
+ */
+size_t blocks_bound(size_t data_len) {
+    return data_len + (data_len / SPLIT_UNIT_MIN + 1) * (sizeof(Block_header) + 1);
+}
+
+/*
+ * Lowers the level once the rate measured since it was chosen would not finish the rest of the input
+ * before the deadline: a boundary search gives way to fixed level 1 blocks, and those to stored blocks.
+ * Once the deadline has passed everything left is stored.
+ */
+static void pace_level(Pace *pace, size_t done, size_t data_len) {
+    double remaining = deadline_remaining();
+    if (remaining <= 0) {
+        pace->level = 0;
+        return;
+    }
+    if (pace->level == 0 || done == pace->offset) return;
+    double needed = (pace->remaining - remaining) * (double)(data_len - done) / (double)(done - pace->offset);
+    if (needed > remaining) {
+        pace->level = pace->level > 1 ? 1 : 0;
+        pace->offset = done;
+        pace->remaining = remaining;
+    }
+}
+
+/*
+ * Ends the blocks of an ELF file at whole instruction words counted from its start, so the ARM64 filter,
+ * which only looks at words aligned in the block, sees the same words the file has.
+ */
+static void align_ends(size_t *ends, long count, size_t base, size_t last) {
+    size_t previous = 0;
+    for (long i = 0; i < count; i++) {
+        size_t aligned = base + ((ends[i] - base) & ~(size_t)3);
+        if (ends[i] != last && aligned > previous) ends[i] = aligned;
+        previous = ends[i];
+    }
+}
+
+/*
+ * Chooses the blocks from start onwards: all of the rest of the data, or under a deadline the next
+ * DEADLINE_SEGMENT_SIZE bytes at the level pace_level settles on. An x86 or ARM64 ELF file (see find_elf)
+ * gets blocks of its own, which encode_blocks runs through the branch filter; scan->elf is that file
+ * (at CM_LEVEL, the run of files it starts) once start reaches it. At CM_LEVEL a deflate stream that zlib reproduces (see find_deflate_stream) ends
+ * the blocks before it and then makes up a block of its own; scan->deflate.next is that stream once start
+ * reaches it. Huffman levels leave streams alone: an order-0 code of the inflated data is larger than the
+ * deflate stream. Stores absolute end offsets in *ends as split_blocks does.
+ * Returns the number of blocks or MALLOC_ERROR.
+ */
+static long next_blocks(const unsigned char *data, size_t start, size_t data_len, size_t max_block, Pace *pace, Block_scan *scan, size_t **ends) {
+    size_t length = data_len - start;
+    if (deadline_enabled()) {
+        if (length > DEADLINE_SEGMENT_SIZE) length = DEADLINE_SEGMENT_SIZE;
+        pace_level(pace, start, data_len);
+    }
+    if (pace->level > 0) {
+        Elf_span *elf = &scan->elf;
+        if (elf->length > 0 && elf->offset + elf->length <= start) elf->length = 0;
+        if (elf->length == 0 && scan->elf_scanned < data_len) {
+            size_t from = scan->elf_scanned > start ? scan->elf_scanned : start;
+            bool found = find_elf(data, from, data_len, elf);
+            // Blocks of context mixing learn from one file for the next, so a run of them is kept together.
+            Elf_span next;
+            while (found && pace->level >= CM_LEVEL && elf->offset + elf->length < data_len) {
+                size_t end = elf->offset + elf->length;
+                if (!find_elf(data, end, data_len, &next) || next.offset - end > ELF_RUN_GAP || next.filter != elf->filter) break;
+                elf->length = next.offset + next.length - elf->offset;
+            }
+            scan->elf_scanned = found ? elf->offset + elf->length : data_len;
+        }
+        if (elf->length > 0 && elf->offset <= start) {
+            size_t end = elf->offset + elf->length;
+            if (end - start < length) length = end - start;
+            long count = split_blocks(data + start, length, pace->level, max_block, ends);
+            for (long i = 0; i < count; i++) (*ends)[i] += start;
+            if (count > 0) align_ends(*ends, count, elf->offset, end);
+            return count;
+        }
+        if (elf->length > 0 && elf->offset - start < length) length = elf->offset - start;
+    }
+    if (pace->level >= CM_LEVEL) {
+        Deflate_scan *deflate = &scan->deflate;
+        if (deflate->next.length > 0 && deflate->next.offset < start) deflate->next.length = 0;
+        if (deflate->next.length == 0 && deflate->scanned < data_len) {
+            size_t from = deflate->scanned > start ? deflate->scanned : start;
+            bool found = find_deflate_stream(data, from, data_len, max_block > 0 ? max_block : data_len, &deflate->next);
+            deflate->scanned = found ? deflate->next.offset + deflate->next.length : data_len;
+        }
+        if (deflate->next.length > 0 && deflate->next.offset == start) {
+            *ends = malloc(sizeof(size_t));
+            if (*ends == NULL) return MALLOC_ERROR;
+            (*ends)[0] = start + deflate->next.length;
+            return 1;
+        }
+        if (deflate->next.length > 0 && deflate->next.offset - start < length) length = deflate->next.offset - start;
+    }
+    long count = split_blocks(data + start, length, pace->level > 0 ? pace->level : 1, max_block, ends);
+    for (long i = 0; i < count; i++) (*ends)[i] += start;
+    return count;
+}
+
+// The deflate stream the blocks from start make up, if next_blocks chose one.
+static const Deflate_stream *scan_stream(const Block_scan *scan, size_t start) {
+    return (scan->deflate.next.length > 0 && scan->deflate.next.offset == start) ? &scan->deflate.next : NULL;
+}
+
+// The branch filter for the blocks from start: that of the ELF file they belong to, else 0.
+static unsigned char scan_filter(const Block_scan *scan, size_t start) {
+    const Elf_span *elf = &scan->elf;
+    return (elf->length > 0 && elf->offset <= start && start < elf->offset + elf->length) ? elf->filter : 0;
+}
+
+/*
+ * Codes a block as encode_block does after running it through a branch filter (a BLOCK_FILTER_* flag,
+ * or 0 for none) and records the filter in the block header. The filtered copy is mapped rather than
+ * allocated, so this too is safe on worker threads; without the memory the block is coded unfiltered.
+ */
+static size_t encode_filtered(const unsigned char *data, size_t data_len, int level, unsigned char filter,
+                              unsigned char *out, Huffman_code *pair_table) {
+    if (filter == 0 || data_len == 0) return encode_block(data, data_len, level, out, pair_table);
+    unsigned char *filtered = mmap(NULL, data_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (filtered == MAP_FAILED) return encode_block(data, data_len, level, out, pair_table);
+    memcpy(filtered, data, data_len);
+    filter_block(filter, filtered, data_len, true);
+    size_t written = encode_block(filtered, data_len, level, out, pair_table);
+    munmap(filtered, data_len);
+
+    Block_header header;
+    memcpy(&header, out, sizeof(Block_header));
+    header.flags = filter;
+    memcpy(out, &header, sizeof(Block_header));
+    return written;
+}
+
+// One block of a batch coded on a worker thread.
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    int level;
+    unsigned char filter;
+    unsigned char *out;
+    size_t written;
+} Block_job;
+
+static void *encode_block_job(void *arg) {
+    Block_job *job = arg;
+    job->written = encode_filtered(job->data, job->length, job->level, job->filter, job->out, NULL);
+    return NULL;
+}
+
+/*
+ * Codes the blocks ending at ends[0..count), the first starting at start, one after another into out,
+ * which must hold the sum of their bounds (length + sizeof(Block_header) + 1); level 0 stores them.
+ * With a stream the one block is that deflate stream, kept inflated (see encode_inflated); otherwise
+ * coded blocks go through the branch filter given (see encode_filtered).
+ * Context mixing is slow enough that at CM_LEVEL one block goes to each core, as far as the memory budget
+ * has room for their models (see cm_model_limit): every block is coded into a slot of its own and the
+ * slots are then packed together. Where it has room for none, cm_encode declines and the blocks are
+ * coded with Huffman codes instead.
+ * Returns the number of bytes written, or MALLOC_ERROR.
+ */
+static long encode_blocks(const unsigned char *data, size_t start, const size_t *ends, long count, int level, unsigned char *out,
+                          Huffman_code *pair_table, const Deflate_stream *stream, unsigned char filter) {
+    if (stream != NULL) return encode_inflated(data, stream, level, out, pair_table);
+    size_t written = 0;
+    if (level < CM_LEVEL) {
+        for (long i = 0; i < count; i++) {
+            written += (level > 0) ? encode_filtered(data + start, ends[i] - start, level, filter, out + written, pair_table)
+                                   : store_block(data + start, ends[i] - start, out + written);
+            start = ends[i];
+        }
+        return written;
+    }
+
+    // Each job maps a model of its own, so no more run at once than the memory budget holds.
+    int worker_count = max_workers();
+    int models = cm_model_limit(worker_count);
+    if (models > 0) worker_count = models;
+    Block_job *jobs = malloc((count < worker_count ? count : worker_count) * sizeof(Block_job));
+    if (jobs == NULL) return MALLOC_ERROR;
+    size_t slot = 0;
+    for (long first = 0; first < count; first += worker_count) {
+        long group = count - first < worker_count ? count - first : worker_count;
+        for (long i = 0; i < group; i++) {
+            size_t length = ends[first + i] - start;
+            jobs[i] = (Block_job){data + start, length, level, filter, out + slot, 0};
+            slot += length + sizeof(Block_header) + 1;
+            start = ends[first + i];
+        }
+        run_workers(group, encode_block_job, jobs, sizeof(Block_job));
+        for (long i = 0; i < group; i++) {
+            memmove(out + written, jobs[i].out, jobs[i].written);
+            written += jobs[i].written;
+        }
+    }
+    free(jobs);
+    return written;
+}
+
+/*
+ * Writes length bytes at offset in the archive: to the file, or to the stripes of the volumes.
+ * Returns SUCCESS or FILE_WRITE_ERROR.
+ */
+static int write_output(int fd, Volume_writer *volumes, const char *data, size_t length, size_t offset) {
+    if (volumes != NULL) return write_volumes(volumes, data, length, offset);
+    throttle_io(length);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pwrite(fd, data + done, length - done, offset + done);
+        if (n <= 0) return FILE_WRITE_ERROR;
+        done += n;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Codes the data as blocks and writes the block-format archive to fd, or to the volumes if given,
+ * without holding the whole output: blocks are coded in batches into a buffer sized to the memory budget
+ * (see budgeted_size), each batch is written out, and fewer blocks are batched while memory pressure is high.
+ * The header fields of compressed (is_dir, original_file, original_size) must be set.
+ * With a consume_fd (the input opened for writing, else -1) every batch is made durable and then
+ * the input it came from is punched out of the file, so input and output never both exist in full.
+ * Under a deadline the level drops as needed to finish in time (see pace_level).
+ * Returns the archive size on success or a negative code on failure.
+ */
+static long emit_blocks(Compressed_file *compressed, const char *data, size_t data_len, int level,
+                        int fd, Volume_writer *volumes, int consume_fd) {
+    long ret = SUCCESS;
+    size_t *ends = NULL;
+    unsigned char *header = NULL;
+    Huffman_code *pair_table = NULL;
+    char *buffer = MAP_FAILED;
+    size_t buffer_size = budgeted_size(data_len + sizeof(Block_header) + 1, 2);
+    // Rounded down to whole pages, a buffer for all of the input falls short of it by a tail not worth a block.
+    if (buffer_size + (size_t)sysconf(_SC_PAGESIZE) > data_len + sizeof(Block_header) + 1) buffer_size = data_len + sizeof(Block_header) + 1;
+    size_t max_block = (buffer_size < data_len + sizeof(Block_header) + 1) ? buffer_size - sizeof(Block_header) - 1 : 0;
+    if (consume_fd != -1 && (max_block == 0 || max_block > CONSUME_BATCH_SIZE)) max_block = CONSUME_BATCH_SIZE;
+
+    memcpy(compressed->magic, block_magic, sizeof(block_magic));
+    compressed->block_data = NULL;
+    compressed->block_data_size = 0;
+    long header_size = compressed_file_size(compressed);
+    Pace pace = {level, 0, deadline_remaining()};
+    Block_scan scan = {0};
+
+    while (true) {
+        header = malloc(header_size);
+        pair_table = malloc(PAIR_TABLE_ENTRIES * sizeof(Huffman_code));
+        buffer = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (header == NULL || pair_table == NULL || buffer == MAP_FAILED) {
+            ret = MALLOC_ERROR;
+            break;
+        }
+        serialize_compressed(compressed, header);
+        ret = write_output(fd, volumes, (const char *)header, header_size, 0);
+        if (ret != SUCCESS) break;
+
+        size_t start = 0;
+        size_t blocks_size = 0;
+        size_t punched = 0;
+        do {
+            long count = next_blocks((const unsigned char *)data, start, data_len, max_block, &pace, &scan, &ends);
+            if (count < 0) {
+                ret = count;
+                break;
+            }
+            for (long i = 0; i < count && ret == SUCCESS;) {
+                size_t limit = memory_pressure_high() ? buffer_size / 2 : buffer_size;
+                if (consume_fd != -1 && limit > CONSUME_BATCH_SIZE) limit = CONSUME_BATCH_SIZE;
+                size_t reserved = 0;
+                long first = i;
+                size_t first_start = start;
+                while (i < count) {
+                    size_t bound = ends[i] - start + sizeof(Block_header) + 1;
+                    if (reserved > 0 && reserved + bound > limit) break;
+                    reserved += bound;
+                    start = ends[i];
+                    i++;
+                }
+                long coded = encode_blocks((const unsigned char *)data, first_start, ends + first, i - first, pace.level,
+                                           (unsigned char *)buffer, pair_table, scan_stream(&scan, first_start),
+                                           scan_filter(&scan, first_start));
+                if (coded < 0) {
+                    ret = coded;
+                    break;
+                }
+                size_t used = coded;
+                ret = write_output(fd, volumes, buffer, used, header_size + blocks_size);
+                blocks_size += used;
+                // Hand the pages of the unused half back while the system is short of memory.
+                // madvise takes a page-aligned start, so the page holding the end of the used part stays.
+                size_t page = sysconf(_SC_PAGESIZE);
+                size_t unused = (limit + page - 1) / page * page;
+                if (unused < buffer_size) madvise(buffer + unused, buffer_size - unused, MADV_DONTNEED);
+
+                /*
+                 * Record how far the output goes and persist it before the input behind it is freed.
+                 * Punching is best effort: where the file system cannot, the input is only removed at the end.
+                 */
+                if (consume_fd != -1 && ret == SUCCESS) {
+                    if (pwrite(fd, &blocks_size, sizeof(size_t), header_size - sizeof(size_t)) != sizeof(size_t) || fdatasync(fd) != 0) {
+                        ret = FILE_WRITE_ERROR;
+                        break;
+                    }
+                    fallocate(consume_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, punched, start - punched);
+                    punched = start;
+                }
+            }
+            free(ends);
+            ends = NULL;
+        } while (ret == SUCCESS && start < data_len);
+        if (ret != SUCCESS) break;
+
+        /* The block data size precedes the blocks; it is known only now. Volumes are synced as they are finished. */
+        ret = write_output(fd, volumes, (const char *)&blocks_size, sizeof(size_t), header_size - sizeof(size_t));
+        if (ret == SUCCESS && volumes == NULL && fdatasync(fd) != 0) ret = FILE_WRITE_ERROR;
+        if (ret != SUCCESS) break;
+        ret = header_size + blocks_size;
+        break;
+    }
+
+    if (buffer != MAP_FAILED) munmap(buffer, buffer_size);
+    free(header);
+    free(pair_table);
+    free(ends);
+    return ret;
+}
+
+/*
+ * Codes the data as blocks into the block-format file named by compressed->file_name, batch by batch
+ * (see emit_blocks).
+ * Returns the file size on success or a negative code on failure.
+ */
+long write_blocks(Compressed_file *compressed, const char *data, size_t data_len, int level, bool overwrite, int consume_fd) {
+    long ret = confirm_overwrite(compressed->file_name, overwrite);
+    if (ret != SUCCESS) return ret;
+    int fd = open(compressed->file_name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1) return FILE_WRITE_ERROR;
+    ret = emit_blocks(compressed, data, data_len, level, fd, NULL, consume_fd);
+    close(fd);
+    return ret;
+}
+
+/*
+ * Codes the data as blocks striped across the volumes (see write_striped), batch by batch as write_blocks
+ * does: each coded batch goes straight to the stripes it falls in, so the image is never held whole.
+ * Returns the total number of bytes written on success or a negative code on failure.
+ */
+long write_striped_blocks(Compressed_file *compressed, const char *data, size_t data_len, int level,
+                          char **volumes, int volume_count, bool overwrite) {
+    Volume_writer writer;
+    long ret = open_volumes(&writer, volumes, volume_count, overwrite);
+    if (ret != SUCCESS) return ret;
+    ret = emit_blocks(compressed, data, data_len, level, -1, &writer, -1);
+    if (ret >= 0) ret = finish_volumes(&writer, ret);
+    close_volumes(&writer);
+    return ret;
+}
@@ -0,0 +1,23 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "data_types.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+// Level 1 cuts blocks of this size; also the most encode_chunk codes at once.
+#define FIXED_BLOCK_SIZE (1024 * 1024)
+
+void set_lanes(bool enabled);
+void set_words(bool enabled);
+void pack_lengths(const unsigned char *lengths, unsigned char *packed);
+void unpack_lengths(const unsigned char *packed, unsigned char *lengths);
+long split_blocks(const unsigned char *data, size_t data_len, int level, size_t max_block, size_t **ends);
+size_t encode_block(const unsigned char *data, size_t data_len, int level, unsigned char *out, Huffman_code *pair_table);
+size_t encode_chunk(const unsigned char *data, size_t data_len, int level, unsigned char *out, Huffman_code *pair_table);
+size_t blocks_bound(size_t data_len);
+long write_blocks(Compressed_file *compressed, const char *data, size_t data_len, int level, bool overwrite, int consume_fd);
+long write_striped_blocks(Compressed_file *compressed, const char *data, size_t data_len, int level,
+                          char **volumes, int volume_count, bool overwrite);
+
+#endif // BLOCK_H
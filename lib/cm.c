@@ -0,0 +1,362 @@
+#include "cm.h"
+#include "data_types.h"
+#include "throttle.h"
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "debugmalloc.h"
+
+/*
+ * Context mixing for BLOCK_CM: every byte is coded as 8 binary decisions, most significant bit first.
+ * Order 1 to 4 contexts (the previous bytes together with the bits of the current byte seen so far)
+ * and a match model (the byte that followed the last occurrence of the previous CM_MATCH_MIN bytes)
+ * each predict the next bit. A small online logistic mixer, with a weight set per partial byte,
+ * combines their predictions, and a carry-less binary arithmetic coder codes the bit with the result.
+ * Encoder and decoder run the same model, so the payload is only the arithmetic code.
+ */
+#define CM_ORDER1_SIZE (1 << 16)
+#define CM_HASH_BITS 22
+#define CM_HASHED_ORDERS 3          // Orders 2, 3 and 4.
+#define CM_MATCH_BITS 20
+#define CM_MATCH_MIN 6
+#define CM_MATCH_MAX_LENGTH 65535
+#define CM_HISTORY_BITS 22          // The match model looks this far back.
+#define CM_HISTORY_SIZE (1 << CM_HISTORY_BITS)
+#define CM_INPUTS 6                 // Four orders, the match model and a bias.
+#define CM_ORDER_LIMIT 255          // Counters of the order contexts keep adapting this fast.
+#define CM_MATCH_LIMIT 1023
+#define CM_MAX_MODELS 64            // Models live at once when no memory budget limits them.
+
+/*
+ * All of a model's state. Every counter is a probability that the next bit is 1 in its upper 22 bits
+ * and how often it was updated (which sets its adaptation rate) in the lower 10.
+ * About 60 MB, so it is mapped rather than allocated, which also keeps it usable on worker threads.
+ */
+typedef struct Cm_model {
+    unsigned int order1[CM_ORDER1_SIZE];
+    unsigned int hashed[CM_HASHED_ORDERS][1 << CM_HASH_BITS];
+    unsigned int match_counters[64];
+    int weights[256][CM_INPUTS];
+    unsigned int match_index[1 << CM_MATCH_BITS]; // Bytes coded when each hashed context last ended.
+    unsigned char history[CM_HISTORY_SIZE];
+    int rates[1024];                // Update rate of a counter by its count.
+    short stretch[4096];            // Inverse of squash.
+    // Between bytes.
+    size_t pos;                     // Bytes coded so far.
+    unsigned int last;              // The last four bytes, the latest in the low byte.
+    unsigned int hashes[CM_HASHED_ORDERS];
+    size_t match_ptr;               // Position of the byte the match predicts.
+    int match_len;                  // 0 when there is no match.
+    // Within a byte.
+    int c0;                         // Bits of the current byte seen so far behind a leading 1.
+    int bit_count;
+    unsigned int *slots[CM_INPUTS - 1];
+    int inputs[CM_INPUTS];
+    int probability;                // The mixer's output (12 bits).
+} Cm_model;
+
+/*
+ * Logistic function scaled to probabilities of 12 bits: 4096 / (1 + e^(-d / 256)) for d in [-2047, 2047],
+ * interpolated from 33 points.
+ */
+static int squash(int d) {
+    static const int points[33] = {
+        1, 2, 3, 6, 10, 16, 27, 45, 73, 120, 194, 310, 488, 747, 1101, 1546, 2047,
+        2549, 2994, 3348, 3607, 3785, 3901, 3975, 4022, 4050, 4068, 4079, 4085, 4089, 4092, 4093, 4094
+    };
+    if (d > 2047) return 4095;
+    if (d < -2047) return 1;
+    int weight = d & 127;
+    d = (d >> 7) + 16;
+    return (points[d] * (128 - weight) + points[d + 1] * weight + 64) >> 7;
+}
+
+// Models mapped right now, across every thread of the process.
+static pthread_mutex_t models_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t models_released = PTHREAD_COND_INITIALIZER;
+static int models_live = 0;
+
+// Unmaps a model (if any) and gives its place in the budget to a thread waiting in create_model.
+static void destroy_model(Cm_model *model) {
+    if (model != NULL) munmap(model, sizeof(Cm_model));
+    pthread_mutex_lock(&models_lock);
+    models_live--;
+    pthread_cond_broadcast(&models_released);
+    pthread_mutex_unlock(&models_lock);
+}
+
+/*
+ * Number of context-mixing models, at most wanted, that half the memory budget holds at once
+ * (see budgeted_size); 0 when not even one fits.
+ */
+int cm_model_limit(int wanted) {
+    if (wanted < 1) return 0;
+    size_t room = budgeted_size((size_t)wanted * sizeof(Cm_model), 2);
+    size_t models = room / sizeof(Cm_model);
+    return models < (size_t)wanted ? (int)models : wanted;
+}
+
+/*
+ * Maps a fresh model once the memory budget has room for it beside the models already live, waiting for
+ * one to be released while it has not. A decoder (required) always gets one model; an encoder gets NULL
+ * if the budget cannot hold even one, and codes the block another way.
+ */
+static Cm_model *create_model(bool required) {
+    pthread_mutex_lock(&models_lock);
+    int limit = cm_model_limit(CM_MAX_MODELS);
+    if (limit == 0 && required) limit = 1;
+    while (limit > 0 && models_live >= limit) {
+        pthread_cond_wait(&models_released, &models_lock);
+        limit = cm_model_limit(CM_MAX_MODELS);
+        if (limit == 0 && required) limit = 1;
+    }
+    if (limit > 0) models_live++;
+    pthread_mutex_unlock(&models_lock);
+    if (limit == 0) return NULL;
+
+    Cm_model *model = mmap(NULL, sizeof(Cm_model), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (model == MAP_FAILED) {
+        destroy_model(NULL);
+        return NULL;
+    }
+    // The mapping starts zeroed; counters start at one half, never updated.
+    for (int i = 0; i < CM_ORDER1_SIZE; i++) model->order1[i] = 1u << 31;
+    for (int k = 0; k < CM_HASHED_ORDERS; k++) {
+        for (int i = 0; i < (1 << CM_HASH_BITS); i++) model->hashed[k][i] = 1u << 31;
+    }
+    for (int i = 0; i < 64; i++) model->match_counters[i] = 1u << 31;
+    for (int i = 0; i < 256; i++) {
+        for (int j = 0; j < CM_INPUTS - 1; j++) model->weights[i][j] = (1 << 16) / 4;
+    }
+    for (int i = 0; i < 1024; i++) model->rates[i] = 16384 / (i + i + 3);
+    int next = 0;
+    for (int d = -2047; d <= 2047; d++) {
+        int p = squash(d);
+        for (int j = next; j <= p; j++) model->stretch[j] = d;
+        next = p + 1;
+    }
+    for (int j = next; j < 4096; j++) model->stretch[j] = 2047;
+    model->c0 = 1;
+    return model;
+}
+
+static void update_counter(const Cm_model *model, unsigned int *counter, int bit, int limit) {
+    unsigned int value = *counter;
+    int count = value & 1023;
+    int p = value >> 10;
+    if (count < limit) value++;
+    long long delta = (long long)((((bit << 22) - p) >> 3) * (long long)model->rates[count]);
+    *counter = value + ((unsigned int)delta & 0xFFFFFC00u);
+}
+
+// Probability (12 bits) that the next bit is 1.
+static int predict(Cm_model *model) {
+    int c0 = model->c0;
+    model->slots[0] = &model->order1[((model->last & 0xFF) << 8) | c0];
+    for (int k = 0; k < CM_HASHED_ORDERS; k++) {
+        model->slots[k + 1] = &model->hashed[k][(model->hashes[k] + c0 * 0x9E3779B1u) >> (32 - CM_HASH_BITS)];
+    }
+    model->slots[CM_INPUTS - 2] = NULL;
+    if (model->match_len > 0) {
+        int predicted = model->history[model->match_ptr & (CM_HISTORY_SIZE - 1)] | 256;
+        if ((predicted >> (8 - model->bit_count)) == c0) {
+            int expected = (predicted >> (7 - model->bit_count)) & 1;
+            int length = model->match_len < 31 ? model->match_len : 31;
+            model->slots[CM_INPUTS - 2] = &model->match_counters[(length << 1) | expected];
+        }
+    }
+
+    const int *weights = model->weights[c0];
+    long long dot = 0;
+    for (int i = 0; i < CM_INPUTS - 1; i++) {
+        model->inputs[i] = (model->slots[i] != NULL) ? model->stretch[*model->slots[i] >> 20] : 0;
+        dot += (long long)model->inputs[i] * weights[i];
+    }
+    model->inputs[CM_INPUTS - 1] = 256;
+    dot += 256LL * weights[CM_INPUTS - 1];
+    int p = squash((int)(dot >> 16));
+    model->probability = p < 1 ? 1 : (p > 4095 ? 4095 : p);
+    return model->probability;
+}
+
+// Moves the history, the context hashes and the match on by one coded byte.
+static void next_byte(Cm_model *model, int byte) {
+    model->history[model->pos & (CM_HISTORY_SIZE - 1)] = (unsigned char)byte;
+    model->pos++;
+    model->last = (model->last << 8) | (unsigned int)byte;
+    model->hashes[0] = ((model->last & 0xFFFF) + 0x10000u) * 0x2545F491u;
+    model->hashes[1] = ((model->last & 0xFFFFFF) + 0x3000000u) * 0x9E3779B1u;
+    model->hashes[2] = (model->last * 0x85EBCA6Bu + 0x4F1BBCDDu) * 0xC2B2AE35u;
+
+    if (model->match_len > 0 && model->history[model->match_ptr & (CM_HISTORY_SIZE - 1)] == byte) {
+        if (model->match_len < CM_MATCH_MAX_LENGTH) model->match_len++;
+        model->match_ptr++;
+    } else {
+        model->match_len = 0;
+    }
+    if (model->pos < CM_MATCH_MIN) return;
+
+    unsigned int hash = 0;
+    for (int i = 1; i <= CM_MATCH_MIN; i++) {
+        hash = (hash + model->history[(model->pos - i) & (CM_HISTORY_SIZE - 1)] + 1) * 0x2F0B4C27u;
+    }
+    hash >>= 32 - CM_MATCH_BITS;
+    if (model->match_len == 0) {
+        size_t candidate = model->match_index[hash];
+        // Verify the context (the hash may collide) by counting how many bytes before it agree.
+        if (candidate > 0 && model->pos - candidate + 32 < CM_HISTORY_SIZE) {
+            int length = 0;
+            while (length < 32 && length < (int)candidate &&
+                   model->history[(candidate - 1 - length) & (CM_HISTORY_SIZE - 1)] ==
+                   model->history[(model->pos - 1 - length) & (CM_HISTORY_SIZE - 1)]) {
+                length++;
+            }
+            if (length > 0) {
+                model->match_len = length;
+                model->match_ptr = candidate;
+            }
+        }
+    }
+    model->match_index[hash] = (unsigned int)model->pos;
+}
+
+// Trains every counter and the mixer on the bit just coded.
+static void update(Cm_model *model, int bit) {
+    int *weights = model->weights[model->c0];
+    int error = (bit << 12) - model->probability;
+    for (int i = 0; i < CM_INPUTS; i++) {
+        weights[i] += (model->inputs[i] * error) >> 13;
+    }
+    for (int i = 0; i < CM_INPUTS - 2; i++) update_counter(model, model->slots[i], bit, CM_ORDER_LIMIT);
+    if (model->slots[CM_INPUTS - 2] != NULL) update_counter(model, model->slots[CM_INPUTS - 2], bit, CM_MATCH_LIMIT);
+
+    model->c0 = (model->c0 << 1) | bit;
+    if (++model->bit_count == 8) {
+        next_byte(model, model->c0 & 0xFF);
+        model->c0 = 1;
+        model->bit_count = 0;
+    }
+}
+
+/*
+ * Codes data with the context-mixing model into out. Gives up when the code would exceed out_cap bytes,
+ * so callers can fall back to a cheaper method. Safe on worker threads: the model is mapped, not allocated.
+ * Returns the number of bytes written, or 0 if they did not fit or the memory budget has no room for a model.
+ */
+size_t cm_encode(const unsigned char *data, size_t data_len, unsigned char *out, size_t out_cap) {
+    Cm_model *model = create_model(false);
+    if (model == NULL) return 0;
+    unsigned int x1 = 0;
+    unsigned int x2 = 0xFFFFFFFF;
+    size_t written = 0;
+    bool fits = true;
+
+    for (size_t i = 0; i < data_len && fits; i++) {
+        for (int j = 7; j >= 0; j--) {
+            int bit = (data[i] >> j) & 1;
+            unsigned int middle = x1 + ((x2 - x1) >> 12) * predict(model);
+            if (bit) x2 = middle;
+            else x1 = middle + 1;
+            update(model, bit);
+            // Leading bytes on which both ends agree are settled.
+            while (((x1 ^ x2) & 0xFF000000u) == 0) {
+                if (written == out_cap) {
+                    fits = false;
+                    break;
+                }
+                out[written++] = (unsigned char)(x2 >> 24);
+                x1 <<= 8;
+                x2 = (x2 << 8) | 0xFF;
+            }
+        }
+    }
+    // All of x1 makes the decoder's last window lie inside the final range.
+    for (int i = 0; fits && i < 4; i++) {
+        if (written == out_cap) fits = false;
+        else out[written++] = (unsigned char)(x1 >> (24 - 8 * i));
+    }
+    destroy_model(model);
+    return fits ? written : 0;
+}
+
+/*
+ * Maps a fresh model and prepares to decode a payload of payload_size bytes. While the memory budget
+ * is taken by other models this waits for one of them to be released (see create_model).
+ * Returns SUCCESS or MALLOC_ERROR.
+ */
+int cm_decoder_start(Cm_decoder *decoder, size_t payload_size) {
+    decoder->model = create_model(true);
+    if (decoder->model == NULL) return MALLOC_ERROR;
+    decoder->x1 = 0;
+    decoder->x2 = 0xFFFFFFFF;
+    decoder->x = 0;
+    decoder->started = false;
+    decoder->ring_head = 0;
+    decoder->ring_count = 0;
+    decoder->payload_left = payload_size;
+    return SUCCESS;
+}
+
+// Next payload byte from the ring; past the end of the payload the code continues with zeros.
+static unsigned int next_input(Cm_decoder *decoder) {
+    if (decoder->ring_count == 0) return 0;
+    unsigned int byte = decoder->ring[decoder->ring_head];
+    decoder->ring_head = (decoder->ring_head + 1) % CM_RING_SIZE;
+    decoder->ring_count--;
+    return byte;
+}
+
+/*
+ * Decodes up to count bytes into out, taking payload bytes from in as needed. A byte is only decoded
+ * once CM_LOOKAHEAD input bytes (or the rest of the payload) are at hand, so it can stop between any two.
+ * Sets *in_used to the input bytes taken. Returns the number of bytes decoded; fewer than count
+ * means more input is needed.
+ */
+size_t cm_decode(Cm_decoder *decoder, const unsigned char *in, size_t in_len, size_t *in_used, char *out, size_t count) {
+    Cm_model *model = decoder->model;
+    size_t used = 0;
+    size_t decoded = 0;
+    while (decoded < count) {
+        while (decoder->ring_count < CM_RING_SIZE && decoder->payload_left > 0 && used < in_len) {
+            decoder->ring[(decoder->ring_head + decoder->ring_count) % CM_RING_SIZE] = in[used++];
+            decoder->ring_count++;
+            decoder->payload_left--;
+        }
+        // Before the first byte the decoder also loads its 4-byte window.
+        unsigned int needed = decoder->started ? CM_LOOKAHEAD : CM_LOOKAHEAD + 4;
+        if (decoder->ring_count < needed && decoder->payload_left > 0) break;
+        if (!decoder->started) {
+            for (int i = 0; i < 4; i++) decoder->x = (decoder->x << 8) | next_input(decoder);
+            decoder->started = true;
+        }
+
+        unsigned int x1 = decoder->x1;
+        unsigned int x2 = decoder->x2;
+        unsigned int x = decoder->x;
+        for (int j = 0; j < 8; j++) {
+            unsigned int middle = x1 + ((x2 - x1) >> 12) * predict(model);
+            int bit = x <= middle;
+            if (bit) x2 = middle;
+            else x1 = middle + 1;
+            update(model, bit);
+            while (((x1 ^ x2) & 0xFF000000u) == 0) {
+                x1 <<= 8;
+                x2 = (x2 << 8) | 0xFF;
+                x = (x << 8) | next_input(decoder);
+            }
+        }
+        decoder->x1 = x1;
+        decoder->x2 = x2;
+        decoder->x = x;
+        out[decoded++] = (char)(model->last & 0xFF);
+    }
+    *in_used = used;
+    return decoded;
+}
+
+// Unmaps the model; harmless when none is mapped.
+void cm_decoder_end(Cm_decoder *decoder) {
+    if (decoder->model != NULL) destroy_model(decoder->model);
+    decoder->model = NULL;
+}
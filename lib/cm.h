@@ -0,0 +1,13 @@
+#ifndef CM_H
+#define CM_H
+
+#include "data_types.h"
+#include <stddef.h>
+
+int cm_model_limit(int wanted);
+size_t cm_encode(const unsigned char *data, size_t data_len, unsigned char *out, size_t out_cap);
+int cm_decoder_start(Cm_decoder *decoder, size_t payload_size);
+size_t cm_decode(Cm_decoder *decoder, const unsigned char *in, size_t in_len, size_t *in_used, char *out, size_t count);
+void cm_decoder_end(Cm_decoder *decoder);
+
+#endif // CM_H
@@ -4,10 +4,19 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "file.h"
 #include "compress.h"
 #include "data_types.h"
 #include "directory.h"
+#include "volume.h"
+#include "table_cache.h"
+#include "block.h"
+#include "throttle.h"
+#include "workers.h"
+#include "index.h"
 #include "debugmalloc.h"
 
 // Helper for sorting with qsort.
@@ -125,6 +134,243 @@ Node* construct_tree(Node *nodes, long leaf_count) { // nodes is sorted
     return &nodes[last_branch - 1];
 }
 
+/*
+ * LSD radix sort of 64-bit keys, one byte per pass; passes above the largest key's top byte are skipped.
+ * Leaves the sorted keys in `keys`, using `scratch` (same length) as the second buffer.
+ */
+static void radix_sort_keys(unsigned long long *keys, unsigned long long *scratch, int count) {
+    unsigned long long max_key = 0;
+    for (int i = 0; i < count; i++) {
+        if (keys[i] > max_key) max_key = keys[i];
+    }
+    unsigned long long *from = keys;
+    unsigned long long *to = scratch;
+    for (int shift = 0; shift < 64 && (max_key >> shift) != 0; shift += 8) {
+        int offsets[257] = {0};
+        for (int i = 0; i < count; i++) offsets[((from[i] >> shift) & 0xFF) + 1]++;
+        for (int d = 0; d < 256; d++) offsets[d + 1] += offsets[d];
+        for (int i = 0; i < count; i++) to[offsets[(from[i] >> shift) & 0xFF]++] = from[i];
+        unsigned long long *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != keys) memcpy(keys, from, count * sizeof(unsigned long long));
+}
+
+/*
+ * Moffat-Katajainen in-place minimum-redundancy code computation.
+ * On entry a[] holds n weights in nondecreasing order; on return a[i] is the code length of item i.
+ */
+static void minimum_redundancy_lengths(unsigned long long *a, int n) {
+    if (n == 0) return;
+    if (n == 1) {
+        a[0] = 0;
+        return;
+    }
+    /* First pass, left to right: combine weights and store parent pointers. */
+    a[0] += a[1];
+    int root = 0;
+    int leaf = 2;
+    for (int next = 1; next < n - 1; next++) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+    /* Second pass, right to left: turn parent pointers into internal node depths. */
+    a[n - 2] = 0;
+    for (int next = n - 3; next >= 0; next--) {
+        a[next] = a[a[next]] + 1;
+    }
+    /* Third pass, right to left: derive leaf depths from the internal node depths. */
+    int available = 1;
+    int used = 0;
+    unsigned long long depth = 0;
+    root = n - 2;
+    int next = n - 1;
+    while (available > 0) {
+        while (root >= 0 && a[root] == depth) {
+            used++;
+            root--;
+        }
+        while (available > used) {
+            a[next--] = depth;
+            available--;
+        }
+        available = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+/*
+ * Clamps the lengths (sorted by nondecreasing weight, so nonincreasing length) to max_length
+ * and lengthens the rarest shorter codes until Kraft's inequality holds again.
+ */
+static void limit_code_lengths(unsigned long long *lengths, int n, int max_length) {
+    unsigned long long capacity = 1ULL << max_length;
+    unsigned long long kraft = 0;
+    for (int i = 0; i < n; i++) {
+        if (lengths[i] > (unsigned long long)max_length) lengths[i] = max_length;
+        kraft += 1ULL << (max_length - lengths[i]);
+    }
+    while (kraft > capacity) {
+        /* The rarest symbol whose code can still grow gives up the least. */
+        for (int i = 0; i < n && kraft > capacity; i++) {
+            if (lengths[i] < (unsigned long long)max_length) {
+                kraft -= 1ULL << (max_length - lengths[i] - 1);
+                lengths[i]++;
+            }
+        }
+    }
+    /* Hand any slack back to the most frequent symbols. */
+    for (int i = n - 1; i >= 0; i--) {
+        while (lengths[i] > 1 && kraft + (1ULL << (max_length - lengths[i])) <= capacity) {
+            kraft += 1ULL << (max_length - lengths[i]);
+            lengths[i]--;
+        }
+    }
+}
+
+/*
+ * Computes optimal code lengths for an alphabet of up to MAX_ALPHABET_SIZE symbols without touching the heap.
+ * The caller supplies two work arrays of alphabet_size entries; symbols are counting-sorted by
+ * frequency (radix passes over frequency << 16 | symbol) and the lengths computed in place.
+ * A max_length of 0 leaves the lengths unlimited. Absent symbols get length 0.
+ * Returns the number of symbols present.
+ */
+int compute_code_lengths(const long *frequencies, int alphabet_size, unsigned long long *work, unsigned long long *scratch, unsigned char *lengths, int max_length) {
+    int count = 0;
+    for (int symbol = 0; symbol < alphabet_size; symbol++) {
+        lengths[symbol] = 0;
+        if (frequencies[symbol] > 0) {
+            work[count++] = ((unsigned long long)frequencies[symbol] << 16) | (unsigned)symbol;
+        }
+    }
+    radix_sort_keys(work, scratch, count);
+    for (int i = 0; i < count; i++) {
+        scratch[i] = work[i] & 0xFFFF;
+        work[i] >>= 16;
+    }
+    minimum_redundancy_lengths(work, count);
+    if (max_length > 0 && count > 1) {
+        limit_code_lengths(work, count, max_length);
+    }
+    for (int i = 0; i < count; i++) {
+        lengths[scratch[i]] = (unsigned char)work[i];
+    }
+    return count;
+}
+
+/*
+ * Derives byte code lengths straight from the histogram as -log2(p) rounded to the nearest integer and clamped
+ * to 1..max_length, without sorting or building a tree. Kraft's inequality is restored by lengthening codes,
+ * those that were rounded down first as they give up the least, and any slack is handed back to the most
+ * frequent symbols so the code is complete. Costs a little ratio against compute_code_lengths.
+ * Absent symbols get length 0. Returns the number of symbols present.
+ */
+int approximate_code_lengths(const long *frequencies, unsigned char *lengths, int max_length) {
+    unsigned long long total = 0;
+    unsigned long long capacity = 1ULL << max_length;
+    unsigned long long kraft = 0;
+    bool rounded_down[256];
+    int count = 0;
+    for (int symbol = 0; symbol < 256; symbol++) {
+        lengths[symbol] = 0;
+        total += frequencies[symbol];
+        if (frequencies[symbol] > 0) count++;
+    }
+    if (count < 2) return count;
+
+    for (int symbol = 0; symbol < 256; symbol++) {
+        if (frequencies[symbol] == 0) continue;
+        /* 1/p in 8.8 fixed point; its leading nine bits, from 256 up to 511, decide the rounding. */
+        unsigned long long ratio = (total << 8) / (unsigned long long)frequencies[symbol];
+        int length = 63 - __builtin_clzll(ratio) - 8;
+        unsigned long long mantissa = ratio >> length;
+        rounded_down[symbol] = mantissa > 256 && mantissa < 363; // 363 / 256 is just above sqrt(2).
+        if (mantissa >= 363) length++;
+        if (length < 1) length = 1;
+        if (length > max_length) length = max_length;
+        lengths[symbol] = (unsigned char)length;
+        kraft += capacity >> length;
+    }
+
+    for (int pass = 0; kraft > capacity; pass++) {
+        for (int symbol = 0; symbol < 256 && kraft > capacity; symbol++) {
+            if (lengths[symbol] > 0 && lengths[symbol] < max_length && (pass > 0 || rounded_down[symbol])) {
+                kraft -= capacity >> (lengths[symbol] + 1);
+                lengths[symbol]++;
+            }
+        }
+    }
+    /* The shortest codes belong to the most frequent symbols; shorten those first, until no code fits. */
+    for (bool shortened = true; shortened && kraft < capacity;) {
+        shortened = false;
+        for (int length = 2; length <= max_length && kraft < capacity; length++) {
+            for (int symbol = 0; symbol < 256 && kraft < capacity; symbol++) {
+                if (lengths[symbol] == length && kraft + (capacity >> length) <= capacity) {
+                    kraft += capacity >> length;
+                    lengths[symbol]--;
+                    shortened = true;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * Builds the canonical Huffman tree for the given byte code lengths into nodes (room for 511).
+ * Works bottom-up: at each depth the leaves of that length (in byte order) come first, followed by
+ * branches pairing the nodes one level deeper, so codes are canonical with '0' as the left child.
+ * An unpaired node (incomplete code) moves up a level unchanged. Leaves come first, the root last.
+ * Returns the number of nodes written, or 0 unless at least two lengths are set.
+ */
+long build_canonical_tree(const unsigned char *lengths, Node *nodes) {
+    int level[256];
+    int deeper[256];
+    int deeper_count = 0;
+    long node_count = 0;
+    int max_length = 0;
+
+    for (int symbol = 0; symbol < 256; symbol++) {
+        if (lengths[symbol] > max_length) max_length = lengths[symbol];
+    }
+
+    for (int depth = max_length; depth > 0; depth--) {
+        int level_count = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (lengths[symbol] == depth) {
+                nodes[node_count] = construct_leaf(0, (char)symbol);
+                level[level_count++] = node_count++;
+            }
+        }
+        for (int i = 0; i + 1 < deeper_count; i += 2) {
+            nodes[node_count] = construct_branch(nodes, deeper[i], deeper[i + 1]);
+            level[level_count++] = node_count++;
+        }
+        if (deeper_count % 2 == 1) {
+            level[level_count++] = deeper[deeper_count - 1];
+        }
+        memcpy(deeper, level, level_count * sizeof(int));
+        deeper_count = level_count;
+    }
+    if (deeper_count < 2) return 0;
+
+    /* The root pairs the two depth-1 nodes (an unpaired third cannot occur as Kraft's sum is at most 1). */
+    nodes[node_count] = construct_branch(nodes, deeper[0], deeper[1]);
+    return node_count + 1;
+}
+
 /*
  * Checks whether the sought byte's path in the Huffman tree is already cached.
  * Returns the path string if present, otherwise NULL.
@@ -173,96 +419,466 @@ char* find_leaf(char leaf, Node *nodes, Node *root_node) {
     }
 }
 
+// Records the code of every leaf below the node; bits beyond the 32nd are dropped, lengths are exact.
+static int assign_codes(Node *nodes, Node *node, unsigned int bits, int depth, Huffman_code *codes) {
+    if (node->type == LEAF) {
+        codes[(unsigned char)node->data].bits = bits;
+        codes[(unsigned char)node->data].length = depth;
+        return depth;
+    }
+    int left = assign_codes(nodes, &nodes[node->left], bits << 1, depth + 1, codes);
+    int right = assign_codes(nodes, &nodes[node->right], (bits << 1) | 1, depth + 1, codes);
+    return left > right ? left : right;
+}
+
+/*
+ * Fills the 256-entry code array from the tree; absent bytes get length 0.
+ * Returns the longest code length.
+ */
+int build_code_table(Node *nodes, Node *root_node, Huffman_code *codes) {
+    memset(codes, 0, 256 * sizeof(Huffman_code));
+    return assign_codes(nodes, root_node, 0, 0, codes);
+}
+
+/*
+ * Builds the 65536-entry byte-pair table: entry (a << 8 | b) holds the concatenated codes of a and b.
+ * The codes must be at most PAIR_MAX_CODE_LENGTH bits long so a pair fits in 24 bits.
+ */
+void build_pair_table(const Huffman_code *codes, Huffman_code *pair_table) {
+    for (int a = 0; a < 256; a++) {
+        Huffman_code first = codes[a];
+        Huffman_code *row = &pair_table[a << 8];
+        for (int b = 0; b < 256; b++) {
+            row[b].bits = (first.bits << codes[b].length) | codes[b].bits;
+            row[b].length = first.length + codes[b].length;
+        }
+    }
+}
+
+/*
+ * Encoder variant that emits two input bytes per table lookup through a 64-bit bit accumulator.
+ * Produces the same bitstream as the path-by-path encoder. Returns the number of bits written.
+ */
+size_t compress_pairs(const unsigned char *data, size_t data_len, const Huffman_code *codes, const Huffman_code *pair_table, char *out) {
+    unsigned long long acc = 0;
+    int acc_bits = 0;
+    size_t out_pos = 0;
+    size_t i = 0;
+
+    for (; i + 1 < data_len; i += 2) {
+        Huffman_code pair = pair_table[(data[i] << 8) | data[i + 1]];
+        acc = (acc << pair.length) | pair.bits;
+        acc_bits += pair.length;
+        while (acc_bits >= 8) {
+            acc_bits -= 8;
+            out[out_pos++] = (char)(acc >> acc_bits);
+        }
+    }
+    if (i < data_len) {
+        Huffman_code last = codes[data[i]];
+        acc = (acc << last.length) | last.bits;
+        acc_bits += last.length;
+        while (acc_bits >= 8) {
+            acc_bits -= 8;
+            out[out_pos++] = (char)(acc >> acc_bits);
+        }
+    }
+    if (acc_bits > 0) {
+        out[out_pos] = (char)(acc << (8 - acc_bits));
+    }
+    return out_pos * 8 + acc_bits;
+}
+
+/*
+ * Encoder variant that emits one symbol per lookup in the code array through a 64-bit bit accumulator.
+ * Codes must be at most 32 bits long. Returns the number of bits written.
+ */
+size_t compress_codes(const unsigned char *data, size_t data_len, const Huffman_code *codes, char *out) {
+    unsigned long long acc = 0;
+    int acc_bits = 0;
+    size_t out_pos = 0;
+    for (size_t i = 0; i < data_len; i++) {
+        Huffman_code code = codes[data[i]];
+        acc = (acc << code.length) | code.bits;
+        acc_bits += code.length;
+        while (acc_bits >= 8) {
+            acc_bits -= 8;
+            out[out_pos++] = (char)(acc >> acc_bits);
+        }
+    }
+    if (acc_bits > 0) {
+        out[out_pos] = (char)(acc << (8 - acc_bits));
+    }
+    return out_pos * 8 + acc_bits;
+}
+
+static void *count_slice(void *arg) {
+    Encode_slice *slice = arg;
+    memset(slice->histogram, 0, sizeof(slice->histogram));
+    for (size_t i = 0; i < slice->length; i++) slice->histogram[slice->data[i]]++;
+    return NULL;
+}
+
+/*
+ * Encodes a slice starting bit_offset % 8 bits into its first byte. That byte is shared with the
+ * previous slice, so it goes to head; every later byte belongs to this slice and is written in place.
+ */
+static void *encode_slice(void *arg) {
+    Encode_slice *slice = arg;
+    const unsigned char *data = slice->data;
+    char *out = slice->out + slice->bit_offset / 8 + 1;
+    unsigned long long acc = 0;
+    int acc_bits = slice->bit_offset % 8;
+    size_t out_pos = 0;
+    size_t i = 0;
+
+    while (acc_bits < 8 && i < slice->length) {
+        Huffman_code code = slice->codes[data[i++]];
+        acc = (acc << code.length) | code.bits;
+        acc_bits += code.length;
+    }
+    if (acc_bits < 8) {
+        slice->head = (unsigned char)(acc << (8 - acc_bits));
+        return NULL;
+    }
+    acc_bits -= 8;
+    slice->head = (unsigned char)(acc >> acc_bits);
+
+    if (slice->pair_table != NULL) {
+        for (; i + 1 < slice->length; i += 2) {
+            Huffman_code pair = slice->pair_table[(data[i] << 8) | data[i + 1]];
+            acc = (acc << pair.length) | pair.bits;
+            acc_bits += pair.length;
+            while (acc_bits >= 8) {
+                acc_bits -= 8;
+                out[out_pos++] = (char)(acc >> acc_bits);
+            }
+        }
+    }
+    for (; i < slice->length; i++) {
+        Huffman_code code = slice->codes[data[i]];
+        acc = (acc << code.length) | code.bits;
+        acc_bits += code.length;
+        while (acc_bits >= 8) {
+            acc_bits -= 8;
+            out[out_pos++] = (char)(acc >> acc_bits);
+        }
+    }
+    if (acc_bits > 0) {
+        out[out_pos] = (char)(acc << (8 - acc_bits));
+    }
+    return NULL;
+}
+
+/*
+ * Cuts the data into at most max_slices slices of similar length. With members set the data is a
+ * serialized directory and cuts fall between its items; an item longer than a slice is cut inside as well.
+ * Returns the number of slices.
+ */
+int cut_slices(const char *data, size_t data_len, bool members, int max_slices, Encode_slice *slices) {
+    int count = 0;
+    if (max_slices > MAX_ENCODE_SLICES) max_slices = MAX_ENCODE_SLICES;
+    size_t target = (max_slices > 1) ? data_len / max_slices : data_len;
+    if (target == 0) target = data_len;
+    size_t start = 0;
+
+    for (size_t offset = 0; offset < data_len && count < max_slices - 1;) {
+        size_t item_end = data_len;
+        if (members) {
+            Directory_item item;
+            long used = parse_item(&item, data + offset, data_len - offset);
+            if (used > 0) item_end = offset + used;
+        } else {
+            item_end = (offset + target < data_len) ? offset + target : data_len;
+        }
+        while (item_end - start >= 2 * target && count < max_slices - 1) {
+            slices[count++] = (Encode_slice){.data = (const unsigned char *)data + start, .length = target};
+            start += target;
+        }
+        if (item_end - start >= target && item_end < data_len && count < max_slices - 1) {
+            slices[count++] = (Encode_slice){.data = (const unsigned char *)data + start, .length = item_end - start};
+            start = item_end;
+        }
+        offset = item_end;
+    }
+    slices[count++] = (Encode_slice){.data = (const unsigned char *)data + start, .length = data_len - start};
+    return count;
+}
+
+/*
+ * Fills the histogram of every slice, one thread per slice.
+ */
+void count_slices(Encode_slice *slices, int slice_count) {
+    run_workers(slice_count, count_slice, slices, sizeof(Encode_slice));
+}
+
+/*
+ * Maps a zeroed buffer for a bitstream of the given number of bits (at least one byte). The legacy
+ * encoders write into these instead of the heap, so inputs of any size fit. Returns NULL on failure.
+ */
+char *map_bitstream(size_t bits) {
+    size_t size = (bits + 7) / 8;
+    if (size == 0) size = 1;
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (data == MAP_FAILED) ? NULL : data;
+}
+
+/*
+ * Releases a bitstream from map_bitstream, given the bit count it was mapped for.
+ */
+void free_bitstream(char *data, size_t bits) {
+    if (data == NULL) return;
+    size_t size = (bits + 7) / 8;
+    munmap(data, size == 0 ? 1 : size);
+}
+
+/*
+ * Takes each counted slice's exact bit length from its histogram and the code lengths and prefix-sums
+ * the lengths into bit offsets. Returns the total number of bits the slices encode to.
+ */
+size_t place_slices(Encode_slice *slices, int slice_count, const Huffman_code *codes) {
+    size_t total_bits = 0;
+    for (int i = 0; i < slice_count; i++) {
+        slices[i].bits = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            slices[i].bits += slices[i].histogram[symbol] * codes[symbol].length;
+        }
+        slices[i].bit_offset = total_bits;
+        total_bits += slices[i].bits;
+    }
+    return total_bits;
+}
+
+/*
+ * Encodes placed slices (see place_slices) into one bitstream: every thread encodes its slice at its
+ * offset, and the bytes shared at slice boundaries are merged afterwards. The result is the bitstream
+ * compress_codes (or compress_pairs with a pair_table) produces for the whole data.
+ * out must hold the total number of bits place_slices returned.
+ */
+void encode_slices(Encode_slice *slices, int slice_count, const Huffman_code *codes, const Huffman_code *pair_table, char *out) {
+    for (int i = 0; i < slice_count; i++) {
+        slices[i].codes = codes;
+        slices[i].pair_table = pair_table;
+        slices[i].out = out;
+    }
+    run_workers(slice_count, encode_slice, slices, sizeof(Encode_slice));
+
+    /* A slice starting mid-byte shares that byte with the tail the previous slice wrote. */
+    for (int i = 0; i < slice_count; i++) {
+        if (slices[i].bits == 0) continue;
+        size_t byte = slices[i].bit_offset / 8;
+        if (slices[i].bit_offset % 8 == 0) {
+            out[byte] = (char)slices[i].head;
+        } else {
+            out[byte] |= (char)slices[i].head;
+        }
+    }
+}
+
+/*
+ * Encodes counted slices (see cut_slices and count_slices) with the codes into one bitstream, mapped
+ * at the exact size their histograms give (see place_slices) and encoded on as many threads as there
+ * are slices (see encode_slices). *out is released with free_bitstream.
+ * Returns the number of bits written or MALLOC_ERROR.
+ */
+long compress_sliced(Encode_slice *slices, int slice_count, const Huffman_code *codes, const Huffman_code *pair_table, char **out) {
+    size_t total_bits = place_slices(slices, slice_count, codes);
+    *out = map_bitstream(total_bits);
+    if (*out == NULL) return MALLOC_ERROR;
+    encode_slices(slices, slice_count, codes, pair_table, *out);
+    return total_bits;
+}
 
 /*
  * Walks the Huffman tree and encodes the data into a compressed bitstream.
- * Loads the data needed for decompression into a Compressed_file structure.
+ * Loads the data needed for decompression into a Compressed_file structure; the bitstream is mapped
+ * at the exact size the histogram gives and released with free_bitstream.
  * Returns 0 on success or a negative value for allocation or traversal errors.
  */
 int compress(const char *original_data, long data_len, Node *nodes, Node *root_node, char** cache, Compressed_file *compressed_file) {
+    compressed_file->data_size = 0;
+    compressed_file->compressed_data = NULL;
     if (data_len == 0) {
-        compressed_file->data_size = 0;
-        compressed_file->compressed_data = NULL;
         return 0;
     }
 
-    compressed_file->compressed_data = malloc(data_len * sizeof(char));
-    if (compressed_file->compressed_data == NULL) {
-        compressed_file->data_size = 0;
-        return MALLOC_ERROR;
-    }
-
     size_t total_bits = 0;
     unsigned char buffer = 0;
     int bit_count = 0;
 
-    for (size_t i = 0; i < (size_t)data_len; i++) {
-        char *path = check_cache(original_data[i], cache);
-        if (path == NULL) {
-            path = find_leaf(original_data[i], nodes, root_node);
-            if (path != NULL) {
-                cache[(unsigned char)original_data[i]] = path;
-            } else {
-                free(compressed_file->compressed_data);
-                compressed_file->compressed_data = NULL;
-                compressed_file->data_size = 0;
-                return TREE_ERROR;
-            }
+    /* Canonical trees take their code array from the table cache; others are walked once. */
+    Huffman_code codes[256];
+    unsigned char lengths[256];
+    int max_length = 0;
+    if (tree_signature(nodes, (root_node - nodes) + 1, lengths) == 1) {
+        if (!lookup_tables(lengths, NULL, NULL, codes)) {
+            canonical_codes(lengths, codes);
+            store_tables(lengths, NULL, 0, codes);
         }
-
-        for (int j = 0; path[j] != '\0'; j++) {
-            if (path[j] == '1') {
-                buffer |= (1 << (7 - bit_count));
-            }
-            bit_count++;
-            if (bit_count == 8) {
-                compressed_file->compressed_data[total_bits / 8] = buffer;
-                total_bits += 8;
-                buffer = 0;
-                bit_count = 0;
-            }
+        for (int i = 0; i < 256; i++) {
+            if (lengths[i] > max_length) max_length = lengths[i];
         }
+    } else {
+        max_length = build_code_table(nodes, root_node, codes);
     }
 
-    if (bit_count > 0) {
-        compressed_file->compressed_data[total_bits / 8] = buffer;
-        total_bits += bit_count;
+    /*
+     * Large inputs with short codes take the byte-pair variant, which halves the loop iterations,
+     * and inputs of several slices are encoded on as many threads as the CPU budget allows.
+     * Either way the histogram gives the exact output size before anything is encoded.
+     */
+    Huffman_code *pair_table = NULL;
+    if (data_len >= PAIR_TABLE_MIN_SIZE && max_length >= 1 && max_length <= PAIR_MAX_CODE_LENGTH) {
+        pair_table = malloc(PAIR_TABLE_ENTRIES * sizeof(Huffman_code));
+        if (pair_table != NULL) build_pair_table(codes, pair_table);
+    }
+    int slice_count = data_len / PARALLEL_SLICE_MIN;
+    if (slice_count > max_workers()) slice_count = max_workers();
+    if (slice_count > 1 && max_length >= 1 && max_length <= 32) {
+        Encode_slice slices[MAX_ENCODE_SLICES];
+        slice_count = cut_slices(original_data, data_len, false, slice_count, slices);
+        count_slices(slices, slice_count);
+        long bits = compress_sliced(slices, slice_count, codes, pair_table, &compressed_file->compressed_data);
+        free(pair_table);
+        if (bits < 0) return MALLOC_ERROR;
+        compressed_file->data_size = bits;
+        return 0;
     }
 
-    /* Special case: if only a single unique character exists, the tree depth is 0,
-     * so no bits would be generated. Write a 0 bit for each character to record the length. */
-    if (total_bits == 0 && data_len > 0) {
-        buffer = 0;
-        bit_count = 0;
+    size_t expected_bits = 0;
+    long frequencies[256] = {0};
+    count_frequencies(original_data, data_len, frequencies);
+    for (int symbol = 0; symbol < 256; symbol++) expected_bits += (size_t)frequencies[symbol] * codes[symbol].length;
+    // A single unique character has a zero-length code; it is recorded as one 0 bit per character.
+    bool single = expected_bits == 0;
+    if (single) expected_bits = data_len;
+    compressed_file->compressed_data = map_bitstream(expected_bits);
+    if (compressed_file->compressed_data == NULL || single) {
+        free(pair_table);
+        if (compressed_file->compressed_data == NULL) return MALLOC_ERROR;
+        compressed_file->data_size = expected_bits;
+        return 0;
+    }
+
+    if (pair_table != NULL) {
+        total_bits = compress_pairs((const unsigned char *)original_data, data_len, codes, pair_table, compressed_file->compressed_data);
+    } else if (max_length >= 1 && max_length <= 32) {
+        total_bits = compress_codes((const unsigned char *)original_data, data_len, codes, compressed_file->compressed_data);
+    } else {
         for (size_t i = 0; i < (size_t)data_len; i++) {
-            // Write a 0 bit (do not set a bit in the buffer)
-            bit_count++;
-            if (bit_count == 8) {
-                compressed_file->compressed_data[total_bits / 8] = buffer;
-                total_bits += 8;
-                buffer = 0;
-                bit_count = 0;
+            char *path = check_cache(original_data[i], cache);
+            if (path == NULL) {
+                path = find_leaf(original_data[i], nodes, root_node);
+                if (path != NULL) {
+                    cache[(unsigned char)original_data[i]] = path;
+                } else {
+                    free_bitstream(compressed_file->compressed_data, expected_bits);
+                    compressed_file->compressed_data = NULL;
+                    return TREE_ERROR;
+                }
+            }
+
+            for (int j = 0; path[j] != '\0'; j++) {
+                if (path[j] == '1') {
+                    buffer |= (1 << (7 - bit_count));
+                }
+                bit_count++;
+                if (bit_count == 8) {
+                    compressed_file->compressed_data[total_bits / 8] = buffer;
+                    total_bits += 8;
+                    buffer = 0;
+                    bit_count = 0;
+                }
             }
         }
+
         if (bit_count > 0) {
             compressed_file->compressed_data[total_bits / 8] = buffer;
             total_bits += bit_count;
         }
     }
+    free(pair_table);
 
     compressed_file->data_size = total_bits;
+    return 0;
+}
 
-    size_t final_size = (size_t)ceil((double)total_bits / 8.0);
-    char *temp = realloc(compressed_file->compressed_data, final_size);
-    if (temp != NULL) {
-        compressed_file->compressed_data = temp;
+/*
+ * Codes the data with one canonical tree in the original single-tree format, which every decoder reads.
+ * nodes (2 * 256 - 1 entries) receives the tree and is referenced, not copied, by compressed.
+ * Returns 0 on success or a negative code.
+ */
+static int compress_single_tree(const char *data, long data_len, bool is_dir, Node *nodes, Compressed_file *compressed) {
+    long frequencies[256] = {0};
+    unsigned long long work[256];
+    unsigned long long scratch[256];
+    unsigned char lengths[256];
+    long tree_size = 0;
+    Encode_slice slices[MAX_ENCODE_SLICES];
+
+    /*
+     * With several workers the slices (whole members for a directory) are counted in parallel and their
+     * histograms merged into the one table, then reused to place every slice's codes.
+     */
+    int slice_count = data_len / PARALLEL_SLICE_MIN;
+    if (slice_count > max_workers()) slice_count = max_workers();
+    if (slice_count > 1) {
+        slice_count = cut_slices(data, data_len, is_dir, slice_count, slices);
+        count_slices(slices, slice_count);
+        for (int i = 0; i < slice_count; i++) {
+            for (int symbol = 0; symbol < 256; symbol++) frequencies[symbol] += slices[i].histogram[symbol];
+        }
+    } else {
+        count_frequencies(data, data_len, frequencies);
     }
 
-    return 0;
+    // Derive the code lengths in place and lay out the canonical tree; no heap is involved.
+    int leaf_count = compute_code_lengths(frequencies, 256, work, scratch, lengths, 0);
+    if (leaf_count == 1) {
+        for (int i = 0; i < 256; i++) {
+            if (frequencies[i] != 0) nodes[0] = construct_leaf(frequencies[i], (char)i);
+        }
+        tree_size = 1;
+    } else {
+        tree_size = build_canonical_tree(lengths, nodes);
+    }
+    if (tree_size <= 0) return TREE_ERROR;
+    memcpy(compressed->magic, magic, sizeof(magic));
+    compressed->huffman_tree = nodes;
+    compressed->tree_size = tree_size * sizeof(Node);
+
+    int max_length = 0;
+    for (int i = 0; i < 256; i++) {
+        if (lengths[i] > max_length) max_length = lengths[i];
+    }
+    if (slice_count > 1 && leaf_count > 1 && max_length <= 32) {
+        Huffman_code codes[256];
+        canonical_codes(lengths, codes);
+        Huffman_code *pair_table = NULL;
+        if (max_length <= PAIR_MAX_CODE_LENGTH) {
+            pair_table = malloc(PAIR_TABLE_ENTRIES * sizeof(Huffman_code));
+            if (pair_table != NULL) build_pair_table(codes, pair_table);
+        }
+        long bits = compress_sliced(slices, slice_count, codes, pair_table, &compressed->compressed_data);
+        free(pair_table);
+        if (bits < 0) return MALLOC_ERROR;
+        compressed->data_size = bits;
+        return SUCCESS;
+    }
+
+    char **cache = calloc(256, sizeof(char *));
+    if (cache == NULL) return MALLOC_ERROR;
+    int res = compress(data, data_len, nodes, &nodes[tree_size - 1], cache, compressed);
+    for (int i = 0; i < 256; i++) {
+        free(cache[i]);
+    }
+    free(cache);
+    return res;
 }
 
 /*
- * Uses the prepared raw data to build a Huffman tree and write the compressed output.
+ * Uses the prepared raw data to build independently coded blocks and write the compressed output
+ * (or, with args.legacy, a single tree in the original format).
  * The caller must supply the raw data beforehand (file read, directory serialization).
  * Reads directory mode from args.directory. Returns 0 on success or a negative error code.
  */
@@ -279,94 +895,78 @@ int run_compression(Arguments args, const char *data, long data_len, long direct
     }
 
     int write_res = 0;
-    long *frequencies = NULL;
     Compressed_file *compressed_file = NULL;
-    Node *nodes = NULL;
-    long tree_size = 0;
-    char **cache = NULL;
+    Node nodes[2 * 256 - 1];
+    char *index = NULL;
     int res = 0;
     
     // The loop always breaks at the end; on errors we jump to the end.
     while (true) {
-        // Count the frequency of each byte in the input data.
-        frequencies = calloc(256, sizeof(long));
-        if (frequencies == NULL) {
-            fprintf(stderr, "Failed to allocate memory.\n");
-            res = MALLOC_ERROR;
-            break;
-        }
-        count_frequencies(data, data_len, frequencies);
-
-        int leaf_count = 0;
-        for (int i = 0; i < 256; i++) {
-            if (frequencies[i] != 0) {
-                leaf_count++;
-            }
-        }
-
-        if (leaf_count == 0) {
+        if (data_len == 0) {
             fprintf(stderr, "The file (%s) is empty.\n", args.input_file);
             res = SUCCESS;
             break;
         }
 
-        nodes = malloc((2 * leaf_count - 1) * sizeof(Node));
-        if (nodes == NULL) {
+        compressed_file = calloc(1, sizeof(Compressed_file));
+        if (compressed_file == NULL) {
             fprintf(stderr, "Failed to allocate memory.\n");
             res = MALLOC_ERROR;
             break;
         }
+        compressed_file->is_dir = args.directory;
+        compressed_file->original_file = args.input_file;
+        compressed_file->original_size = data_len;
+        compressed_file->file_name = args.output_file;
 
-        int j = 0;
-        for (int i = 0; i < 256; i++) {
-            if (frequencies[i] != 0) {
-                nodes[j] = construct_leaf(frequencies[i], (char)i);
-                j++;
+        // Index the members first: --consume frees the input while it is coded.
+        long index_size = build_index(data, data_len, args.directory, args.input_file, &index);
+        if (index_size < 0) {
+            if (index_size == MALLOC_ERROR) {
+                fprintf(stderr, "Failed to allocate memory.\n");
+            } else {
+                fprintf(stderr, "Failed to index the members.\n");
             }
-        }
-        free(frequencies);
-        frequencies = NULL;
-
-        // Build the Huffman tree from the sorted leaves.
-        sort_nodes(nodes, leaf_count);
-        Node *root_node = construct_tree(nodes, leaf_count);
-
-        if (root_node != NULL) {
-            tree_size = (root_node - nodes) + 1;
-        } else {
-            fprintf(stderr, "Failed to build the Huffman tree.\n");
-            res = TREE_ERROR;
-            break;
-        }
-        cache = calloc(256, sizeof(char *));
-        if (cache == NULL) {
-            fprintf(stderr, "Failed to allocate memory.\n");
-            res = MALLOC_ERROR;
+            res = index_size;
             break;
         }
 
-        compressed_file = malloc(sizeof(Compressed_file));
-        if (compressed_file == NULL) {
-            fprintf(stderr, "Failed to allocate memory.\n");
-            res = MALLOC_ERROR;
-            break;
+        // Split the data where its statistics change and code every block with its own table.
+        int level = args.level > 0 ? args.level : DEFAULT_LEVEL;
+        if (args.legacy) {
+            int compress_res = compress_single_tree(data, data_len, args.directory, nodes, compressed_file);
+            if (compress_res != 0) {
+                fprintf(stderr, "Failed to compress.\n");
+                res = compress_res;
+                break;
+            }
+            if (args.output_count > 1) {
+                write_res = write_striped(compressed_file, args.output_files, args.output_count, args.force);
+            } else {
+                write_res = write_compressed(compressed_file, args.force);
+            }
+        } else if (args.output_count > 1) {
+            // Striped output is also written batch by batch, each batch to the stripes it falls in.
+            write_res = write_striped_blocks(compressed_file, data, data_len, level, args.output_files, args.output_count, args.force);
+        } else {
+            // A single output is written batch by batch, within the memory budget.
+            int consume_fd = -1;
+            if (args.consume) {
+                consume_fd = open(args.input_file, O_WRONLY);
+                if (consume_fd == -1) {
+                    fprintf(stderr, "The file (%s) cannot be opened for writing, so it cannot be consumed.\n", args.input_file);
+                    res = EACCES;
+                    break;
+                }
+            }
+            write_res = write_blocks(compressed_file, data, data_len, level, args.force, consume_fd);
+            if (consume_fd != -1) close(consume_fd);
         }
-        // Compress the read data into the compressed_file structure.
-        int compress_res = compress(data, data_len, nodes, root_node, cache, compressed_file);
-        if (compress_res != 0) {
-            fprintf(stderr, "Failed to compress.\n");
-            res = compress_res;
-            break;
+        // Every volume carries the index, so --diff can read any of them.
+        for (int i = 0; write_res >= 0 && i < (args.output_count > 1 ? args.output_count : 1); i++) {
+            long appended = append_index(args.output_count > 1 ? args.output_files[i] : compressed_file->file_name, index, index_size);
+            write_res = (appended < 0) ? (int)appended : write_res + (int)appended;
         }
-
-        compressed_file->is_dir = args.directory;
-
-        compressed_file->huffman_tree = nodes;
-        compressed_file->tree_size = tree_size * sizeof(Node);
-        compressed_file->original_file = args.input_file;
-        compressed_file->original_size = data_len;
-        compressed_file->file_name = args.output_file;
-        write_res = write_compressed(compressed_file, args.force);
         if (write_res < 0) {
             if (write_res == NO_OVERWRITE) {
                 fprintf(stderr, "The file was not overwritten; compression was not performed.\n");
@@ -391,25 +991,20 @@ int run_compression(Arguments args, const char *data, long data_len, long direct
                     "Compression ratio: %.2f%%\n", original_size, get_unit(&original_size),
                                                  compressed_size, get_unit(&compressed_size),
                                                  (double)write_res/(args.directory ? directory_size : data_len) * 100);
+            // The input now lives only in the archive.
+            if (args.consume && unlink(args.input_file) != 0) {
+                fprintf(stderr, "Warning: Failed to remove the consumed file (%s).\n", args.input_file);
+            }
         }
         break;
     }
-    free(frequencies);
     if (output_generated) free(args.output_file);
-    free(nodes);
+    free(index);
     if (compressed_file != NULL) {
-        free(compressed_file->compressed_data);
+        free(compressed_file->block_data);
+        free_bitstream(compressed_file->compressed_data, compressed_file->data_size);
         free(compressed_file);
     }
-
-    if (cache != NULL) {
-        for (int i = 0; i < 256; ++i) {
-            if (cache[i] != NULL) {
-                free(cache[i]);
-            }
-        }
-        free(cache);
-    }
     if (write_res < 0) res = write_res;
     return res;
 }
@@ -4,13 +4,38 @@
 #include "data_types.h"
 #include <stdbool.h>
 
+// Inputs at least this long amortize building the 64K-entry byte-pair table.
+#define PAIR_TABLE_MIN_SIZE (256 * 1024)
+// Entries of a byte-pair table: one per pair of bytes.
+#define PAIR_TABLE_ENTRIES 65536
+// Longest code the byte-pair encoder accepts, so a pair fits in 24 bits.
+#define PAIR_MAX_CODE_LENGTH 12
+// compress() encodes on several threads once every thread gets a slice at least this long.
+#define PARALLEL_SLICE_MIN (256 * 1024)
+// Most slices a sliced encode is cut into.
+#define MAX_ENCODE_SLICES 64
+
 int count_frequencies(const char *data, long data_len, long *frequencies);
 Node* construct_tree(Node *nodes, long leaf_count);
 Node construct_leaf(long frequency, char data);
 Node construct_branch(Node *nodes, int left_index, int right_index);
 void sort_nodes(Node *nodes, int len);
+int compute_code_lengths(const long *frequencies, int alphabet_size, unsigned long long *work, unsigned long long *scratch, unsigned char *lengths, int max_length);
+int approximate_code_lengths(const long *frequencies, unsigned char *lengths, int max_length);
+long build_canonical_tree(const unsigned char *lengths, Node *nodes);
 char* check_cache(char leaf, char **cache);
 char* find_leaf(char leaf, Node *nodes, Node *root_node);
+int build_code_table(Node *nodes, Node *root_node, Huffman_code *codes);
+void build_pair_table(const Huffman_code *codes, Huffman_code *pair_table);
+size_t compress_pairs(const unsigned char *data, size_t data_len, const Huffman_code *codes, const Huffman_code *pair_table, char *out);
+size_t compress_codes(const unsigned char *data, size_t data_len, const Huffman_code *codes, char *out);
+int cut_slices(const char *data, size_t data_len, bool members, int max_slices, Encode_slice *slices);
+void count_slices(Encode_slice *slices, int slice_count);
+char *map_bitstream(size_t bits);
+void free_bitstream(char *data, size_t bits);
+size_t place_slices(Encode_slice *slices, int slice_count, const Huffman_code *codes);
+void encode_slices(Encode_slice *slices, int slice_count, const Huffman_code *codes, const Huffman_code *pair_table, char *out);
+long compress_sliced(Encode_slice *slices, int slice_count, const Huffman_code *codes, const Huffman_code *pair_table, char **out);
 int compress(const char *original_data, long data_len, Node *nodes, Node *root_node, char** cache, Compressed_file *compressed_file);
 char* generate_output_file(char *input_file);
 int run_compression(Arguments args, const char *data, long data_len, long directory_size);
@@ -9,8 +9,32 @@
  */
 static const char magic[4] = {'H', 'U', 'F', 'F'};
 
+/*
+ * Magic value at the start of every volume of a striped (multi-volume) archive.
+ */
+static const char volume_magic[4] = {'H', 'U', 'F', 'V'};
+
+/*
+ * Magic value of the block format, where the payload is a sequence of independently coded blocks.
+ */
+static const char block_magic[4] = {'H', 'U', 'F', 'B'};
+
+/*
+ * Magic value closing the member index appended after an archive's payload (see build_index).
+ */
+static const char index_magic[4] = {'H', 'I', 'D', 'X'};
+
 #define SERIALIZED_TMP_FILE ".serialized.tmp"
 
+// Largest alphabet the code-length engine accepts (symbols are stored in 16 bits while sorting).
+#define MAX_ALPHABET_SIZE 65536
+
+// Maximum number of -o volumes a striped archive may be split across.
+#define MAX_VOLUMES 16
+
+// Maximum number of --grep patterns one search matches at once.
+#define MAX_GREP_PATTERNS 16
+
 
 // Indicates whether a node is a leaf (stores data) or a branch.
 typedef enum {
@@ -32,6 +56,145 @@ typedef struct Node {
     };
 } Node;
 
+// A symbol's code as an integer (first path bit most significant) and its length in bits.
+typedef struct {
+    unsigned int bits;
+    unsigned char length;
+} Huffman_code;
+
+/*
+ * One slice of a sliced encode (see encode_slices). Every slice is counted on its own thread; the bit lengths
+ * taken from the histograms are prefix-summed into bit_offset so each thread encodes at its final position.
+ */
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    size_t histogram[256];
+    const Huffman_code *codes;
+    const Huffman_code *pair_table; // NULL to code one byte at a time.
+    size_t bits;
+    size_t bit_offset;
+    char *out;
+    unsigned char head;     // The slice's first output byte, merged into the output afterwards.
+} Encode_slice;
+
+// Narrowest and widest lookup table the specialized decoders are generated for.
+#define MIN_TABLE_BITS 9
+#define MAX_TABLE_BITS 12
+
+/*
+ * One entry of a table-driven decoder: the decoded byte and its code length, or for codes longer
+ * than the table, length 0 and the index of the tree node reached after the table's bits.
+ */
+typedef struct {
+    unsigned short value;
+    unsigned char length;
+} Decode_entry;
+
+// How the payload of one block is coded.
+typedef enum {
+    BLOCK_STORED,   // raw_size bytes copied verbatim.
+    BLOCK_HUFFMAN,  // Packed canonical code lengths, then the bitstream.
+    BLOCK_FILL,     // A single byte repeated raw_size times.
+    BLOCK_LANES,    // Packed canonical code lengths, then segments of LANE_COUNT interleaved bitstreams.
+    BLOCK_CM,       // Binary arithmetic code driven by a context-mixing model (see cm.c).
+    BLOCK_INFLATED, // A raw deflate stream kept inflated: Deflate_params, then one block of the inflated data.
+    BLOCK_WORDS     // Text coded by whole words: a word dictionary, then Huffman codes of words and bytes (see words.c).
+} Block_method;
+
+// Code lengths of a Huffman block are limited so two of them pack into one byte.
+#define BLOCK_MAX_CODE_LENGTH 15
+#define PACKED_LENGTHS_SIZE 128
+
+/*
+ * A BLOCK_WORDS payload: the number of dictionary words (unsigned short), the length of each (one byte),
+ * the words themselves, the code lengths of the 256 + count symbols packed two per byte, then the bitstream.
+ * Symbols below 256 are single bytes, the others dictionary words.
+ */
+#define WORDS_MAX 4096
+#define WORD_MAX_LENGTH 64
+
+/*
+ * A BLOCK_LANES payload codes its bytes in segments of up to LANE_SEGMENT_SYMBOLS: byte i of a segment
+ * goes to lane i % LANE_COUNT, and every lane is a bitstream of its own, so a decoder can follow all lanes
+ * side by side. A segment is the size in bytes of each lane (unsigned short), then the lanes in order.
+ */
+#define LANE_COUNT 16
+#define LANE_SEGMENT_SYMBOLS (LANE_COUNT * 1024)
+#define LANE_SEGMENT_HEADER (LANE_COUNT * sizeof(unsigned short))
+#define LANE_SIZE_MAX ((LANE_SEGMENT_SYMBOLS / LANE_COUNT * BLOCK_MAX_CODE_LENGTH + 7) / 8)
+#define LANE_SEGMENT_MAX (LANE_SEGMENT_HEADER + LANE_COUNT * LANE_SIZE_MAX)
+
+// Where decoding stands inside one segment of a BLOCK_LANES block.
+typedef struct {
+    unsigned int lane_start[LANE_COUNT]; // Offset of each lane from the start of the segment.
+    unsigned int lane_size[LANE_COUNT];  // In bytes.
+    unsigned int pos[LANE_COUNT];        // Next bit of each lane.
+    size_t size;                         // Bytes in the segment, header included.
+    size_t symbols;                      // Bytes it decodes to.
+    size_t done;                         // Of those, already decoded.
+} Lane_cursor;
+
+// Compression levels accepted by --level; 1 is fastest, 9 splits blocks optimally.
+#define MIN_LEVEL 1
+#define MAX_LEVEL 9
+#define DEFAULT_LEVEL 6
+// Archival level above MAX_LEVEL: CM_BLOCK_SIZE blocks coded with context mixing, one per core.
+#define CM_LEVEL 10
+#define CM_BLOCK_SIZE (4 * 1024 * 1024)
+// Input bytes a Cm_decoder holds back: enough for the arithmetic decoder to finish any one byte.
+#define CM_LOOKAHEAD 32
+#define CM_RING_SIZE 64
+
+struct Cm_model;
+
+/*
+ * Arithmetic decoder of one BLOCK_CM payload. The model it drives is mapped by cm_decoder_start
+ * and unmapped by cm_decoder_end; input is taken into a small ring ahead of the decoder.
+ */
+typedef struct {
+    struct Cm_model *model;
+    unsigned int x1;
+    unsigned int x2;
+    unsigned int x;
+    bool started;               // x has been loaded with the first four bytes.
+    unsigned char ring[CM_RING_SIZE];
+    unsigned int ring_head;
+    unsigned int ring_count;
+    size_t payload_left;        // Payload bytes not yet taken into the ring.
+} Cm_decoder;
+
+/*
+ * How to deflate the inner block of a BLOCK_INFLATED block back into the original stream: the zlib
+ * parameters deflate_exact is given (raw deflate, so window_bits is positive here), and the CRC-32 of
+ * that stream, which is checked so that a damaged block fails rather than restoring different bytes.
+ */
+typedef struct {
+    unsigned char level;
+    unsigned char mem_level;
+    unsigned char window_bits;
+    unsigned char strategy;
+    unsigned int crc;
+} Deflate_params;
+
+// Deflate streams are recompressed only between these sizes; the inflated data is kept below the maximum too.
+#define DEFLATE_STREAM_MIN 256
+#define DEFLATE_INFLATED_MAX (8 * 1024 * 1024)
+
+/*
+ * Precedes every block of the block format. payload_size lets a reader skip a block without decoding it.
+ * flags names the branch filter (BLOCK_FILTER_*) the raw bytes went through before they were coded, or is 0.
+ */
+#define BLOCK_FILTER_X86 1      // x86 CALL/JMP displacements made block-relative (see filter.c).
+#define BLOCK_FILTER_ARM64 2    // ARM64 BL offsets made block-relative.
+
+typedef struct {
+    unsigned char method;
+    unsigned char flags;
+    size_t raw_size;
+    size_t payload_size;
+} Block_header;
+
 /*
  * Contains all key data of the compressed file: the identifier, file names, tree, compressed data, and sizes.
  * The compress/decompress and read/write_compressed functions interpret this structure.
@@ -47,6 +210,8 @@ typedef struct {
     size_t tree_size; 
     char *compressed_data;
     size_t data_size; // In bits.
+    char *block_data; // Block format only (magic is block_magic): the serialized blocks replace the tree and data.
+    size_t block_data_size; // In bytes.
 } Compressed_file;
 
 // Holds the error codes for the helper functions.
@@ -66,9 +231,90 @@ typedef enum {
     EMPTY_DIRECTORY = -11,
     MKDIR_ERROR = -12,
     DIRECTORY_ERROR = -13,
-    EMPTY_FILE = -14
+    EMPTY_FILE = -14,
+    THROTTLE_ERROR = -15,
+    VOLUME_ERROR = -16,
+    JOB_CANCELLED = -17,
+    BUFFER_TOO_SMALL = -18,
+    NO_INDEX = -19,
+    ARCHIVE_TRUNCATED = -20
 } Error_code;
 
+// I/O scheduling class requested with --io-class.
+typedef enum {
+    IO_CLASS_DEFAULT,
+    IO_CLASS_BEST_EFFORT,
+    IO_CLASS_IDLE
+} Io_class;
+
+// The header field or payload a Stream_decoder is waiting for.
+typedef enum {
+    STREAM_MAGIC,
+    STREAM_IS_DIR,
+    STREAM_ORIGINAL_SIZE,
+    STREAM_NAME_LENGTH,
+    STREAM_NAME,
+    STREAM_TREE_SIZE,
+    STREAM_TREE,
+    STREAM_DATA_SIZE,
+    STREAM_DATA,
+    STREAM_BLOCKS_SIZE,
+    STREAM_BLOCK_HEADER,
+    STREAM_LENGTHS,
+    STREAM_SEGMENT_HEADER,
+    STREAM_SEGMENT,
+    STREAM_LANES,
+    STREAM_CM,
+    STREAM_CM_TAIL,
+    STREAM_WHOLE_PAYLOAD,
+    STREAM_WHOLE,
+    STREAM_STORED,
+    STREAM_FILL_BYTE,
+    STREAM_FILL,
+    STREAM_DONE
+} Stream_stage;
+
+// Longest original file name a Stream_decoder keeps; longer names are truncated.
+#define STREAM_NAME_MAX 4096
+
+/*
+ * Complete state of a resumable decoder: which header field it is in, the header values read so far,
+ * the decode table, and the bit buffer plus partially walked code of the symbol in progress.
+ * Holds no pointers, so it can live anywhere (stack, static, shared memory), except while inside a
+ * context-mixing block or one decoded whole: a decoder abandoned there must be released with stream_decoder_release.
+ */
+typedef struct {
+    Stream_stage stage;
+    size_t field_used;          // Bytes of the current field gathered so far.
+    unsigned char field[8];
+    bool blocked;               // Block format rather than a single tree.
+    bool is_dir;
+    size_t original_size;
+    long name_len;
+    char original_file[STREAM_NAME_MAX];
+    size_t tree_size;
+    Node tree[2 * 256 - 1];
+    size_t data_size;           // In bits.
+    size_t blocks_size;         // Block format: bytes of block data.
+    Block_header block;
+    unsigned char packed_lengths[PACKED_LENGTHS_SIZE];
+    size_t segments_left;       // BLOCK_LANES: payload bytes of the segments not yet gathered.
+    unsigned char segment[LANE_SEGMENT_MAX];
+    Lane_cursor lanes;
+    Cm_decoder cm;              // BLOCK_CM: its model is mapped while the block is decoded (see stream_decoder_release).
+    unsigned char *whole_payload; // Blocks decoded whole: the payload, mapped until the block is decoded.
+    char *whole_raw;            // Blocks decoded whole: the decoded block, mapped until it has been handed out.
+    size_t block_end;           // Value of produced at the end of the current block (or the file).
+    int width;                  // Decode table width, 0 when the root is a leaf.
+    Decode_entry table[1 << MAX_TABLE_BITS];
+    unsigned long long bit_buffer; // Valid bits are the most significant bit_count bits.
+    int bit_count;
+    size_t bits_loaded;         // Stream bits moved into the bit buffer so far.
+    size_t produced;            // Output bytes decoded so far.
+    long partial_node;          // Tree node of a long code being walked, -1 if none.
+    bool pause_stored;          // Return at the start of every stored block (see stream_stored_left).
+} Stream_decoder;
+
 typedef struct {
     bool is_dir;
     union {
@@ -84,6 +330,83 @@ typedef struct {
     };
 } Directory_item;
 
+// One member of an opened archive; path and data point into the archive's decoded image, or data into the archive itself.
+typedef struct {
+    const char *path;
+    bool is_dir;
+    int perms;              // Directories only.
+    const char *data;       // Files only, NULL when empty.
+    size_t size;
+} Archive_member;
+
+/*
+ * An archive opened for in-memory access (see archive_open).
+ * For a single-file archive there is one member named after the original file.
+ */
+typedef struct {
+    bool is_dir;
+    char *image;            // Decoded payload, an anonymous mapping (NULL when nothing needed decoding).
+    size_t image_size;
+    const char *mapping;    // The archive file as read, kept for members stored in it as they are.
+    size_t mapping_size;
+    char *name;             // Original file or directory name.
+    Archive_member *members;
+    size_t member_count;
+} Archive;
+
+// One member as recorded in an archive's member index.
+typedef struct {
+    const char *path;       // Points into the index data.
+    bool is_dir;
+    int perms;              // Directories only.
+    size_t size;            // Files only.
+    unsigned long long checksum; // FNV-1a of the content, files only.
+} Index_entry;
+
+// The member index read back from an archive (see read_index).
+typedef struct {
+    char *data;             // The raw entries, which the paths point into.
+    Index_entry *entries;
+    size_t count;
+} Member_index;
+
+// What an asynchronous job does (see job_submit).
+typedef enum {
+    JOB_COMPRESS,   // Codes the input as a block-format archive.
+    JOB_DECOMPRESS  // Restores the payload of an archive.
+} Job_kind;
+
+typedef enum {
+    JOB_IDLE,
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE
+} Job_state;
+
+/*
+ * One asynchronous codec job. The caller owns it (and every buffer and descriptor it names)
+ * and must leave it untouched from job_submit until job_poll returns it.
+ * The input is the in buffer, or in_fd read to end of file when in is NULL;
+ * the output is the out buffer, or out_fd when out is NULL. Descriptors are not closed.
+ */
+typedef struct Job {
+    Job_kind kind;
+    int level;              // Compression only, 0 means DEFAULT_LEVEL.
+    const char *name;       // Compression only: original file name stored in the header, may be NULL.
+    const char *in;
+    size_t in_len;
+    int in_fd;
+    char *out;
+    size_t out_cap;
+    int out_fd;
+    void *user;             // Left alone for the caller.
+    // Set by the queue.
+    Job_state state;
+    bool cancel;
+    long result;            // Once done: bytes produced, or a negative code (JOB_CANCELLED, BUFFER_TOO_SMALL, ...).
+    struct Job *next;
+} Job;
+
 typedef struct {
     bool compress_mode;
     bool extract_mode;
@@ -91,7 +414,24 @@ typedef struct {
     bool directory;
     bool no_preserve_perms;
     char *input_file;
-    char *output_file;
+    char *output_file; // The first -o path.
+    char *output_files[MAX_VOLUMES]; // Every -o path; more than one stripes the output.
+    int output_count;
+    double max_rate; // MB/s, 0 means unlimited.
+    Io_class io_class;
+    int cpu_budget; // 0 means every allowed CPU.
+    int level; // Compression level, 0 means DEFAULT_LEVEL.
+    size_t max_memory; // Bytes, 0 means no budget.
+    bool consume; // Free the input while compressing and remove it at the end.
+    bool legacy; // Write the single-tree format instead of blocks.
+    long deadline_ms; // Compression time limit, 0 means none.
+    bool lanes; // Code Huffman blocks as interleaved lanes (BLOCK_LANES) for wide decoders.
+    bool text; // Code blocks by words (BLOCK_WORDS) where that comes out smaller.
+    bool diff_mode;
+    char *diff_file; // --diff: the archive input_file is compared against.
+    char *grep_pattern; // The first --grep pattern: search input_file instead of restoring it.
+    char *grep_patterns[MAX_GREP_PATTERNS]; // Every --grep pattern; a line matches if it contains any.
+    int grep_pattern_count;
 } Arguments;
 
 #endif
@@ -2,62 +2,550 @@
 #include "data_types.h"
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "file.h"
 #include "decompress.h"
+#include "table_cache.h"
+#include "pipe.h"
+#include "restore.h"
+#include "block.h"
+#include "compress.h"
+#include "throttle.h"
+#include "cm.h"
+#include "recompress.h"
+#include "filter.h"
+#include "words.h"
 
 /*
- * Traverses the Huffman tree to recreate the original data bit by bit.
- * Reads from the compressed buffer and writes the decompressed bytes into the caller-provided array.
- * Returns 0 on success or a negative value on failure.
+ * Fills the decode table for the subtree at `index`, reached with `code` after `depth` bits.
+ * Leaves within the table width cover every entry sharing their prefix; branches at exactly the
+ * table width store their node index (length 0) so longer codes continue bit by bit from there.
+ * Returns the depth of the deepest leaf, or DECOMPRESSION_ERROR for a malformed tree.
  */
-int decompress(Compressed_file *compressed, char *raw) {
-    size_t root_index = (compressed->tree_size / sizeof(Node)) - 1;
+static int fill_decode_table(const Node *tree, size_t node_count, size_t index, unsigned int code, int depth, int width, Decode_entry *table) {
+    if (index >= node_count || depth > 255) return DECOMPRESSION_ERROR;
+    const Node *node = &tree[index];
+    if (node->type == LEAF) {
+        if (depth <= width) {
+            unsigned int first = code << (width - depth);
+            unsigned int last = (code + 1) << (width - depth);
+            for (unsigned int i = first; i < last; i++) {
+                table[i].value = (unsigned char)node->data;
+                table[i].length = depth;
+            }
+        }
+        return depth;
+    }
+    if (depth == width) {
+        table[code].value = index;
+        table[code].length = 0;
+    }
+    unsigned int next = depth < width ? code << 1 : code;
+    int left = fill_decode_table(tree, node_count, node->left, next, depth + 1, width, table);
+    if (left < 0) return DECOMPRESSION_ERROR;
+    int right = fill_decode_table(tree, node_count, node->right, next | (depth < width), depth + 1, width, table);
+    if (right < 0) return DECOMPRESSION_ERROR;
+    return left > right ? left : right;
+}
+
+/*
+ * Builds the lookup table for the tree, choosing the narrowest width in [MIN_TABLE_BITS, MAX_TABLE_BITS]
+ * that still covers the longest code. The table must hold 1 << MAX_TABLE_BITS entries.
+ * The tree comes from the archive, so it is checked (see valid_tree) before it is walked.
+ * Returns the chosen width or DECOMPRESSION_ERROR for a malformed tree.
+ */
+int build_decode_table(const Node *tree, size_t node_count, Decode_entry *table) {
+    if (!valid_tree(tree, node_count)) return DECOMPRESSION_ERROR;
+    int width = MAX_TABLE_BITS;
+    int max_depth = fill_decode_table(tree, node_count, node_count - 1, 0, 0, width, table);
+    if (max_depth < 0) return DECOMPRESSION_ERROR;
+    if (max_depth < MAX_TABLE_BITS) {
+        width = max_depth < MIN_TABLE_BITS ? MIN_TABLE_BITS : max_depth;
+        fill_decode_table(tree, node_count, node_count - 1, 0, 0, width, table);
+    }
+    return width;
+}
 
-    size_t current_node = root_index;
-    size_t current_raw = 0;
+/*
+ * Returns the decode table for the tree like build_decode_table(), taking it from the table cache
+ * when the tree is canonical (identified by its code lengths) and caching newly built ones.
+ */
+int prepare_decode_table(const Node *tree, size_t node_count, Decode_entry *table) {
+    unsigned char lengths[256];
+    int width = 0;
+    bool cacheable = tree_signature(tree, node_count, lengths) == 1;
+    if (cacheable && lookup_tables(lengths, table, &width, NULL)) return width;
 
-    // Check whether the root is a leaf (the single unique character case).
-    bool root_is_leaf = (compressed->huffman_tree[root_index].type == LEAF);
+    width = build_decode_table(tree, node_count, table);
+    if (width >= 0 && cacheable) {
+        Huffman_code codes[256];
+        canonical_codes(lengths, codes);
+        store_tables(lengths, table, width, codes);
+    }
+    return width;
+}
 
-    unsigned char buffer = 0;
-    for (size_t i = 0; i < (size_t)compressed->data_size; i++) {
-        if (current_raw >= compressed->original_size) {
-            break;
+static inline unsigned long long load_be64(const unsigned char *p) {
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return __builtin_bswap64(v);
+}
+
+/*
+ * Decodes one symbol at bit position *pos of a bitstream of total_bits bits without reading past its
+ * last byte, following the table and then the tree for codes longer than the table.
+ * Returns the byte or -1 if the bits run out.
+ */
+static int decode_slow(const unsigned char *data, size_t total_bits, const Node *tree, const Decode_entry *table, int width, size_t *pos) {
+    unsigned int index = 0;
+    for (int i = 0; i < width; i++) {
+        size_t bit = *pos + i;
+        index = (index << 1) | (bit < total_bits ? (data[bit / 8] >> (7 - bit % 8)) & 1 : 0);
+    }
+    Decode_entry entry = table[index];
+    if (entry.length > 0) {
+        if (*pos + entry.length > total_bits) return -1;
+        *pos += entry.length;
+        return entry.value;
+    }
+    size_t node = entry.value;
+    *pos += width;
+    while (tree[node].type != LEAF) {
+        if (*pos >= total_bits) return -1;
+        int bit = (data[*pos / 8] >> (7 - *pos % 8)) & 1;
+        node = bit ? tree[node].right : tree[node].left;
+        (*pos)++;
+    }
+    return (unsigned char)tree[node].data;
+}
+
+/*
+ * Template for a decoder specialized to a fixed table width. The fast path loads 64 bits
+ * (at least 57 usable) and decodes four symbols from them, unrolled, with constant shifts.
+ * Entries without a length (codes longer than the table) drop to decode_slow().
+ */
+#define DECODE_STEP(WIDTH)                                                              \
+    entry = table[window >> (64 - (WIDTH))];                                           \
+    if (entry.length == 0) goto slow;                                                   \
+    raw[out++] = (char)entry.value;                                                     \
+    window <<= entry.length;                                                            \
+    pos += entry.length;
+
+#define DEFINE_DECODER(WIDTH)                                                           \
+static size_t decode_width_##WIDTH(const Compressed_file *compressed, const Decode_entry *table, char *raw) { \
+    const unsigned char *data = (const unsigned char *)compressed->compressed_data;     \
+    size_t byte_count = (compressed->data_size + 7) / 8;                                \
+    size_t size = compressed->original_size;                                            \
+    size_t out = 0;                                                                     \
+    size_t pos = 0;                                                                     \
+    while (out < size && pos < compressed->data_size) {                                 \
+        if (out + 4 <= size && pos / 8 + 8 <= byte_count) {                             \
+            unsigned long long window = load_be64(data + pos / 8) << (pos % 8);         \
+            Decode_entry entry;                                                         \
+            DECODE_STEP(WIDTH)                                                          \
+            DECODE_STEP(WIDTH)                                                          \
+            DECODE_STEP(WIDTH)                                                          \
+            DECODE_STEP(WIDTH)                                                          \
+            continue;                                                                   \
+        }                                                                               \
+    slow: {                                                                             \
+            int symbol = decode_slow(data, compressed->data_size, compressed->huffman_tree, table, WIDTH, &pos); \
+            if (symbol < 0) break;                                                      \
+            raw[out++] = (char)symbol;                                                  \
+        }                                                                               \
+    }                                                                                   \
+    return out;                                                                         \
+}
+
+// Every generated table width; each X(W) expands to one specialized decoder.
+#define DECODER_WIDTHS X(9) X(10) X(11) X(12)
+
+#define X(WIDTH) DEFINE_DECODER(WIDTH)
+DECODER_WIDTHS
+#undef X
+
+typedef size_t (*Decoder_fn)(const Compressed_file *compressed, const Decode_entry *table, char *raw);
+
+static const Decoder_fn decoders[] = {
+#define X(WIDTH) decode_width_##WIDTH,
+    DECODER_WIDTHS
+#undef X
+};
+
+/*
+ * Reads the lane sizes at the start of a BLOCK_LANES segment that decodes to `symbols` bytes
+ * and sets up the cursor to decode it. The segment needs only its LANE_SEGMENT_HEADER bytes here.
+ * Returns the size of the whole segment (at most LANE_SEGMENT_MAX) or DECOMPRESSION_ERROR.
+ */
+long open_segment(const unsigned char *segment, size_t symbols, Lane_cursor *cursor) {
+    unsigned short sizes[LANE_COUNT];
+    if (symbols == 0 || symbols > LANE_SEGMENT_SYMBOLS) return DECOMPRESSION_ERROR;
+    memcpy(sizes, segment, sizeof(sizes));
+    size_t offset = LANE_SEGMENT_HEADER;
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        if (sizes[lane] > LANE_SIZE_MAX) return DECOMPRESSION_ERROR;
+        cursor->lane_start[lane] = offset;
+        cursor->lane_size[lane] = sizes[lane];
+        cursor->pos[lane] = 0;
+        offset += sizes[lane];
+    }
+    cursor->size = offset;
+    cursor->symbols = symbols;
+    cursor->done = 0;
+    return offset;
+}
+
+// Decodes the next symbol of one lane, with the 64-bit window while the lane has 8 bytes left.
+static int lane_symbol(const unsigned char *segment, Lane_cursor *cursor, int lane, const Node *tree, const Decode_entry *table, int width) {
+    const unsigned char *data = segment + cursor->lane_start[lane];
+    size_t pos = cursor->pos[lane];
+    if (pos / 8 + 8 <= cursor->lane_size[lane]) {
+        Decode_entry entry = table[(load_be64(data + pos / 8) << (pos % 8)) >> (64 - width)];
+        if (entry.length > 0) {
+            cursor->pos[lane] += entry.length;
+            return entry.value;
         }
+    }
+    int symbol = decode_slow(data, (size_t)cursor->lane_size[lane] * 8, tree, table, width, &pos);
+    cursor->pos[lane] = pos;
+    return symbol;
+}
+
+#if defined(__x86_64__)
+_Static_assert(sizeof(Decode_entry) == 4, "the vector decoders gather entries as 32-bit words");
+
+/*
+ * Vector decoders: every round gathers 32 bits from each lane at once, looks all of them up in the table
+ * with a second gather and writes one byte per lane. A round stops them when a lane is within 4 bytes
+ * of the segment end or meets a code longer than the table; the caller finishes that round one lane at a time.
+ * Each returns the number of whole rounds decoded, at most `rounds`.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static size_t decode_rounds_avx512(const unsigned char *segment, Lane_cursor *cursor, const Decode_entry *table, int width, char *out, size_t rounds) {
+    const __m512i swap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    const __m512i limit = _mm512_set1_epi32((int)cursor->size - 4);
+    const __m512i shift = _mm512_set1_epi32(32 - width);
+    const __m512i byte = _mm512_set1_epi32(0xFF);
+    __m512i start = _mm512_loadu_si512(cursor->lane_start);
+    __m512i pos = _mm512_loadu_si512(cursor->pos);
+    size_t done = 0;
+    while (done < rounds) {
+        __m512i offset = _mm512_add_epi32(start, _mm512_srli_epi32(pos, 3));
+        if (_mm512_cmpgt_epi32_mask(offset, limit) != 0) break;
+        __m512i words = _mm512_shuffle_epi8(_mm512_i32gather_epi32(offset, segment, 1), swap);
+        __m512i window = _mm512_sllv_epi32(words, _mm512_and_si512(pos, _mm512_set1_epi32(7)));
+        __m512i entries = _mm512_i32gather_epi32(_mm512_srlv_epi32(window, shift), table, 4);
+        __m512i lengths = _mm512_and_si512(_mm512_srli_epi32(entries, 16), byte);
+        if (_mm512_cmpeq_epi32_mask(lengths, _mm512_setzero_si512()) != 0) break;
+        pos = _mm512_add_epi32(pos, lengths);
+        _mm_storeu_si128((__m128i *)(out + done * LANE_COUNT), _mm512_cvtepi32_epi8(entries));
+        done++;
+    }
+    _mm512_storeu_si512(cursor->pos, pos);
+    return done;
+}
 
-        if (i % 8 == 0) {
-            buffer = compressed->compressed_data[i / 8];
+// The AVX2 form runs the 16 lanes as two vectors of 8.
+__attribute__((target("avx2")))
+static size_t decode_rounds_avx2(const unsigned char *segment, Lane_cursor *cursor, const Decode_entry *table, int width, char *out, size_t rounds) {
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i pick = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i limit = _mm256_set1_epi32((int)cursor->size - 4);
+    const __m128i shift = _mm_cvtsi32_si128(32 - width);
+    const __m256i seven = _mm256_set1_epi32(7);
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+    __m256i start[2] = {_mm256_loadu_si256((const __m256i *)cursor->lane_start), _mm256_loadu_si256((const __m256i *)(cursor->lane_start + 8))};
+    __m256i pos[2] = {_mm256_loadu_si256((const __m256i *)cursor->pos), _mm256_loadu_si256((const __m256i *)(cursor->pos + 8))};
+    size_t done = 0;
+    while (done < rounds) {
+        __m256i offset[2];
+        __m256i entries[2];
+        __m256i lengths[2];
+        bool stop = false;
+        for (int half = 0; half < 2; half++) {
+            offset[half] = _mm256_add_epi32(start[half], _mm256_srli_epi32(pos[half], 3));
+            stop |= _mm256_movemask_epi8(_mm256_cmpgt_epi32(offset[half], limit)) != 0;
+        }
+        if (stop) break;
+        for (int half = 0; half < 2; half++) {
+            __m256i words = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int *)segment, offset[half], 1), swap);
+            __m256i window = _mm256_sllv_epi32(words, _mm256_and_si256(pos[half], seven));
+            entries[half] = _mm256_i32gather_epi32((const int *)table, _mm256_srl_epi32(window, shift), 4);
+            lengths[half] = _mm256_and_si256(_mm256_srli_epi32(entries[half], 16), byte);
+            stop |= _mm256_movemask_epi8(_mm256_cmpeq_epi32(lengths[half], _mm256_setzero_si256())) != 0;
+        }
+        if (stop) break;
+        for (int half = 0; half < 2; half++) {
+            pos[half] = _mm256_add_epi32(pos[half], lengths[half]);
+            // The low byte of every entry, four per 128-bit half, joined into 8 bytes.
+            __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(entries[half], pick), _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1));
+            _mm_storel_epi64((__m128i *)(out + done * LANE_COUNT + half * 8), _mm256_castsi256_si128(bytes));
         }
+        done++;
+    }
+    _mm256_storeu_si256((__m256i *)cursor->pos, pos[0]);
+    _mm256_storeu_si256((__m256i *)(cursor->pos + 8), pos[1]);
+    return done;
+}
+#endif
 
-        // If the root is a leaf, every bit yields the same character.
-        if (root_is_leaf) {
-            raw[current_raw++] = compressed->huffman_tree[root_index].data;
-        } else {
-            if (buffer & (1 << (7 - i % 8))) {
-                current_node = compressed->huffman_tree[current_node].right;
-            } else {
-                current_node = compressed->huffman_tree[current_node].left;
-            }
+// Runs the widest vector decoder the CPU supports; without one it decodes no rounds.
+static size_t decode_rounds(const unsigned char *segment, Lane_cursor *cursor, const Decode_entry *table, int width, char *out, size_t rounds) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return decode_rounds_avx512(segment, cursor, table, width, out, rounds);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return decode_rounds_avx2(segment, cursor, table, width, out, rounds);
+    }
+#endif
+    (void)segment;
+    (void)cursor;
+    (void)table;
+    (void)width;
+    (void)out;
+    (void)rounds;
+    return 0;
+}
 
-            if (compressed->huffman_tree[current_node].type == LEAF) {
-                raw[current_raw++] = compressed->huffman_tree[current_node].data;
-                current_node = root_index;
-            }
+/*
+ * Decodes up to out_cap bytes of an opened segment (see open_segment), resuming where the cursor stands.
+ * Whole rounds (one byte from every lane) go through the vector decoders; the scalar path decodes the lanes
+ * in the same lockstep one byte at a time, finishing rounds the vector decoders stopped in and the tail.
+ * The tree and table must be built for the block, the table at least MIN_TABLE_BITS wide.
+ * Returns the number of bytes written or DECOMPRESSION_ERROR if a lane runs out of bits.
+ */
+long decode_segment(const unsigned char *segment, Lane_cursor *cursor, const Node *tree, const Decode_entry *table, int width, char *out, size_t out_cap) {
+    size_t count = cursor->symbols - cursor->done;
+    if (count > out_cap) count = out_cap;
+    size_t written = 0;
+    while (written < count) {
+        if (cursor->done % LANE_COUNT == 0 && count - written >= LANE_COUNT) {
+            size_t rounds = decode_rounds(segment, cursor, table, width, out + written, (count - written) / LANE_COUNT);
+            written += rounds * LANE_COUNT;
+            cursor->done += rounds * LANE_COUNT;
+            if (written == count) break;
+        }
+        int symbol = lane_symbol(segment, cursor, cursor->done % LANE_COUNT, tree, table, width);
+        if (symbol < 0) return DECOMPRESSION_ERROR;
+        out[written++] = (char)symbol;
+        cursor->done++;
+    }
+    // The vector decoders do not check lane ends, so a malformed lane may have run into the next one.
+    if (cursor->done == cursor->symbols) {
+        for (int lane = 0; lane < LANE_COUNT; lane++) {
+            if (cursor->pos[lane] > cursor->lane_size[lane] * 8) return DECOMPRESSION_ERROR;
         }
     }
+    return written;
+}
+
+/*
+ * Decodes a BLOCK_LANES payload of payload_size bytes into raw_size bytes.
+ * Returns 0 on success or DECOMPRESSION_ERROR for a malformed payload.
+ */
+static int decompress_lanes(const unsigned char *payload, size_t payload_size, char *raw, size_t raw_size) {
+    unsigned char lengths[256];
+    Node nodes[2 * 256 - 1];
+    Decode_entry table[1 << MAX_TABLE_BITS];
+    unpack_lengths(payload, lengths);
+    long node_count = build_canonical_tree(lengths, nodes);
+    if (node_count < 3) return DECOMPRESSION_ERROR;
+    int width = prepare_decode_table(nodes, node_count, table);
+    if (width < 0) return DECOMPRESSION_ERROR;
+
+    size_t offset = PACKED_LENGTHS_SIZE;
+    for (size_t produced = 0; produced < raw_size;) {
+        Lane_cursor cursor;
+        size_t symbols = raw_size - produced < LANE_SEGMENT_SYMBOLS ? raw_size - produced : LANE_SEGMENT_SYMBOLS;
+        if (payload_size - offset < LANE_SEGMENT_HEADER) return DECOMPRESSION_ERROR;
+        long size = open_segment(payload + offset, symbols, &cursor);
+        if (size < 0 || (size_t)size > payload_size - offset) return DECOMPRESSION_ERROR;
+        if (decode_segment(payload + offset, &cursor, nodes, table, width, raw + produced, symbols) != (long)symbols) {
+            return DECOMPRESSION_ERROR;
+        }
+        produced += symbols;
+        offset += size;
+    }
+    return offset == payload_size ? 0 : DECOMPRESSION_ERROR;
+}
 
+static int rebuild_deflate(const unsigned char *payload, size_t payload_size, char *raw, size_t raw_size);
+
+/*
+ * Decodes one block of the block format from its header and payload into raw (header->raw_size bytes):
+ * stored blocks are copied, fills are set, Huffman blocks rebuild their canonical tree from the packed
+ * lengths and run through the same table-driven decoders, interleaved (BLOCK_LANES) blocks go to the
+ * lane decoders, context-mixed (BLOCK_CM) blocks run their model again, word-coded (BLOCK_WORDS)
+ * blocks go to decode_words and inflated (BLOCK_INFLATED) blocks are deflated back (see rebuild_deflate). A block coded through a branch filter (header->flags)
+ * is unfiltered afterwards.
+ * Returns 0 on success, DECOMPRESSION_ERROR for a malformed block or MALLOC_ERROR.
+ */
+int decode_block(const Block_header *header, const unsigned char *payload, char *raw) {
+    if (header->flags != 0 && header->flags != BLOCK_FILTER_X86 && header->flags != BLOCK_FILTER_ARM64) return DECOMPRESSION_ERROR;
+
+    if (header->method == BLOCK_STORED && header->payload_size == header->raw_size) {
+        memcpy(raw, payload, header->raw_size);
+    } else if (header->method == BLOCK_FILL && header->payload_size == 1) {
+        memset(raw, payload[0], header->raw_size);
+    } else if (header->method == BLOCK_HUFFMAN && header->payload_size >= PACKED_LENGTHS_SIZE) {
+        unsigned char lengths[256];
+        Node nodes[2 * 256 - 1];
+        unpack_lengths(payload, lengths);
+        long node_count = build_canonical_tree(lengths, nodes);
+        if (node_count == 0) return DECOMPRESSION_ERROR;
+
+        Compressed_file block = {0};
+        block.huffman_tree = nodes;
+        block.tree_size = node_count * sizeof(Node);
+        block.compressed_data = (char *)payload + PACKED_LENGTHS_SIZE;
+        block.data_size = (header->payload_size - PACKED_LENGTHS_SIZE) * 8;
+        block.original_size = header->raw_size;
+        if (decompress(&block, raw) != 0) return DECOMPRESSION_ERROR;
+    } else if (header->method == BLOCK_LANES && header->payload_size >= PACKED_LENGTHS_SIZE) {
+        if (decompress_lanes(payload, header->payload_size, raw, header->raw_size) != 0) return DECOMPRESSION_ERROR;
+    } else if (header->method == BLOCK_CM) {
+        Cm_decoder cm;
+        if (cm_decoder_start(&cm, header->payload_size) != SUCCESS) return MALLOC_ERROR;
+        size_t used = 0;
+        size_t decoded = cm_decode(&cm, payload, header->payload_size, &used, raw, header->raw_size);
+        cm_decoder_end(&cm);
+        if (decoded != header->raw_size) return DECOMPRESSION_ERROR;
+    } else if (header->method == BLOCK_INFLATED) {
+        int ret = rebuild_deflate(payload, header->payload_size, raw, header->raw_size);
+        if (ret != SUCCESS) return ret;
+    } else if (header->method == BLOCK_WORDS) {
+        if (decode_words(payload, header->payload_size, raw, header->raw_size) != 0) return DECOMPRESSION_ERROR;
+    } else {
+        return DECOMPRESSION_ERROR;
+    }
+    if (header->flags != 0) filter_block(header->flags, (unsigned char *)raw, header->raw_size, false);
+    return 0;
+}
+
+/*
+ * Decodes the block format block by block (see decode_block).
+ * Returns 0 on success, DECOMPRESSION_ERROR for a malformed block sequence or MALLOC_ERROR.
+ */
+static int decompress_blocks(Compressed_file *compressed, char *raw) {
+    const char *current = compressed->block_data;
+    const char *end = current + compressed->block_data_size;
+    size_t produced = 0;
+
+    while (produced < compressed->original_size) {
+        Block_header header;
+        if ((size_t)(end - current) < sizeof(Block_header)) return DECOMPRESSION_ERROR;
+        memcpy(&header, current, sizeof(Block_header));
+        current += sizeof(Block_header);
+        if (header.payload_size > (size_t)(end - current) || header.raw_size > compressed->original_size - produced) {
+            return DECOMPRESSION_ERROR;
+        }
+        int ret = decode_block(&header, (const unsigned char *)current, raw + produced);
+        if (ret != SUCCESS) return ret;
+        produced += header.raw_size;
+        current += header.payload_size;
+    }
+    return 0;
+}
+
+/*
+ * Walks the block headers of a block-format archive and returns how many bytes of the original they hold.
+ * Compressing with --consume records the block data size after every durable batch, so a run that was
+ * killed leaves blocks ending cleanly before original_size; whatever follows them in the file is not counted.
+ * Returns DECOMPRESSION_ERROR if a block runs past the recorded size.
+ */
+long recorded_size(const Compressed_file *compressed) {
+    const char *current = compressed->block_data;
+    const char *end = current + compressed->block_data_size;
+    size_t produced = 0;
+
+    while (current < end) {
+        Block_header header;
+        if ((size_t)(end - current) < sizeof(Block_header)) return DECOMPRESSION_ERROR;
+        memcpy(&header, current, sizeof(Block_header));
+        current += sizeof(Block_header);
+        if (header.payload_size > (size_t)(end - current)) return DECOMPRESSION_ERROR;
+        produced += header.raw_size;
+        current += header.payload_size;
+    }
+    return produced;
+}
+
+/*
+ * Turns the payload of a BLOCK_INFLATED block back into the raw_size bytes of deflate stream it stands for:
+ * decodes the inner block to the inflated data and deflates that with the stored parameters.
+ * The deflate is the pinned one of deflate_exact, not the system zlib's; the result must still match the stored CRC.
+ * Returns 0 on success, DECOMPRESSION_ERROR or MALLOC_ERROR.
+ */
+static int rebuild_deflate(const unsigned char *payload, size_t payload_size, char *raw, size_t raw_size) {
+    Deflate_params params;
+    Block_header inner;
+    if (payload_size < sizeof(Deflate_params) + sizeof(Block_header)) return DECOMPRESSION_ERROR;
+    memcpy(&params, payload, sizeof(Deflate_params));
+    memcpy(&inner, payload + sizeof(Deflate_params), sizeof(Block_header));
+    if (inner.method == BLOCK_INFLATED || inner.raw_size > DEFLATE_INFLATED_MAX
+        || inner.payload_size != payload_size - sizeof(Deflate_params) - sizeof(Block_header)) {
+        return DECOMPRESSION_ERROR;
+    }
+
+    char *inflated = mmap(NULL, inner.raw_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (inflated == MAP_FAILED) return MALLOC_ERROR;
+    Compressed_file block = {0};
+    memcpy(block.magic, block_magic, sizeof(block_magic));
+    block.block_data = (char *)payload + sizeof(Deflate_params);
+    block.block_data_size = payload_size - sizeof(Deflate_params);
+    block.original_size = inner.raw_size;
+    int ret = decompress_blocks(&block, inflated);
+    if (ret == SUCCESS) ret = deflate_inflated(&params, (const unsigned char *)inflated, inner.raw_size, raw, raw_size);
+    munmap(inflated, inner.raw_size + 1);
+    return ret;
+}
+
+/*
+ * Recreates the original data from the Huffman bitstream into the caller-provided array.
+ * Builds a lookup table from the tree and runs the decoder generated for that table width.
+ * Block-format files are decoded block by block.
+ * Returns 0 on success or a negative value for a malformed tree.
+ */
+int decompress(Compressed_file *compressed, char *raw) {
+    if (memcmp(compressed->magic, block_magic, sizeof(block_magic)) == 0) {
+        return decompress_blocks(compressed, raw);
+    }
+    size_t node_count = compressed->tree_size / sizeof(Node);
+    if (node_count == 0) return DECOMPRESSION_ERROR;
+    size_t root_index = node_count - 1;
+
+    // If the root is a leaf (the single unique character case), every bit yields the same character.
+    if (compressed->huffman_tree[root_index].type == LEAF) {
+        size_t count = compressed->data_size < compressed->original_size ? compressed->data_size : compressed->original_size;
+        memset(raw, compressed->huffman_tree[root_index].data, count);
+        return 0;
+    }
+
+    Decode_entry table[1 << MAX_TABLE_BITS];
+    int width = prepare_decode_table(compressed->huffman_tree, node_count, table);
+    if (width < 0) return DECOMPRESSION_ERROR;
+
+    // Like the bitwise walk it replaces, decoding stops at original_size or when the bits run out.
+    decoders[width - MIN_TABLE_BITS](compressed, table, raw);
     return 0;
 }
 
 /*
  * Reads the compressed file, decodes the Huffman data, and returns the raw content.
  * For files: creates a memory-mapped output file and decompresses directly to it, then unmaps.
- * For directories: allocates a buffer for serialized data (caller must free).
- * Output pointer arguments must be valid addresses; the function allocates and assigns the data.
+ * For directories: restores the tree under args.output_file while decoding (see restore_stream).
+ * Output pointer arguments must be valid addresses; raw_data is left NULL in both cases.
  */
 int run_decompression(Arguments args, char **raw_data, long *raw_size, bool *is_directory, char **original_name) {
     *raw_data = NULL;
@@ -110,42 +598,119 @@ int run_decompression(Arguments args, char **raw_data, long *raw_size, bool *is_
             break;
         }
 
-        if (compressed_file->is_dir) {
-            *raw_data = malloc(compressed_file->original_size * sizeof(char));
-            if (*raw_data == NULL) {
-                fprintf(stderr, "Failed to allocate memory.\n");
-                res = ENOMEM;
+        /*
+         * An archive whose compression was killed during --consume holds the input up to its last durable
+         * batch, and the input file still holds the rest from that offset. The prefix is restored on its
+         * own, and where it stops is reported.
+         */
+        size_t image_size = mmap_size;
+        size_t full_size = compressed_file->original_size;
+        bool truncated = false;
+        if (memcmp(compressed_file->magic, block_magic, sizeof(block_magic)) == 0 && !compressed_file->is_dir) {
+            long recorded = recorded_size(compressed_file);
+            if (recorded >= 0 && (size_t)recorded < full_size) {
+                truncated = true;
+                compressed_file->original_size = recorded;
+                image_size = (compressed_file->block_data - mmap_ptr) + compressed_file->block_data_size;
+            }
+        }
+        if (truncated && compressed_file->original_size == 0) {
+            fprintf(stderr, "The archive holds none of its %zu bytes: its compression was interrupted before the first batch.\n", full_size);
+            res = ENODATA;
+            break;
+        }
+
+        /* "-o -" streams the file to standard output instead of materializing it. */
+        if (args.output_file != NULL && strcmp(args.output_file, "-") == 0) {
+            if (compressed_file->is_dir) {
+                fprintf(stderr, "A compressed directory cannot be written to standard output.\n");
+                res = EINVAL;
+                break;
+            }
+            // Stored blocks are spliced from the archive file, unless the image was reassembled from volumes.
+            int archive_fd = open(args.input_file, O_RDONLY);
+            char head[sizeof(volume_magic)];
+            if (archive_fd != -1 && (pread(archive_fd, head, sizeof(head), 0) != sizeof(head) || memcmp(head, volume_magic, sizeof(head)) == 0)) {
+                close(archive_fd);
+                archive_fd = -1;
+            }
+            int pipe_res = decode_to_fd(mmap_ptr, image_size, archive_fd, STDOUT_FILENO);
+            if (archive_fd != -1) close(archive_fd);
+            if (pipe_res == ARCHIVE_TRUNCATED && truncated) {
+                fprintf(stderr, "The archive ends after %zu of %zu bytes: its compression was interrupted. "
+                        "The rest of the original starts at that offset of the input file.\n", compressed_file->original_size, full_size);
+                *raw_size = compressed_file->original_size;
+                res = ENODATA;
+                break;
+            } else if (pipe_res == FILE_WRITE_ERROR) {
+                fprintf(stderr, "Failed to write to standard output.\n");
+                res = EIO;
+                break;
+            } else if (pipe_res != SUCCESS) {
+                fprintf(stderr, "Failed to decompress.\n");
+                res = EIO;
                 break;
             }
-        } else {
-            char *target = args.output_file != NULL ? args.output_file : compressed_file->original_file;
-            int write_res = write_raw(target, raw_data, compressed_file->original_size, args.force);
-            if (write_res < 0) {
-                if (write_res == FILE_WRITE_ERROR) {
-                    fprintf(stderr, "Failed to write the output file (%s).\n", target);
-                    res = EIO;
-                } else if (write_res == SCANF_FAILED) {
-                    fprintf(stderr, "Failed to read the response.\n");
-                    res = EIO;
-                } else if (write_res == NO_OVERWRITE) {
-                    fprintf(stderr, "The file was not overwritten.\n");
-                    res = ECANCELED;
+            *raw_size = compressed_file->original_size;
+            break;
+        }
+
+        /* Directories are decoded and written out through a bounded ring, never held whole. */
+        if (compressed_file->is_dir) {
+            int restore_res = restore_stream(mmap_ptr, mmap_size, budgeted_size(RESTORE_RING_SIZE, 4), args.output_file, args.force, args.no_preserve_perms);
+            if (restore_res != SUCCESS) {
+                if (restore_res == FILE_READ_ERROR) {
+                    fprintf(stderr, "Failed to read the compressed directory.\n");
+                } else if (restore_res == MALLOC_ERROR) {
+                    fprintf(stderr, "Failed to allocate memory.\n");
+                } else if (restore_res == MKDIR_ERROR) {
+                    fprintf(stderr, "Failed to create a directory during extraction.\n");
+                } else if (restore_res == FILE_WRITE_ERROR) {
+                    fprintf(stderr, "Failed to write a file during extraction.\n");
                 } else {
-                    fprintf(stderr, "An error occurred while writing the output file (%s).\n", target);
-                    res = EIO;
+                    fprintf(stderr, "Failed to decompress.\n");
                 }
+                res = (restore_res == MALLOC_ERROR) ? ENOMEM : EIO;
                 break;
             }
-            output_mmap = *raw_data;
-            output_mmap_size = write_res;
+            *raw_size = compressed_file->original_size;
+            break;
         }
 
+        char *target = args.output_file != NULL ? args.output_file : compressed_file->original_file;
+        int write_res = write_raw(target, raw_data, compressed_file->original_size, args.force);
+        if (write_res < 0) {
+            if (write_res == FILE_WRITE_ERROR) {
+                fprintf(stderr, "Failed to write the output file (%s).\n", target);
+                res = EIO;
+            } else if (write_res == SCANF_FAILED) {
+                fprintf(stderr, "Failed to read the response.\n");
+                res = EIO;
+            } else if (write_res == NO_OVERWRITE) {
+                fprintf(stderr, "The file was not overwritten.\n");
+                res = ECANCELED;
+            } else {
+                fprintf(stderr, "An error occurred while writing the output file (%s).\n", target);
+                res = EIO;
+            }
+            break;
+        }
+        output_mmap = *raw_data;
+        output_mmap_size = write_res;
+
         int decompress_result = decompress(compressed_file, *raw_data);
         if (decompress_result != 0) {
             fprintf(stderr, "Failed to decompress.\n");
             res = EIO;
             break;
         }
+        if (truncated) {
+            fprintf(stderr, "The archive ends after %zu of %zu bytes: its compression was interrupted. "
+                    "%s holds that prefix; the rest of the original starts at that offset of the input file.\n",
+                    compressed_file->original_size, full_size, target);
+            *raw_size = compressed_file->original_size;
+            res = ENODATA;
+        }
 
         *raw_size = compressed_file->original_size;
         break;
@@ -156,7 +721,7 @@ int run_decompression(Arguments args, char **raw_data, long *raw_size, bool *is_
     }
 
     if (output_mmap != NULL) {
-        if (msync(output_mmap, output_mmap_size, MS_SYNC) == -1) {
+        if (sync_raw(output_mmap, output_mmap_size) != SUCCESS) {
             fprintf(stderr, "Warning: Failed to sync output file.\n");
         }
         munmap(output_mmap, output_mmap_size);
@@ -172,12 +737,7 @@ int run_decompression(Arguments args, char **raw_data, long *raw_size, bool *is_
     }
 
     if (res != 0) {
-        if (*raw_data != NULL && !*is_directory) {
-            *raw_data = NULL;
-        } else if (*raw_data != NULL && *is_directory) {
-            free(*raw_data);
-            *raw_data = NULL;
-        }
+        *raw_data = NULL;
         if (*original_name != NULL) {
             free(*original_name);
             *original_name = NULL;
@@ -3,8 +3,14 @@
 
 #include "data_types.h"
 
+int build_decode_table(const Node *tree, size_t node_count, Decode_entry *table);
+int prepare_decode_table(const Node *tree, size_t node_count, Decode_entry *table);
+long open_segment(const unsigned char *segment, size_t symbols, Lane_cursor *cursor);
+long decode_segment(const unsigned char *segment, Lane_cursor *cursor, const Node *tree, const Decode_entry *table, int width, char *out, size_t out_cap);
+int decode_block(const Block_header *header, const unsigned char *payload, char *raw);
 int decompress(Compressed_file *compressed, char *raw);
-// Output pointer arguments must be valid addresses; the function allocates and fills the data.
+long recorded_size(const Compressed_file *compressed);
+// Output pointer arguments must be valid addresses; files and directories are written out directly.
 int run_decompression(Arguments args, char **raw_data, long *raw_size, bool *is_directory, char **original_name);
 
 #endif
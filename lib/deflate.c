@@ -0,0 +1,812 @@
+#include "deflate.h"
+#include "data_types.h"
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include "debugmalloc.h"
+
+/*
+ * This file is a modified port of deflate.c and trees.c from zlib DEFLATE_EXACT_VERSION; it is not the
+ * original software. The zlib notice follows.
+ *
+ * Copyright (C) 1995-2022 Jean-loup Gailly and Mark Adler
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ * Jean-loup Gailly        Mark Adler
+ * jloup@gzip.org          madler@alumni.caltech.edu
+ */
+
+/*
+ * Raw deflate as zlib DEFLATE_EXACT_VERSION writes it, for the parameter sets BLOCK_INFLATED blocks record:
+ * levels 1 to 9, memory levels 1 to 9, windows of 2^9 to 2^15 bytes and the default or filtered strategy.
+ * A recompressed stream is only worth keeping if it can be written again exactly, and the deflate of
+ * another zlib release or build (zlib-ng, Chromium's) picks different matches and block boundaries, so
+ * the encoder is kept here rather than taken from the system: find_params and deflate_inflated both use
+ * it. Matching, hashing and tree building follow zlib's deflate.c and trees.c step for step, since any
+ * difference in a tie changes the output. Only inflate and crc32 still come from the system zlib; their
+ * results are fixed by RFC 1951 and 1952.
+ */
+
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MIN_LOOKAHEAD (MAX_MATCH + MIN_MATCH + 1)   // Bytes of input a match search may look at.
+#define TOO_FAR 4096                                // Matches of three bytes further back are not worth it.
+#define WINDOW_INIT MAX_MATCH                       // Bytes past the input zeroed for the match search.
+#define WINDOW_SIZE_MAX (1 << 15)
+#define HASH_SIZE_MAX (1 << (9 + 7))
+#define SYMBOLS_MAX (1 << (9 + 6))
+#define STRATEGY_DEFAULT 0                          // zlib's Z_DEFAULT_STRATEGY and Z_FILTERED.
+#define STRATEGY_FILTERED 1
+
+#define LENGTH_CODES 29
+#define LITERALS 256
+#define END_BLOCK 256
+#define L_CODES (LITERALS + 1 + LENGTH_CODES)
+#define D_CODES 30
+#define BL_CODES 19
+#define HEAP_SIZE (2 * L_CODES + 1)
+#define MAX_BITS 15
+#define MAX_BL_BITS 7
+#define REP_3_6 16
+#define REPZ_3_10 17
+#define REPZ_11_138 18
+#define STORED_BLOCK 0
+#define STATIC_TREES 1
+#define DYN_TREES 2
+
+// zlib's configuration_table: levels 1 to 3 insert matches greedily, the others wait for a longer match.
+typedef struct {
+    unsigned short good_length; // Search less once a match this long is found.
+    unsigned short max_lazy;    // Greedy levels: insert matches only up to this long.
+    unsigned short nice_length; // Stop searching at a match this long.
+    unsigned short max_chain;
+    bool lazy;
+} Level_config;
+
+static const Level_config level_configs[10] = {
+    {0, 0, 0, 0, false},       {4, 4, 8, 4, false},     {4, 5, 16, 8, false},   {4, 6, 32, 32, false},
+    {4, 4, 16, 16, true},      {8, 16, 32, 32, true},   {8, 16, 128, 128, true}, {8, 32, 128, 256, true},
+    {32, 128, 258, 1024, true}, {32, 258, 258, 4096, true},
+};
+
+static const int extra_lbits[LENGTH_CODES] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const int extra_dbits[D_CODES] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const int extra_blbits[BL_CODES] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7};
+static const unsigned char bl_order[BL_CODES] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// A Huffman tree node: zlib keeps freq and code, and dad and len, in unions; they are never needed together.
+typedef struct {
+    unsigned short freq;
+    unsigned short code;
+    unsigned short dad;
+    unsigned short len;
+} Tree_node;
+
+typedef struct {
+    Tree_node *tree;
+    const Tree_node *static_tree;   // NULL for the bit length tree.
+    const int *extra_bits;
+    int extra_base;
+    int elems;
+    int max_length;
+    int max_code;                   // Largest code with a nonzero frequency, set by build_tree.
+} Tree_desc;
+
+typedef struct {
+    const unsigned char *in;
+    size_t in_len;
+    size_t in_pos;
+    unsigned char *out;             // NULL when the output is only compared.
+    size_t out_cap;
+    size_t out_len;
+    const unsigned char *expected;  // Output the stream must match, or NULL.
+    bool failed;                    // The output overflowed or differed from expected.
+    unsigned long long bit_buf;
+    int bit_count;
+
+    const Level_config *config;
+    int strategy;
+    unsigned int w_size;
+    unsigned int w_mask;
+    unsigned int window_size;
+    unsigned long high_water;       // Window bytes below this have been written or zeroed.
+    unsigned int hash_size;
+    unsigned int hash_mask;
+    unsigned int hash_shift;
+    unsigned int ins_h;
+    long block_start;               // Window offset of the current block; negative once slid out.
+    unsigned int strstart;
+    unsigned int match_start;
+    unsigned int lookahead;
+    unsigned int insert;            // Bytes before strstart still to be hashed.
+    unsigned int match_length;
+    unsigned int prev_length;
+    unsigned int prev_match;
+    bool match_available;
+
+    unsigned int sym_count;
+    unsigned int sym_limit;         // A block ends after this many symbols.
+    unsigned short sym_dist[SYMBOLS_MAX];   // 0 for a literal.
+    unsigned char sym_lc[SYMBOLS_MAX];      // The literal, or the match length less MIN_MATCH.
+
+    Tree_node dyn_ltree[HEAP_SIZE];
+    Tree_node dyn_dtree[2 * D_CODES + 1];
+    Tree_node bl_tree[2 * BL_CODES + 1];
+    Tree_node static_ltree[L_CODES + 2];
+    Tree_node static_dtree[D_CODES];
+    Tree_desc l_desc;
+    Tree_desc d_desc;
+    Tree_desc bl_desc;
+    unsigned short bl_count[MAX_BITS + 1];
+    int heap[HEAP_SIZE];
+    int heap_len;
+    int heap_max;
+    unsigned char depth[HEAP_SIZE];
+    unsigned long opt_len;          // Bits of the block with the dynamic trees.
+    unsigned long static_len;       // Bits of the block with the static trees.
+    unsigned char length_code[MAX_MATCH - MIN_MATCH + 1];
+    unsigned char dist_code[512];
+    int base_length[LENGTH_CODES];
+    int base_dist[D_CODES];
+
+    unsigned char window[2 * WINDOW_SIZE_MAX];
+    unsigned short prev[WINDOW_SIZE_MAX];
+    unsigned short head[HASH_SIZE_MAX];
+} Deflater;
+
+static void put_byte(Deflater *s, unsigned char c) {
+    if (s->failed) return;
+    if (s->out_len == s->out_cap || (s->expected != NULL && s->expected[s->out_len] != c)) {
+        s->failed = true;
+        return;
+    }
+    if (s->out != NULL) s->out[s->out_len] = c;
+    s->out_len++;
+}
+
+static void send_bits(Deflater *s, unsigned int value, int length) {
+    s->bit_buf |= (unsigned long long)value << s->bit_count;
+    s->bit_count += length;
+    while (s->bit_count >= 8) {
+        put_byte(s, s->bit_buf & 0xFF);
+        s->bit_buf >>= 8;
+        s->bit_count -= 8;
+    }
+}
+
+// Pads the output to a byte boundary.
+static void bit_windup(Deflater *s) {
+    if (s->bit_count > 0) put_byte(s, s->bit_buf & 0xFF);
+    s->bit_buf = 0;
+    s->bit_count = 0;
+}
+
+static void send_code(Deflater *s, int c, const Tree_node *tree) {
+    send_bits(s, tree[c].code, tree[c].len);
+}
+
+static unsigned int bi_reverse(unsigned int code, int len) {
+    unsigned int res = 0;
+    do {
+        res |= code & 1;
+        code >>= 1;
+        res <<= 1;
+    } while (--len > 0);
+    return res >> 1;
+}
+
+static unsigned int d_code(unsigned int dist, const Deflater *s) {
+    return dist < 256 ? s->dist_code[dist] : s->dist_code[256 + (dist >> 7)];
+}
+
+// Gives every node of tree up to max_code with a length its canonical code.
+static void gen_codes(Tree_node *tree, int max_code, const unsigned short *bl_count) {
+    unsigned short next_code[MAX_BITS + 1];
+    unsigned int code = 0;
+    for (int bits = 1; bits <= MAX_BITS; bits++) {
+        code = (code + bl_count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    for (int n = 0; n <= max_code; n++) {
+        int len = tree[n].len;
+        if (len == 0) continue;
+        tree[n].code = bi_reverse(next_code[len]++, len);
+    }
+}
+
+// zlib's tr_static_init and _tr_init.
+static void init_tables(Deflater *s) {
+    int length = 0;
+    int code;
+    for (code = 0; code < LENGTH_CODES - 1; code++) {
+        s->base_length[code] = length;
+        for (int n = 0; n < (1 << extra_lbits[code]); n++) s->length_code[length++] = code;
+    }
+    // Length 258 could also be code 284 with five extra bits; code 285 is shorter.
+    s->length_code[length - 1] = code;
+    s->base_length[LENGTH_CODES - 1] = 0;
+
+    int dist = 0;
+    for (code = 0; code < 16; code++) {
+        s->base_dist[code] = dist;
+        for (int n = 0; n < (1 << extra_dbits[code]); n++) s->dist_code[dist++] = code;
+    }
+    dist >>= 7; // Longer distances are looked up by dist / 128.
+    for (; code < D_CODES; code++) {
+        s->base_dist[code] = dist << 7;
+        for (int n = 0; n < (1 << (extra_dbits[code] - 7)); n++) s->dist_code[256 + dist++] = code;
+    }
+
+    unsigned short bl_count[MAX_BITS + 1] = {0};
+    int n = 0;
+    while (n <= 143) s->static_ltree[n++].len = 8, bl_count[8]++;
+    while (n <= 255) s->static_ltree[n++].len = 9, bl_count[9]++;
+    while (n <= 279) s->static_ltree[n++].len = 7, bl_count[7]++;
+    while (n <= 287) s->static_ltree[n++].len = 8, bl_count[8]++;
+    gen_codes(s->static_ltree, L_CODES + 1, bl_count);
+    for (n = 0; n < D_CODES; n++) {
+        s->static_dtree[n].len = 5;
+        s->static_dtree[n].code = bi_reverse(n, 5);
+    }
+
+    s->l_desc = (Tree_desc){s->dyn_ltree, s->static_ltree, extra_lbits, LITERALS + 1, L_CODES, MAX_BITS, 0};
+    s->d_desc = (Tree_desc){s->dyn_dtree, s->static_dtree, extra_dbits, 0, D_CODES, MAX_BITS, 0};
+    s->bl_desc = (Tree_desc){s->bl_tree, NULL, extra_blbits, 0, BL_CODES, MAX_BL_BITS, 0};
+}
+
+static void init_block(Deflater *s) {
+    for (int n = 0; n < L_CODES; n++) s->dyn_ltree[n].freq = 0;
+    for (int n = 0; n < D_CODES; n++) s->dyn_dtree[n].freq = 0;
+    for (int n = 0; n < BL_CODES; n++) s->bl_tree[n].freq = 0;
+    s->dyn_ltree[END_BLOCK].freq = 1;
+    s->opt_len = 0;
+    s->static_len = 0;
+    s->sym_count = 0;
+}
+
+// Whether node n sorts before node m: by frequency, then by depth.
+static bool smaller(const Tree_node *tree, int n, int m, const unsigned char *depth) {
+    return tree[n].freq < tree[m].freq || (tree[n].freq == tree[m].freq && depth[n] <= depth[m]);
+}
+
+static void pqdownheap(Deflater *s, const Tree_node *tree, int k) {
+    int v = s->heap[k];
+    int j = k << 1;
+    while (j <= s->heap_len) {
+        if (j < s->heap_len && smaller(tree, s->heap[j + 1], s->heap[j], s->depth)) j++;
+        if (smaller(tree, v, s->heap[j], s->depth)) break;
+        s->heap[k] = s->heap[j];
+        k = j;
+        j <<= 1;
+    }
+    s->heap[k] = v;
+}
+
+/*
+ * Sets the code lengths of a tree built by build_tree, limiting them to the tree's maximum the way zlib
+ * does, and adds the block's bits with this tree (and with the static one) to opt_len and static_len.
+ */
+static void gen_bitlen(Deflater *s, Tree_desc *desc) {
+    Tree_node *tree = desc->tree;
+    int max_code = desc->max_code;
+    int max_length = desc->max_length;
+    int overflow = 0;
+    int h;
+
+    for (int bits = 0; bits <= MAX_BITS; bits++) s->bl_count[bits] = 0;
+    tree[s->heap[s->heap_max]].len = 0; // The root.
+    for (h = s->heap_max + 1; h < HEAP_SIZE; h++) {
+        int n = s->heap[h];
+        int bits = tree[tree[n].dad].len + 1;
+        if (bits > max_length) bits = max_length, overflow++;
+        tree[n].len = bits;
+        if (n > max_code) continue; // Not a leaf.
+
+        s->bl_count[bits]++;
+        int xbits = n >= desc->extra_base ? desc->extra_bits[n - desc->extra_base] : 0;
+        unsigned short f = tree[n].freq;
+        s->opt_len += (unsigned long)f * (unsigned int)(bits + xbits);
+        if (desc->static_tree != NULL) s->static_len += (unsigned long)f * (unsigned int)(desc->static_tree[n].len + xbits);
+    }
+    if (overflow == 0) return;
+
+    // Move overflowing leaves up next to the deepest leaf that can go one deeper.
+    do {
+        int bits = max_length - 1;
+        while (s->bl_count[bits] == 0) bits--;
+        s->bl_count[bits]--;
+        s->bl_count[bits + 1] += 2;
+        s->bl_count[max_length]--;
+        overflow -= 2;
+    } while (overflow > 0);
+
+    // Hand the lengths out again in order of increasing frequency.
+    for (int bits = max_length; bits != 0; bits--) {
+        int n = s->bl_count[bits];
+        while (n != 0) {
+            int m = s->heap[--h];
+            if (m > max_code) continue;
+            if (tree[m].len != (unsigned int)bits) {
+                s->opt_len += ((unsigned long)bits - tree[m].len) * tree[m].freq;
+                tree[m].len = bits;
+            }
+            n--;
+        }
+    }
+}
+
+// Builds the Huffman tree of desc from the frequencies of its leaves and gives them their codes.
+static void build_tree(Deflater *s, Tree_desc *desc) {
+    Tree_node *tree = desc->tree;
+    int max_code = -1;
+    int node;
+
+    s->heap_len = 0;
+    s->heap_max = HEAP_SIZE;
+    for (int n = 0; n < desc->elems; n++) {
+        if (tree[n].freq != 0) {
+            s->heap[++s->heap_len] = max_code = n;
+            s->depth[n] = 0;
+        } else {
+            tree[n].len = 0;
+        }
+    }
+    // Deflate needs at least one distance code, and every code at least one bit: force two leaves.
+    while (s->heap_len < 2) {
+        node = s->heap[++s->heap_len] = max_code < 2 ? ++max_code : 0;
+        tree[node].freq = 1;
+        s->depth[node] = 0;
+        s->opt_len--;
+        if (desc->static_tree != NULL) s->static_len -= desc->static_tree[node].len;
+    }
+    desc->max_code = max_code;
+
+    for (int n = s->heap_len / 2; n >= 1; n--) pqdownheap(s, tree, n);
+    node = desc->elems;
+    do {
+        int n = s->heap[1];
+        s->heap[1] = s->heap[s->heap_len--];
+        pqdownheap(s, tree, 1);
+        int m = s->heap[1];
+        s->heap[--s->heap_max] = n;
+        s->heap[--s->heap_max] = m;
+
+        tree[node].freq = tree[n].freq + tree[m].freq;
+        s->depth[node] = (s->depth[n] >= s->depth[m] ? s->depth[n] : s->depth[m]) + 1;
+        tree[n].dad = tree[m].dad = node;
+        s->heap[1] = node++;
+        pqdownheap(s, tree, 1);
+    } while (s->heap_len >= 2);
+    s->heap[--s->heap_max] = s->heap[1];
+
+    gen_bitlen(s, desc);
+    gen_codes(tree, max_code, s->bl_count);
+}
+
+// Counts the code lengths of tree, run-length coded as send_tree sends them, into the bit length tree.
+static void scan_tree(Deflater *s, Tree_node *tree, int max_code) {
+    int prevlen = -1;
+    int nextlen = tree[0].len;
+    int count = 0;
+    int max_count = nextlen == 0 ? 138 : 7;
+    int min_count = nextlen == 0 ? 3 : 4;
+
+    tree[max_code + 1].len = 0xFFFF; // Guard.
+    for (int n = 0; n <= max_code; n++) {
+        int curlen = nextlen;
+        nextlen = tree[n + 1].len;
+        if (++count < max_count && curlen == nextlen) {
+            continue;
+        } else if (count < min_count) {
+            s->bl_tree[curlen].freq += count;
+        } else if (curlen != 0) {
+            if (curlen != prevlen) s->bl_tree[curlen].freq++;
+            s->bl_tree[REP_3_6].freq++;
+        } else if (count <= 10) {
+            s->bl_tree[REPZ_3_10].freq++;
+        } else {
+            s->bl_tree[REPZ_11_138].freq++;
+        }
+        count = 0;
+        prevlen = curlen;
+        if (nextlen == 0) {
+            max_count = 138, min_count = 3;
+        } else if (curlen == nextlen) {
+            max_count = 6, min_count = 3;
+        } else {
+            max_count = 7, min_count = 4;
+        }
+    }
+}
+
+static void send_tree(Deflater *s, const Tree_node *tree, int max_code) {
+    int prevlen = -1;
+    int nextlen = tree[0].len;
+    int count = 0;
+    int max_count = nextlen == 0 ? 138 : 7;
+    int min_count = nextlen == 0 ? 3 : 4;
+
+    for (int n = 0; n <= max_code; n++) {
+        int curlen = nextlen;
+        nextlen = tree[n + 1].len;
+        if (++count < max_count && curlen == nextlen) {
+            continue;
+        } else if (count < min_count) {
+            do send_code(s, curlen, s->bl_tree); while (--count != 0);
+        } else if (curlen != 0) {
+            if (curlen != prevlen) {
+                send_code(s, curlen, s->bl_tree);
+                count--;
+            }
+            send_code(s, REP_3_6, s->bl_tree);
+            send_bits(s, count - 3, 2);
+        } else if (count <= 10) {
+            send_code(s, REPZ_3_10, s->bl_tree);
+            send_bits(s, count - 3, 3);
+        } else {
+            send_code(s, REPZ_11_138, s->bl_tree);
+            send_bits(s, count - 11, 7);
+        }
+        count = 0;
+        prevlen = curlen;
+        if (nextlen == 0) {
+            max_count = 138, min_count = 3;
+        } else if (curlen == nextlen) {
+            max_count = 6, min_count = 3;
+        } else {
+            max_count = 7, min_count = 4;
+        }
+    }
+}
+
+// Builds the bit length tree. Returns the index in bl_order of the last length code sent.
+static int build_bl_tree(Deflater *s) {
+    scan_tree(s, s->dyn_ltree, s->l_desc.max_code);
+    scan_tree(s, s->dyn_dtree, s->d_desc.max_code);
+    build_tree(s, &s->bl_desc);
+    int max_blindex;
+    for (max_blindex = BL_CODES - 1; max_blindex >= 3; max_blindex--) {
+        if (s->bl_tree[bl_order[max_blindex]].len != 0) break;
+    }
+    s->opt_len += 3 * ((unsigned long)max_blindex + 1) + 5 + 5 + 4;
+    return max_blindex;
+}
+
+static void send_all_trees(Deflater *s, int lcodes, int dcodes, int blcodes) {
+    send_bits(s, lcodes - 257, 5);
+    send_bits(s, dcodes - 1, 5);
+    send_bits(s, blcodes - 4, 4);
+    for (int rank = 0; rank < blcodes; rank++) send_bits(s, s->bl_tree[bl_order[rank]].len, 3);
+    send_tree(s, s->dyn_ltree, lcodes - 1);
+    send_tree(s, s->dyn_dtree, dcodes - 1);
+}
+
+static void compress_block(Deflater *s, const Tree_node *ltree, const Tree_node *dtree) {
+    for (unsigned int i = 0; i < s->sym_count; i++) {
+        unsigned int dist = s->sym_dist[i];
+        int lc = s->sym_lc[i];
+        if (dist == 0) {
+            send_code(s, lc, ltree);
+            continue;
+        }
+        unsigned int code = s->length_code[lc];
+        send_code(s, code + LITERALS + 1, ltree);
+        if (extra_lbits[code] != 0) send_bits(s, lc - s->base_length[code], extra_lbits[code]);
+        dist--;
+        code = d_code(dist, s);
+        send_code(s, code, dtree);
+        if (extra_dbits[code] != 0) send_bits(s, dist - s->base_dist[code], extra_dbits[code]);
+    }
+    send_code(s, END_BLOCK, ltree);
+}
+
+/*
+ * Ends the current block (zlib's _tr_flush_block): as a stored block when that is smallest and its bytes
+ * are still in the window (buf), else with the static or the dynamic trees.
+ */
+static void flush_trees(Deflater *s, const unsigned char *buf, unsigned long stored_len, bool last) {
+    build_tree(s, &s->l_desc);
+    build_tree(s, &s->d_desc);
+    int max_blindex = build_bl_tree(s);
+    unsigned long opt_lenb = (s->opt_len + 3 + 7) >> 3;
+    unsigned long static_lenb = (s->static_len + 3 + 7) >> 3;
+    if (static_lenb <= opt_lenb) opt_lenb = static_lenb;
+
+    if (stored_len + 4 <= opt_lenb && buf != NULL) {
+        send_bits(s, (STORED_BLOCK << 1) + last, 3);
+        bit_windup(s);
+        send_bits(s, stored_len & 0xFFFF, 16);
+        send_bits(s, ~stored_len & 0xFFFF, 16);
+        for (unsigned long i = 0; i < stored_len; i++) put_byte(s, buf[i]);
+    } else if (static_lenb == opt_lenb) {
+        send_bits(s, (STATIC_TREES << 1) + last, 3);
+        compress_block(s, s->static_ltree, s->static_dtree);
+    } else {
+        send_bits(s, (DYN_TREES << 1) + last, 3);
+        send_all_trees(s, s->l_desc.max_code + 1, s->d_desc.max_code + 1, max_blindex + 1);
+        compress_block(s, s->dyn_ltree, s->dyn_dtree);
+    }
+    init_block(s);
+    if (last) bit_windup(s);
+}
+
+static void flush_block(Deflater *s, bool last) {
+    const unsigned char *buf = s->block_start >= 0 ? s->window + s->block_start : NULL;
+    flush_trees(s, buf, (unsigned long)((long)s->strstart - s->block_start), last);
+    s->block_start = s->strstart;
+}
+
+// Records a literal (dist 0) or a match. Returns true when the block is full.
+static bool tally(Deflater *s, unsigned int dist, unsigned int lc) {
+    s->sym_dist[s->sym_count] = dist;
+    s->sym_lc[s->sym_count] = lc;
+    s->sym_count++;
+    if (dist == 0) {
+        s->dyn_ltree[lc].freq++;
+    } else {
+        s->dyn_ltree[s->length_code[lc] + LITERALS + 1].freq++;
+        s->dyn_dtree[d_code(dist - 1, s)].freq++;
+    }
+    return s->sym_count == s->sym_limit;
+}
+
+static unsigned int max_dist(const Deflater *s) {
+    return s->w_size - MIN_LOOKAHEAD;
+}
+
+// Hashes the three bytes at str into the chains. Returns the previous head of its chain.
+static unsigned int insert_string(Deflater *s, unsigned int str) {
+    s->ins_h = ((s->ins_h << s->hash_shift) ^ s->window[str + MIN_MATCH - 1]) & s->hash_mask;
+    unsigned int match_head = s->prev[str & s->w_mask] = s->head[s->ins_h];
+    s->head[s->ins_h] = str;
+    return match_head;
+}
+
+// Moves the chains back by a window's size as the window slides; positions slid out end them.
+static void slide_hash(Deflater *s) {
+    unsigned int wsize = s->w_size;
+    for (unsigned int n = 0; n < s->hash_size; n++) s->head[n] = s->head[n] >= wsize ? s->head[n] - wsize : 0;
+    for (unsigned int n = 0; n < wsize; n++) s->prev[n] = s->prev[n] >= wsize ? s->prev[n] - wsize : 0;
+}
+
+/*
+ * Reads input into the window, sliding it down first when strstart nears its end, until MIN_LOOKAHEAD
+ * bytes are ahead of strstart or the input runs out. The bytes just past the input are zeroed as zlib
+ * zeroes them, since the match search compares them too.
+ */
+static void fill_window(Deflater *s) {
+    unsigned int wsize = s->w_size;
+    do {
+        unsigned int more = s->window_size - s->lookahead - s->strstart;
+        if (s->strstart >= wsize + max_dist(s)) {
+            memcpy(s->window, s->window + wsize, wsize - more);
+            s->match_start -= wsize;
+            s->strstart -= wsize;
+            s->block_start -= (long)wsize;
+            if (s->insert > s->strstart) s->insert = s->strstart;
+            slide_hash(s);
+            more += wsize;
+        }
+        if (s->in_pos == s->in_len) break;
+
+        size_t n = s->in_len - s->in_pos;
+        if (n > more) n = more;
+        memcpy(s->window + s->strstart + s->lookahead, s->in + s->in_pos, n);
+        s->in_pos += n;
+        s->lookahead += n;
+
+        if (s->lookahead + s->insert >= MIN_MATCH) {
+            unsigned int str = s->strstart - s->insert;
+            s->ins_h = s->window[str];
+            s->ins_h = ((s->ins_h << s->hash_shift) ^ s->window[str + 1]) & s->hash_mask;
+            while (s->insert) {
+                insert_string(s, str);
+                str++;
+                s->insert--;
+                if (s->lookahead + s->insert < MIN_MATCH) break;
+            }
+        }
+    } while (s->lookahead < MIN_LOOKAHEAD && s->in_pos < s->in_len);
+
+    if (s->high_water < s->window_size) {
+        unsigned long curr = s->strstart + (unsigned long)s->lookahead;
+        unsigned long init;
+        if (s->high_water < curr) {
+            init = s->window_size - curr;
+            if (init > WINDOW_INIT) init = WINDOW_INIT;
+            memset(s->window + curr, 0, init);
+            s->high_water = curr + init;
+        } else if (s->high_water < curr + WINDOW_INIT) {
+            init = curr + WINDOW_INIT - s->high_water;
+            if (init > s->window_size - s->high_water) init = s->window_size - s->high_water;
+            memset(s->window + s->high_water, 0, init);
+            s->high_water += init;
+        }
+    }
+}
+
+/*
+ * Follows the hash chain from cur_match for the longest match at strstart that beats prev_length.
+ * Sets match_start and returns its length, cut to the lookahead.
+ */
+static unsigned int longest_match(Deflater *s, unsigned int cur_match) {
+    unsigned int chain_length = s->config->max_chain;
+    const unsigned char *scan = s->window + s->strstart;
+    int best_len = s->prev_length;
+    int nice_match = s->config->nice_length;
+    unsigned int limit = s->strstart > max_dist(s) ? s->strstart - max_dist(s) : 0;
+    const unsigned char *strend = s->window + s->strstart + MAX_MATCH;
+    unsigned char scan_end1 = scan[best_len - 1];
+    unsigned char scan_end = scan[best_len];
+
+    if (s->prev_length >= s->config->good_length) chain_length >>= 2;
+    if ((unsigned int)nice_match > s->lookahead) nice_match = s->lookahead;
+    do {
+        const unsigned char *match = s->window + cur_match;
+        if (match[best_len] != scan_end || match[best_len - 1] != scan_end1 || match[0] != scan[0] || match[1] != scan[1]) continue;
+
+        // Equal hashes and first two bytes make the third equal too, so zlib starts comparing at the fourth.
+        const unsigned char *p = scan + 2;
+        match += 2;
+        do {
+        } while (*++p == *++match && *++p == *++match && *++p == *++match && *++p == *++match
+                 && *++p == *++match && *++p == *++match && *++p == *++match && *++p == *++match && p < strend);
+        int len = MAX_MATCH - (int)(strend - p);
+        if (len > best_len) {
+            s->match_start = cur_match;
+            best_len = len;
+            if (len >= nice_match) break;
+            scan_end1 = scan[best_len - 1];
+            scan_end = scan[best_len];
+        }
+    } while ((cur_match = s->prev[cur_match & s->w_mask]) > limit && --chain_length != 0);
+    return (unsigned int)best_len <= s->lookahead ? (unsigned int)best_len : s->lookahead;
+}
+
+// zlib's deflate_fast (levels 1 to 3): takes each match found, inserting only the short ones into the chains.
+static void deflate_greedy(Deflater *s) {
+    while (!s->failed) {
+        if (s->lookahead < MIN_LOOKAHEAD) {
+            fill_window(s);
+            if (s->lookahead == 0) break;
+        }
+        unsigned int hash_head = 0;
+        if (s->lookahead >= MIN_MATCH) hash_head = insert_string(s, s->strstart);
+        if (hash_head != 0 && s->strstart - hash_head <= max_dist(s)) s->match_length = longest_match(s, hash_head);
+
+        bool full;
+        if (s->match_length >= MIN_MATCH) {
+            full = tally(s, s->strstart - s->match_start, s->match_length - MIN_MATCH);
+            s->lookahead -= s->match_length;
+            if (s->match_length <= s->config->max_lazy && s->lookahead >= MIN_MATCH) {
+                s->match_length--; // The string at strstart is in the chains already.
+                do {
+                    s->strstart++;
+                    insert_string(s, s->strstart);
+                } while (--s->match_length != 0);
+                s->strstart++;
+            } else {
+                s->strstart += s->match_length;
+                s->match_length = 0;
+                s->ins_h = s->window[s->strstart];
+                s->ins_h = ((s->ins_h << s->hash_shift) ^ s->window[s->strstart + 1]) & s->hash_mask;
+            }
+        } else {
+            full = tally(s, 0, s->window[s->strstart]);
+            s->lookahead--;
+            s->strstart++;
+        }
+        if (full) flush_block(s, false);
+    }
+    flush_block(s, true);
+}
+
+// zlib's deflate_slow (levels 4 to 9): keeps a match only if the next position does not start a longer one.
+static void deflate_lazy(Deflater *s) {
+    while (!s->failed) {
+        if (s->lookahead < MIN_LOOKAHEAD) {
+            fill_window(s);
+            if (s->lookahead == 0) break;
+        }
+        unsigned int hash_head = 0;
+        if (s->lookahead >= MIN_MATCH) hash_head = insert_string(s, s->strstart);
+
+        s->prev_length = s->match_length;
+        s->prev_match = s->match_start;
+        s->match_length = MIN_MATCH - 1;
+        if (hash_head != 0 && s->prev_length < s->config->max_lazy && s->strstart - hash_head <= max_dist(s)) {
+            s->match_length = longest_match(s, hash_head);
+            if (s->match_length <= 5 && (s->strategy == STRATEGY_FILTERED
+                                         || (s->match_length == MIN_MATCH && s->strstart - s->match_start > TOO_FAR))) {
+                s->match_length = MIN_MATCH - 1;
+            }
+        }
+
+        if (s->prev_length >= MIN_MATCH && s->match_length <= s->prev_length) {
+            unsigned int max_insert = s->strstart + s->lookahead - MIN_MATCH;
+            bool full = tally(s, s->strstart - 1 - s->prev_match, s->prev_length - MIN_MATCH);
+            s->lookahead -= s->prev_length - 1;
+            s->prev_length -= 2;
+            do {
+                if (++s->strstart <= max_insert) insert_string(s, s->strstart);
+            } while (--s->prev_length != 0);
+            s->match_available = false;
+            s->match_length = MIN_MATCH - 1;
+            s->strstart++;
+            if (full) flush_block(s, false);
+        } else if (s->match_available) {
+            if (tally(s, 0, s->window[s->strstart - 1])) flush_block(s, false);
+            s->strstart++;
+            s->lookahead--;
+        } else {
+            s->match_available = true;
+            s->strstart++;
+            s->lookahead--;
+        }
+    }
+    if (s->match_available) {
+        tally(s, 0, s->window[s->strstart - 1]);
+        s->match_available = false;
+    }
+    flush_block(s, true);
+}
+
+/*
+ * Deflates in_len bytes of in as one raw deflate stream, exactly as zlib DEFLATE_EXACT_VERSION does with
+ * deflateInit2(level, Z_DEFLATED, -window_bits, mem_level, strategy) and a single deflate(Z_FINISH).
+ * The stream goes to out (which may be NULL when only comparing) and must fit in out_cap bytes; when
+ * expected is not NULL it must also match expected byte for byte, and the work stops at the first byte
+ * that does not. Safe on worker threads: the state is mapped, not allocated.
+ * Returns the size of the stream, or 0 if the parameters are not supported, the state could not be
+ * mapped, or the output overflowed or differed.
+ */
+size_t deflate_exact(const Deflate_params *params, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_cap, const unsigned char *expected) {
+    // zlib rejects a raw window of 2^8 bytes.
+    if (params->level < 1 || params->level > 9 || params->mem_level < 1 || params->mem_level > 9 || params->window_bits < 9
+        || params->window_bits > 15 || (params->strategy != STRATEGY_DEFAULT && params->strategy != STRATEGY_FILTERED)) {
+        return 0;
+    }
+    Deflater *s = mmap(NULL, sizeof(Deflater), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED) return 0;
+
+    s->in = in;
+    s->in_len = in_len;
+    s->out = out;
+    s->out_cap = out_cap;
+    s->expected = expected;
+    s->config = &level_configs[params->level];
+    s->strategy = params->strategy;
+    s->w_size = 1u << params->window_bits;
+    s->w_mask = s->w_size - 1;
+    s->window_size = 2 * s->w_size;
+    unsigned int hash_bits = params->mem_level + 7;
+    s->hash_size = 1u << hash_bits;
+    s->hash_mask = s->hash_size - 1;
+    s->hash_shift = (hash_bits + MIN_MATCH - 1) / MIN_MATCH;
+    s->sym_limit = (1u << (params->mem_level + 6)) - 1;
+    s->match_length = s->prev_length = MIN_MATCH - 1;
+    init_tables(s);
+    init_block(s);
+
+    if (s->config->lazy) deflate_lazy(s);
+    else deflate_greedy(s);
+
+    size_t written = s->failed ? 0 : s->out_len;
+    munmap(s, sizeof(Deflater));
+    return written;
+}
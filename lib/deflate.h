@@ -0,0 +1,12 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include "data_types.h"
+#include <stddef.h>
+
+// The zlib release whose raw deflate output deflate_exact reproduces byte for byte.
+#define DEFLATE_EXACT_VERSION "1.2.13"
+
+size_t deflate_exact(const Deflate_params *params, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_cap, const unsigned char *expected);
+
+#endif // DEFLATE_H
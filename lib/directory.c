@@ -113,9 +113,10 @@ long archive_directory(char *path, int *archive_size, long *data_size, FILE *f)
                     current_item = file;
                     break;
                 }
-                file.file_size = read_raw(newpath, (const char**)&file.file_data);
-                if (file.file_size < 0) {
-                    if (file.file_size == EMPTY_FILE) {
+                int read_size = read_raw(newpath, (const char**)&file.file_data);
+                file.file_size = read_size;
+                if (read_size < 0) {
+                    if (read_size == EMPTY_FILE) {
                         /* Empty files are valid - include them with size 0 */
                         file.file_size = 0;
                         file.file_data = NULL;
@@ -255,7 +256,7 @@ int extract_directory(char *path, Directory_item *item, bool force, bool no_pres
                 return FILE_WRITE_ERROR;
             }
             memcpy(mmap_ptr, item->file_data, item->file_size);
-            if (msync(mmap_ptr, item->file_size, MS_SYNC) == -1) {
+            if (sync_raw(mmap_ptr, item->file_size) != SUCCESS) {
                 munmap(mmap_ptr, item->file_size);
                 free(full_path);
                 return FILE_WRITE_ERROR;
@@ -267,6 +268,43 @@ int extract_directory(char *path, Directory_item *item, bool force, bool no_pres
     return SUCCESS;
 }
 
+/*
+ * Parses one archived element in place from a serialized buffer, without copying:
+ * the paths and file data of the item point into the buffer.
+ * Returns the number of bytes consumed, 0 at the end of the buffer, or FILE_READ_ERROR if the item is malformed.
+ */
+long parse_item(Directory_item *item, const char *data, size_t size) {
+    long item_size = 0;
+    if (size == 0) return 0;
+    if (size < sizeof(long) + sizeof(bool)) return FILE_READ_ERROR;
+    memcpy(&item_size, data, sizeof(long));
+    if (item_size < (long)sizeof(bool) || (size_t)item_size > size - sizeof(long)) return FILE_READ_ERROR;
+    const char *current = data + sizeof(long);
+    const char *end = current + item_size;
+
+    memcpy(&item->is_dir, current, sizeof(bool));
+    current += sizeof(bool);
+    if (item->is_dir) {
+        if (end - current < (long)sizeof(int) + 1) return FILE_READ_ERROR;
+        memcpy(&item->perms, current, sizeof(int));
+        current += sizeof(int);
+        item->dir_path = (char *)current;
+    }
+    else {
+        if (end - current < (long)sizeof(size_t) + 1) return FILE_READ_ERROR;
+        memcpy(&item->file_size, current, sizeof(size_t));
+        current += sizeof(size_t);
+        if (item->file_size >= (size_t)(end - current)) return FILE_READ_ERROR;
+        item->file_path = (char *)current;
+        item->file_data = (item->file_size > 0) ? (char *)end - item->file_size : NULL;
+    }
+
+    /* The path must be terminated inside the item. */
+    const char *path_end = item->is_dir ? end : end - item->file_size;
+    if (path_end[-1] != '\0') return FILE_READ_ERROR;
+    return sizeof(long) + item_size;
+}
+
 /*
  * Reconstructs the archive array from the serialized buffer.
  * Returns the archive size on success or a negative code on failure.
@@ -1,5 +1,7 @@
 #include "file.h"
 #include "data_types.h"
+#include "throttle.h"
+#include "volume.h"
 #include <math.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -10,9 +12,11 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <errno.h>
 #include "debugmalloc.h"
 
-
+// Granularity of paced reads and syncs; a multiple of every common page size.
+#define IO_CHUNK_SIZE (1024 * 1024)
 
 /*
  * Determines the length of an open file.
@@ -42,6 +46,7 @@ const char* get_unit(size_t *bytes) {
 
 /*
  * Reads the file into memory; the caller supplies the pointer.
+ * With a rate limit set, the mapping is faulted in chunk by chunk at the allowed pace.
  * Returns the number of bytes read on success or a negative code on error.
  */
 int read_raw(char file_name[], const char** data){
@@ -54,10 +59,49 @@ int read_raw(char file_name[], const char** data){
     void *map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
     if (map == MAP_FAILED) { close(fd); return FILE_READ_ERROR; }
     close(fd);
+    if (throttle_enabled()) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        for (long offset = 0; offset < file_size; offset += IO_CHUNK_SIZE) {
+            long chunk = (file_size - offset < IO_CHUNK_SIZE) ? file_size - offset : IO_CHUNK_SIZE;
+            throttle_io(chunk);
+            for (long page = 0; page < chunk; page += page_size) {
+                (void)*(volatile const char *)((const char *)map + offset + page);
+            }
+        }
+    }
     *data = map;
     return file_size;
 }
 
+/*
+ * Writes the whole buffer to a file descriptor, retrying short and interrupted writes.
+ * Returns SUCCESS or FILE_WRITE_ERROR.
+ */
+int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return FILE_WRITE_ERROR;
+        data += n;
+        length -= n;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Flushes a shared file mapping to disk, one chunk at a time so writes obey the rate limit.
+ * The mapping must start on a page boundary (as mappings from write_raw do).
+ * Returns 0 on success or FILE_WRITE_ERROR on failure.
+ */
+int sync_raw(char *data, long file_size) {
+    for (long offset = 0; offset < file_size; offset += IO_CHUNK_SIZE) {
+        long chunk = (file_size - offset < IO_CHUNK_SIZE) ? file_size - offset : IO_CHUNK_SIZE;
+        throttle_io(chunk);
+        if (msync(data + offset, chunk, MS_SYNC) == -1) return FILE_WRITE_ERROR;
+    }
+    return SUCCESS;
+}
+
 /*
  * Reads data from an open FILE* into an allocated buffer.
  * Returns the number of bytes read on success or a negative code on error.
@@ -85,6 +129,36 @@ int read_from_file(FILE *f, char** data) {
     return file_size;
 }
 
+/*
+ * Maps an open file read-only instead of copying it to the heap, so it is paged in on demand.
+ * Returns the file size on success (the caller munmaps the data) or a negative code on failure.
+ */
+long map_from_file(FILE *f, const char **data) {
+    if (f == NULL || fflush(f) != 0) return FILE_READ_ERROR;
+    long file_size = get_file_size(f);
+    if (file_size < 0) return FILE_READ_ERROR;
+    if (file_size == 0) return EMPTY_FILE;
+
+    void *map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (map == MAP_FAILED) return FILE_READ_ERROR;
+    *data = map;
+    return file_size;
+}
+
+/*
+ * Asks the user before an existing file is replaced, unless overwrite is set.
+ * Returns 0 if writing may proceed, NO_OVERWRITE if declined or SCANF_FAILED if no answer was read.
+ */
+int confirm_overwrite(const char *file_name, bool overwrite) {
+    if (!overwrite && access(file_name, F_OK) == 0) {
+        printf("The file (%s) exists. Overwrite? [Y/n]>", file_name);
+        char input;
+        if (scanf(" %c", &input) != 1) return SCANF_FAILED;
+        if (tolower(input) != 'y') return NO_OVERWRITE;
+    }
+    return SUCCESS;
+}
+
 /*
  * Creates a file and memory maps it for writing.
  * Returns the file size on success or negative error codes on failure.
@@ -96,18 +170,8 @@ int write_raw(char *file_name, char **data, long file_size, bool overwrite){
     int ret = SUCCESS;
     
     while (true) {
-        if (!overwrite && access(file_name, F_OK) == 0) {
-            printf("The file (%s) exists. Overwrite? [Y/n]>", file_name);
-            char input;
-            if (scanf(" %c", &input) != 1) {
-                ret = SCANF_FAILED;
-                break;
-            }
-            if (tolower(input) != 'y') {
-                ret = NO_OVERWRITE;
-                break;
-            }
-        }
+        ret = confirm_overwrite(file_name, overwrite);
+        if (ret != SUCCESS) break;
         
         fd = open(file_name, O_CREAT | O_TRUNC | O_RDWR, 0644);
         if (fd == -1) {
@@ -153,10 +217,24 @@ int read_compressed(char file_name[], Compressed_file *compressed, const char **
         return file_size;
     }
 
+    /* A striped volume carries the manifest; reassemble the archive image from all volumes. */
+    if (file_size >= (long)sizeof(volume_magic) && memcmp(data, volume_magic, sizeof(volume_magic)) == 0) {
+        const char *image = NULL;
+        long image_size = read_striped(file_name, data, file_size, &image);
+        munmap((void*)data, file_size);
+        if (image_size < 0) {
+            return image_size;
+        }
+        data = image;
+        file_size = image_size;
+    }
+
     compressed->original_file = NULL;
     compressed->huffman_tree = NULL;
     compressed->compressed_data = NULL;
     compressed->file_name = NULL;
+    compressed->block_data = NULL;
+    compressed->block_data_size = 0;
 
     const char* current = data;
     const char* end = data + file_size;
@@ -169,7 +247,8 @@ int read_compressed(char file_name[], Compressed_file *compressed, const char **
         memcpy(compressed->magic, current, sizeof(magic));
         current += sizeof(magic);
 
-        if (memcmp(compressed->magic, magic, sizeof(magic)) != 0) {
+        bool blocked = memcmp(compressed->magic, block_magic, sizeof(block_magic)) == 0;
+        if (!blocked && memcmp(compressed->magic, magic, sizeof(magic)) != 0) {
             ret = FILE_MAGIC_ERROR;
             break;
         }
@@ -214,33 +293,50 @@ int read_compressed(char file_name[], Compressed_file *compressed, const char **
         compressed->original_file[name_len] = '\0';
         current += name_len;
 
-        if (current + sizeof(size_t) > end) {
-            ret = FILE_READ_ERROR;
-            break;
-        }
-        compressed->tree_size = *(size_t*)current;
-        current += sizeof(size_t);
+        /* The block format stores its blocks in place of the tree and the data. */
+        if (blocked) {
+            if (current + sizeof(size_t) > end) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            compressed->block_data_size = *(size_t*)current;
+            current += sizeof(size_t);
+            if (compressed->block_data_size > (size_t)(end - current)) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            compressed->block_data = (char*)current;
+            compressed->tree_size = 0;
+            compressed->data_size = 0;
+        } else {
+            if (current + sizeof(size_t) > end) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            compressed->tree_size = *(size_t*)current;
+            current += sizeof(size_t);
 
-        if (current + compressed->tree_size > end) {
-            ret = FILE_READ_ERROR;
-            break;
-        }
-        compressed->huffman_tree = (Node*)current;
-        current += compressed->tree_size;
+            if (current + compressed->tree_size > end) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            compressed->huffman_tree = (Node*)current;
+            current += compressed->tree_size;
 
-        if (current + sizeof(size_t) > end) {
-            ret = FILE_READ_ERROR;
-            break;
-        }
-        compressed->data_size = *(size_t*)current;
-        current += sizeof(size_t);
+            if (current + sizeof(size_t) > end) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            compressed->data_size = *(size_t*)current;
+            current += sizeof(size_t);
 
-        size_t compressed_bytes = (size_t)ceil((double)compressed->data_size / 8.0);
-        if (current + compressed_bytes > end) {
-            ret = FILE_READ_ERROR;
-            break;
+            size_t compressed_bytes = (size_t)ceil((double)compressed->data_size / 8.0);
+            if (current + compressed_bytes > end) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            compressed->compressed_data = (char*)current;
         }
-        compressed->compressed_data = (char*)current;
 
         compressed->file_name = strdup(file_name);
         if (compressed->file_name == NULL) {
@@ -265,6 +361,51 @@ int read_compressed(char file_name[], Compressed_file *compressed, const char **
     *mmap_ptr = data;
     return file_size;
 }
+/*
+ * Returns the number of bytes the structure occupies once serialized.
+ */
+long compressed_file_size(Compressed_file *compressed) {
+    size_t name_len = strlen(compressed->original_file);
+    long header_size = (sizeof(char) * 4) + sizeof(bool) + sizeof(size_t) + sizeof(long) + name_len * sizeof(char);
+    if (memcmp(compressed->magic, block_magic, sizeof(block_magic)) == 0) {
+        return header_size + sizeof(size_t) + compressed->block_data_size;
+    }
+    return header_size + sizeof(size_t) + compressed->tree_size + sizeof(size_t) + (compressed->data_size + 7) / 8;
+}
+
+/*
+ * Serializes the structure into the caller's buffer, which must hold compressed_file_size() bytes.
+ */
+void serialize_compressed(Compressed_file *compressed, unsigned char *data) {
+    size_t name_len = strlen(compressed->original_file);
+    bool blocked = memcmp(compressed->magic, block_magic, sizeof(block_magic)) == 0;
+    for (int i = 0; i < 4; i++) {
+        data[i] = blocked ? block_magic[i] : magic[i];
+    }
+    data += sizeof(char) * 4;
+    memcpy(data, &compressed->is_dir, sizeof(bool));
+    data += sizeof(bool);
+    memcpy(data, &compressed->original_size, sizeof(size_t));
+    data += sizeof(size_t);
+    memcpy(data, &name_len, sizeof(long));
+    data += sizeof(long);
+    memcpy(data, compressed->original_file, name_len);
+    data += name_len;
+    if (blocked) {
+        memcpy(data, &compressed->block_data_size, sizeof(size_t));
+        data += sizeof(size_t);
+        if (compressed->block_data_size > 0) memcpy(data, compressed->block_data, compressed->block_data_size);
+        return;
+    }
+    memcpy(data, &compressed->tree_size, sizeof(size_t));
+    data += sizeof(size_t);
+    memcpy(data, compressed->huffman_tree, compressed->tree_size);
+    data += compressed->tree_size;
+    memcpy(data, &compressed->data_size, sizeof(size_t));
+    data += sizeof(size_t);
+    memcpy(data, compressed->compressed_data, (compressed->data_size + 7) / 8);
+}
+
 /*
  * Serializes the provided structure and writes it directly into a newly mmapped output file.
  * Prompts for overwrite (unless forced) and persists the data with msync before closing.
@@ -276,21 +417,10 @@ int write_compressed(Compressed_file *compressed, bool overwrite) {
     long file_size = 0;
     
     while (true) {
-        size_t name_len = strlen(compressed->original_file);
-        file_size = (sizeof(char) * 4) + sizeof(bool) + sizeof(size_t) + sizeof(long) + name_len * sizeof(char) + sizeof(size_t) + compressed->tree_size + sizeof(size_t) + (compressed->data_size + 7) / 8;
+        file_size = compressed_file_size(compressed);
         
-        if (!overwrite && access(compressed->file_name, F_OK) == 0) {
-            printf("The file (%s) exists. Overwrite? [Y/n]>", compressed->file_name);
-            char input;
-            if (scanf(" %c", &input) != 1) {
-                ret = SCANF_FAILED;
-                break;
-            }
-            if (tolower(input) != 'y') {
-                ret = NO_OVERWRITE;
-                break;
-            }
-        }
+        ret = confirm_overwrite(compressed->file_name, overwrite);
+        if (ret != SUCCESS) break;
         
         fd = open(compressed->file_name, O_CREAT | O_TRUNC | O_RDWR, 0644);
         if (fd == -1) {
@@ -309,28 +439,9 @@ int write_compressed(Compressed_file *compressed, bool overwrite) {
             break;
         }
         
-        unsigned char *data = map;
-        for (int i = 0; i < 4; i++) {
-            data[i] = magic[i];
-        }
-        data += sizeof(char) * 4;
-        memcpy(data, &compressed->is_dir, sizeof(bool));
-        data += sizeof(bool);
-        memcpy(data, &compressed->original_size, sizeof(size_t));
-        data += sizeof(size_t);
-        memcpy(data, &name_len, sizeof(long));
-        data += sizeof(long);
-        memcpy(data, compressed->original_file, name_len);
-        data += name_len;
-        memcpy(data, &compressed->tree_size, sizeof(size_t));
-        data += sizeof(size_t);
-        memcpy(data, compressed->huffman_tree, compressed->tree_size);
-        data += compressed->tree_size;
-        memcpy(data, &compressed->data_size, sizeof(size_t));
-        data += sizeof(size_t);
-        memcpy(data, compressed->compressed_data, (compressed->data_size + 7) / 8);
+        serialize_compressed(compressed, map);
         
-        if (msync(map, file_size, MS_SYNC) == -1) {
+        if (sync_raw(map, file_size) != SUCCESS) {
             ret = FILE_WRITE_ERROR;
             break;
         }
@@ -6,9 +6,15 @@
 
 int read_raw(char file_name[], const char** data);
 int read_from_file(FILE *f, char** data);
+long map_from_file(FILE *f, const char **data);
 int write_raw(char file_name[], char** data, long file_size, bool overwrite);
+int sync_raw(char *data, long file_size);
+int write_all(int fd, const char *data, size_t length);
 int read_compressed(char file_name[], Compressed_file *compressed, const char **mmap_ptr);
 int write_compressed(Compressed_file *compressed, bool overwrite); 
+long compressed_file_size(Compressed_file *compressed);
+void serialize_compressed(Compressed_file *compressed, unsigned char *data);
+int confirm_overwrite(const char *file_name, bool overwrite);
 long get_file_size(FILE* f);
 const char* get_unit(size_t *bytes);
 
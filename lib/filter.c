@@ -0,0 +1,117 @@
+#include "filter.h"
+#include "data_types.h"
+#include <string.h>
+#include <stdbool.h>
+#include "debugmalloc.h"
+
+/*
+ * Branch filters for machine code (BCJ). A call or branch stores its target relative to itself, so calls
+ * to one function look different from every call site. Rewriting the displacements as block-relative
+ * targets makes them repeat, which the block coders pick up. Every decision is made on bytes the filter
+ * leaves alone, so decoding retraces the same instructions and subtracts what encoding added.
+ */
+
+// ELF header fields (64-bit offsets; 32-bit files keep them at their own places).
+#define ELF_HEADER_SIZE 52
+#define EM_386 3
+#define EM_X86_64 62
+#define EM_AARCH64 183
+
+static unsigned int read_le16(const unsigned char *p) {
+    return p[0] | (unsigned int)p[1] << 8;
+}
+
+static unsigned long long read_le32(const unsigned char *p) {
+    return p[0] | (unsigned long long)p[1] << 8 | (unsigned long long)p[2] << 16 | (unsigned long long)p[3] << 24;
+}
+
+static unsigned long long read_le64(const unsigned char *p) {
+    return read_le32(p) | read_le32(p + 4) << 32;
+}
+
+/*
+ * Checks for a little-endian ELF header of an x86 or ARM64 file at p and works out how long the file is:
+ * up to the end of its section header table, which linkers put last, or of its program headers.
+ * Returns the filter for it (0 if p does not start one) and sets *length, capped at left.
+ */
+static unsigned char elf_header(const unsigned char *p, size_t left, size_t *length) {
+    if (left < 64 || memcmp(p, "\177ELF", 4) != 0 || p[5] != 1 || p[6] != 1) return 0;
+    unsigned int machine = read_le16(p + 18);
+    unsigned long long end = 0;
+    unsigned char filter = 0;
+    if (p[4] == 2) {
+        if (machine == EM_X86_64) filter = BLOCK_FILTER_X86;
+        if (machine == EM_AARCH64) filter = BLOCK_FILTER_ARM64;
+        unsigned long long sections = read_le64(p + 0x28) + (unsigned long long)read_le16(p + 0x3A) * read_le16(p + 0x3C);
+        unsigned long long programs = read_le64(p + 0x20) + (unsigned long long)read_le16(p + 0x36) * read_le16(p + 0x38);
+        end = sections > programs ? sections : programs;
+    } else if (p[4] == 1 && machine == EM_386) {
+        filter = BLOCK_FILTER_X86;
+        unsigned long long sections = read_le32(p + 0x20) + (unsigned long long)read_le16(p + 0x2E) * read_le16(p + 0x30);
+        unsigned long long programs = read_le32(p + 0x1C) + (unsigned long long)read_le16(p + 0x2A) * read_le16(p + 0x2C);
+        end = sections > programs ? sections : programs;
+    }
+    if (filter == 0 || end < ELF_HEADER_SIZE) return 0;
+    *length = end < left ? end : left;
+    return filter;
+}
+
+/*
+ * Searches data[from, data_len) for the first x86 or ARM64 ELF file and fills *span with it.
+ * Returns true if it found one.
+ */
+bool find_elf(const unsigned char *data, size_t from, size_t data_len, Elf_span *span) {
+    for (size_t i = from; i + 4 <= data_len; i++) {
+        const unsigned char *p = memchr(data + i, 0x7F, data_len - i);
+        if (p == NULL) break;
+        i = p - data;
+        size_t length = 0;
+        unsigned char filter = elf_header(p, data_len - i, &length);
+        if (filter != 0) {
+            *span = (Elf_span){i, length, filter};
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * x86 CALL (E8) and JMP (E9) with a 32-bit displacement. Only displacements within +-16 MiB (top byte
+ * 0x00 or 0xFF) are converted, modulo 2^25 so the top byte stays 0x00 or 0xFF; the four bytes after
+ * any E8 or E9 are skipped whether converted or not, so the opcodes seen are the same both ways.
+ */
+static void filter_x86(unsigned char *data, size_t size, bool encode) {
+    for (size_t i = 0; i + 5 <= size; i++) {
+        if ((data[i] & 0xFE) != 0xE8) continue;
+        if (data[i + 4] == 0x00 || data[i + 4] == 0xFF) {
+            unsigned int value = (unsigned int)read_le32(data + i + 1);
+            unsigned int position = (unsigned int)(i + 5);
+            value = encode ? value + position : value - position;
+            value &= 0x01FFFFFF;
+            if (value & 0x01000000) value |= 0xFE000000;
+            for (int k = 0; k < 4; k++) data[i + 1 + k] = (unsigned char)(value >> (8 * k));
+        }
+        i += 4;
+    }
+}
+
+// ARM64 BL: the low 26 bits of the instruction word are the target in words, relative to the instruction.
+static void filter_arm64(unsigned char *data, size_t size, bool encode) {
+    for (size_t i = 0; i + 4 <= size; i += 4) {
+        unsigned int word = (unsigned int)read_le32(data + i);
+        if ((word & 0xFC000000) != 0x94000000) continue;
+        unsigned int position = (unsigned int)(i >> 2);
+        unsigned int target = encode ? word + position : word - position;
+        word = (word & 0xFC000000) | (target & 0x03FFFFFF);
+        for (int k = 0; k < 4; k++) data[i + k] = (unsigned char)(word >> (8 * k));
+    }
+}
+
+/*
+ * Runs the block filter named by a BLOCK_FILTER_* flag over size bytes in place: forwards before coding
+ * (encode), backwards after decoding. Positions count from the start of the block.
+ */
+void filter_block(unsigned char filter, unsigned char *data, size_t size, bool encode) {
+    if (filter == BLOCK_FILTER_X86) filter_x86(data, size, encode);
+    if (filter == BLOCK_FILTER_ARM64) filter_arm64(data, size, encode);
+}
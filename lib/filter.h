@@ -0,0 +1,18 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "data_types.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+// An ELF executable or library in the input and the filter its blocks go through.
+typedef struct {
+    size_t offset;
+    size_t length;      // 0 when there is none.
+    unsigned char filter;
+} Elf_span;
+
+bool find_elf(const unsigned char *data, size_t from, size_t data_len, Elf_span *span);
+void filter_block(unsigned char filter, unsigned char *data, size_t size, bool encode);
+
+#endif // FILTER_H
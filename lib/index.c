@@ -0,0 +1,272 @@
+#include "index.h"
+#include "data_types.h"
+#include "directory.h"
+#include "file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "debugmalloc.h"
+
+/*
+ * The member index is appended to an archive after its payload, so readers of the payload never see it:
+ * for every member is_dir (bool), perms (int), size (size_t), checksum (unsigned long long),
+ * the path length including its terminator (long) and the path; then the entry count (size_t),
+ * the size of the entries in bytes (size_t) and index_magic. It is found from the end of the file.
+ */
+#define ENTRY_FIXED_SIZE (sizeof(bool) + sizeof(int) + sizeof(size_t) + sizeof(unsigned long long) + sizeof(long))
+#define INDEX_TAIL_SIZE (2 * sizeof(size_t) + sizeof(index_magic))
+
+// FNV-1a over the member's content.
+static unsigned long long content_checksum(const char *data, size_t size) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static char *put_entry(char *out, const Index_entry *entry) {
+    long path_len = strlen(entry->path) + 1;
+    memcpy(out, &entry->is_dir, sizeof(bool));
+    out += sizeof(bool);
+    memcpy(out, &entry->perms, sizeof(int));
+    out += sizeof(int);
+    memcpy(out, &entry->size, sizeof(size_t));
+    out += sizeof(size_t);
+    memcpy(out, &entry->checksum, sizeof(unsigned long long));
+    out += sizeof(unsigned long long);
+    memcpy(out, &path_len, sizeof(long));
+    out += sizeof(long);
+    memcpy(out, entry->path, path_len);
+    return out + path_len;
+}
+
+/*
+ * Builds the member index of an archive's payload: every item of a serialized directory,
+ * or for a single file one member named after the file (without its directory).
+ * Stores the index, ready to append, in a newly allocated *index (caller frees).
+ * Returns its size in bytes or a negative code on failure.
+ */
+long build_index(const char *data, size_t data_len, bool is_dir, const char *name, char **index) {
+    size_t count = 0;
+    size_t entries_size = 0;
+    const char *base = strrchr(name, '/');
+    base = (base != NULL) ? base + 1 : name;
+
+    if (is_dir) {
+        for (size_t offset = 0; offset < data_len; count++) {
+            Directory_item item = {0};
+            long used = parse_item(&item, data + offset, data_len - offset);
+            if (used <= 0) return FILE_READ_ERROR;
+            entries_size += ENTRY_FIXED_SIZE + strlen(item.is_dir ? item.dir_path : item.file_path) + 1;
+            offset += used;
+        }
+    } else {
+        count = 1;
+        entries_size = ENTRY_FIXED_SIZE + strlen(base) + 1;
+    }
+
+    long index_size = entries_size + INDEX_TAIL_SIZE;
+    *index = malloc(index_size);
+    if (*index == NULL) return MALLOC_ERROR;
+    char *current = *index;
+    if (is_dir) {
+        for (size_t offset = 0; offset < data_len;) {
+            Directory_item item = {0};
+            offset += parse_item(&item, data + offset, data_len - offset);
+            Index_entry entry = {item.dir_path, true, item.perms, 0, 0};
+            if (!item.is_dir) {
+                entry = (Index_entry){item.file_path, false, 0, item.file_size, content_checksum(item.file_data, item.file_size)};
+            }
+            current = put_entry(current, &entry);
+        }
+    } else {
+        Index_entry entry = {base, false, 0, data_len, content_checksum(data, data_len)};
+        current = put_entry(current, &entry);
+    }
+    memcpy(current, &count, sizeof(size_t));
+    current += sizeof(size_t);
+    memcpy(current, &entries_size, sizeof(size_t));
+    current += sizeof(size_t);
+    memcpy(current, index_magic, sizeof(index_magic));
+    return index_size;
+}
+
+/*
+ * Appends a built index to the end of a written archive (or volume) and persists it.
+ * Returns the number of bytes appended or FILE_WRITE_ERROR.
+ */
+long append_index(const char *file_name, const char *index, size_t index_size) {
+    int fd = open(file_name, O_WRONLY | O_APPEND);
+    if (fd == -1) return FILE_WRITE_ERROR;
+    long ret = index_size;
+    if (write_all(fd, index, index_size) != SUCCESS || fdatasync(fd) != 0) ret = FILE_WRITE_ERROR;
+    close(fd);
+    return ret;
+}
+
+/*
+ * Reads the member index from the end of an archive without touching its payload.
+ * Returns SUCCESS, NO_INDEX if the archive was written without one, or another negative code on failure;
+ * on success the caller releases the index with free_index.
+ */
+int read_index(const char *file_name, Member_index *index) {
+    int ret = SUCCESS;
+    char tail[INDEX_TAIL_SIZE];
+    size_t entries_size = 0;
+    struct stat st;
+    *index = (Member_index){0};
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) return FILE_READ_ERROR;
+    while (true) {
+        if (fstat(fd, &st) != 0) {
+            ret = FILE_READ_ERROR;
+            break;
+        }
+        if (st.st_size < (off_t)INDEX_TAIL_SIZE) {
+            ret = NO_INDEX;
+            break;
+        }
+        if (pread(fd, tail, INDEX_TAIL_SIZE, st.st_size - INDEX_TAIL_SIZE) != (ssize_t)INDEX_TAIL_SIZE) {
+            ret = FILE_READ_ERROR;
+            break;
+        }
+        if (memcmp(tail + 2 * sizeof(size_t), index_magic, sizeof(index_magic)) != 0) {
+            ret = NO_INDEX;
+            break;
+        }
+        memcpy(&index->count, tail, sizeof(size_t));
+        memcpy(&entries_size, tail + sizeof(size_t), sizeof(size_t));
+        if (index->count == 0 || entries_size > (size_t)st.st_size - INDEX_TAIL_SIZE || index->count > entries_size / ENTRY_FIXED_SIZE) {
+            ret = FILE_READ_ERROR;
+            break;
+        }
+
+        index->data = malloc(entries_size);
+        index->entries = malloc(index->count * sizeof(Index_entry));
+        if (index->data == NULL || index->entries == NULL) {
+            ret = MALLOC_ERROR;
+            break;
+        }
+        off_t start = st.st_size - INDEX_TAIL_SIZE - entries_size;
+        if (pread(fd, index->data, entries_size, start) != (ssize_t)entries_size) {
+            ret = FILE_READ_ERROR;
+            break;
+        }
+
+        const char *current = index->data;
+        const char *end = index->data + entries_size;
+        for (size_t i = 0; i < index->count && ret == SUCCESS; i++) {
+            Index_entry *entry = &index->entries[i];
+            long path_len = 0;
+            if ((size_t)(end - current) < ENTRY_FIXED_SIZE) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            memcpy(&entry->is_dir, current, sizeof(bool));
+            current += sizeof(bool);
+            memcpy(&entry->perms, current, sizeof(int));
+            current += sizeof(int);
+            memcpy(&entry->size, current, sizeof(size_t));
+            current += sizeof(size_t);
+            memcpy(&entry->checksum, current, sizeof(unsigned long long));
+            current += sizeof(unsigned long long);
+            memcpy(&path_len, current, sizeof(long));
+            current += sizeof(long);
+            /* The path must be terminated inside the entry. */
+            if (path_len < 1 || path_len > end - current || current[path_len - 1] != '\0') {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            entry->path = current;
+            current += path_len;
+        }
+        if (ret == SUCCESS && current != end) ret = FILE_READ_ERROR;
+        break;
+    }
+
+    close(fd);
+    if (ret != SUCCESS) free_index(index);
+    return ret;
+}
+
+void free_index(Member_index *index) {
+    free(index->data);
+    free(index->entries);
+    *index = (Member_index){0};
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const Index_entry *)a)->path, ((const Index_entry *)b)->path);
+}
+
+/*
+ * Lists the members that differ between two indexes, one per line: "A\tpath" for members only in the new one,
+ * "D\tpath" for members only in the old one and "M\tpath" for members whose type, size, permissions
+ * or content checksum changed. Sorts both indexes by path. Returns the number of lines written.
+ */
+long diff_indexes(Member_index *old_index, Member_index *new_index, FILE *out) {
+    long differences = 0;
+    size_t i = 0;
+    size_t j = 0;
+    qsort(old_index->entries, old_index->count, sizeof(Index_entry), compare_entries);
+    qsort(new_index->entries, new_index->count, sizeof(Index_entry), compare_entries);
+
+    while (i < old_index->count || j < new_index->count) {
+        const Index_entry *old_entry = (i < old_index->count) ? &old_index->entries[i] : NULL;
+        const Index_entry *new_entry = (j < new_index->count) ? &new_index->entries[j] : NULL;
+        int order = (old_entry == NULL) ? 1 : (new_entry == NULL) ? -1 : strcmp(old_entry->path, new_entry->path);
+        if (order < 0) {
+            fprintf(out, "D\t%s\n", old_entry->path);
+            differences++;
+            i++;
+        } else if (order > 0) {
+            fprintf(out, "A\t%s\n", new_entry->path);
+            differences++;
+            j++;
+        } else {
+            if (old_entry->is_dir != new_entry->is_dir || old_entry->perms != new_entry->perms ||
+                old_entry->size != new_entry->size || old_entry->checksum != new_entry->checksum) {
+                fprintf(out, "M\t%s\n", new_entry->path);
+                differences++;
+            }
+            i++;
+            j++;
+        }
+    }
+    return differences;
+}
+
+/*
+ * Compares the archives args.input_file (old) and args.diff_file (new) by their member indexes alone,
+ * printing the differences to standard output.
+ * Returns 0 when both hold the same members, 1 when they differ, or a negative code on failure.
+ */
+int run_diff(Arguments args) {
+    Member_index old_index;
+    Member_index new_index = {0};
+    char *files[2] = {args.input_file, args.diff_file};
+    int ret = read_index(files[0], &old_index);
+    if (ret == SUCCESS) {
+        ret = read_index(files[1], &new_index);
+        if (ret != SUCCESS) files[0] = files[1];
+    }
+
+    if (ret == NO_INDEX) {
+        fprintf(stderr, "The archive (%s) has no member index; compress it again to compare it.\n", files[0]);
+    } else if (ret == MALLOC_ERROR) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+    } else if (ret != SUCCESS) {
+        fprintf(stderr, "Failed to read the member index of the archive (%s).\n", files[0]);
+    } else {
+        ret = diff_indexes(&old_index, &new_index, stdout) > 0 ? 1 : SUCCESS;
+    }
+    free_index(&old_index);
+    free_index(&new_index);
+    return ret;
+}
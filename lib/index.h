@@ -0,0 +1,14 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "data_types.h"
+#include <stdio.h>
+
+long build_index(const char *data, size_t data_len, bool is_dir, const char *name, char **index);
+long append_index(const char *file_name, const char *index, size_t index_size);
+int read_index(const char *file_name, Member_index *index);
+void free_index(Member_index *index);
+long diff_indexes(Member_index *old_index, Member_index *new_index, FILE *out);
+int run_diff(Arguments args);
+
+#endif // INDEX_H
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include "jobs.h"
+#include "data_types.h"
+#include "block.h"
+#include "compress.h"
+#include "stream.h"
+#include "file.h"
+#include "throttle.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "debugmalloc.h"
+
+// Upper bound on the worker threads of one queue.
+#define JOB_MAX_WORKERS 64
+// Bytes read from an input descriptor, or decoded for an output descriptor, per step.
+#define JOB_IO_SIZE (256 * 1024)
+
+/*
+ * Scratch of one worker thread, mapped when the queue is created so running a job never allocates.
+ * coded holds blocks_bound(FIXED_BLOCK_SIZE) bytes.
+ */
+typedef struct {
+    Stream_decoder decoder;
+    Huffman_code pair_table[PAIR_TABLE_ENTRIES];
+    char io[JOB_IO_SIZE];
+    char decoded[JOB_IO_SIZE];
+    unsigned char coded[];
+} Job_context;
+
+typedef struct {
+    Job_queue *queue;
+    pthread_t thread;
+    Job_context *context;
+    size_t context_size;
+    Job *current;           // The job being run, NULL while idle.
+} Job_worker;
+
+/*
+ * Pending jobs wait in a FIFO list, finished ones in a second list until job_poll collects them;
+ * both are linked through Job.next, so queueing never allocates.
+ * The eventfd counter is non-zero exactly while the finished list is not empty.
+ */
+struct Job_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    bool stopping;
+    Job *pending;
+    Job *pending_tail;
+    Job *done;
+    Job *done_tail;
+    int event_fd;
+    int worker_count;
+    Job_worker workers[JOB_MAX_WORKERS];
+};
+
+/*
+ * Moves a job to the finished list and wakes the event loop. The queue lock must be held.
+ */
+static void finish_job(Job_queue *queue, Job *job, long result) {
+    job->result = result;
+    job->state = JOB_DONE;
+    job->next = NULL;
+    if (queue->done_tail != NULL) {
+        queue->done_tail->next = job;
+    } else {
+        queue->done = job;
+    }
+    queue->done_tail = job;
+    uint64_t one = 1;
+    ssize_t written = write(queue->event_fd, &one, sizeof(one));
+    (void)written;
+}
+
+static bool job_cancelled(Job_queue *queue, Job *job) {
+    pthread_mutex_lock(&queue->lock);
+    bool cancel = job->cancel;
+    pthread_mutex_unlock(&queue->lock);
+    return cancel;
+}
+
+/*
+ * Maps everything readable from fd: a regular file is mapped whole, anything else (pipe, socket)
+ * is read to end of file into an anonymous mapping that grows with mremap.
+ * Returns SUCCESS (the caller munmaps map_size bytes at *map) or a negative code on failure.
+ */
+static int map_input(int fd, char **map, size_t *map_size, size_t *length) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return FILE_READ_ERROR;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*map == MAP_FAILED) return FILE_READ_ERROR;
+        *map_size = *length = st.st_size;
+        return SUCCESS;
+    }
+
+    size_t size = JOB_IO_SIZE;
+    size_t used = 0;
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) return MALLOC_ERROR;
+    while (true) {
+        if (used == size) {
+            char *grown = mremap(data, size, 2 * size, MREMAP_MAYMOVE);
+            if (grown == MAP_FAILED) {
+                munmap(data, size);
+                return MALLOC_ERROR;
+            }
+            data = grown;
+            size *= 2;
+        }
+        ssize_t n = read(fd, data + used, size - used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            munmap(data, size);
+            return FILE_READ_ERROR;
+        }
+        if (n == 0) break;
+        used += n;
+    }
+    *map = data;
+    *map_size = size;
+    *length = used;
+    return SUCCESS;
+}
+
+/*
+ * Codes the job's input as a block-format archive, one FIXED_BLOCK_SIZE chunk at a time,
+ * checking for cancellation between chunks. Output to a descriptor is assembled in an anonymous
+ * mapping first, as the block data size in the header is known only at the end.
+ * Returns the archive size or a negative code.
+ */
+static long compress_job(Job_queue *queue, Job_context *context, Job *job) {
+    long ret = SUCCESS;
+    const char *data = job->in;
+    size_t data_len = job->in_len;
+    char *input_map = MAP_FAILED;
+    size_t input_map_size = 0;
+    char *output_map = MAP_FAILED;
+    size_t output_map_size = 0;
+    int level = job->level > 0 ? job->level : DEFAULT_LEVEL;
+
+    while (true) {
+        if (data == NULL) {
+            ret = map_input(job->in_fd, &input_map, &input_map_size, &data_len);
+            if (ret != SUCCESS) break;
+            data = input_map;
+        }
+
+        Compressed_file header = {0};
+        memcpy(header.magic, block_magic, sizeof(block_magic));
+        header.original_file = (char *)(job->name != NULL ? job->name : "");
+        header.original_size = data_len;
+        size_t header_size = compressed_file_size(&header);
+
+        char *out = job->out;
+        size_t out_cap = job->out_cap;
+        if (out == NULL) {
+            output_map_size = header_size + blocks_bound(data_len);
+            output_map = mmap(NULL, output_map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (output_map == MAP_FAILED) {
+                ret = MALLOC_ERROR;
+                break;
+            }
+            out = output_map;
+            out_cap = output_map_size;
+        }
+        if (out_cap < header_size) {
+            ret = BUFFER_TOO_SMALL;
+            break;
+        }
+
+        size_t written = header_size;
+        for (size_t start = 0; start < data_len && ret == SUCCESS; start += FIXED_BLOCK_SIZE) {
+            if (job_cancelled(queue, job)) {
+                ret = JOB_CANCELLED;
+                break;
+            }
+            size_t length = data_len - start < FIXED_BLOCK_SIZE ? data_len - start : FIXED_BLOCK_SIZE;
+            const unsigned char *chunk = (const unsigned char *)data + start;
+            /* Code straight into the output when the worst case fits, through the scratch otherwise. */
+            if (out_cap - written >= blocks_bound(length)) {
+                written += encode_chunk(chunk, length, level, (unsigned char *)out + written, context->pair_table);
+            } else {
+                size_t coded = encode_chunk(chunk, length, level, context->coded, context->pair_table);
+                if (coded > out_cap - written) {
+                    ret = BUFFER_TOO_SMALL;
+                    break;
+                }
+                memcpy(out + written, context->coded, coded);
+                written += coded;
+            }
+        }
+        if (ret != SUCCESS) break;
+
+        /* The header goes in front of the blocks, with the block data size patched in last. */
+        size_t blocks_size = written - header_size;
+        serialize_compressed(&header, (unsigned char *)out);
+        memcpy(out + header_size - sizeof(size_t), &blocks_size, sizeof(size_t));
+        if (job->out == NULL) {
+            throttle_io(written);
+            if (write_all(job->out_fd, out, written) != SUCCESS) {
+                ret = FILE_WRITE_ERROR;
+                break;
+            }
+        }
+        ret = written;
+        break;
+    }
+
+    if (input_map != MAP_FAILED) munmap(input_map, input_map_size);
+    if (output_map != MAP_FAILED) munmap(output_map, output_map_size);
+    return ret;
+}
+
+/*
+ * Decodes the job's input with the worker's resumable decoder, reading a descriptor and writing
+ * a descriptor JOB_IO_SIZE bytes at a time, and checking for cancellation between steps.
+ * Returns the decoded size or a negative code.
+ */
+static long decompress_job(Job_queue *queue, Job_context *context, Job *job) {
+    Stream_decoder *decoder = &context->decoder;
+    const char *in = job->in;
+    size_t in_len = job->in_len;
+    size_t in_pos = 0;
+    bool in_ended = (job->in != NULL);
+    size_t produced = 0;
+    int status = SUCCESS;
+    bool done = false;
+
+    stream_decoder_init(decoder);
+    while (status == SUCCESS && !done) {
+        if (job_cancelled(queue, job)) return JOB_CANCELLED;
+        if (in_pos == in_len && !in_ended) {
+            ssize_t n = read(job->in_fd, context->io, JOB_IO_SIZE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return FILE_READ_ERROR;
+            in = context->io;
+            in_len = n;
+            in_pos = 0;
+            in_ended = (n == 0);
+        }
+
+        char *out = context->decoded;
+        size_t out_cap = JOB_IO_SIZE;
+        if (job->out != NULL) {
+            out = job->out + produced;
+            out_cap = job->out_cap - produced;
+        }
+        size_t in_used = 0;
+        size_t out_len = 0;
+        status = stream_decode(decoder, in + in_pos, in_len - in_pos, &in_used, out, out_cap, &out_len, &done);
+        in_pos += in_used;
+        produced += out_len;
+        if (job->out == NULL && out_len > 0) {
+            throttle_io(out_len);
+            if (write_all(job->out_fd, out, out_len) != SUCCESS) return FILE_WRITE_ERROR;
+        }
+        if (status == SUCCESS && !done && in_used == 0 && out_len == 0) {
+            if (out_cap == 0) return BUFFER_TOO_SMALL;
+            if (in_ended) return DECOMPRESSION_ERROR; // The archive ended before the data did.
+        }
+    }
+    return (status == SUCCESS) ? (long)produced : status;
+}
+
+/*
+ * Worker thread: runs pending jobs until the queue is destroyed. Must not allocate.
+ */
+static void *job_worker(void *arg) {
+    Job_worker *worker = arg;
+    Job_queue *queue = worker->queue;
+
+    pthread_mutex_lock(&queue->lock);
+    while (true) {
+        while (queue->pending == NULL && !queue->stopping) {
+            pthread_cond_wait(&queue->work, &queue->lock);
+        }
+        if (queue->stopping) break;
+
+        Job *job = queue->pending;
+        queue->pending = job->next;
+        if (queue->pending == NULL) queue->pending_tail = NULL;
+        job->state = JOB_RUNNING;
+        worker->current = job;
+        pthread_mutex_unlock(&queue->lock);
+
+        long result = (job->kind == JOB_COMPRESS) ? compress_job(queue, worker->context, job)
+                                                  : decompress_job(queue, worker->context, job);
+        stream_decoder_release(&worker->context->decoder); // A cancelled job can stop inside a block.
+
+        pthread_mutex_lock(&queue->lock);
+        worker->current = NULL;
+        finish_job(queue, job, result);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/*
+ * Starts a queue with worker_count threads (0 means one per CPU the process may use),
+ * each with its own codec scratch, so submitted jobs run without blocking the caller.
+ * Returns SUCCESS and sets *queue, or a negative code on failure.
+ */
+int job_queue_create(int worker_count, Job_queue **queue) {
+    if (worker_count <= 0) worker_count = max_workers();
+    if (worker_count > JOB_MAX_WORKERS) worker_count = JOB_MAX_WORKERS;
+
+    Job_queue *created = calloc(1, sizeof(Job_queue));
+    if (created == NULL) return MALLOC_ERROR;
+    pthread_mutex_init(&created->lock, NULL);
+    pthread_cond_init(&created->work, NULL);
+    created->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (created->event_fd == -1) {
+        job_queue_destroy(created);
+        return FILE_READ_ERROR;
+    }
+
+    size_t context_size = sizeof(Job_context) + blocks_bound(FIXED_BLOCK_SIZE);
+    for (int i = 0; i < worker_count; i++) {
+        Job_worker *worker = &created->workers[i];
+        worker->queue = created;
+        worker->context = mmap(NULL, context_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (worker->context == MAP_FAILED) break;
+        worker->context_size = context_size;
+        if (pthread_create(&worker->thread, NULL, job_worker, worker) != 0) {
+            munmap(worker->context, context_size);
+            break;
+        }
+        created->worker_count++;
+    }
+    if (created->worker_count == 0) {
+        job_queue_destroy(created);
+        return MALLOC_ERROR;
+    }
+    *queue = created;
+    return SUCCESS;
+}
+
+/*
+ * Returns the eventfd that is readable while finished jobs wait for job_poll; add it to an epoll set.
+ */
+int job_queue_fd(const Job_queue *queue) {
+    return queue->event_fd;
+}
+
+/*
+ * Queues a job that is not queued or running already; it runs on a worker thread and is reported
+ * through job_poll once done.
+ * Returns SUCCESS, or FILE_READ_ERROR / FILE_WRITE_ERROR if it names no input or no output.
+ */
+int job_submit(Job_queue *queue, Job *job) {
+    if (job->in == NULL && job->in_fd < 0) return FILE_READ_ERROR;
+    if (job->out == NULL && job->out_fd < 0) return FILE_WRITE_ERROR;
+
+    pthread_mutex_lock(&queue->lock);
+    job->state = JOB_QUEUED;
+    job->cancel = false;
+    job->result = SUCCESS;
+    job->next = NULL;
+    if (queue->pending_tail != NULL) {
+        queue->pending_tail->next = job;
+    } else {
+        queue->pending = job;
+    }
+    queue->pending_tail = job;
+    pthread_cond_signal(&queue->work);
+    pthread_mutex_unlock(&queue->lock);
+    return SUCCESS;
+}
+
+/*
+ * Cancels a job: a queued one finishes at once, a running one at its next chunk.
+ * Either way it is still reported by job_poll, with result JOB_CANCELLED unless it had already completed.
+ */
+void job_cancel(Job_queue *queue, Job *job) {
+    pthread_mutex_lock(&queue->lock);
+    if (job->state == JOB_QUEUED) {
+        Job **link = &queue->pending;
+        Job *previous = NULL;
+        while (*link != NULL && *link != job) {
+            previous = *link;
+            link = &(*link)->next;
+        }
+        if (*link == job) {
+            *link = job->next;
+            if (queue->pending_tail == job) queue->pending_tail = previous;
+            finish_job(queue, job, JOB_CANCELLED);
+        }
+    } else if (job->state == JOB_RUNNING) {
+        job->cancel = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * Takes the next finished job, or returns NULL if none is waiting. Never blocks.
+ */
+Job *job_poll(Job_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    Job *job = queue->done;
+    if (job != NULL) {
+        queue->done = job->next;
+        if (queue->done == NULL) queue->done_tail = NULL;
+        job->next = NULL;
+    }
+    if (queue->done == NULL) {
+        uint64_t count = 0;
+        ssize_t drained = read(queue->event_fd, &count, sizeof(count));
+        (void)drained;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+/*
+ * Stops the workers and frees the queue. Queued jobs are cancelled and running ones asked to stop;
+ * once this returns every submitted job is done and its result says how it ended.
+ */
+void job_queue_destroy(Job_queue *queue) {
+    if (queue == NULL) return;
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = true;
+    while (queue->pending != NULL) {
+        Job *job = queue->pending;
+        queue->pending = job->next;
+        finish_job(queue, job, JOB_CANCELLED);
+    }
+    queue->pending_tail = NULL;
+    for (int i = 0; i < queue->worker_count; i++) {
+        if (queue->workers[i].current != NULL) queue->workers[i].current->cancel = true;
+    }
+    pthread_cond_broadcast(&queue->work);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (int i = 0; i < queue->worker_count; i++) {
+        pthread_join(queue->workers[i].thread, NULL);
+        munmap(queue->workers[i].context, queue->workers[i].context_size);
+    }
+    if (queue->event_fd != -1) close(queue->event_fd);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->work);
+    free(queue);
+}
@@ -0,0 +1,15 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "data_types.h"
+
+typedef struct Job_queue Job_queue;
+
+int job_queue_create(int worker_count, Job_queue **queue);
+int job_queue_fd(const Job_queue *queue);
+int job_submit(Job_queue *queue, Job *job);
+void job_cancel(Job_queue *queue, Job *job);
+Job *job_poll(Job_queue *queue);
+void job_queue_destroy(Job_queue *queue);
+
+#endif // JOBS_H
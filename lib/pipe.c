@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include "pipe.h"
+#include "data_types.h"
+#include "stream.h"
+#include "throttle.h"
+#include "file.h"
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "debugmalloc.h"
+
+// Decoded bytes handed to the output per step (less under a memory budget); a whole number of pages.
+#define PIPE_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Hands the pages of a chunk to the pipe without copying them.
+ * Returns the number of bytes moved; stops early (with errno set) if vmsplice fails.
+ */
+static size_t gift_chunk(int fd, char *chunk, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        struct iovec iov = {chunk + done, length - done};
+        ssize_t n = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * Moves length stored bytes from the archive file at offset straight into the pipe, without them
+ * passing through user space.
+ * Returns the number of bytes moved; stops early (with errno set) if splice fails.
+ */
+static size_t splice_stored(int archive_fd, loff_t offset, int fd, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = splice(archive_fd, &offset, fd, NULL, length - done, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * Decodes a compressed file image (starting at its magic) straight into a file descriptor.
+ * When fd is a pipe, every chunk is decoded into a fresh page-aligned mapping and gifted to the pipe
+ * with vmsplice, so the kernel references the pages instead of copying them; the mapping is never
+ * touched again, only unmapped. Stored blocks are not decoded at all: given the archive file the image
+ * was mapped from (archive_fd, else -1), their payloads are spliced from it into the pipe.
+ * Other descriptors, or kernels refusing vmsplice or splice, get plain write().
+ * Returns SUCCESS, ARCHIVE_TRUNCATED once the blocks of an archive that ends between two of them are written,
+ * or a negative code (FILE_MAGIC_ERROR, DECOMPRESSION_ERROR, FILE_WRITE_ERROR, MALLOC_ERROR).
+ */
+int decode_to_fd(const char *archive, size_t archive_size, int archive_fd, int fd) {
+    int ret = SUCCESS;
+    char *chunk = MAP_FAILED;
+    size_t in_pos = 0;
+    size_t chunk_size = budgeted_size(PIPE_CHUNK_SIZE, 4);
+    struct stat st;
+    bool use_splice = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    // Mapped per call, like the grep workers' decoders, so concurrent calls do not share it.
+    Stream_decoder *decoder = mmap(NULL, sizeof(Stream_decoder), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (decoder == MAP_FAILED) return MALLOC_ERROR;
+
+    // A larger pipe lets each vmsplice move the whole chunk; failure only means more round trips.
+    if (use_splice) fcntl(fd, F_SETPIPE_SZ, chunk_size);
+    stream_decoder_init(decoder);
+    decoder->pause_stored = use_splice && archive_fd != -1;
+
+    while (true) {
+        if (chunk == MAP_FAILED) {
+            chunk = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (chunk == MAP_FAILED) {
+                ret = MALLOC_ERROR;
+                break;
+            }
+        }
+
+        size_t in_used = 0;
+        size_t out_len = 0;
+        bool done = false;
+        int status = stream_decode(decoder, archive + in_pos, archive_size - in_pos, &in_used, chunk, chunk_size, &out_len, &done);
+        in_pos += in_used;
+        if (status < 0) {
+            ret = status;
+            break;
+        }
+        if (!done && in_pos == archive_size && out_len < chunk_size) {
+            // The archive ended before the data did: between two blocks it was cut short (see recorded_size),
+            // and the blocks it has are still written out.
+            ret = (decoder->stage == STREAM_BLOCK_HEADER && decoder->field_used == 0) ? ARCHIVE_TRUNCATED : DECOMPRESSION_ERROR;
+            if (ret == DECOMPRESSION_ERROR) break;
+        }
+
+        throttle_io(out_len);
+        size_t gifted = 0;
+        if (use_splice && out_len > 0) {
+            gifted = gift_chunk(fd, chunk, out_len);
+            if (gifted < out_len && errno != EINVAL && errno != ENOSYS) {
+                ret = FILE_WRITE_ERROR;
+                break;
+            }
+            if (gifted < out_len) use_splice = false;
+        }
+        if (write_all(fd, chunk + gifted, out_len - gifted) != SUCCESS) {
+            ret = FILE_WRITE_ERROR;
+            break;
+        }
+        if (gifted > 0) {
+            // The pipe now references these pages; writing to them again would corrupt queued data.
+            munmap(chunk, chunk_size);
+            chunk = MAP_FAILED;
+        }
+        if (done || ret != SUCCESS) break;
+
+        /* Paused at a stored block: its payload goes from the archive file to the pipe as it is. */
+        size_t stored = stream_stored_left(decoder);
+        if (decoder->pause_stored && stored > 0) {
+            if (stored > archive_size - in_pos) {
+                ret = DECOMPRESSION_ERROR;
+                break;
+            }
+            throttle_io(stored);
+            size_t spliced = splice_stored(archive_fd, in_pos, fd, stored);
+            if (spliced < stored && errno != EINVAL && errno != ENOSYS) {
+                ret = FILE_WRITE_ERROR;
+                break;
+            }
+            // Whatever splice could not move is decoded and written like the rest.
+            if (spliced < stored) decoder->pause_stored = false;
+            stream_skip_stored(decoder, spliced);
+            in_pos += spliced;
+        }
+    }
+
+    stream_decoder_release(decoder);
+    munmap(decoder, sizeof(Stream_decoder));
+    if (chunk != MAP_FAILED) munmap(chunk, chunk_size);
+    return ret;
+}
@@ -0,0 +1,8 @@
+#ifndef PIPE_H
+#define PIPE_H
+
+#include <stddef.h>
+
+int decode_to_fd(const char *archive, size_t archive_size, int archive_fd, int fd);
+
+#endif // PIPE_H
@@ -0,0 +1,216 @@
+#include "recompress.h"
+#include "data_types.h"
+#include "block.h"
+#include "deflate.h"
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "debugmalloc.h"
+
+/*
+ * Deflate streams inside gzip members, zip entries and PNG image data code their bytes far worse than
+ * the block coder codes the inflated data. A stream qualifies when deflate_exact, given the inflated data
+ * and one of the usual zlib parameter sets, deflates it back to exactly the same bytes; it is then kept
+ * inflated in a BLOCK_INFLATED block and deflated again on decoding. deflate_exact is the deflate of one
+ * pinned zlib release, so a stream kept this way restores the same whichever zlib the system has. The
+ * container headers around it stay in the neighbouring blocks, so the decoded data is the input byte for byte.
+ */
+
+// Levels in the order they are tried: zlib's default first, then the maximum most tools offer.
+static const unsigned char trial_levels[] = {6, 9, 1, 2, 3, 4, 5, 7, 8};
+static const unsigned char trial_mem_levels[] = {8, 9};
+static const unsigned char trial_strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED}; // PNG encoders filter.
+
+static unsigned int read_le16(const unsigned char *p) {
+    return p[0] | (unsigned int)p[1] << 8;
+}
+
+static size_t read_be32(const unsigned char *p) {
+    return (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+}
+
+/*
+ * Skips the header of a gzip member (RFC 1952) at p. Returns the offset of its deflate data, or 0 if p
+ * does not start one.
+ */
+static size_t gzip_start(const unsigned char *p, size_t left) {
+    if (left < 18 || p[0] != 0x1F || p[1] != 0x8B || p[2] != 8 || (p[3] & 0xE0) != 0) return 0;
+    unsigned char flags = p[3];
+    size_t pos = 10;
+    if (flags & 0x04) pos += 2 + read_le16(p + pos); // FEXTRA
+    for (unsigned char field = 0x08; field <= 0x10; field <<= 1) { // FNAME, then FCOMMENT
+        if (!(flags & field)) continue;
+        const unsigned char *end = pos < left ? memchr(p + pos, 0, left - pos) : NULL;
+        if (end == NULL) return 0;
+        pos = end - p + 1;
+    }
+    if (flags & 0x02) pos += 2; // FHCRC
+    return pos < left ? pos : 0;
+}
+
+/*
+ * Skips the local header of a deflated, unencrypted zip entry at p. Returns the offset of its deflate data,
+ * or 0 if p does not start one.
+ */
+static size_t zip_start(const unsigned char *p, size_t left) {
+    if (left < 30 || memcmp(p, "PK\3\4", 4) != 0 || read_le16(p + 8) != 8 || (read_le16(p + 6) & 1)) return 0;
+    size_t pos = 30 + read_le16(p + 26) + read_le16(p + 28);
+    return pos < left ? pos : 0;
+}
+
+/*
+ * Checks for a PNG IDAT chunk at p whose data opens a zlib stream (RFC 1950) without a preset dictionary.
+ * Sets *avail to the chunk data after the zlib header and *window_bits from the header.
+ * Returns the offset of the deflate data, or 0 if p does not start such a chunk.
+ */
+static size_t idat_start(const unsigned char *p, size_t left, size_t *avail, int *window_bits) {
+    if (left < 14 || memcmp(p + 4, "IDAT", 4) != 0) return 0;
+    unsigned char cmf = p[8];
+    unsigned char flg = p[9];
+    size_t chunk_size = read_be32(p);
+    if ((cmf & 0x0F) != 8 || (cmf >> 4) > 7 || (cmf * 256 + flg) % 31 != 0 || (flg & 0x20) || chunk_size < 3) return 0;
+    *avail = chunk_size - 2;
+    *window_bits = (cmf >> 4) + 8;
+    return 10;
+}
+
+/*
+ * Inflates the raw deflate stream at the start of in (at most avail bytes) into inflated,
+ * which holds DEFLATE_INFLATED_MAX bytes. Sets *length to the bytes the stream takes and *inflated_size.
+ * Returns true if the stream ended within both limits.
+ */
+static bool inflate_stream(const unsigned char *in, size_t avail, unsigned char *inflated, size_t *length, size_t *inflated_size) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, -MAX_WBITS) != Z_OK) return false;
+    z.next_in = (Bytef *)in;
+    z.avail_in = avail;
+    z.next_out = inflated;
+    z.avail_out = DEFLATE_INFLATED_MAX;
+    int ret = inflate(&z, Z_FINISH);
+    *length = z.total_in;
+    *inflated_size = z.total_out;
+    inflateEnd(&z);
+    return ret == Z_STREAM_END;
+}
+
+// Whether deflate_exact turns the inflated data back into the length bytes of original.
+static bool reproduces(const unsigned char *original, size_t length, const unsigned char *inflated, size_t inflated_size, const Deflate_params *params) {
+    return deflate_exact(params, inflated, inflated_size, NULL, length, original) == length;
+}
+
+/*
+ * Tries the usual zlib parameter sets on a stream until one reproduces it; fills params on success.
+ */
+static bool find_params(const unsigned char *original, size_t length, const unsigned char *inflated, size_t inflated_size, int window_bits, Deflate_params *params) {
+    for (size_t s = 0; s < sizeof(trial_strategies); s++) {
+        for (size_t m = 0; m < sizeof(trial_mem_levels); m++) {
+            for (size_t l = 0; l < sizeof(trial_levels); l++) {
+                *params = (Deflate_params){trial_levels[l], trial_mem_levels[m], window_bits, trial_strategies[s], 0};
+                if (reproduces(original, length, inflated, inflated_size, params)) {
+                    params->crc = crc32(0, original, length);
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Searches data[from, data_len) for the first deflate stream of a gzip member, zip entry or single-chunk
+ * PNG image that is between DEFLATE_STREAM_MIN and max_length bytes long, inflates to at most
+ * DEFLATE_INFLATED_MAX bytes and is reproduced by zlib (see find_params). Fills *stream when it finds one.
+ * Returns true if it did.
+ */
+bool find_deflate_stream(const unsigned char *data, size_t from, size_t data_len, size_t max_length, Deflate_stream *stream) {
+    unsigned char *inflated = MAP_FAILED;
+    bool found = false;
+    if (max_length > DEFLATE_INFLATED_MAX) max_length = DEFLATE_INFLATED_MAX;
+
+    for (size_t i = from; i < data_len && !found; i++) {
+        const unsigned char *p = data + i;
+        size_t left = data_len - i;
+        size_t avail = 0;
+        int window_bits = MAX_WBITS;
+        size_t start = 0;
+        if (p[0] == 0x1F) start = gzip_start(p, left);
+        if (p[0] == 'P') start = zip_start(p, left);
+        if (start == 0 && left >= 14 && p[4] == 'I') start = idat_start(p, left, &avail, &window_bits);
+        if (start == 0) continue;
+        if (avail == 0 || avail > left - start) avail = left - start;
+        if (avail > max_length) avail = max_length;
+
+        if (inflated == MAP_FAILED) {
+            inflated = mmap(NULL, DEFLATE_INFLATED_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (inflated == MAP_FAILED) break;
+        }
+        size_t length = 0;
+        size_t inflated_size = 0;
+        if (!inflate_stream(p + start, avail, inflated, &length, &inflated_size) || length < DEFLATE_STREAM_MIN) continue;
+        Deflate_params params;
+        if (!find_params(p + start, length, inflated, inflated_size, window_bits, &params)) continue;
+        *stream = (Deflate_stream){i + start, length, inflated_size, params};
+        found = true;
+    }
+    if (inflated != MAP_FAILED) munmap(inflated, DEFLATE_INFLATED_MAX);
+    return found;
+}
+
+/*
+ * Codes a stream found by find_deflate_stream as one BLOCK_INFLATED block: its parameters, then the inflated
+ * data coded by encode_block at the given level. Where that would not beat coding the deflate bytes as they
+ * are, or the memory for it is not available, they are coded by encode_block instead.
+ * data is the whole input; out must hold stream->length + sizeof(Block_header) + 1 bytes.
+ * Returns the number of bytes written.
+ */
+size_t encode_inflated(const unsigned char *data, const Deflate_stream *stream, int level, unsigned char *out, Huffman_code *pair_table) {
+    const unsigned char *deflated = data + stream->offset;
+    size_t inner_bound = stream->inflated_size + sizeof(Block_header) + 1;
+    size_t mapped = stream->inflated_size + inner_bound;
+    unsigned char *inflated = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (inflated == MAP_FAILED) return encode_block(deflated, stream->length, level, out, pair_table);
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    bool inflated_all = false;
+    if (inflateInit2(&z, -MAX_WBITS) == Z_OK) {
+        z.next_in = (Bytef *)deflated;
+        z.avail_in = stream->length;
+        z.next_out = inflated;
+        z.avail_out = stream->inflated_size;
+        inflated_all = inflate(&z, Z_FINISH) == Z_STREAM_END && z.total_out == stream->inflated_size;
+        inflateEnd(&z);
+    }
+
+    size_t written = 0;
+    if (inflated_all) {
+        unsigned char *inner = inflated + stream->inflated_size;
+        size_t inner_size = encode_block(inflated, stream->inflated_size, level, inner, pair_table);
+        size_t size = sizeof(Block_header) + sizeof(Deflate_params) + inner_size;
+        if (size < stream->length) {
+            Block_header header;
+            memset(&header, 0, sizeof(header)); // Padding bytes are written too.
+            header.method = BLOCK_INFLATED;
+            header.raw_size = stream->length;
+            header.payload_size = sizeof(Deflate_params) + inner_size;
+            memcpy(out, &header, sizeof(Block_header));
+            memcpy(out + sizeof(Block_header), &stream->params, sizeof(Deflate_params));
+            memcpy(out + sizeof(Block_header) + sizeof(Deflate_params), inner, inner_size);
+            written = size;
+        }
+    }
+    munmap(inflated, mapped);
+    return written > 0 ? written : encode_block(deflated, stream->length, level, out, pair_table);
+}
+
+/*
+ * Deflates inflated_size bytes with the given parameters into raw (see deflate_exact), which must come out
+ * exactly raw_size bytes long and match params->crc. Returns SUCCESS or DECOMPRESSION_ERROR.
+ */
+int deflate_inflated(const Deflate_params *params, const unsigned char *inflated, size_t inflated_size, char *raw, size_t raw_size) {
+    size_t written = deflate_exact(params, inflated, inflated_size, (unsigned char *)raw, raw_size, NULL);
+    if (written != raw_size || crc32(0, (const Bytef *)raw, raw_size) != params->crc) return DECOMPRESSION_ERROR;
+    return SUCCESS;
+}
@@ -0,0 +1,26 @@
+#ifndef RECOMPRESS_H
+#define RECOMPRESS_H
+
+#include "data_types.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+// A raw deflate stream in the input that zlib reproduces bit for bit from its inflated data.
+typedef struct {
+    size_t offset;          // Of the first deflate byte in the input.
+    size_t length;          // Deflate bytes; 0 when there is no stream.
+    size_t inflated_size;
+    Deflate_params params;
+} Deflate_stream;
+
+// How far the input has been searched for deflate streams, and the first one found ahead.
+typedef struct {
+    size_t scanned;
+    Deflate_stream next;
+} Deflate_scan;
+
+bool find_deflate_stream(const unsigned char *data, size_t from, size_t data_len, size_t max_length, Deflate_stream *stream);
+size_t encode_inflated(const unsigned char *data, const Deflate_stream *stream, int level, unsigned char *out, Huffman_code *pair_table);
+int deflate_inflated(const Deflate_params *params, const unsigned char *inflated, size_t inflated_size, char *raw, size_t raw_size);
+
+#endif // RECOMPRESS_H
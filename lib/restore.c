@@ -0,0 +1,274 @@
+#include "restore.h"
+#include "data_types.h"
+#include "stream.h"
+#include "directory.h"
+#include "file.h"
+#include "throttle.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "debugmalloc.h"
+
+/*
+ * Ring buffer shared by the decoder thread (producer) and the restoring thread (consumer).
+ * head and tail count bytes ever produced and consumed; their difference is the fill level.
+ */
+typedef struct {
+    char *buffer;
+    size_t size;
+    size_t head;
+    size_t tail;
+    bool finished;          // The decoder stopped; status holds why.
+    bool cancelled;         // The consumer gave up, the decoder must stop.
+    int status;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    const char *archive;
+    size_t archive_size;
+    Stream_decoder decoder;
+} Restore_ring;
+
+/*
+ * Producer: decodes the archive into the free part of the ring until the stream ends.
+ * Runs on its own thread, so it must not allocate.
+ */
+static void *decode_into_ring(void *arg) {
+    Restore_ring *ring = arg;
+    size_t in_pos = 0;
+    int status = SUCCESS;
+    bool done = false;
+
+    while (status == SUCCESS && !done) {
+        pthread_mutex_lock(&ring->lock);
+        while (ring->head - ring->tail == ring->size && !ring->cancelled) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        bool cancelled = ring->cancelled;
+        size_t offset = ring->head % ring->size;
+        size_t space = ring->size - (ring->head - ring->tail);
+        pthread_mutex_unlock(&ring->lock);
+        if (cancelled) break;
+        if (space > ring->size - offset) space = ring->size - offset;
+
+        size_t in_used = 0;
+        size_t out_len = 0;
+        status = stream_decode(&ring->decoder, ring->archive + in_pos, ring->archive_size - in_pos, &in_used,
+                               ring->buffer + offset, space, &out_len, &done);
+        in_pos += in_used;
+        if (status == SUCCESS && !done && in_pos == ring->archive_size && out_len < space) {
+            status = DECOMPRESSION_ERROR; // The archive ended before the data did.
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        ring->head += out_len;
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+    }
+
+    stream_decoder_release(&ring->decoder);
+    pthread_mutex_lock(&ring->lock);
+    ring->status = status;
+    ring->finished = true;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+/*
+ * Waits until decoded bytes are available and points data at the contiguous part of them.
+ * Returns the length of that span, or 0 once the decoder has finished and everything was consumed.
+ */
+static size_t ring_wait(Restore_ring *ring, const char **data) {
+    pthread_mutex_lock(&ring->lock);
+    while (ring->head == ring->tail && !ring->finished) {
+        pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+    size_t available = ring->head - ring->tail;
+    pthread_mutex_unlock(&ring->lock);
+
+    size_t offset = ring->tail % ring->size;
+    *data = ring->buffer + offset;
+    return (available < ring->size - offset) ? available : ring->size - offset;
+}
+
+static void ring_consume(Restore_ring *ring, size_t length) {
+    pthread_mutex_lock(&ring->lock);
+    ring->tail += length;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Copies exactly length decoded bytes out of the ring.
+ * Returns SUCCESS or FILE_READ_ERROR if the stream ends first.
+ */
+static int ring_read(Restore_ring *ring, void *dest, size_t length) {
+    while (length > 0) {
+        const char *data = NULL;
+        size_t span = ring_wait(ring, &data);
+        if (span == 0) return FILE_READ_ERROR;
+        if (span > length) span = length;
+        memcpy(dest, data, span);
+        ring_consume(ring, span);
+        dest = (char *)dest + span;
+        length -= span;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Writes the next file_size bytes of the ring to a new file, straight from the ring memory.
+ * Returns SUCCESS or a negative code on failure.
+ */
+static int restore_file(Restore_ring *ring, char *output_dir, const char *path, size_t file_size, bool force) {
+    int ret = SUCCESS;
+    int fd = -1;
+    if (output_dir == NULL) output_dir = ".";
+    char *full_path = malloc(strlen(output_dir) + strlen(path) + 2);
+    if (full_path == NULL) return MALLOC_ERROR;
+    strcpy(full_path, output_dir);
+    strcat(full_path, "/");
+    strcat(full_path, path);
+
+    while (true) {
+        if (file_size > 0 && confirm_overwrite(full_path, force) != SUCCESS) {
+            ret = FILE_WRITE_ERROR;
+            break;
+        }
+        fd = open(full_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd == -1) {
+            ret = FILE_WRITE_ERROR;
+            break;
+        }
+        while (file_size > 0) {
+            const char *data = NULL;
+            size_t span = ring_wait(ring, &data);
+            if (span == 0) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            if (span > file_size) span = file_size;
+            throttle_io(span);
+            if (write_all(fd, data, span) != SUCCESS) {
+                ret = FILE_WRITE_ERROR;
+                break;
+            }
+            ring_consume(ring, span);
+            file_size -= span;
+        }
+        if (ret != SUCCESS) break;
+        if (fdatasync(fd) != 0) ret = FILE_WRITE_ERROR;
+        break;
+    }
+
+    if (fd != -1) close(fd);
+    free(full_path);
+    return ret;
+}
+
+/*
+ * Restores a compressed directory (image starting at its magic) without holding the decoded stream:
+ * a decoder thread fills a ring buffer of ring_size bytes while this thread parses the serialized
+ * items from it and writes each file as its bytes arrive. Memory use is the ring plus one path.
+ * Returns SUCCESS or a negative code (FILE_READ_ERROR, MKDIR_ERROR, FILE_WRITE_ERROR, MALLOC_ERROR,
+ * FILE_MAGIC_ERROR, DECOMPRESSION_ERROR).
+ */
+int restore_stream(const char *archive, size_t archive_size, size_t ring_size, char *output_dir, bool force, bool no_preserve_perms) {
+    int ret = SUCCESS;
+    bool started = false;
+    char *path = NULL;
+    pthread_t decoder_thread;
+    Restore_ring *ring = malloc(sizeof(Restore_ring));
+    if (ring == NULL) return MALLOC_ERROR;
+    *ring = (Restore_ring){0};
+    ring->size = ring_size;
+    ring->archive = archive;
+    ring->archive_size = archive_size;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->changed, NULL);
+    stream_decoder_init(&ring->decoder);
+
+    while (true) {
+        if (output_dir != NULL && mkdir(output_dir, 0755) != 0 && errno != EEXIST) {
+            ret = MKDIR_ERROR;
+            break;
+        }
+        ring->buffer = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring->buffer == MAP_FAILED) {
+            ring->buffer = NULL;
+            ret = MALLOC_ERROR;
+            break;
+        }
+        if (pthread_create(&decoder_thread, NULL, decode_into_ring, ring) != 0) {
+            ret = MALLOC_ERROR;
+            break;
+        }
+        started = true;
+
+        /* Same layout as deserialize_item, read incrementally. */
+        while (ret == SUCCESS) {
+            const char *peek = NULL;
+            if (ring_wait(ring, &peek) == 0) break;
+
+            long item_size = 0;
+            Directory_item item = {0};
+            size_t fixed_size = 0;
+            ret = ring_read(ring, &item_size, sizeof(long));
+            if (ret == SUCCESS) ret = ring_read(ring, &item.is_dir, sizeof(bool));
+            if (ret != SUCCESS) break;
+            if (item.is_dir) {
+                ret = ring_read(ring, &item.perms, sizeof(int));
+                fixed_size = sizeof(bool) + sizeof(int);
+            } else {
+                ret = ring_read(ring, &item.file_size, sizeof(size_t));
+                fixed_size = sizeof(bool) + sizeof(size_t) + item.file_size;
+            }
+            if (ret != SUCCESS) break;
+            if (item_size <= (long)fixed_size || (size_t)item_size - fixed_size > STREAM_NAME_MAX) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+
+            size_t path_len = item_size - fixed_size;
+            path = malloc(path_len);
+            if (path == NULL) {
+                ret = MALLOC_ERROR;
+                break;
+            }
+            ret = ring_read(ring, path, path_len);
+            if (ret != SUCCESS) break;
+            path[path_len - 1] = '\0';
+
+            if (item.is_dir) {
+                item.dir_path = path;
+                ret = extract_directory(output_dir, &item, force, no_preserve_perms);
+            } else {
+                ret = restore_file(ring, output_dir, path, item.file_size, force);
+            }
+            free(path);
+            path = NULL;
+        }
+        break;
+    }
+
+    if (started) {
+        pthread_mutex_lock(&ring->lock);
+        ring->cancelled = true;
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+        pthread_join(decoder_thread, NULL);
+        // A decoding failure explains a short read better than the read itself.
+        if (ring->status != SUCCESS && (ret == SUCCESS || ret == FILE_READ_ERROR)) ret = ring->status;
+    }
+    free(path);
+    if (ring->buffer != NULL) munmap(ring->buffer, ring_size);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->changed);
+    free(ring);
+    return ret;
+}
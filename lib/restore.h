@@ -0,0 +1,12 @@
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Decoded bytes buffered between the decoder thread and the file writer.
+#define RESTORE_RING_SIZE (8 * 1024 * 1024)
+
+int restore_stream(const char *archive, size_t archive_size, size_t ring_size, char *output_dir, bool force, bool no_preserve_perms);
+
+#endif // RESTORE_H
@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+#include "search.h"
+#include "data_types.h"
+#include "cm.h"
+#include "file.h"
+#include "index.h"
+#include "stream.h"
+#include "throttle.h"
+#include "workers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include "debugmalloc.h"
+
+// Initial size of a worker's output buffer; it doubles (mremap) as matches come in.
+#define GREP_OUTPUT_SIZE (64 * 1024)
+
+// Where one member's content lies in the decoded payload.
+typedef struct {
+    size_t start;
+    size_t end;
+    const char *path;
+} Member_span;
+
+/*
+ * The patterns of one search; a line matches if it contains any of them. A single pattern is found with
+ * memmem; several are matched in one pass over the line that, at each byte, tries only the patterns
+ * starting with it.
+ */
+typedef struct {
+    const char *text[MAX_GREP_PATTERNS];
+    size_t length[MAX_GREP_PATTERNS];
+    int count;
+    unsigned short starting[256]; // Bit p is set when pattern p starts with the byte.
+} Grep_patterns;
+
+/*
+ * One search worker: decodes the payload from the first block of its range in GREP_CHUNK_SIZE pieces
+ * and reports the lines that start inside [start, end]. The line running across `start` belongs to the
+ * previous worker, which decodes past its own end to finish it. Buffers are mapped by the caller,
+ * except that the worker grows `out` with mremap.
+ */
+typedef struct {
+    const char *in;             // Header of the first block (or the whole file for the single-tree format).
+    size_t in_len;
+    bool blocked;
+    size_t start;
+    size_t end;
+    size_t data_len;
+    const Grep_patterns *patterns;
+    const Member_span *members;
+    size_t member_count;
+    Stream_decoder *decoder;
+    char *window;               // GREP_LINE_MAX + GREP_CHUNK_SIZE bytes: the unfinished line, then new output.
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    long matches;
+    int result;
+} Grep_worker;
+
+/*
+ * Appends "path:offset:line\n" to the worker's output. Returns false if the buffer cannot grow.
+ */
+static bool emit_line(Grep_worker *worker, const char *path, size_t offset, const char *line, size_t length) {
+    char position[32];
+    int position_len = snprintf(position, sizeof(position), ":%zu:", offset);
+    size_t path_len = strlen(path);
+    size_t needed = worker->out_len + path_len + position_len + length + 1;
+    if (needed > worker->out_cap) {
+        size_t cap = worker->out_cap;
+        while (cap < needed) cap *= 2;
+        char *grown = mremap(worker->out, worker->out_cap, cap, MREMAP_MAYMOVE);
+        if (grown == MAP_FAILED) return false;
+        worker->out = grown;
+        worker->out_cap = cap;
+    }
+    char *current = worker->out + worker->out_len;
+    memcpy(current, path, path_len);
+    memcpy(current + path_len, position, position_len);
+    memcpy(current + path_len + position_len, line, length);
+    current[path_len + position_len + length] = '\n';
+    worker->out_len = needed;
+    return true;
+}
+
+/*
+ * Returns true if the text contains any of the patterns.
+ */
+static bool contains_pattern(const Grep_patterns *patterns, const char *text, size_t length) {
+    if (patterns->count == 1) return memmem(text, length, patterns->text[0], patterns->length[0]) != NULL;
+    for (size_t i = 0; i < length; i++) {
+        unsigned int candidates = patterns->starting[(unsigned char)text[i]];
+        while (candidates != 0) {
+            int p = __builtin_ctz(candidates);
+            candidates &= candidates - 1;
+            if (patterns->length[p] <= length - i && memcmp(text + i, patterns->text[p], patterns->length[p]) == 0) return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Searches one line (or piece of one) starting at `offset` in the payload. A line can run across the
+ * gap between two members of a directory, so every member's part of it is matched and printed on its own.
+ */
+static void search_line(Grep_worker *worker, size_t offset, const char *line, size_t length) {
+    size_t low = 0;
+    size_t high = worker->member_count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (worker->members[middle].end <= offset) low = middle + 1;
+        else high = middle;
+    }
+    for (size_t i = low; i < worker->member_count && worker->members[i].start < offset + length; i++) {
+        const Member_span *member = &worker->members[i];
+        size_t from = member->start > offset ? member->start : offset;
+        size_t to = member->end < offset + length ? member->end : offset + length;
+        if (to <= from || !contains_pattern(worker->patterns, line + (from - offset), to - from)) continue;
+        if (!emit_line(worker, member->path, from - member->start, line + (from - offset), to - from)) {
+            worker->result = MALLOC_ERROR;
+            return;
+        }
+        worker->matches++;
+    }
+}
+
+static void *grep_range(void *arg) {
+    Grep_worker *worker = arg;
+    size_t consumed = 0;
+    size_t window_start = worker->start; // Payload offset of window[0].
+    size_t window_len = 0;
+    bool skipping = worker->start > 0;
+    bool continued = false;
+    bool finished = false;
+    bool done = false;
+    worker->result = SUCCESS;
+
+    if (worker->blocked) {
+        stream_decoder_seek(worker->decoder, worker->start, worker->data_len);
+    } else {
+        stream_decoder_init(worker->decoder);
+    }
+
+    while (!finished && worker->result == SUCCESS) {
+        size_t in_used = 0;
+        size_t out_len = 0;
+        if (!done) {
+            int status = stream_decode(worker->decoder, worker->in + consumed, worker->in_len - consumed, &in_used,
+                                       worker->window + window_len, GREP_CHUNK_SIZE, &out_len, &done);
+            if (status < 0 || (!done && in_used == 0 && out_len == 0)) {
+                worker->result = DECOMPRESSION_ERROR;
+                break;
+            }
+            consumed += in_used;
+        }
+        bool last = done;
+
+        /* Up to the first newline at or after start, the text belongs to the previous worker. */
+        if (skipping) {
+            char *newline = memchr(worker->window, '\n', out_len);
+            size_t dropped = (newline != NULL) ? (size_t)(newline - worker->window) + 1 : out_len;
+            memmove(worker->window, worker->window + dropped, out_len - dropped);
+            window_start += dropped;
+            out_len -= dropped;
+            skipping = (newline == NULL);
+        }
+        window_len += out_len;
+
+        /* A piece of an over-long line keeps its line going past end, like the rest of that line. */
+        size_t line = 0;
+        while (true) {
+            size_t line_offset = window_start + line;
+            if (line_offset >= worker->data_len || (!continued && line_offset > worker->end)) {
+                finished = true;
+                break;
+            }
+            char *newline = memchr(worker->window + line, '\n', window_len - line);
+            size_t length = (newline != NULL) ? (size_t)(newline - worker->window) - line : window_len - line;
+            if (newline == NULL && length < GREP_LINE_MAX && !last) break;
+            if (length > GREP_LINE_MAX) length = GREP_LINE_MAX;
+            search_line(worker, line_offset, worker->window + line, length);
+            if (worker->result != SUCCESS) break;
+            continued = (worker->window + line + length != newline);
+            line += length + (continued ? 0 : 1);
+        }
+        memmove(worker->window, worker->window + line, window_len - line);
+        window_start += line;
+        window_len -= line;
+    }
+    stream_decoder_release(worker->decoder); // Workers stop at end, usually inside a block.
+    return NULL;
+}
+
+/*
+ * Locates every file's content in a serialized directory from the archive's member index,
+ * following the item layout of serialize_item. Fills spans (count entries) and checks the sizes add up.
+ */
+static int index_spans(const Member_index *index, size_t data_len, Member_span *spans, size_t *span_count) {
+    size_t offset = 0;
+    *span_count = 0;
+    for (size_t i = 0; i < index->count; i++) {
+        const Index_entry *entry = &index->entries[i];
+        offset += sizeof(long) + sizeof(bool) + (entry->is_dir ? sizeof(int) : sizeof(size_t)) + strlen(entry->path) + 1;
+        if (entry->is_dir) continue;
+        spans[(*span_count)++] = (Member_span){offset, offset + entry->size, entry->path};
+        offset += entry->size;
+    }
+    return offset == data_len ? SUCCESS : FILE_READ_ERROR;
+}
+
+/*
+ * Prints every line of the archive that contains one of the patterns (1 to MAX_GREP_PATTERNS non-empty
+ * strings) as "member:offset:line", where offset is the line's byte offset inside the member. Block-format
+ * archives are searched by up to worker_count threads, each decoding a contiguous run of blocks one
+ * cache-sized chunk at a time; nothing is written to disk.
+ * Directory archives need their member index to name the members.
+ * Returns the number of lines printed or a negative code (NO_INDEX, FILE_READ_ERROR, ...).
+ */
+long grep_archive(char *file_name, char **patterns, int pattern_count, int worker_count, FILE *out) {
+    long ret = SUCCESS;
+    Compressed_file compressed = {0};
+    const char *mmap_ptr = NULL;
+    Member_index index = {0};
+    Member_span *spans = NULL;
+    size_t span_count = 0;
+    Grep_worker workers[MAX_GREP_WORKERS];
+    int started = 0;
+    size_t window_size = GREP_LINE_MAX + GREP_CHUNK_SIZE;
+
+    Grep_patterns matcher = {0};
+    for (int p = 0; p < pattern_count; p++) {
+        matcher.text[p] = patterns[p];
+        matcher.length[p] = strlen(patterns[p]);
+        matcher.starting[(unsigned char)patterns[p][0]] |= 1 << p;
+    }
+    matcher.count = pattern_count;
+
+    long file_size = read_compressed(file_name, &compressed, &mmap_ptr);
+    if (file_size < 0) return file_size;
+    if (worker_count < 1) worker_count = 1;
+    if (worker_count > MAX_GREP_WORKERS) worker_count = MAX_GREP_WORKERS;
+
+    while (true) {
+        if (compressed.is_dir) {
+            ret = read_index(file_name, &index);
+            if (ret != SUCCESS) break;
+            spans = malloc(index.count * sizeof(Member_span));
+            if (spans == NULL) {
+                ret = MALLOC_ERROR;
+                break;
+            }
+            ret = index_spans(&index, compressed.original_size, spans, &span_count);
+            if (ret != SUCCESS) break;
+        } else {
+            spans = malloc(sizeof(Member_span));
+            if (spans == NULL) {
+                ret = MALLOC_ERROR;
+                break;
+            }
+            const char *base = strrchr(compressed.original_file, '/');
+            spans[0] = (Member_span){0, compressed.original_size, (base != NULL) ? base + 1 : compressed.original_file};
+            span_count = 1;
+        }
+
+        /* Give each worker a contiguous run of blocks holding about an equal share of the payload. */
+        Grep_worker plan = {0};
+        plan.patterns = &matcher;
+        plan.members = spans;
+        plan.member_count = span_count;
+        plan.data_len = compressed.original_size;
+        plan.blocked = memcmp(compressed.magic, block_magic, sizeof(block_magic)) == 0;
+        if (!plan.blocked) {
+            workers[started] = plan;
+            workers[started].in = mmap_ptr;
+            workers[started].in_len = file_size;
+            started++;
+        } else {
+            // A worker decoding a context-mixed block maps a model of its own; no more run than the budget holds.
+            for (const char *block = compressed.block_data; block + sizeof(Block_header) <= compressed.block_data + compressed.block_data_size;) {
+                Block_header header;
+                memcpy(&header, block, sizeof(Block_header));
+                if (header.method == BLOCK_CM) {
+                    int models = cm_model_limit(worker_count);
+                    worker_count = (models >= 1) ? models : 1;
+                    break;
+                }
+                if (header.payload_size > compressed.block_data_size) break;
+                block += sizeof(Block_header) + header.payload_size;
+            }
+            size_t share = (compressed.original_size + worker_count - 1) / worker_count;
+            size_t last_share = 0;
+            size_t produced = 0;
+            const char *current = compressed.block_data;
+            const char *end = compressed.block_data + compressed.block_data_size;
+            while (produced < compressed.original_size) {
+                Block_header header;
+                if ((size_t)(end - current) < sizeof(Block_header)) {
+                    ret = DECOMPRESSION_ERROR;
+                    break;
+                }
+                memcpy(&header, current, sizeof(Block_header));
+                if (header.payload_size > (size_t)(end - current) - sizeof(Block_header) || header.raw_size == 0) {
+                    ret = DECOMPRESSION_ERROR;
+                    break;
+                }
+                if (started == 0 || (produced / share > last_share && started < worker_count)) {
+                    workers[started] = plan;
+                    workers[started].in = current;
+                    workers[started].in_len = end - current;
+                    workers[started].start = produced;
+                    started++;
+                    last_share = produced / share;
+                }
+                produced += header.raw_size;
+                current += sizeof(Block_header) + header.payload_size;
+            }
+            if (ret != SUCCESS) break;
+        }
+        for (int i = 0; i < started; i++) {
+            workers[i].end = (i + 1 < started) ? workers[i + 1].start : compressed.original_size;
+            workers[i].decoder = MAP_FAILED;
+            workers[i].window = MAP_FAILED;
+            workers[i].out = MAP_FAILED;
+        }
+        for (int i = 0; i < started && ret == SUCCESS; i++) {
+            workers[i].decoder = mmap(NULL, sizeof(Stream_decoder), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            workers[i].window = mmap(NULL, window_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            workers[i].out = mmap(NULL, GREP_OUTPUT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            workers[i].out_cap = GREP_OUTPUT_SIZE;
+            if (workers[i].decoder == MAP_FAILED || workers[i].window == MAP_FAILED || workers[i].out == MAP_FAILED) {
+                ret = MALLOC_ERROR;
+            }
+        }
+        if (ret != SUCCESS) break;
+
+        run_workers(started, grep_range, workers, sizeof(Grep_worker));
+        long matches = 0;
+        for (int i = 0; i < started; i++) {
+            if (workers[i].result != SUCCESS) ret = workers[i].result;
+            matches += workers[i].matches;
+        }
+        if (ret != SUCCESS) break;
+        /* Workers cover the payload in order, so their outputs concatenate in file order. */
+        for (int i = 0; i < started; i++) {
+            if (fwrite(workers[i].out, 1, workers[i].out_len, out) != workers[i].out_len) ret = FILE_WRITE_ERROR;
+        }
+        if (ret != SUCCESS) break;
+        ret = matches;
+        break;
+    }
+
+    for (int i = 0; i < started; i++) {
+        if (workers[i].decoder != NULL && workers[i].decoder != MAP_FAILED) munmap(workers[i].decoder, sizeof(Stream_decoder));
+        if (workers[i].window != NULL && workers[i].window != MAP_FAILED) munmap(workers[i].window, window_size);
+        if (workers[i].out != NULL && workers[i].out != MAP_FAILED) munmap(workers[i].out, workers[i].out_cap);
+    }
+    free(spans);
+    free_index(&index);
+    munmap((void *)mmap_ptr, file_size);
+    free(compressed.file_name);
+    free(compressed.original_file);
+    return ret;
+}
+
+/*
+ * Searches args.input_file for the --grep patterns on every allowed CPU and prints the matching lines.
+ * Returns 0 when a line matched, 1 when none did, or a negative code on failure.
+ */
+int run_grep(Arguments args) {
+    long matches = grep_archive(args.input_file, args.grep_patterns, args.grep_pattern_count, max_workers(), stdout);
+    if (matches == NO_INDEX) {
+        fprintf(stderr, "The archive (%s) has no member index; compress it again to search it.\n", args.input_file);
+    } else if (matches == MALLOC_ERROR) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+    } else if (matches == FILE_MAGIC_ERROR) {
+        fprintf(stderr, "The file (%s) is not a compressed file.\n", args.input_file);
+    } else if (matches < 0) {
+        fprintf(stderr, "Failed to search the archive (%s).\n", args.input_file);
+    }
+    if (matches < 0) return (int)matches;
+    return matches > 0 ? SUCCESS : 1;
+}
@@ -0,0 +1,17 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "data_types.h"
+#include <stdio.h>
+
+// Decoded bytes each search worker scans at a time, sized to stay in the L2 cache.
+#define GREP_CHUNK_SIZE (256 * 1024)
+// Longer lines are searched (and printed) in pieces of this length.
+#define GREP_LINE_MAX (64 * 1024)
+// Most workers a single search is spread over.
+#define MAX_GREP_WORKERS 64
+
+long grep_archive(char *file_name, char **patterns, int pattern_count, int worker_count, FILE *out);
+int run_grep(Arguments args);
+
+#endif // SEARCH_H
@@ -0,0 +1,463 @@
+#include "stream.h"
+#include "data_types.h"
+#include "decompress.h"
+#include "compress.h"
+#include "block.h"
+#include "cm.h"
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include "debugmalloc.h"
+
+/*
+ * Resets the decoder to expect the start of a compressed file.
+ */
+void stream_decoder_init(Stream_decoder *decoder) {
+    decoder->stage = STREAM_MAGIC;
+    decoder->field_used = 0;
+    decoder->blocked = false;
+    decoder->is_dir = false;
+    decoder->original_size = 0;
+    decoder->name_len = 0;
+    decoder->original_file[0] = '\0';
+    decoder->tree_size = 0;
+    decoder->data_size = 0;
+    decoder->blocks_size = 0;
+    decoder->block_end = 0;
+    decoder->width = 0;
+    decoder->bit_buffer = 0;
+    decoder->bit_count = 0;
+    decoder->bits_loaded = 0;
+    decoder->produced = 0;
+    decoder->partial_node = -1;
+    decoder->cm.model = NULL;
+    decoder->whole_payload = NULL;
+    decoder->whole_raw = NULL;
+    decoder->pause_stored = false;
+}
+
+/*
+ * Payload bytes left in the stored block the decoder is inside, which a caller holding the archive in a file
+ * may move itself and then account for with stream_skip_stored; 0 outside stored blocks.
+ * With pause_stored set, stream_decode returns at the start of every stored block so all of it can be moved.
+ */
+size_t stream_stored_left(const Stream_decoder *decoder) {
+    return decoder->stage == STREAM_STORED ? decoder->block_end - decoder->produced : 0;
+}
+
+// Accounts for length payload bytes of the current stored block that the caller moved itself.
+void stream_skip_stored(Stream_decoder *decoder, size_t length) {
+    decoder->produced += length;
+    if (decoder->produced == decoder->block_end) decoder->stage = STREAM_BLOCK_HEADER;
+}
+
+/*
+ * Frees what the decoder holds inside a context-mixed block or one decoded whole. Needed only when a decoder
+ * is abandoned midway (finishing or failing releases it already); harmless at any other time.
+ */
+void stream_decoder_release(Stream_decoder *decoder) {
+    cm_decoder_end(&decoder->cm);
+    if (decoder->whole_payload != NULL) munmap(decoder->whole_payload, decoder->block.payload_size);
+    if (decoder->whole_raw != NULL) munmap(decoder->whole_raw, decoder->block.raw_size);
+    decoder->whole_payload = NULL;
+    decoder->whole_raw = NULL;
+}
+
+// Maps size bytes for a block decoded whole, or returns NULL.
+static void *map_whole(size_t size) {
+    void *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mapped == MAP_FAILED ? NULL : mapped;
+}
+
+/*
+ * Positions a decoder inside the block data of a block-format file: the next input it is given must be the
+ * header of the block that starts `produced` bytes into the original data, and it stops after `end` bytes.
+ * Lets several decoders work through different blocks of one file at the same time.
+ */
+void stream_decoder_seek(Stream_decoder *decoder, size_t produced, size_t end) {
+    stream_decoder_init(decoder);
+    decoder->blocked = true;
+    decoder->original_size = end;
+    decoder->produced = produced;
+    decoder->stage = STREAM_BLOCK_HEADER;
+}
+
+/*
+ * Copies up to `size` bytes of the current field from the input into dest (may be NULL to skip them).
+ * Returns true once the whole field has been gathered, resetting the field counter.
+ */
+static bool gather(Stream_decoder *decoder, void *dest, size_t size, const char *in, size_t in_len, size_t *pos) {
+    size_t take = size - decoder->field_used;
+    if (take > in_len - *pos) take = in_len - *pos;
+    if (dest != NULL) memcpy((char *)dest + decoder->field_used, in + *pos, take);
+    decoder->field_used += take;
+    *pos += take;
+    if (decoder->field_used < size) return false;
+    decoder->field_used = 0;
+    return true;
+}
+
+static void consume_bits(Stream_decoder *decoder, int count) {
+    decoder->bit_buffer <<= count;
+    decoder->bit_count -= count;
+}
+
+/*
+ * Decodes payload bits up to block_end until the output is full, the input runs out, or the data is complete.
+ * Sets *complete once every bit has been read and block_end reached.
+ * Returns SUCCESS, or DECOMPRESSION_ERROR if the bits end in the middle of a code.
+ */
+static int decode_payload(Stream_decoder *decoder, const char *in, size_t in_len, size_t *pos, char *out, size_t out_cap, size_t *out_pos,
+                          bool *complete) {
+    const Node *tree = decoder->tree;
+    size_t root = decoder->tree_size / sizeof(Node) - 1;
+
+    while (decoder->produced < decoder->block_end) {
+        while (decoder->bit_count <= 56 && decoder->bits_loaded < decoder->data_size && *pos < in_len) {
+            size_t valid = decoder->data_size - decoder->bits_loaded < 8 ? decoder->data_size - decoder->bits_loaded : 8;
+            unsigned long long byte = (unsigned char)in[(*pos)++] & (0xFF << (8 - valid));
+            decoder->bit_buffer |= byte << (56 - decoder->bit_count);
+            decoder->bit_count += valid;
+            decoder->bits_loaded += valid;
+        }
+        bool exhausted = decoder->bits_loaded == decoder->data_size;
+        if (*out_pos == out_cap) return SUCCESS;
+
+        int symbol = -1;
+        if (decoder->width == 0) {
+            // Single-symbol tree: every bit stands for one byte.
+            if (decoder->bit_count >= 1) {
+                consume_bits(decoder, 1);
+                symbol = (unsigned char)tree[root].data;
+            }
+        } else if (decoder->partial_node >= 0) {
+            // Resume the bitwise walk of a code longer than the table.
+            while (decoder->bit_count > 0 && tree[decoder->partial_node].type != LEAF) {
+                bool bit = decoder->bit_buffer >> 63;
+                consume_bits(decoder, 1);
+                decoder->partial_node = bit ? tree[decoder->partial_node].right : tree[decoder->partial_node].left;
+            }
+            if (tree[decoder->partial_node].type == LEAF) {
+                symbol = (unsigned char)tree[decoder->partial_node].data;
+                decoder->partial_node = -1;
+            }
+        } else {
+            // Missing low bits read as zeros; the entry is still right if its code fits in the valid bits.
+            Decode_entry entry = decoder->table[decoder->bit_buffer >> (64 - decoder->width)];
+            if (entry.length > 0 && entry.length <= decoder->bit_count) {
+                consume_bits(decoder, entry.length);
+                symbol = entry.value;
+            } else if (entry.length == 0 && decoder->bit_count >= decoder->width) {
+                consume_bits(decoder, decoder->width);
+                decoder->partial_node = entry.value;
+                continue;
+            }
+        }
+
+        if (symbol >= 0) {
+            out[(*out_pos)++] = (char)symbol;
+            decoder->produced++;
+        } else if (exhausted) {
+            return DECOMPRESSION_ERROR;
+        } else if (*pos == in_len) {
+            return SUCCESS;
+        }
+    }
+
+    /* Skip the padding of the last byte(s) so in_used ends exactly after the stream. */
+    while (decoder->bits_loaded < decoder->data_size && *pos < in_len) {
+        size_t valid = decoder->data_size - decoder->bits_loaded < 8 ? decoder->data_size - decoder->bits_loaded : 8;
+        decoder->bits_loaded += valid;
+        (*pos)++;
+    }
+    *complete = decoder->bits_loaded == decoder->data_size;
+    return SUCCESS;
+}
+
+/*
+ * Feeds the next chunk of a compressed file to the decoder and decodes into out as far as possible.
+ * Input and output may be split at any byte; the decoder keeps all state between calls.
+ * Sets *in_used to the input bytes consumed, *out_len to the bytes written, and *done once the whole
+ * file is decoded (until then SUCCESS means it needs more input or output room).
+ * Returns SUCCESS or a negative code (FILE_MAGIC_ERROR, DECOMPRESSION_ERROR, MALLOC_ERROR) for invalid data.
+ */
+int stream_decode(Stream_decoder *decoder, const char *in, size_t in_len, size_t *in_used, char *out, size_t out_cap, size_t *out_len,
+                  bool *done) {
+    size_t pos = 0;
+    size_t out_pos = 0;
+    int ret = SUCCESS;
+    bool waiting = false;
+    *done = false;
+
+    while (!waiting && ret == SUCCESS) {
+        switch (decoder->stage) {
+            case STREAM_MAGIC:
+                if (!(waiting = !gather(decoder, decoder->field, sizeof(magic), in, in_len, &pos))) {
+                    decoder->blocked = memcmp(decoder->field, block_magic, sizeof(block_magic)) == 0;
+                    if (!decoder->blocked && memcmp(decoder->field, magic, sizeof(magic)) != 0) ret = FILE_MAGIC_ERROR;
+                    decoder->stage = STREAM_IS_DIR;
+                }
+                break;
+            case STREAM_IS_DIR:
+                if (!(waiting = !gather(decoder, &decoder->is_dir, sizeof(bool), in, in_len, &pos))) {
+                    decoder->stage = STREAM_ORIGINAL_SIZE;
+                }
+                break;
+            case STREAM_ORIGINAL_SIZE:
+                if (!(waiting = !gather(decoder, &decoder->original_size, sizeof(size_t), in, in_len, &pos))) {
+                    decoder->stage = STREAM_NAME_LENGTH;
+                }
+                break;
+            case STREAM_NAME_LENGTH:
+                if (!(waiting = !gather(decoder, &decoder->name_len, sizeof(long), in, in_len, &pos))) {
+                    if (decoder->name_len < 0) ret = FILE_MAGIC_ERROR;
+                    decoder->stage = STREAM_NAME;
+                }
+                break;
+            case STREAM_NAME: {
+                /* Keep what fits in the name buffer, skip the rest. */
+                size_t name_len = decoder->name_len;
+                size_t kept = name_len < STREAM_NAME_MAX - 1 ? name_len : STREAM_NAME_MAX - 1;
+                size_t take = name_len - decoder->field_used;
+                if (take > in_len - pos) take = in_len - pos;
+                if (decoder->field_used < kept) {
+                    size_t copy = take < kept - decoder->field_used ? take : kept - decoder->field_used;
+                    memcpy(decoder->original_file + decoder->field_used, in + pos, copy);
+                }
+                decoder->field_used += take;
+                pos += take;
+                if (decoder->field_used < name_len) {
+                    waiting = true;
+                    break;
+                }
+                decoder->original_file[kept] = '\0';
+                decoder->field_used = 0;
+                decoder->stage = decoder->blocked ? STREAM_BLOCKS_SIZE : STREAM_TREE_SIZE;
+                break;
+            }
+            case STREAM_TREE_SIZE:
+                if (!(waiting = !gather(decoder, &decoder->tree_size, sizeof(size_t), in, in_len, &pos))) {
+                    size_t node_count = decoder->tree_size / sizeof(Node);
+                    if (decoder->tree_size % sizeof(Node) != 0 || node_count == 0 || node_count > 2 * 256 - 1) {
+                        ret = DECOMPRESSION_ERROR;
+                    }
+                    decoder->stage = STREAM_TREE;
+                }
+                break;
+            case STREAM_TREE:
+                if (!(waiting = !gather(decoder, decoder->tree, decoder->tree_size, in, in_len, &pos))) {
+                    size_t node_count = decoder->tree_size / sizeof(Node);
+                    decoder->width = 0;
+                    if (decoder->tree[node_count - 1].type != LEAF) {
+                        decoder->width = prepare_decode_table(decoder->tree, node_count, decoder->table);
+                        if (decoder->width < 0) ret = DECOMPRESSION_ERROR;
+                    }
+                    decoder->stage = STREAM_DATA_SIZE;
+                }
+                break;
+            case STREAM_DATA_SIZE:
+                if (!(waiting = !gather(decoder, &decoder->data_size, sizeof(size_t), in, in_len, &pos))) {
+                    decoder->block_end = decoder->original_size;
+                    decoder->stage = STREAM_DATA;
+                }
+                break;
+            case STREAM_DATA: {
+                bool complete = false;
+                ret = decode_payload(decoder, in, in_len, &pos, out, out_cap, &out_pos, &complete);
+                waiting = !complete;
+                if (complete) decoder->stage = decoder->blocked ? STREAM_BLOCK_HEADER : STREAM_DONE;
+                break;
+            }
+            case STREAM_BLOCKS_SIZE:
+                if (!(waiting = !gather(decoder, &decoder->blocks_size, sizeof(size_t), in, in_len, &pos))) {
+                    decoder->stage = STREAM_BLOCK_HEADER;
+                }
+                break;
+            case STREAM_BLOCK_HEADER:
+                if (decoder->produced == decoder->original_size) {
+                    decoder->stage = STREAM_DONE;
+                    break;
+                }
+                if (!(waiting = !gather(decoder, &decoder->block, sizeof(Block_header), in, in_len, &pos))) {
+                    Block_header *block = &decoder->block;
+                    decoder->block_end = decoder->produced + block->raw_size;
+                    if (block->raw_size > decoder->original_size - decoder->produced) {
+                        ret = DECOMPRESSION_ERROR;
+                    } else if (block->flags != 0 || block->method == BLOCK_INFLATED || block->method == BLOCK_WORDS) {
+                        /*
+                         * Filtered blocks are unfiltered and inflated ones deflated back in one go, and word-coded
+                         * ones refer to their dictionary, so these are gathered and decoded whole (see decode_block)
+                         * before they are handed out.
+                         */
+                        if (block->payload_size == 0 || block->payload_size > block->raw_size
+                            || (block->method == BLOCK_INFLATED && block->raw_size > DEFLATE_INFLATED_MAX)) {
+                            ret = DECOMPRESSION_ERROR;
+                        } else {
+                            decoder->whole_payload = map_whole(block->payload_size);
+                            decoder->whole_raw = map_whole(block->raw_size);
+                            if (decoder->whole_payload == NULL || decoder->whole_raw == NULL) ret = MALLOC_ERROR;
+                            decoder->stage = STREAM_WHOLE_PAYLOAD;
+                        }
+                    } else if (block->method == BLOCK_STORED && block->payload_size == block->raw_size) {
+                        decoder->stage = STREAM_STORED;
+                        waiting = decoder->pause_stored;
+                    } else if (block->method == BLOCK_FILL && block->payload_size == 1) {
+                        decoder->stage = STREAM_FILL_BYTE;
+                    } else if ((block->method == BLOCK_HUFFMAN || block->method == BLOCK_LANES) && block->payload_size >= PACKED_LENGTHS_SIZE) {
+                        decoder->stage = STREAM_LENGTHS;
+                    } else if (block->method == BLOCK_CM) {
+                        ret = cm_decoder_start(&decoder->cm, block->payload_size);
+                        decoder->stage = STREAM_CM;
+                    } else {
+                        ret = DECOMPRESSION_ERROR;
+                    }
+                }
+                break;
+            case STREAM_LENGTHS:
+                if (!(waiting = !gather(decoder, decoder->packed_lengths, PACKED_LENGTHS_SIZE, in, in_len, &pos))) {
+                    unsigned char lengths[256];
+                    unpack_lengths(decoder->packed_lengths, lengths);
+                    long node_count = build_canonical_tree(lengths, decoder->tree);
+                    decoder->width = (node_count > 0) ? prepare_decode_table(decoder->tree, node_count, decoder->table) : -1;
+                    if (decoder->width < 0) ret = DECOMPRESSION_ERROR;
+                    decoder->tree_size = node_count * sizeof(Node);
+                    decoder->data_size = (decoder->block.payload_size - PACKED_LENGTHS_SIZE) * 8;
+                    decoder->bit_buffer = 0;
+                    decoder->bit_count = 0;
+                    decoder->bits_loaded = 0;
+                    decoder->partial_node = -1;
+                    decoder->stage = STREAM_DATA;
+                    if (decoder->block.method == BLOCK_LANES) {
+                        if (node_count < 3) ret = DECOMPRESSION_ERROR;
+                        decoder->segments_left = decoder->block.payload_size - PACKED_LENGTHS_SIZE;
+                        decoder->stage = STREAM_SEGMENT_HEADER;
+                    }
+                }
+                break;
+            case STREAM_SEGMENT_HEADER:
+                if (decoder->produced == decoder->block_end) {
+                    if (decoder->segments_left != 0) ret = DECOMPRESSION_ERROR;
+                    decoder->stage = STREAM_BLOCK_HEADER;
+                    break;
+                }
+                if (!(waiting = !gather(decoder, decoder->segment, LANE_SEGMENT_HEADER, in, in_len, &pos))) {
+                    size_t symbols = decoder->block_end - decoder->produced;
+                    if (symbols > LANE_SEGMENT_SYMBOLS) symbols = LANE_SEGMENT_SYMBOLS;
+                    long size = open_segment(decoder->segment, symbols, &decoder->lanes);
+                    if (size < 0 || (size_t)size > decoder->segments_left) ret = DECOMPRESSION_ERROR;
+                    decoder->stage = STREAM_SEGMENT;
+                }
+                break;
+            case STREAM_SEGMENT:
+                /* The lanes are decoded side by side, so the whole segment is gathered first. */
+                if (!(waiting = !gather(decoder, decoder->segment + LANE_SEGMENT_HEADER, decoder->lanes.size - LANE_SEGMENT_HEADER, in, in_len, &pos))) {
+                    decoder->segments_left -= decoder->lanes.size;
+                    decoder->stage = STREAM_LANES;
+                }
+                break;
+            case STREAM_LANES: {
+                long written = decode_segment(decoder->segment, &decoder->lanes, decoder->tree, decoder->table, decoder->width,
+                                              out + out_pos, out_cap - out_pos);
+                if (written < 0) {
+                    ret = DECOMPRESSION_ERROR;
+                    break;
+                }
+                out_pos += written;
+                decoder->produced += written;
+                if (decoder->lanes.done == decoder->lanes.symbols) {
+                    decoder->stage = STREAM_SEGMENT_HEADER;
+                } else {
+                    waiting = true;
+                }
+                break;
+            }
+            case STREAM_CM: {
+                size_t count = decoder->block_end - decoder->produced;
+                if (count > out_cap - out_pos) count = out_cap - out_pos;
+                size_t used = 0;
+                size_t written = cm_decode(&decoder->cm, (const unsigned char *)in + pos, in_len - pos, &used, out + out_pos, count);
+                pos += used;
+                out_pos += written;
+                decoder->produced += written;
+                if (decoder->produced == decoder->block_end) {
+                    cm_decoder_end(&decoder->cm);
+                    decoder->stage = STREAM_CM_TAIL;
+                } else {
+                    waiting = true;
+                }
+                break;
+            }
+            case STREAM_CM_TAIL:
+                // The last bytes of the arithmetic code may not have been needed to decode the block.
+                if (!(waiting = !gather(decoder, NULL, decoder->cm.payload_left, in, in_len, &pos))) {
+                    decoder->stage = STREAM_BLOCK_HEADER;
+                }
+                break;
+            case STREAM_WHOLE_PAYLOAD:
+                if (!(waiting = !gather(decoder, decoder->whole_payload, decoder->block.payload_size, in, in_len, &pos))) {
+                    ret = decode_block(&decoder->block, decoder->whole_payload, decoder->whole_raw);
+                    munmap(decoder->whole_payload, decoder->block.payload_size);
+                    decoder->whole_payload = NULL;
+                    decoder->stage = STREAM_WHOLE;
+                }
+                break;
+            case STREAM_WHOLE: {
+                size_t left = decoder->block_end - decoder->produced;
+                size_t length = left < out_cap - out_pos ? left : out_cap - out_pos;
+                memcpy(out + out_pos, decoder->whole_raw + decoder->block.raw_size - left, length);
+                out_pos += length;
+                decoder->produced += length;
+                if (decoder->produced == decoder->block_end) {
+                    munmap(decoder->whole_raw, decoder->block.raw_size);
+                    decoder->whole_raw = NULL;
+                    decoder->stage = STREAM_BLOCK_HEADER;
+                } else {
+                    waiting = true;
+                }
+                break;
+            }
+            case STREAM_STORED: {
+                size_t length = decoder->block_end - decoder->produced;
+                if (length > in_len - pos) length = in_len - pos;
+                if (length > out_cap - out_pos) length = out_cap - out_pos;
+                memcpy(out + out_pos, in + pos, length);
+                pos += length;
+                out_pos += length;
+                decoder->produced += length;
+                if (decoder->produced == decoder->block_end) {
+                    decoder->stage = STREAM_BLOCK_HEADER;
+                } else {
+                    waiting = true;
+                }
+                break;
+            }
+            case STREAM_FILL_BYTE:
+                if (!(waiting = !gather(decoder, decoder->field, 1, in, in_len, &pos))) {
+                    decoder->stage = STREAM_FILL;
+                }
+                break;
+            case STREAM_FILL: {
+                size_t length = decoder->block_end - decoder->produced;
+                if (length > out_cap - out_pos) length = out_cap - out_pos;
+                memset(out + out_pos, decoder->field[0], length);
+                out_pos += length;
+                decoder->produced += length;
+                if (decoder->produced == decoder->block_end) {
+                    decoder->stage = STREAM_BLOCK_HEADER;
+                } else {
+                    waiting = true;
+                }
+                break;
+            }
+            case STREAM_DONE:
+                *done = true;
+                waiting = true;
+                break;
+        }
+    }
+
+    if (ret < 0) stream_decoder_release(decoder);
+    *in_used = pos;
+    *out_len = out_pos;
+    return ret;
+}
@@ -0,0 +1,16 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "data_types.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+void stream_decoder_init(Stream_decoder *decoder);
+void stream_decoder_seek(Stream_decoder *decoder, size_t produced, size_t end);
+void stream_decoder_release(Stream_decoder *decoder);
+size_t stream_stored_left(const Stream_decoder *decoder);
+void stream_skip_stored(Stream_decoder *decoder, size_t length);
+int stream_decode(Stream_decoder *decoder, const char *in, size_t in_len, size_t *in_used, char *out, size_t out_cap, size_t *out_len,
+                  bool *done);
+
+#endif // STREAM_H
@@ -0,0 +1,171 @@
+#include "table_cache.h"
+#include "data_types.h"
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "debugmalloc.h"
+
+// Number of distinct code-length signatures kept; the least recently used one is replaced.
+#define TABLE_CACHE_SLOTS 16
+// Entries per cached decode table (the widest table the decoders use).
+#define TABLE_CACHE_DECODE_ENTRIES (1 << MAX_TABLE_BITS)
+
+typedef struct {
+    bool valid;
+    unsigned long long hash;
+    unsigned long long last_used;
+    unsigned char lengths[256];
+    int width;
+    Decode_entry decode[TABLE_CACHE_DECODE_ENTRIES];
+    Huffman_code encode[256];
+} Table_cache_entry;
+
+/*
+ * Process-wide cache shared by every thread; lives in static storage so it never touches the heap.
+ */
+static struct {
+    pthread_mutex_t lock;
+    unsigned long long clock;
+    Table_cache_entry entries[TABLE_CACHE_SLOTS];
+} cache = { PTHREAD_MUTEX_INITIALIZER, 0, {{0}} };
+
+// FNV-1a over the code-length vector.
+static unsigned long long hash_lengths(const unsigned char *lengths) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < 256; i++) {
+        hash = (hash ^ lengths[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Checks a tree read from an archive in one linear pass before anything walks it: every branch points
+ * at two nodes before it, and every node but the root (the last) is the child of exactly one branch.
+ * A walk of a tree that passes visits each node once, so a crafted tree whose branches share children
+ * cannot make it take exponential time.
+ */
+bool valid_tree(const Node *tree, size_t node_count) {
+    unsigned char parents[2 * 256 - 1] = {0};
+    if (node_count == 0 || node_count > 2 * 256 - 1) return false;
+    for (size_t i = 0; i < node_count; i++) {
+        if (tree[i].type == LEAF) continue;
+        if (tree[i].type != BRANCH || tree[i].left < 0 || tree[i].right < 0
+            || (size_t)tree[i].left >= i || (size_t)tree[i].right >= i) {
+            return false;
+        }
+        if (parents[tree[i].left]++ != 0 || parents[tree[i].right]++ != 0) return false;
+    }
+    for (size_t i = 0; i + 1 < node_count; i++) {
+        if (parents[i] != 1) return false;
+    }
+    return true;
+}
+
+static int walk_codes(const Node *tree, size_t node_count, size_t index, unsigned int bits, int depth, Huffman_code *codes) {
+    if (index >= node_count || depth > 32) return -1;
+    const Node *node = &tree[index];
+    if (node->type == LEAF) {
+        codes[(unsigned char)node->data].bits = bits;
+        codes[(unsigned char)node->data].length = depth;
+        return 0;
+    }
+    if (walk_codes(tree, node_count, node->left, bits << 1, depth + 1, codes) != 0) return -1;
+    return walk_codes(tree, node_count, node->right, (bits << 1) | 1, depth + 1, codes);
+}
+
+/*
+ * Assigns canonical codes to the lengths: shorter codes first, ties in byte order.
+ */
+void canonical_codes(const unsigned char *lengths, Huffman_code *codes) {
+    unsigned int count[34] = {0};
+    unsigned int next[34] = {0};
+    for (int i = 0; i < 256; i++) {
+        if (lengths[i] <= 32) count[lengths[i]]++;
+    }
+    count[0] = 0;
+    for (int length = 1; length <= 32; length++) {
+        next[length] = (next[length - 1] + count[length - 1]) << 1;
+    }
+    for (int i = 0; i < 256; i++) {
+        codes[i].length = lengths[i];
+        codes[i].bits = lengths[i] > 0 ? next[lengths[i]]++ : 0;
+    }
+}
+
+/*
+ * Extracts the code-length vector of a tree (root last) into lengths.
+ * Returns 1 if the tree is the canonical tree of those lengths (so they identify it completely),
+ * 0 if it is not (or is malformed, see valid_tree, or has codes over 32 bits) and cannot be cached by signature.
+ */
+int tree_signature(const Node *tree, size_t node_count, unsigned char *lengths) {
+    Huffman_code walked[256] = {{0}};
+    Huffman_code canonical[256];
+    if (node_count < 2 || !valid_tree(tree, node_count) || walk_codes(tree, node_count, node_count - 1, 0, 0, walked) != 0) return 0;
+    for (int i = 0; i < 256; i++) lengths[i] = walked[i].length;
+    canonical_codes(lengths, canonical);
+    for (int i = 0; i < 256; i++) {
+        if (walked[i].length > 0 && walked[i].bits != canonical[i].bits) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Copies the cached tables for the code-length vector into the caller's buffers.
+ * decode must hold 1 << MAX_TABLE_BITS entries; either output may be NULL.
+ * Returns true on a hit (a decode request misses if only the encode codes were stored).
+ */
+bool lookup_tables(const unsigned char *lengths, Decode_entry *decode, int *width, Huffman_code *encode) {
+    unsigned long long hash = hash_lengths(lengths);
+    bool hit = false;
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < TABLE_CACHE_SLOTS; i++) {
+        Table_cache_entry *entry = &cache.entries[i];
+        if (entry->valid && entry->hash == hash && memcmp(entry->lengths, lengths, 256) == 0) {
+            if (decode != NULL && entry->width == 0) break; // Only the encode side is known yet.
+            if (decode != NULL) {
+                memcpy(decode, entry->decode, ((size_t)1 << entry->width) * sizeof(Decode_entry));
+                *width = entry->width;
+            }
+            if (encode != NULL) memcpy(encode, entry->encode, sizeof(entry->encode));
+            entry->last_used = ++cache.clock;
+            hit = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return hit;
+}
+
+/*
+ * Remembers the decode table (of the given width) and encode codes for a code-length vector,
+ * replacing the least recently used slot. The encoder passes a NULL decode table and width 0;
+ * a decode table already stored for the same lengths is then kept.
+ */
+void store_tables(const unsigned char *lengths, const Decode_entry *decode, int width, const Huffman_code *encode) {
+    if (decode != NULL && (width < 1 || (1 << width) > TABLE_CACHE_DECODE_ENTRIES)) return;
+    unsigned long long hash = hash_lengths(lengths);
+    pthread_mutex_lock(&cache.lock);
+    Table_cache_entry *victim = &cache.entries[0];
+    for (int i = 0; i < TABLE_CACHE_SLOTS; i++) {
+        Table_cache_entry *entry = &cache.entries[i];
+        if (entry->valid && entry->hash == hash && memcmp(entry->lengths, lengths, 256) == 0) {
+            victim = entry;
+            break;
+        }
+        if (!entry->valid || entry->last_used < victim->last_used) victim = entry;
+        if (!victim->valid) break;
+    }
+    bool same = victim->valid && victim->hash == hash && memcmp(victim->lengths, lengths, 256) == 0;
+    if (decode != NULL) {
+        victim->width = width;
+        memcpy(victim->decode, decode, ((size_t)1 << width) * sizeof(Decode_entry));
+    } else if (!same) {
+        victim->width = 0;
+    }
+    victim->valid = true;
+    victim->hash = hash;
+    victim->last_used = ++cache.clock;
+    memcpy(victim->lengths, lengths, 256);
+    memcpy(victim->encode, encode, sizeof(victim->encode));
+    pthread_mutex_unlock(&cache.lock);
+}
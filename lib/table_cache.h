@@ -0,0 +1,14 @@
+#ifndef TABLE_CACHE_H
+#define TABLE_CACHE_H
+
+#include "data_types.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+bool valid_tree(const Node *tree, size_t node_count);
+int tree_signature(const Node *tree, size_t node_count, unsigned char *lengths);
+void canonical_codes(const unsigned char *lengths, Huffman_code *codes);
+bool lookup_tables(const unsigned char *lengths, Decode_entry *decode, int *width, Huffman_code *encode);
+void store_tables(const unsigned char *lengths, const Decode_entry *decode, int width, const Huffman_code *encode);
+
+#endif // TABLE_CACHE_H
@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include "throttle.h"
+#include "data_types.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "debugmalloc.h"
+
+/* The ioprio constants are not exported by glibc, these mirror <linux/ioprio.h>. */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_BE_NORMAL 4
+
+/*
+ * Token bucket shared by every read and write stage of the process.
+ * Tokens are bytes; the bucket refills at `rate` bytes per second and holds at most `capacity`.
+ */
+static struct {
+    pthread_mutex_t lock;
+    double rate;
+    double capacity;
+    double tokens;
+    struct timespec last;
+} bucket = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, {0, 0} };
+
+static int cpu_budget = 0;
+static size_t memory_limit = 0;
+// Monotonic time by which the current operation should finish; zero when there is no deadline.
+static struct timespec deadline = {0, 0};
+
+// Share of the last 10 seconds (percent) some task stalled on memory above which buffers shrink.
+#define MEMORY_PRESSURE_THRESHOLD 10.0
+// Budgeted buffers never shrink below this.
+#define MIN_BUDGET_BUFFER (64 * 1024)
+
+static double seconds_between(const struct timespec *from, const struct timespec *to) {
+    return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/*
+ * Sets the shared I/O rate limit in megabytes per second; 0 disables throttling.
+ * The bucket starts empty, so the limit applies from the first byte.
+ * Returns 0 on success or THROTTLE_ERROR for a negative rate.
+ */
+int set_rate_limit(double mb_per_sec) {
+    if (mb_per_sec < 0) return THROTTLE_ERROR;
+    pthread_mutex_lock(&bucket.lock);
+    bucket.rate = mb_per_sec * 1024 * 1024;
+    /* A tenth of a second worth of burst, but never less than a typical I/O chunk. */
+    bucket.capacity = bucket.rate / 10 > 64 * 1024 ? bucket.rate / 10 : 64 * 1024;
+    bucket.tokens = 0;
+    clock_gettime(CLOCK_MONOTONIC, &bucket.last);
+    pthread_mutex_unlock(&bucket.lock);
+    return SUCCESS;
+}
+
+// Reports whether a rate limit is active, so callers can skip work that only exists for pacing.
+bool throttle_enabled(void) {
+    pthread_mutex_lock(&bucket.lock);
+    bool enabled = bucket.rate > 0;
+    pthread_mutex_unlock(&bucket.lock);
+    return enabled;
+}
+
+/*
+ * Blocks until the token bucket allows `bytes` more bytes of I/O.
+ * Requests larger than the bucket are charged in bucket-sized pieces. Returns immediately when no limit is set.
+ */
+void throttle_io(size_t bytes) {
+    while (bytes > 0) {
+        pthread_mutex_lock(&bucket.lock);
+        if (bucket.rate <= 0) {
+            pthread_mutex_unlock(&bucket.lock);
+            return;
+        }
+        size_t piece = bytes < (size_t)bucket.capacity ? bytes : (size_t)bucket.capacity;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bucket.tokens += seconds_between(&bucket.last, &now) * bucket.rate;
+        if (bucket.tokens > bucket.capacity) bucket.tokens = bucket.capacity;
+        bucket.last = now;
+
+        /* Take the tokens now (possibly going negative) so concurrent callers queue up behind us. */
+        bucket.tokens -= piece;
+        double wait = bucket.tokens < 0 ? -bucket.tokens / bucket.rate : 0;
+        pthread_mutex_unlock(&bucket.lock);
+
+        if (wait > 0) {
+            struct timespec delay = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+            while (nanosleep(&delay, &delay) != 0) {}
+        }
+        bytes -= piece;
+    }
+}
+
+/*
+ * Moves the process into the given I/O scheduling class with ioprio_set().
+ * Returns 0 on success or THROTTLE_ERROR if the kernel refuses (or the platform lacks ioprio).
+ */
+int set_io_class(Io_class io_class) {
+    if (io_class == IO_CLASS_DEFAULT) return SUCCESS;
+#ifdef SYS_ioprio_set
+    int prio = (io_class == IO_CLASS_IDLE) ? (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)
+                                           : ((IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | IOPRIO_BE_NORMAL);
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio) != 0) return THROTTLE_ERROR;
+    return SUCCESS;
+#else
+    return THROTTLE_ERROR;
+#endif
+}
+
+/*
+ * Caps the process to `cpus` of its currently allowed CPUs and remembers the cap for worker pools.
+ * Returns 0 on success or THROTTLE_ERROR on an invalid budget or affinity failure.
+ */
+int set_cpu_budget(int cpus) {
+    if (cpus <= 0) return THROTTLE_ERROR;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return THROTTLE_ERROR;
+
+    cpu_set_t budget;
+    CPU_ZERO(&budget);
+    int taken = 0;
+    for (int i = 0; i < CPU_SETSIZE && taken < cpus; i++) {
+        if (CPU_ISSET(i, &allowed)) {
+            CPU_SET(i, &budget);
+            taken++;
+        }
+    }
+    if (sched_setaffinity(0, sizeof(budget), &budget) != 0) return THROTTLE_ERROR;
+    cpu_budget = taken;
+    return SUCCESS;
+}
+
+/*
+ * Number of worker threads a parallel stage may keep active: the CPU budget if one was set,
+ * otherwise the number of CPUs the process may run on.
+ */
+int max_workers(void) {
+    if (cpu_budget > 0) return cpu_budget;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        int count = CPU_COUNT(&allowed);
+        if (count > 0) return count;
+    }
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (int)online : 1;
+}
+
+/*
+ * Sets the memory budget in bytes the buffers of the process are sized against; 0 removes it.
+ */
+void set_memory_budget(size_t bytes) {
+    memory_limit = bytes;
+}
+
+/*
+ * Reads the first number in a file (such as a cgroup limit); "max" or a missing file reads as 0.
+ */
+static size_t read_size_file(const char *path) {
+    unsigned long long value = 0;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+    if (fscanf(f, "%llu", &value) != 1) value = 0;
+    fclose(f);
+    return (size_t)value;
+}
+
+/*
+ * Builds the path of a file in the cgroup (v2) the process belongs to.
+ * Returns false if the process is not in a cgroup v2 hierarchy.
+ */
+static bool cgroup_file(const char *name, char *path, size_t path_size) {
+    char line[512];
+    bool found = false;
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) return false;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(path, path_size, "/sys/fs/cgroup%s/%s", strcmp(line + 3, "/") == 0 ? "" : line + 3, name);
+            found = true;
+            break;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+/*
+ * Memory the process may use for buffers: the --max-memory budget, further capped by the room left
+ * under the cgroup's memory.max. Returns 0 when neither limit applies.
+ */
+size_t memory_budget(void) {
+    size_t budget = memory_limit;
+    char path[600];
+    if (cgroup_file("memory.max", path, sizeof(path))) {
+        size_t max = read_size_file(path);
+        if (max > 0 && cgroup_file("memory.current", path, sizeof(path))) {
+            size_t current = read_size_file(path);
+            size_t headroom = max > current ? max - current : 0;
+            if (budget == 0 || headroom < budget) budget = headroom;
+        }
+    }
+    return budget;
+}
+
+/*
+ * Reports whether tasks are stalling on memory (PSI "some avg10" of the cgroup, or system-wide).
+ */
+bool memory_pressure_high(void) {
+    char path[600];
+    double avg10 = 0;
+    FILE *f = NULL;
+    if (cgroup_file("memory.pressure", path, sizeof(path))) f = fopen(path, "r");
+    if (f == NULL) f = fopen("/proc/pressure/memory", "r");
+    if (f == NULL) return false;
+    if (fscanf(f, "some avg10=%lf", &avg10) != 1) avg10 = 0;
+    fclose(f);
+    return avg10 >= MEMORY_PRESSURE_THRESHOLD;
+}
+
+/*
+ * Sizes a buffer that would ideally hold `wanted` bytes to at most 1/`share` of the memory budget,
+ * halved again while memory pressure is high. The result is a whole number of pages.
+ */
+size_t budgeted_size(size_t wanted, int share) {
+    size_t budget = memory_budget();
+    size_t size = wanted;
+    if (budget > 0 && size > budget / share) size = budget / share;
+    if (memory_pressure_high()) size /= 2;
+    if (size < MIN_BUDGET_BUFFER) size = wanted < MIN_BUDGET_BUFFER ? wanted : MIN_BUDGET_BUFFER;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (size > page) size -= size % page;
+    return size;
+}
+
+/*
+ * Sets a deadline `ms` milliseconds from now that compression paces itself against; 0 removes it.
+ */
+void set_deadline(long ms) {
+    if (ms <= 0) {
+        deadline = (struct timespec){0, 0};
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+}
+
+bool deadline_enabled(void) {
+    return deadline.tv_sec != 0 || deadline.tv_nsec != 0;
+}
+
+/*
+ * Seconds left until the deadline, negative once it has passed.
+ */
+double deadline_remaining(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return seconds_between(&now, &deadline);
+}
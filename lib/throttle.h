@@ -0,0 +1,22 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include "data_types.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+int set_rate_limit(double mb_per_sec);
+bool throttle_enabled(void);
+void throttle_io(size_t bytes);
+int set_io_class(Io_class io_class);
+int set_cpu_budget(int cpus);
+int max_workers(void);
+void set_memory_budget(size_t bytes);
+size_t memory_budget(void);
+bool memory_pressure_high(void);
+size_t budgeted_size(size_t wanted, int share);
+void set_deadline(long ms);
+bool deadline_enabled(void);
+double deadline_remaining(void);
+
+#endif // THROTTLE_H
@@ -0,0 +1,330 @@
+#include "volume.h"
+#include "data_types.h"
+#include "file.h"
+#include "throttle.h"
+#include "workers.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "debugmalloc.h"
+
+// Size of the contiguous pieces dealt round-robin to the volumes.
+#define STRIPE_SIZE (1024 * 1024)
+
+/*
+ * Every volume starts with the same manifest (only volume_index differs):
+ * magic, volume_index, volume_count, stripe_size, total_size, then for each volume its path
+ * as a long length followed by the characters. The stripes of the archive image follow.
+ */
+typedef struct {
+    size_t volume_index;
+    size_t volume_count;
+    size_t stripe_size;
+    size_t total_size;
+} Volume_header;
+
+// Per-thread work description: one thread moves every stripe of one volume.
+typedef struct {
+    int fd;
+    size_t volume_index;
+    size_t volume_count;
+    size_t stripe_size;
+    size_t header_size;
+    char *image;
+    size_t image_offset;
+    size_t image_size;
+    bool writing;
+    int result;
+} Volume_job;
+
+static long manifest_size(char **volumes, int volume_count) {
+    long size = sizeof(volume_magic) + sizeof(Volume_header);
+    for (int i = 0; i < volume_count; i++) {
+        size += sizeof(long) + strlen(volumes[i]);
+    }
+    return size;
+}
+
+static void build_manifest(unsigned char *data, Volume_header *header, char **volumes) {
+    memcpy(data, volume_magic, sizeof(volume_magic));
+    data += sizeof(volume_magic);
+    memcpy(data, header, sizeof(Volume_header));
+    data += sizeof(Volume_header);
+    for (size_t i = 0; i < header->volume_count; i++) {
+        long path_len = strlen(volumes[i]);
+        memcpy(data, &path_len, sizeof(long));
+        data += sizeof(long);
+        memcpy(data, volumes[i], path_len);
+        data += path_len;
+    }
+}
+
+/*
+ * Moves the stripes belonging to one volume between a piece of the image (image_size bytes at
+ * image_offset) and the volume file, in either direction, charging each stripe to the I/O rate limit.
+ */
+static void *transfer_volume(void *arg) {
+    Volume_job *job = arg;
+    job->result = SUCCESS;
+    size_t end = job->image_offset + job->image_size;
+    // The first stripe of this volume that reaches into the piece.
+    size_t stripe = job->image_offset / job->stripe_size;
+    stripe += (job->volume_index + job->volume_count - stripe % job->volume_count) % job->volume_count;
+    for (; stripe * job->stripe_size < end; stripe += job->volume_count) {
+        size_t from = stripe * job->stripe_size > job->image_offset ? stripe * job->stripe_size : job->image_offset;
+        size_t to = (stripe + 1) * job->stripe_size < end ? (stripe + 1) * job->stripe_size : end;
+        size_t length = to - from;
+        char *piece = job->image + (from - job->image_offset);
+        off_t file_offset = job->header_size + (stripe / job->volume_count) * job->stripe_size + (from - stripe * job->stripe_size);
+
+        throttle_io(length);
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = job->writing ? pwrite(job->fd, piece + done, length - done, file_offset + done)
+                                     : pread(job->fd, piece + done, length - done, file_offset + done);
+            if (n <= 0) {
+                job->result = job->writing ? FILE_WRITE_ERROR : FILE_READ_ERROR;
+                return NULL;
+            }
+            done += n;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Creates the volumes for writing, after confirming each may be overwritten.
+ * The manifests are left for finish_volumes, which knows the image size.
+ * Returns SUCCESS (the caller then calls close_volumes) or a negative code, with nothing left open.
+ */
+int open_volumes(Volume_writer *writer, char **volumes, int volume_count, bool overwrite) {
+    if (volume_count < 1 || volume_count > MAX_VOLUMES) return VOLUME_ERROR;
+    int ret = SUCCESS;
+    for (int i = 0; i < volume_count && ret == SUCCESS; i++) {
+        ret = confirm_overwrite(volumes[i], overwrite);
+    }
+    if (ret != SUCCESS) return ret;
+
+    writer->volumes = volumes;
+    writer->volume_count = volume_count;
+    writer->header_size = manifest_size(volumes, volume_count);
+    for (int i = 0; i < volume_count; i++) writer->fds[i] = -1;
+    for (int i = 0; i < volume_count; i++) {
+        writer->fds[i] = open(volumes[i], O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (writer->fds[i] == -1) {
+            close_volumes(writer);
+            return FILE_WRITE_ERROR;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Writes length bytes that sit at offset in the archive image to the stripes they fall in,
+ * one writer thread per volume. Pieces may come in any order.
+ * Returns SUCCESS or FILE_WRITE_ERROR.
+ */
+int write_volumes(Volume_writer *writer, const char *data, size_t length, size_t offset) {
+    Volume_job jobs[MAX_VOLUMES];
+    for (int i = 0; i < writer->volume_count; i++) {
+        jobs[i] = (Volume_job){writer->fds[i], i, writer->volume_count, STRIPE_SIZE, writer->header_size,
+                               (char *)data, offset, length, true, SUCCESS};
+    }
+    run_workers(writer->volume_count, transfer_volume, jobs, sizeof(Volume_job));
+    for (int i = 0; i < writer->volume_count; i++) {
+        if (jobs[i].result != SUCCESS) return jobs[i].result;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Writes the manifest of every volume, now that the image size is known, and makes the volumes durable.
+ * Returns the total number of bytes written on success or a negative code on failure.
+ */
+long finish_volumes(Volume_writer *writer, size_t image_size) {
+    unsigned char *manifest = malloc(writer->header_size);
+    if (manifest == NULL) return MALLOC_ERROR;
+    long ret = image_size + writer->volume_count * writer->header_size;
+    Volume_header header = {0, writer->volume_count, STRIPE_SIZE, image_size};
+    for (int i = 0; i < writer->volume_count; i++) {
+        header.volume_index = i;
+        build_manifest(manifest, &header, writer->volumes);
+        if (pwrite(writer->fds[i], manifest, writer->header_size, 0) != writer->header_size || fdatasync(writer->fds[i]) != 0) {
+            ret = FILE_WRITE_ERROR;
+            break;
+        }
+    }
+    free(manifest);
+    return ret;
+}
+
+void close_volumes(Volume_writer *writer) {
+    for (int i = 0; i < writer->volume_count; i++) {
+        if (writer->fds[i] != -1) close(writer->fds[i]);
+        writer->fds[i] = -1;
+    }
+}
+
+/*
+ * Serializes the structure and stripes it round-robin across the given volumes, one writer thread per volume.
+ * Each volume starts with the manifest, so the archive can be restored from any of them.
+ * Returns the total number of bytes written on success or a negative code on failure.
+ */
+int write_striped(Compressed_file *compressed, char **volumes, int volume_count, bool overwrite) {
+    Volume_writer writer;
+    long image_size = compressed_file_size(compressed);
+    int ret = open_volumes(&writer, volumes, volume_count, overwrite);
+    if (ret != SUCCESS) return ret;
+
+    char *image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (image == MAP_FAILED) {
+        ret = MALLOC_ERROR;
+    } else {
+        serialize_compressed(compressed, (unsigned char *)image);
+        ret = write_volumes(&writer, image, image_size, 0);
+        if (ret == SUCCESS) ret = finish_volumes(&writer, image_size);
+        munmap(image, image_size);
+    }
+    close_volumes(&writer);
+    return ret;
+}
+
+/*
+ * Finds a volume listed in the manifest: first as recorded, then next to the volume being read.
+ * Returns an allocated path or NULL on allocation failure.
+ */
+static char *locate_volume(const char *file_name, const char *recorded, long recorded_len) {
+    char *path = malloc(recorded_len + 1);
+    if (path == NULL) return NULL;
+    memcpy(path, recorded, recorded_len);
+    path[recorded_len] = '\0';
+    if (access(path, R_OK) == 0) return path;
+
+    const char *dir_end = strrchr(file_name, '/');
+    const char *base = strrchr(path, '/');
+    base = (base != NULL) ? base + 1 : path;
+    if (dir_end == NULL) {
+        memmove(path, base, strlen(base) + 1);
+        return path;
+    }
+    size_t dir_len = dir_end - file_name + 1;
+    char *sibling = malloc(dir_len + strlen(base) + 1);
+    if (sibling != NULL) {
+        memcpy(sibling, file_name, dir_len);
+        strcpy(sibling + dir_len, base);
+    }
+    free(path);
+    return sibling;
+}
+
+/*
+ * Reassembles a striped archive from the manifest at the start of one of its (already mapped) volumes.
+ * Every volume is read by its own thread into a fresh anonymous mapping returned through image.
+ * Returns the image size on success (the caller munmaps it) or a negative code on failure.
+ */
+long read_striped(const char *file_name, const char *volume_data, long volume_size, const char **image) {
+    long ret = SUCCESS;
+    Volume_header header;
+    int fds[MAX_VOLUMES];
+    Volume_job jobs[MAX_VOLUMES];
+    char *paths[MAX_VOLUMES] = {NULL};
+    unsigned char *expected = NULL;
+    unsigned char *found = NULL;
+    char *assembled = MAP_FAILED;
+    const char *current = volume_data + sizeof(volume_magic);
+    const char *end = volume_data + volume_size;
+    for (int i = 0; i < MAX_VOLUMES; i++) fds[i] = -1;
+
+    while (true) {
+        if (current + sizeof(Volume_header) > end) {
+            ret = FILE_READ_ERROR;
+            break;
+        }
+        memcpy(&header, current, sizeof(Volume_header));
+        current += sizeof(Volume_header);
+        if (header.volume_count < 1 || header.volume_count > MAX_VOLUMES || header.stripe_size == 0 ||
+            header.volume_index >= header.volume_count) {
+            ret = VOLUME_ERROR;
+            break;
+        }
+
+        for (size_t i = 0; i < header.volume_count; i++) {
+            long path_len = 0;
+            if (current + sizeof(long) > end) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            memcpy(&path_len, current, sizeof(long));
+            current += sizeof(long);
+            if (path_len < 0 || current + path_len > end) {
+                ret = FILE_READ_ERROR;
+                break;
+            }
+            paths[i] = (i == header.volume_index) ? strdup(file_name) : locate_volume(file_name, current, path_len);
+            if (paths[i] == NULL) {
+                ret = MALLOC_ERROR;
+                break;
+            }
+            current += path_len;
+        }
+        if (ret != SUCCESS) break;
+
+        /* Every volume must carry the same manifest with its own index. */
+        long header_size = current - volume_data;
+        expected = malloc(header_size);
+        found = malloc(header_size);
+        if (expected == NULL || found == NULL) {
+            ret = MALLOC_ERROR;
+            break;
+        }
+        memcpy(expected, volume_data, header_size);
+        for (size_t i = 0; i < header.volume_count; i++) {
+            fds[i] = open(paths[i], O_RDONLY);
+            if (fds[i] == -1) {
+                fprintf(stderr, "Failed to open the volume (%s).\n", paths[i]);
+                ret = VOLUME_ERROR;
+                break;
+            }
+            Volume_header volume = header;
+            volume.volume_index = i;
+            memcpy(expected + sizeof(volume_magic), &volume, sizeof(Volume_header));
+            if (pread(fds[i], found, header_size, 0) != header_size || memcmp(found, expected, header_size) != 0) {
+                fprintf(stderr, "The volume (%s) does not belong to this archive.\n", paths[i]);
+                ret = VOLUME_ERROR;
+                break;
+            }
+            jobs[i] = (Volume_job){fds[i], i, header.volume_count, header.stripe_size, header_size, NULL, 0, header.total_size, false, SUCCESS};
+        }
+        if (ret != SUCCESS) break;
+
+        assembled = mmap(NULL, header.total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (assembled == MAP_FAILED) {
+            ret = MALLOC_ERROR;
+            break;
+        }
+        for (size_t i = 0; i < header.volume_count; i++) jobs[i].image = assembled;
+
+        run_workers(header.volume_count, transfer_volume, jobs, sizeof(Volume_job));
+        for (size_t i = 0; i < header.volume_count; i++) {
+            if (jobs[i].result != SUCCESS) ret = jobs[i].result;
+        }
+        if (ret != SUCCESS) break;
+
+        *image = assembled;
+        ret = header.total_size;
+        break;
+    }
+
+    if (ret < 0 && assembled != MAP_FAILED) munmap(assembled, header.total_size);
+    for (int i = 0; i < MAX_VOLUMES; i++) {
+        if (fds[i] != -1) close(fds[i]);
+        free(paths[i]);
+    }
+    free(expected);
+    free(found);
+    return ret;
+}
@@ -0,0 +1,24 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include "data_types.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Volumes open for writing an archive image piece by piece (see open_volumes).
+typedef struct {
+    int fds[MAX_VOLUMES];
+    int volume_count;
+    char **volumes;
+    long header_size;
+} Volume_writer;
+
+int open_volumes(Volume_writer *writer, char **volumes, int volume_count, bool overwrite);
+int write_volumes(Volume_writer *writer, const char *data, size_t length, size_t offset);
+long finish_volumes(Volume_writer *writer, size_t image_size);
+void close_volumes(Volume_writer *writer);
+
+int write_striped(Compressed_file *compressed, char **volumes, int volume_count, bool overwrite);
+long read_striped(const char *file_name, const char *volume_data, long volume_size, const char **image);
+
+#endif // VOLUME_H
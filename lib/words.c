@@ -0,0 +1,302 @@
+#include "words.h"
+#include "data_types.h"
+#include "compress.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include "debugmalloc.h"
+
+/*
+ * Word coding for text (BLOCK_WORDS). A block is cut into tokens, each a run of word bytes (letters,
+ * digits, '_' and UTF-8) or a run of the bytes between them, and the tokens that repeat enough become a
+ * dictionary. Words and single bytes share one length-limited canonical Huffman code, so a common word
+ * costs one code instead of a code per byte, and the decoder writes out a whole word per table lookup.
+ * Tokens left out of the dictionary are coded as their bytes.
+ */
+
+#define WORD_ALPHABET_MAX (256 + WORDS_MAX)
+// Distinct tokens counted per block; once the table is three quarters full, new ones are coded as bytes.
+#define WORD_SLOTS (1 << 16)
+// Blocks shorter than this are not worth the dictionary.
+#define WORD_BLOCK_MIN 1024
+// A token earns a dictionary entry once its repeats save about this many bytes.
+#define WORD_MIN_GAIN 8
+// Codes up to this long are decoded in one table lookup, longer ones canonically.
+#define WORD_TABLE_BITS 12
+
+// A distinct token of the block being coded.
+typedef struct {
+    size_t offset;          // Of its first occurrence.
+    unsigned int count;
+    unsigned char length;   // 0 for an empty slot.
+    short id;               // Dictionary index, -1 if it is coded as bytes.
+} Word_slot;
+
+// Everything encode_words works in, mapped as one so it is safe on worker threads.
+typedef struct {
+    Word_slot slots[WORD_SLOTS];
+    unsigned long long ranked[WORD_SLOTS];
+    size_t chosen[WORDS_MAX];   // Slot of each dictionary word.
+    long frequencies[WORD_ALPHABET_MAX];
+    unsigned long long work[WORD_ALPHABET_MAX];
+    unsigned long long scratch[WORD_ALPHABET_MAX];
+    unsigned char lengths[WORD_ALPHABET_MAX];
+    Huffman_code codes[WORD_ALPHABET_MAX];
+} Word_coder;
+
+static bool is_word_byte(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_' || c >= 0x80;
+}
+
+// Length of the token at data: a run of word bytes or of other bytes, at most WORD_MAX_LENGTH.
+static size_t token_length(const unsigned char *data, size_t left) {
+    bool word = is_word_byte(data[0]);
+    size_t length = 1;
+    while (length < left && length < WORD_MAX_LENGTH && is_word_byte(data[length]) == word) length++;
+    return length;
+}
+
+// Slot holding the token data[offset, offset + length), or the empty slot it belongs in.
+static size_t find_slot(const Word_coder *coder, const unsigned char *data, size_t offset, size_t length) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ data[offset + i]) * 16777619u;
+    size_t slot = hash & (WORD_SLOTS - 1);
+    while (coder->slots[slot].length != 0) {
+        const Word_slot *entry = &coder->slots[slot];
+        if (entry->length == length && memcmp(data + entry->offset, data + offset, length) == 0) break;
+        slot = (slot + 1) & (WORD_SLOTS - 1);
+    }
+    return slot;
+}
+
+// Dictionary index of the token, or -1 if it is coded as bytes.
+static int token_word(const Word_coder *coder, const unsigned char *data, size_t offset, size_t length) {
+    if (length < 2) return -1;
+    const Word_slot *entry = &coder->slots[find_slot(coder, data, offset, length)];
+    return entry->length != 0 ? entry->id : -1;
+}
+
+static int compare_ranks(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x < y) - (x > y);
+}
+
+/*
+ * Counts the tokens of the block and makes the WORDS_MAX that save the most, (count - 1) * (length - 1)
+ * bytes roughly, the dictionary. Returns the number of words.
+ */
+static int choose_words(Word_coder *coder, const unsigned char *data, size_t data_len) {
+    size_t used = 0;
+    for (size_t i = 0; i < data_len;) {
+        size_t length = token_length(data + i, data_len - i);
+        if (length > 1) {
+            Word_slot *entry = &coder->slots[find_slot(coder, data, i, length)];
+            if (entry->length != 0) {
+                entry->count++;
+            } else if (used < WORD_SLOTS / 4 * 3) {
+                *entry = (Word_slot){i, 1, (unsigned char)length, -1};
+                used++;
+            }
+        }
+        i += length;
+    }
+
+    size_t candidates = 0;
+    for (size_t slot = 0; slot < WORD_SLOTS; slot++) {
+        const Word_slot *entry = &coder->slots[slot];
+        if (entry->length == 0) continue;
+        unsigned long long gain = (unsigned long long)(entry->count - 1) * (entry->length - 1);
+        if (gain >= WORD_MIN_GAIN) coder->ranked[candidates++] = gain << 16 | slot;
+    }
+    qsort(coder->ranked, candidates, sizeof(unsigned long long), compare_ranks);
+    int count = candidates < WORDS_MAX ? (int)candidates : WORDS_MAX;
+    for (int id = 0; id < count; id++) {
+        coder->chosen[id] = coder->ranked[id] & 0xFFFF;
+        coder->slots[coder->chosen[id]].id = (short)id;
+    }
+    return count;
+}
+
+// Canonical codes for an alphabet of any size, assigned as decode_words expects them.
+static void word_codes(const unsigned char *lengths, int alphabet, Huffman_code *codes) {
+    unsigned int count[BLOCK_MAX_CODE_LENGTH + 1] = {0};
+    unsigned int next[BLOCK_MAX_CODE_LENGTH + 1] = {0};
+    for (int i = 0; i < alphabet; i++) count[lengths[i]]++;
+    count[0] = 0;
+    for (int length = 1; length <= BLOCK_MAX_CODE_LENGTH; length++) next[length] = (next[length - 1] + count[length - 1]) << 1;
+    for (int i = 0; i < alphabet; i++) {
+        codes[i].length = lengths[i];
+        codes[i].bits = lengths[i] > 0 ? next[lengths[i]]++ : 0;
+    }
+}
+
+/*
+ * Codes the block as a BLOCK_WORDS payload into out if that takes at most out_cap bytes.
+ * Returns the payload size, or 0 when word coding does not fit (or its scratch cannot be mapped).
+ */
+size_t encode_words(const unsigned char *data, size_t data_len, unsigned char *out, size_t out_cap) {
+    if (data_len < WORD_BLOCK_MIN) return 0;
+    Word_coder *coder = mmap(NULL, sizeof(Word_coder), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (coder == MAP_FAILED) return 0;
+    size_t size = 0;
+
+    while (true) {
+        int count = choose_words(coder, data, data_len);
+        if (count == 0) break;
+        int alphabet = 256 + count;
+        for (size_t i = 0; i < data_len;) {
+            size_t length = token_length(data + i, data_len - i);
+            int id = token_word(coder, data, i, length);
+            if (id >= 0) {
+                coder->frequencies[256 + id]++;
+            } else {
+                for (size_t j = 0; j < length; j++) coder->frequencies[data[i + j]]++;
+            }
+            i += length;
+        }
+        int present = compute_code_lengths(coder->frequencies, alphabet, coder->work, coder->scratch, coder->lengths, BLOCK_MAX_CODE_LENGTH);
+        if (present < 2) break;
+
+        size_t bits = 0;
+        size_t words_size = 0;
+        for (int i = 0; i < alphabet; i++) bits += (size_t)coder->frequencies[i] * coder->lengths[i];
+        for (int id = 0; id < count; id++) words_size += coder->slots[coder->chosen[id]].length;
+        size_t header_size = sizeof(unsigned short) + count + words_size + (alphabet + 1) / 2;
+        if (header_size + (bits + 7) / 8 > out_cap) break;
+
+        // Dictionary and code lengths.
+        unsigned short stored_count = (unsigned short)count;
+        memcpy(out, &stored_count, sizeof(stored_count));
+        size_t pos = sizeof(stored_count);
+        for (int id = 0; id < count; id++) out[pos++] = coder->slots[coder->chosen[id]].length;
+        for (int id = 0; id < count; id++) {
+            const Word_slot *entry = &coder->slots[coder->chosen[id]];
+            memcpy(out + pos, data + entry->offset, entry->length);
+            pos += entry->length;
+        }
+        memset(out + pos, 0, (alphabet + 1) / 2);
+        for (int i = 0; i < alphabet; i++) out[pos + i / 2] |= (i % 2 == 0) ? coder->lengths[i] << 4 : coder->lengths[i];
+        pos += (alphabet + 1) / 2;
+
+        word_codes(coder->lengths, alphabet, coder->codes);
+        unsigned long long acc = 0;
+        int acc_bits = 0;
+        for (size_t i = 0; i < data_len;) {
+            size_t length = token_length(data + i, data_len - i);
+            int id = token_word(coder, data, i, length);
+            for (size_t j = 0; j < (id >= 0 ? 1 : length); j++) {
+                Huffman_code code = coder->codes[id >= 0 ? 256 + id : data[i + j]];
+                acc = (acc << code.length) | code.bits;
+                acc_bits += code.length;
+                while (acc_bits >= 8) {
+                    acc_bits -= 8;
+                    out[pos++] = (unsigned char)(acc >> acc_bits);
+                }
+            }
+            i += length;
+        }
+        if (acc_bits > 0) out[pos++] = (unsigned char)(acc << (8 - acc_bits));
+        size = pos;
+        break;
+    }
+
+    munmap(coder, sizeof(Word_coder));
+    return size;
+}
+
+/*
+ * Decodes a BLOCK_WORDS payload into raw_size bytes at raw. Codes of up to WORD_TABLE_BITS bits are
+ * resolved by one table lookup, which for a word copies the whole word; longer codes are finished
+ * canonically length by length.
+ * Returns 0 on success or DECOMPRESSION_ERROR for a malformed payload.
+ */
+int decode_words(const unsigned char *payload, size_t payload_size, char *raw, size_t raw_size) {
+    unsigned short count;
+    if (payload_size < sizeof(count)) return DECOMPRESSION_ERROR;
+    memcpy(&count, payload, sizeof(count));
+    if (count == 0 || count > WORDS_MAX || payload_size - sizeof(count) < count) return DECOMPRESSION_ERROR;
+    int alphabet = 256 + count;
+    const unsigned char *word_lengths = payload + sizeof(count);
+    size_t pos = sizeof(count) + count;
+    unsigned int offsets[WORDS_MAX];
+    for (int id = 0; id < count; id++) {
+        if (word_lengths[id] < 2 || word_lengths[id] > WORD_MAX_LENGTH || payload_size - pos < word_lengths[id]) return DECOMPRESSION_ERROR;
+        offsets[id] = pos;
+        pos += word_lengths[id];
+    }
+    if (payload_size - pos < (size_t)(alphabet + 1) / 2) return DECOMPRESSION_ERROR;
+    unsigned char lengths[WORD_ALPHABET_MAX];
+    for (int i = 0; i < alphabet; i++) lengths[i] = (i % 2 == 0) ? payload[pos + i / 2] >> 4 : payload[pos + i / 2] & 0x0F;
+    pos += (alphabet + 1) / 2;
+
+    // Canonical code: first code and first sorted symbol of every length.
+    unsigned int length_count[BLOCK_MAX_CODE_LENGTH + 1] = {0};
+    unsigned int first[BLOCK_MAX_CODE_LENGTH + 1] = {0};
+    unsigned int index[BLOCK_MAX_CODE_LENGTH + 1] = {0};
+    for (int i = 0; i < alphabet; i++) length_count[lengths[i]]++;
+    length_count[0] = 0;
+    unsigned long long kraft = 0;
+    for (int length = 1; length <= BLOCK_MAX_CODE_LENGTH; length++) {
+        kraft += (unsigned long long)length_count[length] << (BLOCK_MAX_CODE_LENGTH - length);
+        first[length] = (first[length - 1] + length_count[length - 1]) << 1;
+        index[length] = index[length - 1] + length_count[length - 1];
+    }
+    if (kraft == 0 || kraft > 1ULL << BLOCK_MAX_CODE_LENGTH) return DECOMPRESSION_ERROR;
+    unsigned short sorted[WORD_ALPHABET_MAX];
+    unsigned int next[BLOCK_MAX_CODE_LENGTH + 1];
+    memcpy(next, index, sizeof(next));
+    for (int i = 0; i < alphabet; i++) {
+        if (lengths[i] > 0) sorted[next[lengths[i]]++] = (unsigned short)i;
+    }
+    Decode_entry table[1 << WORD_TABLE_BITS];
+    memset(table, 0, sizeof(table));
+    for (int length = 1; length <= WORD_TABLE_BITS; length++) {
+        for (unsigned int k = 0; k < length_count[length]; k++) {
+            unsigned int code = (first[length] + k) << (WORD_TABLE_BITS - length);
+            for (unsigned int fill = 0; fill < 1u << (WORD_TABLE_BITS - length); fill++) {
+                table[code + fill] = (Decode_entry){sorted[index[length] + k], (unsigned char)length};
+            }
+        }
+    }
+
+    const unsigned char *stream = payload + pos;
+    size_t stream_size = payload_size - pos;
+    unsigned long long buffer = 0; // Valid bits are the most significant ones.
+    int bit_count = 0;
+    size_t loaded = 0;
+    size_t produced = 0;
+    while (produced < raw_size) {
+        while (bit_count <= 56) {
+            buffer |= (unsigned long long)(loaded < stream_size ? stream[loaded] : 0) << (56 - bit_count);
+            loaded++;
+            bit_count += 8;
+        }
+        Decode_entry entry = table[buffer >> (64 - WORD_TABLE_BITS)];
+        unsigned int symbol = entry.value;
+        int length = entry.length;
+        if (length == 0) {
+            for (length = WORD_TABLE_BITS + 1; length <= BLOCK_MAX_CODE_LENGTH; length++) {
+                unsigned int code = (unsigned int)(buffer >> (64 - length));
+                if (code - first[length] < length_count[length]) {
+                    symbol = sorted[index[length] + code - first[length]];
+                    break;
+                }
+            }
+            if (length > BLOCK_MAX_CODE_LENGTH) return DECOMPRESSION_ERROR;
+        }
+        buffer <<= length;
+        bit_count -= length;
+        if (symbol < 256) {
+            raw[produced++] = (char)symbol;
+        } else {
+            size_t size = word_lengths[symbol - 256];
+            if (size > raw_size - produced) return DECOMPRESSION_ERROR;
+            memcpy(raw + produced, payload + offsets[symbol - 256], size);
+            produced += size;
+        }
+    }
+    // Padding bits past the end of the stream must not have been decoded.
+    return loaded * 8 - bit_count <= stream_size * 8 ? 0 : DECOMPRESSION_ERROR;
+}
@@ -0,0 +1,10 @@
+#ifndef WORDS_H
+#define WORDS_H
+
+#include "data_types.h"
+#include <stddef.h>
+
+size_t encode_words(const unsigned char *data, size_t data_len, unsigned char *out, size_t out_cap);
+int decode_words(const unsigned char *payload, size_t payload_size, char *raw, size_t raw_size);
+
+#endif // WORDS_H
@@ -0,0 +1,34 @@
+#include "workers.h"
+#include "data_types.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include "debugmalloc.h"
+
+// Upper bound on threads started by a single run_workers() call.
+#define MAX_WORKER_THREADS 64
+
+/*
+ * Runs fn once per element of the args array (count elements of arg_size bytes each) on its own thread
+ * and waits for all of them. Elements beyond MAX_WORKER_THREADS, or whose thread could not be started,
+ * run on the calling thread instead, so the work is always done.
+ * Worker functions must not allocate: debugmalloc is not thread-safe, so buffers are prepared by the caller.
+ * Returns 0 once every worker has finished.
+ */
+int run_workers(int count, Worker_fn fn, void *args, size_t arg_size) {
+    pthread_t threads[MAX_WORKER_THREADS];
+    bool started[MAX_WORKER_THREADS] = {false};
+    char *arg = args;
+
+    for (int i = 1; i < count; i++) {
+        if (i < MAX_WORKER_THREADS && pthread_create(&threads[i], NULL, fn, arg + i * arg_size) == 0) {
+            started[i] = true;
+        } else {
+            fn(arg + i * arg_size);
+        }
+    }
+    if (count > 0) fn(arg);
+    for (int i = 1; i < count && i < MAX_WORKER_THREADS; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+    return SUCCESS;
+}
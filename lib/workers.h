@@ -0,0 +1,10 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stddef.h>
+
+typedef void *(*Worker_fn)(void *arg);
+
+int run_workers(int count, Worker_fn fn, void *args, size_t arg_size);
+
+#endif // WORKERS_H
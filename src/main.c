@@ -10,6 +10,10 @@
 #include "../lib/compress.h"
 #include "../lib/decompress.h"
 #include "../lib/directory.h"
+#include "../lib/throttle.h"
+#include "../lib/index.h"
+#include "../lib/block.h"
+#include "../lib/search.h"
 #include "../lib/data_types.h"
 #include "../lib/debugmalloc.h"
 
@@ -25,11 +29,28 @@ static void print_usage(const char *prog_name) {
         "Options:\n"
         "\t-c                        Compress\n"
         "\t-x                        Decompress\n"
-        "\t-o OUTPUT_FILE            Set output file (optional).\n"
+        "\t-o OUTPUT_FILE            Set output file (optional). Repeat to stripe the archive across volumes;\n"
+        "\t                          - writes the restored file to standard output.\n"
         "\t-h                        Show this guide.\n"
         "\t-f                        Overwrite OUTPUT_FILE without asking if it exists.\n"
         "\t-r                        Recursively compress a directory (only needed for compression).\n"
         "\t-P, --no-preserve-perms   When extracting, apply stored permissions even to existing directories.\n"
+        "\t--max-rate MB/s           Limit disk reads and writes to the given rate.\n"
+        "\t--io-class CLASS          I/O scheduling class: idle or best-effort.\n"
+        "\t--cpu-budget N            Run on at most N CPUs.\n"
+        "\t--level N                 Compression level 1-10 (default 6): higher levels search harder for block boundaries;\n"
+        "\t                          10 context-mixes blocks, inflating gzip, zip and PNG streams first, for the best ratio.\n"
+        "\t--max-memory SIZE         Keep buffers within SIZE bytes (K, M or G suffix); also bounded by the cgroup limit.\n"
+        "\t--consume                 Free the input as it is compressed and delete it at the end (single files only).\n"
+        "\t--legacy                  Write the original single-tree format, readable by older versions.\n"
+        "\t--lanes                   Code blocks as 16 interleaved bitstreams for faster (SIMD) restores.\n"
+        "\t--text                    Code text and logs by whole words where that is smaller than by bytes.\n"
+        "\t--deadline MS             Finish compressing within MS milliseconds, trading ratio for speed when behind.\n"
+        "\t--diff OLD NEW            List members added (A), deleted (D) or modified (M) between two archives\n"
+        "\t                          from their member indexes, without decompressing either.\n"
+        "\t--grep PATTERN            Print the lines of the archive's members that contain PATTERN, as\n"
+        "\t                          MEMBER:OFFSET:LINE, decoding in memory without writing anything.\n"
+        "\t                          Repeat to print the lines containing any of several patterns.\n"
         "\tINPUT_FILE: Path to the file to compress or restore.\n"
         "\tThe -c and -x options are mutually exclusive.";
 
@@ -48,11 +69,125 @@ int parse_arguments(int argc, char* argv[], Arguments *args) {
     args->no_preserve_perms = false;
     args->input_file = NULL;
     args->output_file = NULL;
+    args->output_count = 0;
+    args->max_rate = 0;
+    args->io_class = IO_CLASS_DEFAULT;
+    args->cpu_budget = 0;
+    args->level = DEFAULT_LEVEL;
+    args->max_memory = 0;
+    args->consume = false;
+    args->legacy = false;
+    args->lanes = false;
+    args->text = false;
+    args->deadline_ms = 0;
+    args->diff_mode = false;
+    args->diff_file = NULL;
+    args->grep_pattern = NULL;
+    args->grep_pattern_count = 0;
 
     for (int i = 1; i < argc; i++) {
         if (argv[i][0] == '-') {
             if (strcmp(argv[i], "--no-preserve-perms") == 0) {
                 args->no_preserve_perms = true;
+            } else if (strcmp(argv[i], "--consume") == 0) {
+                args->consume = true;
+            } else if (strcmp(argv[i], "--legacy") == 0) {
+                args->legacy = true;
+            } else if (strcmp(argv[i], "--lanes") == 0) {
+                args->lanes = true;
+            } else if (strcmp(argv[i], "--text") == 0) {
+                args->text = true;
+            } else if (strcmp(argv[i], "--max-rate") == 0) {
+                char *end = NULL;
+                if (++i < argc) args->max_rate = strtod(argv[i], &end);
+                if (i >= argc || end == argv[i] || *end != '\0' || args->max_rate <= 0) {
+                    fprintf(stderr, "Provide a positive rate in MB/s after the --max-rate option.\n");
+                    print_usage(argv[0]);
+                    return EINVAL;
+                }
+            } else if (strcmp(argv[i], "--io-class") == 0) {
+                if (++i < argc && strcmp(argv[i], "idle") == 0) {
+                    args->io_class = IO_CLASS_IDLE;
+                } else if (i < argc && strcmp(argv[i], "best-effort") == 0) {
+                    args->io_class = IO_CLASS_BEST_EFFORT;
+                } else {
+                    fprintf(stderr, "Provide idle or best-effort after the --io-class option.\n");
+                    print_usage(argv[0]);
+                    return EINVAL;
+                }
+            } else if (strcmp(argv[i], "--cpu-budget") == 0) {
+                char *end = NULL;
+                long cpus = 0;
+                if (++i < argc) cpus = strtol(argv[i], &end, 10);
+                if (i >= argc || end == argv[i] || *end != '\0' || cpus <= 0 || cpus > 4096) {
+                    fprintf(stderr, "Provide a positive CPU count after the --cpu-budget option.\n");
+                    print_usage(argv[0]);
+                    return EINVAL;
+                }
+                args->cpu_budget = (int)cpus;
+            } else if (strcmp(argv[i], "--level") == 0) {
+                char *end = NULL;
+                long level = 0;
+                if (++i < argc) level = strtol(argv[i], &end, 10);
+                if (i >= argc || end == argv[i] || *end != '\0' || level < MIN_LEVEL || level > CM_LEVEL) {
+                    fprintf(stderr, "Provide a level from %d to %d after the --level option.\n", MIN_LEVEL, CM_LEVEL);
+                    print_usage(argv[0]);
+                    return EINVAL;
+                }
+                args->level = (int)level;
+            } else if (strcmp(argv[i], "--diff") == 0) {
+                if (i + 2 >= argc || args->input_file != NULL) {
+                    fprintf(stderr, "Provide exactly two archives after the --diff option.\n");
+                    print_usage(argv[0]);
+                    return EINVAL;
+                }
+                args->diff_mode = true;
+                args->input_file = argv[++i];
+                args->diff_file = argv[++i];
+            } else if (strcmp(argv[i], "--grep") == 0) {
+                if (args->grep_pattern_count == MAX_GREP_PATTERNS) {
+                    fprintf(stderr, "At most %d --grep patterns can be given.\n", MAX_GREP_PATTERNS);
+                    return EINVAL;
+                }
+                if (++i >= argc || argv[i][0] == '\0' || strchr(argv[i], '\n') != NULL) {
+                    fprintf(stderr, "Provide a non-empty, single-line pattern after the --grep option.\n");
+                    print_usage(argv[0]);
+                    return EINVAL;
+                }
+                if (args->grep_pattern == NULL) args->grep_pattern = argv[i];
+                args->grep_patterns[args->grep_pattern_count++] = argv[i];
+            } else if (strcmp(argv[i], "--deadline") == 0) {
+                char *end = NULL;
+                long ms = 0;
+                if (++i < argc) ms = strtol(argv[i], &end, 10);
+                if (i >= argc || end == argv[i] || *end != '\0' || ms <= 0) {
+                    fprintf(stderr, "Provide a positive number of milliseconds after the --deadline option.\n");
+                    print_usage(argv[0]);
+                    return EINVAL;
+                }
+                args->deadline_ms = ms;
+            } else if (strcmp(argv[i], "--max-memory") == 0) {
+                char *end = NULL;
+                unsigned long long bytes = 0;
+                if (++i < argc) bytes = strtoull(argv[i], &end, 10);
+                if (i < argc && end != argv[i]) {
+                    if (*end == 'K' || *end == 'k') {
+                        bytes <<= 10;
+                        end++;
+                    } else if (*end == 'M' || *end == 'm') {
+                        bytes <<= 20;
+                        end++;
+                    } else if (*end == 'G' || *end == 'g') {
+                        bytes <<= 30;
+                        end++;
+                    }
+                }
+                if (i >= argc || end == argv[i] || *end != '\0' || bytes == 0 || argv[i][0] == '-') {
+                    fprintf(stderr, "Provide a positive size after the --max-memory option.\n");
+                    print_usage(argv[0]);
+                    return EINVAL;
+                }
+                args->max_memory = (size_t)bytes;
             } else {
                 switch (argv[i][1]) {
                     case 'h':
@@ -74,8 +209,13 @@ int parse_arguments(int argc, char* argv[], Arguments *args) {
                         args->no_preserve_perms = true;
                         break;
                     case 'o':
+                        if (args->output_count == MAX_VOLUMES) {
+                            fprintf(stderr, "At most %d output volumes can be given.\n", MAX_VOLUMES);
+                            return EINVAL;
+                        }
                         if (++i < argc) {
-                            args->output_file = argv[i];
+                            if (args->output_file == NULL) args->output_file = argv[i];
+                            args->output_files[args->output_count++] = argv[i];
                         } else {
                             fprintf(stderr, "Provide the output file after the -o option.\n");
                             print_usage(argv[0]);
@@ -114,12 +254,54 @@ int parse_arguments(int argc, char* argv[], Arguments *args) {
         return FILE_READ_ERROR;
     }
 
+    if (args->output_count > 1 && !args->compress_mode) {
+        fprintf(stderr, "Multiple -o volumes are only supported for compression.\n");
+        print_usage(argv[0]);
+        return EINVAL;
+    }
+
+    if (args->consume && (!args->compress_mode || args->directory || args->output_count > 1 || args->legacy)) {
+        fprintf(stderr, "--consume only applies to compressing a single file to a single block-format output.\n");
+        print_usage(argv[0]);
+        return EINVAL;
+    }
+
+    if (args->lanes && (!args->compress_mode || args->legacy)) {
+        fprintf(stderr, "--lanes only applies to compressing to the block format.\n");
+        print_usage(argv[0]);
+        return EINVAL;
+    }
+
+    if (args->text && (!args->compress_mode || args->legacy)) {
+        fprintf(stderr, "--text only applies to compressing to the block format.\n");
+        print_usage(argv[0]);
+        return EINVAL;
+    }
+
+    if (args->deadline_ms > 0 && (!args->compress_mode || args->legacy)) {
+        fprintf(stderr, "--deadline only applies to compressing to the block format.\n");
+        print_usage(argv[0]);
+        return EINVAL;
+    }
+
     if (args->compress_mode && args->extract_mode) {
         fprintf(stderr, "The -c and -x options are mutually exclusive.\n");
         print_usage(argv[0]);
         return EINVAL;
     }
 
+    if (args->diff_mode && (args->compress_mode || args->extract_mode)) {
+        fprintf(stderr, "--diff cannot be combined with -c or -x.\n");
+        print_usage(argv[0]);
+        return EINVAL;
+    }
+
+    if (args->grep_pattern != NULL && (args->compress_mode || args->extract_mode || args->diff_mode)) {
+        fprintf(stderr, "--grep cannot be combined with -c, -x or --diff.\n");
+        print_usage(argv[0]);
+        return EINVAL;
+    }
+
     return SUCCESS;
 }
 
@@ -139,6 +321,25 @@ int main(int argc, char* argv[]){
         return parse_result;
     }
 
+    /* Apply the resource limits before any file is touched; the deadline counts from here. */
+    if (args.deadline_ms > 0) {
+        set_deadline(args.deadline_ms);
+    }
+    if (args.max_rate > 0) {
+        set_rate_limit(args.max_rate);
+    }
+    if (set_io_class(args.io_class) != SUCCESS) {
+        fprintf(stderr, "Warning: Failed to set the I/O scheduling class.\n");
+    }
+    if (args.max_memory > 0) {
+        set_memory_budget(args.max_memory);
+    }
+    if (args.cpu_budget > 0 && set_cpu_budget(args.cpu_budget) != SUCCESS) {
+        fprintf(stderr, "Warning: Failed to apply the CPU budget.\n");
+    }
+    set_lanes(args.lanes);
+    set_words(args.text);
+
     /* Verify that -r truly points to a directory, or disable it if misused. */
     if (args.directory) {
         struct stat st;
@@ -165,12 +366,10 @@ int main(int argc, char* argv[]){
     
     if (args.compress_mode) {
         const char *data = NULL;
-        char *allocated_data = NULL;
         long data_len = 0;
         long directory_size = 0;
         int directory_size_int = 0;
         FILE *temp_file = NULL;
-        bool use_mmap = false;
 
         if (args.directory) {
             temp_file = prepare_directory(args.input_file, &directory_size_int);
@@ -179,18 +378,14 @@ int main(int argc, char* argv[]){
                 return FILE_WRITE_ERROR;
             }
             directory_size = directory_size_int;
-            int read_res = read_from_file(temp_file, &allocated_data);
+            /* Map the serialized tree rather than copying it, so it pages in only as the coder reads it. */
+            long map_res = map_from_file(temp_file, &data);
             fclose(temp_file);
-            if (read_res < 0) {
-                if (read_res == MALLOC_ERROR) {
-                    fprintf(stderr, "Failed to allocate memory.\n");
-                } else {
-                    fprintf(stderr, "Failed to read the serialized data.\n");
-                }
-                return read_res;
+            if (map_res < 0) {
+                fprintf(stderr, "Failed to read the serialized data.\n");
+                return map_res;
             }
-            data = allocated_data;
-            data_len = read_res;
+            data_len = map_res;
         } else {
             int read_res = read_raw(args.input_file, &data);
             if (read_res < 0) {
@@ -207,15 +402,10 @@ int main(int argc, char* argv[]){
             }
             data_len = read_res;
             directory_size = data_len;
-            use_mmap = true;
         }
 
         int compress_res = run_compression(args, data, data_len, directory_size);
-        if (use_mmap) {
-            munmap((void*)data, data_len);
-        } else {
-            free(allocated_data);
-        }
+        munmap((void*)data, data_len);
         return compress_res;
     } else if (args.extract_mode) {
         char *raw_data = NULL;
@@ -224,48 +414,12 @@ int main(int argc, char* argv[]){
         char *original_name = NULL;
 
         int decomp_res = run_decompression(args, &raw_data, &raw_size, &is_dir, &original_name);
-        if (decomp_res != 0) {
-            if (is_dir && raw_data != NULL) free(raw_data);
-            free(original_name);
-            return decomp_res;
-        }
-
-        int res = 0;
-        if (is_dir) {
-            FILE *temp_file = tmpfile();
-            if (temp_file == NULL) {
-                fprintf(stderr, "Failed to create temporary file.\n");
-                free(raw_data);
-                free(original_name);
-                return FILE_WRITE_ERROR;
-            }
-            if (fwrite(raw_data, 1, raw_size, temp_file) != (size_t)raw_size) {
-                fprintf(stderr, "Failed to write the serialized data.\n");
-                fclose(temp_file);
-                free(raw_data);
-                free(original_name);
-                return FILE_WRITE_ERROR;
-            }
-            res = restore_directory(temp_file, args.output_file, args.force, args.no_preserve_perms);
-            fclose(temp_file);
-            if (res < 0) {
-                if (res == FILE_READ_ERROR) {
-                    fprintf(stderr, "Failed to read the serialized data.\n");
-                } else if (res == MALLOC_ERROR) {
-                    fprintf(stderr, "Failed to allocate memory.\n");
-                } else if (res == MKDIR_ERROR) {
-                    fprintf(stderr, "Failed to create a directory.\n");
-                } else if (res == FILE_WRITE_ERROR) {
-                    fprintf(stderr, "Failed to write a file.\n");
-                } else {
-                    fprintf(stderr, "Failed to restore the directory.\n");
-                }
-            }
-            free(raw_data);
-        }
-
         free(original_name);
-        return res;
+        return decomp_res;
+    } else if (args.diff_mode) {
+        return run_diff(args);
+    } else if (args.grep_pattern != NULL) {
+        return run_grep(args);
     }
     else {
         fprintf(stderr, "You must specify one mode (-c or -x).\n");
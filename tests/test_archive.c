@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include "../lib/archive.h"
+#include "../lib/compress.h"
+#include "../lib/directory.h"
+#include "../lib/file.h"
+#include "../lib/data_types.h"
+#include "test_helpers.h"
+#include "../lib/debugmalloc.h"
+
+void test_archive_directory_members() {
+    mkdir("archive_test_dir", 0755);
+    mkdir("archive_test_dir/sub", 0700);
+    write_text("archive_test_dir/config.ini", "[core]\nname=archive\n");
+    write_text("archive_test_dir/sub/asset.txt", "sprite data sprite data sprite data");
+    write_text("archive_test_dir/sub/empty.txt", "");
+
+    int comp_result = compress_path("archive_test_dir", "archive_test.huff", true);
+    assert(comp_result >= 0);
+    (void)comp_result;
+
+    Archive archive;
+    int open_result = archive_open("archive_test.huff", &archive);
+    assert(open_result == SUCCESS);
+    assert(archive.is_dir);
+    assert(archive.member_count == 5);
+    (void)open_result;
+
+    const Archive_member *config = archive_find(&archive, "archive_test_dir/config.ini");
+    assert(config != NULL && !config->is_dir);
+    assert(config->size == strlen("[core]\nname=archive\n"));
+    assert(memcmp(config->data, "[core]\nname=archive\n", config->size) == 0);
+
+    const Archive_member *asset = archive_find(&archive, "archive_test_dir/sub/asset.txt");
+    assert(asset != NULL && asset->size == 35);
+    assert(memcmp(asset->data, "sprite data sprite data sprite data", 35) == 0);
+
+    const Archive_member *empty = archive_find(&archive, "archive_test_dir/sub/empty.txt");
+    assert(empty != NULL && empty->size == 0 && empty->data == NULL);
+
+    const Archive_member *sub = archive_find(&archive, "archive_test_dir/sub");
+    assert(sub != NULL && sub->is_dir && sub->perms == 0700);
+
+    assert(archive_find(&archive, "archive_test_dir/missing.txt") == NULL);
+    (void)config;
+    (void)asset;
+    (void)empty;
+    (void)sub;
+
+    // Members are spans into the decoded image, or into the archive where it is stored as is, not copies.
+    for (size_t i = 0; i < archive.member_count; i++) {
+        const char *path = archive.members[i].path;
+        assert((path >= archive.image && path < archive.image + archive.image_size) ||
+               (path >= archive.mapping && path < archive.mapping + archive.mapping_size));
+        (void)path;
+    }
+    archive_close(&archive);
+
+    remove("archive_test_dir/sub/asset.txt");
+    remove("archive_test_dir/sub/empty.txt");
+    rmdir("archive_test_dir/sub");
+    remove("archive_test_dir/config.ini");
+    rmdir("archive_test_dir");
+    remove("archive_test.huff");
+    printf("test_archive_directory_members passed\n");
+}
+
+void test_archive_single_file() {
+    write_text("archive_single.txt", "one member only, one member only");
+    int comp_result = compress_path("archive_single.txt", "archive_single.huff", false);
+    assert(comp_result >= 0);
+    (void)comp_result;
+
+    Archive archive;
+    int open_result = archive_open("archive_single.huff", &archive);
+    assert(open_result == SUCCESS);
+    assert(!archive.is_dir && archive.member_count == 1);
+    const Archive_member *member = archive_find(&archive, "archive_single.txt");
+    assert(member != NULL && member->size == 32);
+    assert(memcmp(member->data, "one member only, one member only", 32) == 0);
+    (void)open_result;
+    (void)member;
+    archive_close(&archive);
+
+    remove("archive_single.txt");
+    remove("archive_single.huff");
+    printf("test_archive_single_file passed\n");
+}
+
+void test_archive_stored_members() {
+    // Random bytes do not compress, so they are kept in stored blocks.
+    size_t size = 300 * 1024;
+    char *noise = malloc(size);
+    assert(noise != NULL);
+    srand(9);
+    for (size_t i = 0; i < size; i++) noise[i] = (char)rand();
+    FILE *f = fopen("archive_noise.bin", "wb");
+    fwrite(noise, 1, size, f);
+    fclose(f);
+    int comp_result = compress_path("archive_noise.bin", "archive_noise.huff", false);
+    assert(comp_result >= 0);
+
+    // A stored single file is a span into the archive mapping; nothing is decoded.
+    Archive archive;
+    int open_result = archive_open("archive_noise.huff", &archive);
+    assert(open_result == SUCCESS);
+    const Archive_member *member = archive_find(&archive, "archive_noise.bin");
+    assert(member != NULL && member->size == size);
+    assert(archive.image == NULL);
+    assert(member->data >= archive.mapping && member->data + size <= archive.mapping + archive.mapping_size);
+    assert(memcmp(member->data, noise, size) == 0);
+    archive_close(&archive);
+
+    // A directory of incompressible files is stored whole: paths and data all point into the archive.
+    mkdir("archive_noise_dir", 0755);
+    rename("archive_noise.bin", "archive_noise_dir/noise.bin");
+    f = fopen("archive_noise_dir/noise2.bin", "wb");
+    fwrite(noise, 1, size / 2, f);
+    fclose(f);
+    comp_result = compress_path("archive_noise_dir", "archive_noise.huff", true);
+    assert(comp_result >= 0);
+    open_result = archive_open("archive_noise.huff", &archive);
+    assert(open_result == SUCCESS);
+    assert(archive.image == NULL && archive.member_count == 3);
+    for (size_t i = 0; i < archive.member_count; i++) {
+        const Archive_member *m = &archive.members[i];
+        assert(m->path >= archive.mapping && m->path < archive.mapping + archive.mapping_size);
+        assert(m->is_dir || (m->data >= archive.mapping && m->data + m->size <= archive.mapping + archive.mapping_size));
+        (void)m;
+    }
+    member = archive_find(&archive, "archive_noise_dir/noise2.bin");
+    assert(member != NULL && member->size == size / 2 && memcmp(member->data, noise, size / 2) == 0);
+    archive_close(&archive);
+
+    // Beside compressible text the directory is decoded; its members still read back the same.
+    char *notes_text = malloc(64 * 1024 + 1);
+    assert(notes_text != NULL);
+    for (int i = 0; i < 64 * 1024; i++) notes_text[i] = "notes "[i % 6];
+    notes_text[64 * 1024] = '\0';
+    write_text("archive_noise_dir/notes.txt", notes_text);
+    comp_result = compress_path("archive_noise_dir", "archive_noise.huff", true);
+    assert(comp_result >= 0);
+    (void)comp_result;
+    open_result = archive_open("archive_noise.huff", &archive);
+    assert(open_result == SUCCESS && archive.image != NULL);
+    (void)open_result;
+    member = archive_find(&archive, "archive_noise_dir/noise.bin");
+    assert(member != NULL && member->size == size && memcmp(member->data, noise, size) == 0);
+    const Archive_member *notes = archive_find(&archive, "archive_noise_dir/notes.txt");
+    assert(notes != NULL && notes->size == 64 * 1024 && memcmp(notes->data, notes_text, notes->size) == 0);
+    (void)member;
+    (void)notes;
+    archive_close(&archive);
+
+    remove("archive_noise_dir/noise.bin");
+    remove("archive_noise_dir/noise2.bin");
+    remove("archive_noise_dir/notes.txt");
+    rmdir("archive_noise_dir");
+    remove("archive_noise.huff");
+    free(notes_text);
+    free(noise);
+    printf("test_archive_stored_members passed\n");
+}
+
+void test_archive_rejects_garbage() {
+    write_text("archive_garbage.huff", "this is not an archive at all");
+    Archive archive;
+    int open_result = archive_open("archive_garbage.huff", &archive);
+    assert(open_result < 0);
+    assert(archive.members == NULL && archive.image == NULL);
+    (void)open_result;
+    remove("archive_garbage.huff");
+    printf("test_archive_rejects_garbage passed\n");
+}
+
+int main() {
+    test_archive_directory_members();
+    test_archive_single_file();
+    test_archive_stored_members();
+    test_archive_rejects_garbage();
+    printf("All archive tests passed!\n");
+    return 0;
+}
@@ -9,7 +9,11 @@
 #include <dirent.h>
 #include "../lib/file.h"
 #include "../lib/compress.h"
+#include "../lib/block.h"
+#include "../lib/table_cache.h"
+#include "../lib/throttle.h"
 #include "../lib/data_types.h"
+#include "test_helpers.h"
 #include "../lib/debugmalloc.h"
 #include "../lib/directory.h"
 
@@ -153,7 +157,7 @@ static void test_compress_basic_pattern(void) {
     assert(compressed.compressed_data[0] == (char)0xF0);
     (void)rc;
 
-    free(compressed.compressed_data);
+    free_bitstream(compressed.compressed_data, compressed.data_size);
     free_cache(cache);
     free(nodes);
 }
@@ -175,6 +179,376 @@ static void test_compress_zero_length(void) {
     free_cache(cache);
 }
 
+static void test_compress_pair_encoder_matches_paths(void) {
+    // Large enough to take the byte-pair encoder; 16 skewed symbols keep codes short.
+    const long len = 300 * 1024 + 1; // Odd length exercises the single trailing symbol.
+    char *input = malloc(len);
+    assert(input != NULL);
+    srand(7);
+    for (long i = 0; i < len; i++) {
+        int r = rand() % 100;
+        input[i] = (char)('a' + (r < 50 ? r % 4 : r % 16));
+    }
+
+    Node *nodes = NULL;
+    Node *root = NULL;
+    build_huffman_tree(input, len, &nodes, &root);
+
+    Huffman_code codes[256];
+    int max_length = build_code_table(nodes, root, codes);
+    assert(max_length >= 1 && max_length <= 12);
+
+    char **cache = calloc(256, sizeof(char *));
+    assert(cache != NULL);
+    Compressed_file compressed = {0};
+    int rc = compress(input, len, nodes, root, cache, &compressed);
+    assert(rc == 0);
+    (void)rc;
+    (void)max_length;
+
+    // Re-encode bit by bit from the tree paths and compare.
+    size_t bit = 0;
+    for (long i = 0; i < len; i++) {
+        char *path = find_leaf(input[i], nodes, root);
+        assert(path != NULL);
+        for (int j = 0; path[j] != '\0'; j++, bit++) {
+            int stored = (compressed.compressed_data[bit / 8] >> (7 - bit % 8)) & 1;
+            assert(stored == (path[j] == '1'));
+            (void)stored;
+        }
+        free(path);
+    }
+    assert(compressed.data_size == bit);
+
+    free_bitstream(compressed.compressed_data, compressed.data_size);
+    free_cache(cache);
+    free(nodes);
+    free(input);
+}
+
+static void test_compress_sliced_matches_serial(void) {
+    // Codes of several lengths so slice boundaries fall at every bit phase.
+    const size_t len = 200 * 1024 + 3;
+    unsigned char *input = malloc(len);
+    assert(input != NULL);
+    srand(11);
+    for (size_t i = 0; i < len; i++) {
+        int r = rand() % 100;
+        input[i] = (unsigned char)(r < 60 ? 'a' + r % 3 : r);
+    }
+    long frequencies[256] = {0};
+    unsigned long long work[256];
+    unsigned long long scratch[256];
+    unsigned char lengths[256];
+    count_frequencies((const char *)input, len, frequencies);
+    compute_code_lengths(frequencies, 256, work, scratch, lengths, PAIR_MAX_CODE_LENGTH);
+    Huffman_code codes[256];
+    canonical_codes(lengths, codes);
+    Huffman_code *pair_table = malloc(PAIR_TABLE_ENTRIES * sizeof(Huffman_code));
+    assert(pair_table != NULL);
+    build_pair_table(codes, pair_table);
+
+    char *serial = malloc(len);
+    assert(serial != NULL);
+    size_t serial_bits = compress_codes(input, len, codes, serial);
+    for (int slices = 1; slices <= 7; slices++) {
+        Encode_slice cut[MAX_ENCODE_SLICES];
+        int count = cut_slices((const char *)input, len, false, slices, cut);
+        assert(count == slices);
+        count_slices(cut, count);
+        char *sliced = NULL;
+        long bits = compress_sliced(cut, count, codes, (slices % 2) ? pair_table : NULL, &sliced);
+        assert(bits == (long)serial_bits);
+        assert(memcmp(sliced, serial, (serial_bits + 7) / 8) == 0);
+        (void)bits;
+        free_bitstream(sliced, serial_bits);
+    }
+
+    free(serial);
+    free(pair_table);
+    free(input);
+}
+
+static void test_member_slices_share_one_table(void) {
+    // Ten members of 40 KiB: four slices should end exactly where members do.
+    mkdir("slice_dir", 0755);
+    srand(13);
+    char *content = malloc(40 * 1024);
+    assert(content != NULL);
+    for (int f = 0; f < 10; f++) {
+        char path[64];
+        snprintf(path, sizeof(path), "slice_dir/member%d.txt", f);
+        for (int i = 0; i < 40 * 1024; i++) content[i] = (char)('a' + (rand() % (f + 3)));
+        FILE *out = fopen(path, "wb");
+        assert(out != NULL);
+        fwrite(content, 1, 40 * 1024, out);
+        fclose(out);
+    }
+    free(content);
+
+    int directory_size = 0;
+    FILE *temp_file = prepare_directory("slice_dir", &directory_size);
+    assert(temp_file != NULL);
+    const char *data = NULL;
+    long data_len = map_from_file(temp_file, &data);
+    fclose(temp_file);
+    assert(data_len > 0);
+
+    Encode_slice slices[MAX_ENCODE_SLICES];
+    int count = cut_slices(data, data_len, true, 4, slices);
+    assert(count >= 2 && count <= 4);
+    size_t covered = 0;
+    for (int i = 0; i < count; i++) {
+        assert((const char *)slices[i].data == data + covered);
+        covered += slices[i].length;
+        // Every cut is an item boundary: the next slice starts with a whole item.
+        Directory_item item;
+        if (covered < (size_t)data_len) {
+            long used = parse_item(&item, data + covered, data_len - covered);
+            assert(used > 0);
+            (void)used;
+        }
+    }
+    assert(covered == (size_t)data_len);
+
+    // The merged histograms give one table, and the slices encode to the serial bitstream.
+    count_slices(slices, count);
+    long frequencies[256] = {0};
+    for (int i = 0; i < count; i++) {
+        for (int symbol = 0; symbol < 256; symbol++) frequencies[symbol] += slices[i].histogram[symbol];
+    }
+    unsigned long long work[256];
+    unsigned long long scratch[256];
+    unsigned char lengths[256];
+    compute_code_lengths(frequencies, 256, work, scratch, lengths, 0);
+    Huffman_code codes[256];
+    canonical_codes(lengths, codes);
+    char *serial = malloc(data_len);
+    char *sliced = malloc(data_len);
+    assert(serial != NULL && sliced != NULL);
+    size_t serial_bits = compress_codes((const unsigned char *)data, data_len, codes, serial);
+    size_t bits = place_slices(slices, count, codes);
+    assert(bits == serial_bits);
+    encode_slices(slices, count, codes, NULL, sliced);
+    assert(memcmp(sliced, serial, (serial_bits + 7) / 8) == 0);
+    (void)bits;
+    (void)count;
+
+    free(serial);
+    free(sliced);
+    munmap((void *)data, data_len);
+    remove_directory_recursive("slice_dir");
+}
+
+static void test_split_blocks_follows_statistics(void) {
+    // Text followed by uniformly random bytes: the statistics change sharply at 64 KiB.
+    size_t half = 64 * 1024;
+    unsigned char *data = malloc(2 * half);
+    assert(data != NULL);
+    srand(5);
+    for (size_t i = 0; i < half; i++) data[i] = "etaoin shrdlu"[rand() % 13];
+    for (size_t i = half; i < 2 * half; i++) data[i] = (unsigned char)rand();
+
+    size_t *ends = NULL;
+    long count = split_blocks(data, 2 * half, 1, 0, &ends);
+    assert(count == 1 && ends[0] == 2 * half);
+    free(ends);
+
+    count = split_blocks(data, 2 * half, DEFAULT_LEVEL, 0, &ends);
+    assert(count >= 2);
+    bool boundary = false;
+    for (long i = 0; i < count; i++) {
+        if (ends[i] == half) boundary = true;
+    }
+    assert(boundary);
+    assert(ends[count - 1] == 2 * half);
+    free(ends);
+    (void)boundary;
+
+    // The optimal split is never larger than the greedy one, and both beat a single block.
+    Compressed_file single = {0};
+    Compressed_file greedy = {0};
+    Compressed_file optimal = {0};
+    int result = map_blocks((const char *)data, 2 * half, 1, &single);
+    assert(result == SUCCESS);
+    result = map_blocks((const char *)data, 2 * half, DEFAULT_LEVEL, &greedy);
+    assert(result == SUCCESS);
+    result = map_blocks((const char *)data, 2 * half, MAX_LEVEL, &optimal);
+    assert(result == SUCCESS);
+    (void)result;
+    assert(optimal.block_data_size <= greedy.block_data_size);
+    assert(greedy.block_data_size < single.block_data_size);
+    assert(memcmp(greedy.magic, block_magic, sizeof(block_magic)) == 0);
+
+    unmap_blocks(&single);
+    unmap_blocks(&greedy);
+    unmap_blocks(&optimal);
+    free(data);
+}
+
+static void test_write_blocks_meets_deadline(void) {
+    size_t length = 3 * 1024 * 1024;
+    debugmalloc_max_block_size(8 * 1024 * 1024);
+    unsigned char *data = malloc(length);
+    assert(data != NULL);
+    srand(17);
+    for (size_t i = 0; i < length; i++) data[i] = "etaoin shrdlu\n"[rand() % 14];
+
+    // Ample time changes nothing for input that fits one paced segment.
+    Compressed_file unpaced = {0};
+    Compressed_file paced = {0};
+    int result = map_blocks((const char *)data, 512 * 1024, MAX_LEVEL, &unpaced);
+    assert(result == SUCCESS);
+    set_deadline(60 * 1000);
+    result = map_blocks((const char *)data, 512 * 1024, MAX_LEVEL, &paced);
+    assert(result == SUCCESS);
+    assert(paced.block_data_size == unpaced.block_data_size);
+    assert(memcmp(paced.block_data, unpaced.block_data, paced.block_data_size) == 0);
+
+    // Past the deadline every block is stored, and the blocks still hold the whole input.
+    Compressed_file late = {0};
+    set_deadline(1);
+    struct timespec pause = {0, 5 * 1000 * 1000};
+    nanosleep(&pause, NULL);
+    result = map_blocks((const char *)data, length, MAX_LEVEL, &late);
+    assert(result == SUCCESS);
+    set_deadline(0);
+    assert(!deadline_enabled());
+    size_t offset = 0;
+    size_t restored = 0;
+    while (offset < late.block_data_size) {
+        Block_header header;
+        memcpy(&header, late.block_data + offset, sizeof(header));
+        assert(header.method == BLOCK_STORED);
+        assert(memcmp(late.block_data + offset + sizeof(header), data + restored, header.raw_size) == 0);
+        restored += header.raw_size;
+        offset += sizeof(header) + header.payload_size;
+    }
+    assert(restored == length);
+    (void)result;
+    (void)restored;
+
+    unmap_blocks(&unpaced);
+    unmap_blocks(&paced);
+    unmap_blocks(&late);
+    free(data);
+}
+
+static void test_code_lengths_match_tree_cost(void) {
+    long frequencies[256] = {0};
+    srand(11);
+    for (int i = 0; i < 256; i++) {
+        frequencies[i] = (i % 3 == 0) ? 0 : 1 + rand() % (1 + i * i);
+    }
+    unsigned long long work[256];
+    unsigned long long scratch[256];
+    unsigned char lengths[256];
+    int count = compute_code_lengths(frequencies, 256, work, scratch, lengths, 0);
+
+    // Same total cost as the node-based tree.
+    Node nodes[511];
+    int leaves = 0;
+    for (int i = 0; i < 256; i++) {
+        if (frequencies[i] != 0) nodes[leaves++] = construct_leaf(frequencies[i], (char)i);
+    }
+    assert(count == leaves);
+    sort_nodes(nodes, leaves);
+    Node *root = construct_tree(nodes, leaves);
+    Huffman_code codes[256];
+    build_code_table(nodes, root, codes);
+    long long tree_cost = 0;
+    long long engine_cost = 0;
+    for (int i = 0; i < 256; i++) {
+        tree_cost += frequencies[i] * codes[i].length;
+        engine_cost += frequencies[i] * lengths[i];
+    }
+    assert(tree_cost == engine_cost);
+
+    // The canonical tree realises exactly those lengths.
+    long node_count = build_canonical_tree(lengths, nodes);
+    assert(node_count == 2 * count - 1);
+    build_code_table(nodes, &nodes[node_count - 1], codes);
+    for (int i = 0; i < 256; i++) {
+        assert(codes[i].length == lengths[i]);
+    }
+
+    // Limiting keeps every code within the bound and the code complete.
+    count = compute_code_lengths(frequencies, 256, work, scratch, lengths, 9);
+    unsigned long kraft = 0;
+    for (int i = 0; i < 256; i++) {
+        assert(lengths[i] <= 9);
+        if (lengths[i] > 0) kraft += 1UL << (9 - lengths[i]);
+    }
+    assert(kraft == 1UL << 9);
+    (void)tree_cost;
+    (void)engine_cost;
+    (void)node_count;
+    (void)kraft;
+}
+
+static void test_approximate_code_lengths(void) {
+    long frequencies[256] = {0};
+    unsigned long long work[256];
+    unsigned long long scratch[256];
+    unsigned char optimal[256];
+    unsigned char lengths[256];
+    srand(12);
+    for (int round = 0; round < 50; round++) {
+        int alphabet = 2 + rand() % 255;
+        memset(frequencies, 0, sizeof(frequencies));
+        for (int i = 0; i < alphabet; i++) {
+            frequencies[rand() % 256] = 1 + rand() % (1 + (rand() % 4 == 0 ? 100000 : 100));
+        }
+        int count = compute_code_lengths(frequencies, 256, work, scratch, optimal, BLOCK_MAX_CODE_LENGTH);
+        int approximate = approximate_code_lengths(frequencies, lengths, BLOCK_MAX_CODE_LENGTH);
+        assert(approximate == count);
+
+        // A complete, limited code, only slightly longer than the optimal one.
+        unsigned long kraft = 0;
+        long long optimal_cost = 0;
+        long long approximate_cost = 0;
+        for (int i = 0; i < 256; i++) {
+            assert((lengths[i] == 0) == (frequencies[i] == 0) || count == 1);
+            assert(lengths[i] <= BLOCK_MAX_CODE_LENGTH);
+            if (lengths[i] > 0) kraft += 1UL << (BLOCK_MAX_CODE_LENGTH - lengths[i]);
+            optimal_cost += frequencies[i] * optimal[i];
+            approximate_cost += frequencies[i] * lengths[i];
+        }
+        assert(count == 1 || kraft == 1UL << BLOCK_MAX_CODE_LENGTH);
+        assert(approximate_cost * 100 <= optimal_cost * 105);
+        (void)approximate;
+        (void)kraft;
+        (void)optimal_cost;
+        (void)approximate_cost;
+    }
+
+    // Level 1 blocks use these lengths and still decode to the input.
+    size_t length = 200 * 1024;
+    unsigned char *data = malloc(length);
+    assert(data != NULL);
+    for (size_t i = 0; i < length; i++) data[i] = "aaaabbbcd  \n"[rand() % 12];
+    Compressed_file fast = {0};
+    Compressed_file optimal_blocks = {0};
+    int result = map_blocks((const char *)data, length, MIN_LEVEL, &fast);
+    assert(result == SUCCESS);
+    result = map_blocks((const char *)data, length, 2, &optimal_blocks);
+    assert(result == SUCCESS);
+    assert(fast.block_data_size * 100 <= optimal_blocks.block_data_size * 105);
+    Block_header header;
+    memcpy(&header, fast.block_data, sizeof(header));
+    assert(header.method == BLOCK_HUFFMAN && header.raw_size == length);
+    unpack_lengths((const unsigned char *)fast.block_data + sizeof(header), lengths);
+    long histogram[256] = {0};
+    for (size_t i = 0; i < length; i++) histogram[data[i]]++;
+    approximate_code_lengths(histogram, optimal, BLOCK_MAX_CODE_LENGTH);
+    assert(memcmp(lengths, optimal, 256) == 0);
+    (void)result;
+
+    unmap_blocks(&fast);
+    unmap_blocks(&optimal_blocks);
+    free(data);
+}
+
 /* ===== Tests for run_compression function ===== */
 
 static void test_run_compression_basic_file(void) {
@@ -428,7 +802,7 @@ static void test_compress_single_char(void) {
     assert(compressed.data_size == 1);
     assert(compressed.compressed_data != NULL);
     
-    free(compressed.compressed_data);
+    free_bitstream(compressed.compressed_data, compressed.data_size);
     free_cache(cache);
     free(nodes);
 }
@@ -452,7 +826,7 @@ static void test_compress_all_same_char(void) {
     assert(compressed.compressed_data != NULL);
     (void)rc;
     
-    free(compressed.compressed_data);
+    free_bitstream(compressed.compressed_data, compressed.data_size);
     free_cache(cache);
     free(nodes);
 }
@@ -474,7 +848,7 @@ static void test_compress_all_unique_chars(void) {
     assert(compressed.compressed_data != NULL);
     (void)rc;
     
-    free(compressed.compressed_data);
+    free_bitstream(compressed.compressed_data, compressed.data_size);
     free_cache(cache);
     free(nodes);
 }
@@ -499,7 +873,7 @@ static void test_compress_binary_data(void) {
     assert(compressed.compressed_data != NULL);
     (void)rc;
     
-    free(compressed.compressed_data);
+    free_bitstream(compressed.compressed_data, compressed.data_size);
     free_cache(cache);
     free(nodes);
 }
@@ -696,6 +1070,13 @@ static void test_run_compression_single_byte_file(void) {
 int main(void) {
     test_compress_basic_pattern();
     test_compress_zero_length();
+    test_compress_pair_encoder_matches_paths();
+    test_compress_sliced_matches_serial();
+    test_member_slices_share_one_table();
+    test_code_lengths_match_tree_cost();
+    test_approximate_code_lengths();
+    test_split_blocks_follows_statistics();
+    test_write_blocks_meets_deadline();
     
     // run_compression tests
     test_run_compression_basic_file();
@@ -4,21 +4,31 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include "../lib/compress.h"
 #include "../lib/decompress.h"
 #include "../lib/file.h"
 #include "../lib/data_types.h"
+#include "test_helpers.h"
 #include "../lib/debugmalloc.h"
 #include "../lib/directory.h"
+#include "../lib/table_cache.h"
+#include "../lib/stream.h"
+#include "../lib/pipe.h"
+#include "../lib/restore.h"
+#include "../lib/block.h"
+#include "../lib/throttle.h"
+#include "../lib/index.h"
+#include "../lib/cm.h"
 
 static int invoke_run_compression(Arguments args) {
     char *data = NULL;
-    char *allocated_data = NULL;
     long data_len = 0;
     long directory_size = 0;
-    bool use_mmap = false;
 
     if (args.directory) {
         int directory_size_int = 0;
@@ -27,13 +37,13 @@ static int invoke_run_compression(Arguments args) {
             return FILE_WRITE_ERROR;
         }
         directory_size = directory_size_int;
-        int read_res = read_from_file(temp_file, &allocated_data);
+        // Mapped like the command line does, so trees larger than the allocator limit can be compressed.
+        long map_res = map_from_file(temp_file, (const char **)&data);
         fclose(temp_file);
-        if (read_res < 0) {
-            return read_res;
+        if (map_res < 0) {
+            return map_res;
         }
-        data = allocated_data;
-        data_len = read_res;
+        data_len = map_res;
     } else {
         int read_res = read_raw(args.input_file, (const char**)&data);
         if (read_res < 0) {
@@ -41,14 +51,11 @@ static int invoke_run_compression(Arguments args) {
         }
         data_len = read_res;
         directory_size = data_len;
-        use_mmap = true;
     }
 
     int result = run_compression(args, data, data_len, directory_size);
-    if (use_mmap) {
+    if (data_len > 0) {
         munmap((void*)data, data_len);
-    } else {
-        free(allocated_data);
     }
     return result;
 }
@@ -60,32 +67,6 @@ static int invoke_run_decompression(Arguments args) {
     char *original_name = NULL;
 
     int res = run_decompression(args, &raw_data, &raw_size, &is_dir, &original_name);
-    if (res != 0) {
-        if (is_dir && raw_data != NULL) free(raw_data);
-        free(original_name);
-        return res;
-    }
-
-    if (is_dir) {
-        FILE *temp_file = tmpfile();
-        if (temp_file == NULL) {
-            fprintf(stderr, "Failed to create temporary file.\n");
-            free(raw_data);
-            free(original_name);
-            return FILE_WRITE_ERROR;
-        }
-        if (fwrite(raw_data, 1, raw_size, temp_file) != (size_t)raw_size) {
-            fprintf(stderr, "Failed to write the serialized data.\n");
-            fclose(temp_file);
-            free(raw_data);
-            free(original_name);
-            return FILE_WRITE_ERROR;
-        }
-        res = restore_directory(temp_file, args.output_file, args.force, args.no_preserve_perms);
-        fclose(temp_file);
-        free(raw_data);
-    }
-
     free(original_name);
     return res;
 }
@@ -157,7 +138,7 @@ int main() {
             }
         }
         free(cache);
-        free(compressed_file->compressed_data);
+        free_bitstream(compressed_file->compressed_data, compressed_file->data_size);
         free(compressed_file);
         free(raw_data);
         return 4;
@@ -178,7 +159,7 @@ int main() {
         }
     }
     free(cache);
-    free(compressed_file->compressed_data);
+    free_bitstream(compressed_file->compressed_data, compressed_file->data_size);
     free(compressed_file);
     free(raw_data);
 
@@ -421,7 +402,7 @@ int main() {
             if (single_cache[i] != NULL) free(single_cache[i]);
         }
         free(single_cache);
-        free(single_compressed->compressed_data);
+        free_bitstream(single_compressed->compressed_data, single_compressed->data_size);
         free(single_compressed);
         free(single_raw);
         printf("    Single character test passed.\n");
@@ -472,7 +453,7 @@ int main() {
             if (pattern_cache[i] != NULL) free(pattern_cache[i]);
         }
         free(pattern_cache);
-        free(pattern_compressed->compressed_data);
+        free_bitstream(pattern_compressed->compressed_data, pattern_compressed->data_size);
         free(pattern_compressed);
         free(pattern_raw);
         printf("    Repeating pattern test passed.\n");
@@ -526,7 +507,7 @@ int main() {
             if (ascii_cache[i] != NULL) free(ascii_cache[i]);
         }
         free(ascii_cache);
-        free(ascii_compressed->compressed_data);
+        free_bitstream(ascii_compressed->compressed_data, ascii_compressed->data_size);
         free(ascii_compressed);
         free(ascii_raw);
         printf("    All printable ASCII test passed.\n");
@@ -577,7 +558,7 @@ int main() {
             if (binary_cache[i] != NULL) free(binary_cache[i]);
         }
         free(binary_cache);
-        free(binary_compressed->compressed_data);
+        free_bitstream(binary_compressed->compressed_data, binary_compressed->data_size);
         free(binary_compressed);
         free(binary_raw);
         printf("    Binary data with nulls test passed.\n");
@@ -666,6 +647,1000 @@ int main() {
         printf("    Large file round-trip test passed.\n");
     }
     
+    // Edge case 7: Archive striped across several volumes
+    printf("  Edge case 7: Striped multi-volume round-trip...\n");
+    {
+        char *striped_input = "test_striped_input.txt";
+        char *striped_output = "test_striped_output.txt";
+        char *volumes[] = {"test_striped.vol0.huff", "test_striped.vol1.huff", "test_striped.vol2.huff"};
+
+        // Enough varied data for the compressed image to span several 1 MB stripes.
+        FILE *sf = fopen(striped_input, "w");
+        assert(sf != NULL);
+        srand(42);
+        for (int i = 0; i < 4 * 1024 * 1024; i++) {
+            fputc('a' + rand() % 26, sf);
+        }
+        fclose(sf);
+
+        // Back to the default allocation limit: neither side may hold the whole image in one block.
+        debugmalloc_max_block_size(1024 * 1024);
+        Arguments compress_args = {0};
+        compress_args.compress_mode = true;
+        compress_args.force = true;
+        compress_args.input_file = striped_input;
+        compress_args.output_file = volumes[0];
+        compress_args.output_count = 3;
+        for (int i = 0; i < 3; i++) compress_args.output_files[i] = volumes[i];
+        // A small budget makes the coded batches straddle the stripe boundaries.
+        set_memory_budget(1024 * 1024);
+        int comp_result = invoke_run_compression(compress_args);
+        set_memory_budget(0);
+        assert(comp_result == 0);
+
+        // Every volume carries a share of the stripes.
+        for (int i = 0; i < 3; i++) {
+            struct stat st;
+            assert(stat(volumes[i], &st) == 0);
+            assert(st.st_size > 256 * 1024);
+        }
+
+        Arguments decomp_args = {0};
+        decomp_args.extract_mode = true;
+        decomp_args.force = true;
+        decomp_args.input_file = volumes[0];
+        decomp_args.output_file = striped_output;
+        int decomp_result = invoke_run_decompression(decomp_args);
+        assert(decomp_result == 0);
+
+        const char *original_content = NULL;
+        const char *decompressed_content = NULL;
+        int orig_size = read_raw(striped_input, &original_content);
+        int decomp_size = read_raw(striped_output, &decompressed_content);
+        assert(orig_size == decomp_size);
+        assert(memcmp(original_content, decompressed_content, orig_size) == 0);
+        munmap((void*)original_content, orig_size);
+        munmap((void*)decompressed_content, decomp_size);
+
+        // A missing volume makes the archive unreadable instead of silently truncated.
+        remove(volumes[2]);
+        decomp_result = invoke_run_decompression(decomp_args);
+        assert(decomp_result != 0);
+
+        for (int i = 0; i < 3; i++) remove(volumes[i]);
+        remove(striped_input);
+        remove(striped_output);
+        debugmalloc_max_block_size(10 * 1024 * 1024);
+        printf("    Striped multi-volume round-trip test passed.\n");
+    }
+
+    // Edge case 8: Codes longer than the widest decode table
+    printf("  Edge case 8: Deep Huffman tree round-trip...\n");
+    {
+        char *deep_input = "test_deep_input.bin";
+        char *deep_compressed = "test_deep_input.huff";
+        char *deep_output = "test_deep_output.bin";
+
+        // Fibonacci frequencies give a maximally skewed tree, about 20 levels deep.
+        FILE *df = fopen(deep_input, "wb");
+        assert(df != NULL);
+        long a = 1, b = 1;
+        for (int symbol = 0; symbol < 21; symbol++) {
+            for (long k = 0; k < a; k++) fputc(symbol * 7, df);
+            long next = a + b;
+            a = b;
+            b = next;
+        }
+        fclose(df);
+
+        Arguments compress_args = {0};
+        compress_args.compress_mode = true;
+        compress_args.force = true;
+        compress_args.input_file = deep_input;
+        compress_args.output_file = deep_compressed;
+        int comp_result = invoke_run_compression(compress_args);
+        assert(comp_result == 0);
+
+        Arguments decomp_args = {0};
+        decomp_args.extract_mode = true;
+        decomp_args.force = true;
+        decomp_args.input_file = deep_compressed;
+        decomp_args.output_file = deep_output;
+        int decomp_result = invoke_run_decompression(decomp_args);
+        assert(decomp_result == 0);
+
+        const char *original_content = NULL;
+        const char *decompressed_content = NULL;
+        int orig_size = read_raw(deep_input, &original_content);
+        int decomp_size = read_raw(deep_output, &decompressed_content);
+        assert(orig_size == decomp_size);
+        assert(memcmp(original_content, decompressed_content, orig_size) == 0);
+        munmap((void*)original_content, orig_size);
+        munmap((void*)decompressed_content, decomp_size);
+        (void)comp_result;
+        (void)decomp_result;
+
+        remove(deep_input);
+        remove(deep_compressed);
+        remove(deep_output);
+        printf("    Deep Huffman tree round-trip test passed.\n");
+    }
+
+    // Edge case 9: Decode-table cache keyed by code lengths
+    printf("  Edge case 9: Decode-table cache...\n");
+    {
+        long frequencies[256] = {0};
+        for (int i = 0; i < 40; i++) frequencies['A' + i] = 1 + i * 3;
+        unsigned long long work[256];
+        unsigned long long scratch[256];
+        unsigned char lengths[256];
+        compute_code_lengths(frequencies, 256, work, scratch, lengths, 0);
+        Node tree[511];
+        long node_count = build_canonical_tree(lengths, tree);
+
+        unsigned char signature[256];
+        int canonical = tree_signature(tree, node_count, signature);
+        assert(canonical == 1);
+        assert(memcmp(signature, lengths, 256) == 0);
+        (void)canonical;
+
+        Decode_entry built[1 << 12];
+        Decode_entry cached[1 << 12];
+        Huffman_code codes[256];
+        int width = build_decode_table(tree, node_count, built);
+        canonical_codes(lengths, codes);
+        store_tables(lengths, built, width, codes);
+
+        int cached_width = 0;
+        bool hit = lookup_tables(signature, cached, &cached_width, NULL);
+        assert(hit);
+        assert(cached_width == width);
+        assert(memcmp(cached, built, (1 << width) * sizeof(Decode_entry)) == 0);
+
+        // The cache is bounded: enough other signatures evict the first one.
+        for (int n = 0; n < 32; n++) {
+            unsigned char other[256] = {0};
+            for (int i = 0; i <= n + 1; i++) other[i] = (i <= n) ? i + 1 : n + 1;
+            store_tables(other, built, width, codes);
+        }
+        hit = lookup_tables(signature, cached, &cached_width, NULL);
+        assert(!hit);
+        (void)hit;
+
+        // Branches that share a child would make every walk of the tree take 2^40 steps: rejected up front.
+        Node shared[42];
+        shared[0] = construct_leaf(1, 'a');
+        shared[1] = construct_leaf(1, 'b');
+        for (int i = 2; i < 42; i++) shared[i] = construct_branch(shared, i - 1, i - 1);
+        assert(!valid_tree(shared, 42));
+        canonical = tree_signature(shared, 42, signature);
+        assert(canonical == 0);
+        width = build_decode_table(shared, 42, built);
+        assert(width == DECOMPRESSION_ERROR);
+        Compressed_file crafted = {0};
+        char crafted_bits[8] = {0};
+        char crafted_out[8];
+        crafted.huffman_tree = shared;
+        crafted.tree_size = sizeof(shared);
+        crafted.compressed_data = crafted_bits;
+        crafted.data_size = 64;
+        crafted.original_size = sizeof(crafted_out);
+        int crafted_result = decompress(&crafted, crafted_out);
+        assert(crafted_result == DECOMPRESSION_ERROR);
+        (void)crafted_result;
+        // So are a child placed after its branch and a node no branch reaches.
+        shared[2] = construct_branch(shared, 0, 3);
+        assert(!valid_tree(shared, 3));
+        shared[2] = construct_branch(shared, 0, 1);
+        assert(valid_tree(shared, 3));
+        shared[3] = construct_branch(shared, 0, 1);
+        assert(!valid_tree(shared, 4));
+        printf("    Decode-table cache test passed.\n");
+    }
+
+    // Edge case 10: Resumable decoder fed in arbitrary small pieces
+    printf("  Edge case 10: Resumable stream decoder...\n");
+    {
+        char stream_input[] = "test_stream_input.txt";
+        char stream_compressed[] = "test_stream_input.huff";
+        size_t content_size = 200000;
+        char *content = malloc(content_size);
+        assert(content != NULL);
+        // Skewed text plus rare bytes, so both short table codes and long walked codes occur.
+        srand(7);
+        for (size_t i = 0; i < content_size; i++) {
+            content[i] = (rand() % 50 == 0) ? (char)(rand() % 256) : "eeeetttaaoinshr"[rand() % 15];
+        }
+        FILE *f = fopen(stream_input, "wb");
+        fwrite(content, 1, content_size, f);
+        fclose(f);
+
+        Arguments compress_args = {0};
+        compress_args.compress_mode = true;
+        compress_args.force = true;
+        compress_args.input_file = stream_input;
+        compress_args.output_file = stream_compressed;
+        int comp_result = invoke_run_compression(compress_args);
+        assert(comp_result == 0);
+        (void)comp_result;
+
+        const char *archive = NULL;
+        int archive_size = read_raw(stream_compressed, &archive);
+        assert(archive_size > 0);
+
+        static Stream_decoder decoder;
+        stream_decoder_init(&decoder);
+        char *decoded = malloc(content_size);
+        assert(decoded != NULL);
+        size_t in_pos = 0;
+        size_t out_pos = 0;
+        int status = SUCCESS;
+        bool done = false;
+        while (status == SUCCESS && !done) {
+            size_t in_len = 1 + rand() % 37;
+            size_t out_cap = 1 + rand() % 53;
+            if (in_len > archive_size - in_pos) in_len = archive_size - in_pos;
+            if (out_cap > content_size - out_pos) out_cap = content_size - out_pos;
+            size_t in_used = 0;
+            size_t out_len = 0;
+            status = stream_decode(&decoder, archive + in_pos, in_len, &in_used, decoded + out_pos, out_cap, &out_len, &done);
+            in_pos += in_used;
+            out_pos += out_len;
+        }
+        assert(status == SUCCESS && done);
+        // The decoder stops at the end of the payload, before the member index.
+        char *index = NULL;
+        long index_size = build_index(content, content_size, false, stream_input, &index);
+        assert(index_size > 0);
+        assert(in_pos + index_size == (size_t)archive_size);
+        assert(memcmp(archive + in_pos, index, index_size) == 0);
+        free(index);
+        assert(out_pos == content_size);
+        assert(memcmp(decoded, content, content_size) == 0);
+        assert(strcmp(decoder.original_file, stream_input) == 0);
+
+        // A damaged magic is reported instead of decoded.
+        char bad[8] = "HUFX";
+        size_t in_used = 0;
+        size_t out_len = 0;
+        stream_decoder_init(&decoder);
+        status = stream_decode(&decoder, bad, sizeof(bad), &in_used, decoded, content_size, &out_len, &done);
+        assert(status == FILE_MAGIC_ERROR);
+        (void)status;
+
+        munmap((void*)archive, archive_size);
+        free(decoded);
+        free(content);
+        remove(stream_input);
+        remove(stream_compressed);
+        printf("    Resumable stream decoder test passed.\n");
+    }
+
+    // Edge case 11: Decoding straight into a pipe and into a regular file
+    printf("  Edge case 11: Decoding to a file descriptor...\n");
+    {
+        char pipe_input[] = "test_pipe_input.txt";
+        char pipe_compressed[] = "test_pipe_input.huff";
+        char pipe_output[] = "test_pipe_output.txt";
+        const char *content = "Gifted pages travel through the pipe without being copied. ";
+        FILE *f = fopen(pipe_input, "w");
+        for (int i = 0; i < 500; i++) fputs(content, f);
+        fclose(f);
+
+        Arguments compress_args = {0};
+        compress_args.compress_mode = true;
+        compress_args.force = true;
+        compress_args.input_file = pipe_input;
+        compress_args.output_file = pipe_compressed;
+        int comp_result = invoke_run_compression(compress_args);
+        assert(comp_result == 0);
+        (void)comp_result;
+
+        const char *original_content = NULL;
+        const char *archive = NULL;
+        int orig_size = read_raw(pipe_input, &original_content);
+        int archive_size = read_raw(pipe_compressed, &archive);
+
+        // The output fits in the default pipe buffer, so no reader thread is needed.
+        int fds[2];
+        int pipe_result = pipe(fds);
+        assert(pipe_result == 0);
+        (void)pipe_result;
+        int decode_result = decode_to_fd(archive, archive_size, -1, fds[1]);
+        assert(decode_result == SUCCESS);
+        close(fds[1]);
+        char *piped = malloc(orig_size + 1);
+        assert(piped != NULL);
+        long piped_size = 0;
+        ssize_t n = 0;
+        while ((n = read(fds[0], piped + piped_size, orig_size + 1 - piped_size)) > 0) piped_size += n;
+        close(fds[0]);
+        assert(piped_size == orig_size);
+        assert(memcmp(piped, original_content, orig_size) == 0);
+
+        FILE *out = fopen(pipe_output, "w");
+        decode_result = decode_to_fd(archive, archive_size, -1, fileno(out));
+        fclose(out);
+        assert(decode_result == SUCCESS);
+        const char *written = NULL;
+        int written_size = read_raw(pipe_output, &written);
+        assert(written_size == orig_size);
+        assert(memcmp(written, original_content, orig_size) == 0);
+
+        // A truncated archive is an error, not a short output; the payload ends before the member index.
+        char *index = NULL;
+        long index_size = build_index(original_content, orig_size, false, pipe_input, &index);
+        assert(index_size > 0);
+        free(index);
+        int devnull = open("/dev/null", O_WRONLY);
+        decode_result = decode_to_fd(archive, archive_size - index_size - 1, -1, devnull);
+        close(devnull);
+        assert(decode_result == DECOMPRESSION_ERROR);
+
+        // Random bytes between the text are stored; given the archive file, those blocks are spliced from it.
+        char stored_input[] = "test_pipe_stored.bin";
+        char stored_compressed[] = "test_pipe_stored.huff";
+        size_t stored_size = 400 * 1024;
+        char *stored_content = malloc(stored_size);
+        assert(stored_content != NULL);
+        srand(11);
+        for (size_t i = 0; i < stored_size; i++) {
+            stored_content[i] = (i >= 100 * 1024 && i < 300 * 1024) ? (char)rand() : content[i % strlen(content)];
+        }
+        f = fopen(stored_input, "wb");
+        fwrite(stored_content, 1, stored_size, f);
+        fclose(f);
+        compress_args.input_file = stored_input;
+        compress_args.output_file = stored_compressed;
+        comp_result = invoke_run_compression(compress_args);
+        assert(comp_result == 0);
+        const char *stored_archive = NULL;
+        int stored_archive_size = read_raw(stored_compressed, &stored_archive);
+        int archive_fd = open(stored_compressed, O_RDONLY);
+        assert(archive_fd != -1);
+        pipe_result = pipe(fds);
+        assert(pipe_result == 0);
+        decode_result = decode_to_fd(stored_archive, stored_archive_size, archive_fd, fds[1]);
+        assert(decode_result == SUCCESS);
+        close(fds[1]);
+        close(archive_fd);
+        char *stored_piped = malloc(stored_size + 1);
+        assert(stored_piped != NULL);
+        piped_size = 0;
+        while ((n = read(fds[0], stored_piped + piped_size, stored_size + 1 - piped_size)) > 0) piped_size += n;
+        close(fds[0]);
+        assert(piped_size == (long)stored_size);
+        assert(memcmp(stored_piped, stored_content, stored_size) == 0);
+        (void)decode_result;
+
+        free(stored_piped);
+        free(stored_content);
+        munmap((void*)stored_archive, stored_archive_size);
+        remove(stored_input);
+        remove(stored_compressed);
+        free(piped);
+        munmap((void*)original_content, orig_size);
+        munmap((void*)archive, archive_size);
+        munmap((void*)written, written_size);
+        remove(pipe_input);
+        remove(pipe_compressed);
+        remove(pipe_output);
+        printf("    Decoding to a file descriptor test passed.\n");
+    }
+
+    // Edge case 12: Directory restore streamed through a small ring buffer
+    printf("  Edge case 12: Pipelined directory restore...\n");
+    {
+        char ring_dir[] = "test_ring_dir";
+        char ring_compressed[] = "test_ring_dir.huff";
+        char ring_output[] = "test_ring_output";
+        mkdir(ring_dir, 0755);
+        mkdir("test_ring_dir/nested", 0755);
+        FILE *f = fopen("test_ring_dir/big.txt", "w");
+        for (int i = 0; i < 3000; i++) fprintf(f, "line %d of a file much larger than the ring\n", i);
+        fclose(f);
+        f = fopen("test_ring_dir/nested/small.txt", "w");
+        fputs("small", f);
+        fclose(f);
+
+        Arguments compress_args = {0};
+        compress_args.compress_mode = true;
+        compress_args.force = true;
+        compress_args.directory = true;
+        compress_args.input_file = ring_dir;
+        compress_args.output_file = ring_compressed;
+        int comp_result = invoke_run_compression(compress_args);
+        assert(comp_result >= 0);
+        (void)comp_result;
+
+        // A 4 KiB ring wraps many times over the ~130 KB stream.
+        const char *archive = NULL;
+        int archive_size = read_raw(ring_compressed, &archive);
+        int restore_result = restore_stream(archive, archive_size, 4096, ring_output, true, false);
+        assert(restore_result == SUCCESS);
+        const char *original_content = NULL;
+        const char *restored_content = NULL;
+        int orig_size = read_raw("test_ring_dir/big.txt", &original_content);
+        int restored_size = read_raw("test_ring_output/test_ring_dir/big.txt", &restored_content);
+        assert(orig_size == restored_size);
+        assert(memcmp(original_content, restored_content, orig_size) == 0);
+        munmap((void*)restored_content, restored_size);
+        restored_size = read_raw("test_ring_output/test_ring_dir/nested/small.txt", &restored_content);
+        assert(restored_size == 5 && memcmp(restored_content, "small", 5) == 0);
+        munmap((void*)restored_content, restored_size);
+
+        // A truncated archive fails instead of leaving a silently short file.
+        restore_result = restore_stream(archive, archive_size / 2, 4096, ring_output, true, false);
+        assert(restore_result == DECOMPRESSION_ERROR);
+        (void)restore_result;
+        munmap((void*)archive, archive_size);
+
+        // The command-line path restores through the same pipeline.
+        Arguments decomp_args = {0};
+        decomp_args.extract_mode = true;
+        decomp_args.force = true;
+        decomp_args.input_file = ring_compressed;
+        decomp_args.output_file = ring_output;
+        int decomp_result = invoke_run_decompression(decomp_args);
+        assert(decomp_result == 0);
+        (void)decomp_result;
+        restored_size = read_raw("test_ring_output/test_ring_dir/big.txt", &restored_content);
+        assert(orig_size == restored_size);
+        assert(memcmp(original_content, restored_content, orig_size) == 0);
+        munmap((void*)restored_content, restored_size);
+        munmap((void*)original_content, orig_size);
+
+        remove("test_ring_output/test_ring_dir/nested/small.txt");
+        rmdir("test_ring_output/test_ring_dir/nested");
+        remove("test_ring_output/test_ring_dir/big.txt");
+        rmdir("test_ring_output/test_ring_dir");
+        rmdir(ring_output);
+        remove("test_ring_dir/nested/small.txt");
+        rmdir("test_ring_dir/nested");
+        remove("test_ring_dir/big.txt");
+        rmdir(ring_dir);
+        remove(ring_compressed);
+        printf("    Pipelined directory restore test passed.\n");
+    }
+
+    // Edge case 13: Block format with stored, fill and Huffman blocks
+    printf("  Edge case 13: Block format round-trip...\n");
+    {
+        size_t part = 32 * 1024;
+        char *content = malloc(3 * part);
+        assert(content != NULL);
+        srand(13);
+        for (size_t i = 0; i < part; i++) content[i] = "aaaabbc"[rand() % 7];
+        memset(content + part, 'z', part);
+        for (size_t i = 2 * part; i < 3 * part; i++) content[i] = (char)rand();
+
+        Compressed_file blocks = {0};
+        int result = map_blocks(content, 3 * part, DEFAULT_LEVEL, &blocks);
+        assert(result == SUCCESS);
+        bool seen[3] = {false, false, false};
+        for (size_t offset = 0; offset < blocks.block_data_size;) {
+            Block_header header;
+            memcpy(&header, blocks.block_data + offset, sizeof(header));
+            assert(header.method <= BLOCK_FILL);
+            seen[header.method] = true;
+            offset += sizeof(header) + header.payload_size;
+        }
+        assert(seen[BLOCK_STORED] && seen[BLOCK_HUFFMAN] && seen[BLOCK_FILL]);
+
+        char *decoded = malloc(3 * part);
+        assert(decoded != NULL);
+        blocks.original_size = 3 * part;
+        result = decompress(&blocks, decoded);
+        assert(result == 0);
+        assert(memcmp(decoded, content, 3 * part) == 0);
+
+        // The resumable decoder walks the same blocks from a serialized image in small pieces.
+        char block_name[] = "blocks.bin";
+        blocks.original_file = block_name;
+        long image_size = compressed_file_size(&blocks);
+        unsigned char *image = malloc(image_size);
+        assert(image != NULL);
+        serialize_compressed(&blocks, image);
+        static Stream_decoder block_decoder;
+        stream_decoder_init(&block_decoder);
+        memset(decoded, 0, 3 * part);
+        size_t in_pos = 0;
+        size_t out_pos = 0;
+        int status = SUCCESS;
+        bool done = false;
+        while (status == SUCCESS && !done) {
+            size_t in_len = 1 + rand() % 300;
+            size_t out_cap = 1 + rand() % 500;
+            if (in_len > image_size - in_pos) in_len = image_size - in_pos;
+            if (out_cap > 3 * part - out_pos) out_cap = 3 * part - out_pos;
+            size_t in_used = 0;
+            size_t out_len = 0;
+            status = stream_decode(&block_decoder, (const char *)image + in_pos, in_len, &in_used, decoded + out_pos, out_cap, &out_len, &done);
+            in_pos += in_used;
+            out_pos += out_len;
+        }
+        assert(status == SUCCESS && done);
+        assert(in_pos == (size_t)image_size && out_pos == 3 * part);
+        assert(memcmp(decoded, content, 3 * part) == 0);
+
+        // A block claiming more data than the file holds is rejected.
+        Block_header *first = (Block_header *)blocks.block_data;
+        first->raw_size = 4 * part;
+        result = decompress(&blocks, decoded);
+        assert(result == DECOMPRESSION_ERROR);
+        (void)result;
+        (void)status;
+
+        free(image);
+        free(decoded);
+        unmap_blocks(&blocks);
+        free(content);
+        printf("    Block format round-trip test passed.\n");
+    }
+
+    // Edge case 14: Memory budget smaller than the input
+    printf("  Edge case 14: Compression within a memory budget...\n");
+    {
+        char budget_input[] = "test_budget.txt";
+        char budget_compressed[] = "test_budget.huff";
+        char budget_output[] = "test_budget_out.txt";
+        FILE *bf = fopen(budget_input, "w");
+        assert(bf != NULL);
+        srand(14);
+        for (int i = 0; i < 12000; i++) {
+            fprintf(bf, "Row %d: %d %d %c\n", i, rand() % 100000, rand() % 1000, 'a' + rand() % 26);
+        }
+        fclose(bf);
+
+        // The whole input no longer fits in one batch, so blocks are capped and flushed in pieces.
+        set_memory_budget(256 * 1024);
+        size_t budget = budgeted_size(1024 * 1024, 2);
+        assert(budget <= 128 * 1024);
+        (void)budget;
+
+        Arguments compress_args = {0};
+        compress_args.compress_mode = true;
+        compress_args.force = true;
+        compress_args.input_file = budget_input;
+        compress_args.output_file = budget_compressed;
+        int comp_result = invoke_run_compression(compress_args);
+        assert(comp_result == 0);
+
+        Compressed_file archive = {0};
+        const char *archive_map = NULL;
+        int archive_size = read_compressed(budget_compressed, &archive, &archive_map);
+        assert(archive_size > 0);
+        assert(memcmp(archive.magic, block_magic, sizeof(block_magic)) == 0);
+        size_t block_count = 0;
+        for (size_t offset = 0; offset < archive.block_data_size; block_count++) {
+            Block_header header;
+            memcpy(&header, archive.block_data + offset, sizeof(header));
+            assert(header.raw_size <= 128 * 1024);
+            offset += sizeof(header) + header.payload_size;
+        }
+        assert(block_count > 1);
+        (void)block_count;
+        free(archive.original_file);
+        free(archive.file_name);
+        munmap((void *)archive_map, archive_size);
+        set_memory_budget(0);
+
+        Arguments decomp_args = {0};
+        decomp_args.extract_mode = true;
+        decomp_args.force = true;
+        decomp_args.input_file = budget_compressed;
+        decomp_args.output_file = budget_output;
+        int decomp_result = invoke_run_decompression(decomp_args);
+        assert(decomp_result == 0);
+        (void)comp_result;
+        (void)decomp_result;
+
+        const char *original_content = NULL;
+        const char *decompressed_content = NULL;
+        int orig_size = read_raw(budget_input, &original_content);
+        int decomp_size = read_raw(budget_output, &decompressed_content);
+        assert(orig_size > 256 * 1024 && orig_size == decomp_size);
+        assert(memcmp(original_content, decompressed_content, orig_size) == 0);
+        munmap((void *)original_content, orig_size);
+        munmap((void *)decompressed_content, decomp_size);
+        remove(budget_input);
+        remove(budget_compressed);
+        remove(budget_output);
+        printf("    Memory budget test passed.\n");
+    }
+
+    // Edge case 15: Consuming the input while compressing
+    printf("  Edge case 15: Consumed input...\n");
+    {
+        char consume_input[] = "test_consume.txt";
+        char consume_compressed[] = "test_consume.huff";
+        char consume_output[] = "test_consume_out.txt";
+        size_t consume_size = 3 * 1024 * 1024;
+        char *content = malloc(consume_size);
+        assert(content != NULL);
+        srand(15);
+        for (size_t i = 0; i < consume_size; i++) content[i] = "log line  0123456789\n"[rand() % 21];
+        FILE *cf = fopen(consume_input, "wb");
+        assert(cf != NULL);
+        size_t put = fwrite(content, 1, consume_size, cf);
+        assert(put == consume_size);
+        (void)put;
+        fclose(cf);
+
+        Arguments compress_args = {0};
+        compress_args.compress_mode = true;
+        compress_args.force = true;
+        compress_args.consume = true;
+        compress_args.level = 1;
+        compress_args.input_file = consume_input;
+        compress_args.output_file = consume_compressed;
+        int comp_result = invoke_run_compression(compress_args);
+        assert(comp_result == 0);
+        assert(access(consume_input, F_OK) != 0);
+
+        Arguments decomp_args = {0};
+        decomp_args.extract_mode = true;
+        decomp_args.force = true;
+        decomp_args.input_file = consume_compressed;
+        decomp_args.output_file = consume_output;
+        int decomp_result = invoke_run_decompression(decomp_args);
+        assert(decomp_result == 0);
+        (void)comp_result;
+        (void)decomp_result;
+
+        const char *restored = NULL;
+        int restored_size = read_raw(consume_output, &restored);
+        assert(restored_size == (int)consume_size);
+        assert(memcmp(restored, content, consume_size) == 0);
+        munmap((void *)restored, restored_size);
+        free(content);
+        remove(consume_compressed);
+        remove(consume_output);
+
+        // Killed partway: the archive restores the input up to its last durable batch, and the input
+        // file still holds everything from there.
+        size_t crash_size = 20 * 1024 * 1024;
+        content = mmap(NULL, crash_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(content != MAP_FAILED);
+        for (size_t i = 0; i < crash_size; i++) content[i] = "log line  0123456789\n"[rand() % 21];
+        cf = fopen(consume_input, "wb");
+        assert(cf != NULL);
+        put = fwrite(content, 1, crash_size, cf);
+        assert(put == crash_size);
+        fclose(cf);
+        remove(consume_compressed);
+        pid_t child = fork();
+        assert(child != -1);
+        if (child == 0) {
+            set_rate_limit(8.0);
+            _exit(invoke_run_compression(compress_args) == 0 ? 0 : 1);
+        }
+        size_t recorded_blocks = 0;
+        while (recorded_blocks == 0) {
+            usleep(10000);
+            Compressed_file partial = {0};
+            const char *partial_map = NULL;
+            int partial_size = read_compressed(consume_compressed, &partial, &partial_map);
+            if (partial_size > 0) {
+                recorded_blocks = partial.block_data_size;
+                free(partial.original_file);
+                free(partial.file_name);
+                munmap((void *)partial_map, partial_size);
+            }
+            assert(waitpid(child, NULL, WNOHANG) == 0);
+        }
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+
+        Compressed_file crashed = {0};
+        const char *crashed_map = NULL;
+        int crashed_size = read_compressed(consume_compressed, &crashed, &crashed_map);
+        assert(crashed_size > 0 && crashed.original_size == crash_size);
+        long prefix = recorded_size(&crashed);
+        assert(prefix > 0 && (size_t)prefix < crash_size);
+        decomp_result = invoke_run_decompression(decomp_args);
+        assert(decomp_result == ENODATA);
+        restored_size = read_raw(consume_output, &restored);
+        assert(restored_size == prefix);
+        assert(memcmp(restored, content, prefix) == 0);
+        munmap((void *)restored, restored_size);
+        const char *rest = NULL;
+        int rest_size = read_raw(consume_input, &rest);
+        assert(rest_size == (int)crash_size);
+        assert(memcmp(rest + prefix, content + prefix, crash_size - prefix) == 0);
+        munmap((void *)rest, rest_size);
+
+        // Decoded to a descriptor, the recorded blocks come out before the truncation is reported.
+        int crash_fd = open(consume_output, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        assert(crash_fd != -1);
+        size_t image_size = (crashed.block_data - crashed_map) + crashed.block_data_size;
+        int pipe_result = decode_to_fd(crashed_map, image_size, -1, crash_fd);
+        assert(pipe_result == ARCHIVE_TRUNCATED);
+        (void)pipe_result;
+        close(crash_fd);
+        restored_size = read_raw(consume_output, &restored);
+        assert(restored_size == prefix && memcmp(restored, content, prefix) == 0);
+        munmap((void *)restored, restored_size);
+        free(crashed.original_file);
+        free(crashed.file_name);
+        munmap((void *)crashed_map, crashed_size);
+        munmap(content, crash_size);
+        remove(consume_input);
+        remove(consume_compressed);
+        remove(consume_output);
+        printf("    Consumed input test passed.\n");
+    }
+
+    // Edge case 16: Single-tree format on request
+    printf("  Edge case 16: Legacy format round-trip...\n");
+    {
+        char legacy_input[] = "test_legacy.txt";
+        char legacy_compressed[] = "test_legacy.huff";
+        char legacy_output[] = "test_legacy_out.txt";
+        FILE *lf = fopen(legacy_input, "w");
+        assert(lf != NULL);
+        for (int i = 0; i < 5000; i++) fprintf(lf, "legacy line %d\n", i * 7);
+        fclose(lf);
+
+        Arguments compress_args = {0};
+        compress_args.compress_mode = true;
+        compress_args.force = true;
+        compress_args.legacy = true;
+        compress_args.input_file = legacy_input;
+        compress_args.output_file = legacy_compressed;
+        int comp_result = invoke_run_compression(compress_args);
+        assert(comp_result == 0);
+
+        const char *archive = NULL;
+        int archive_size = read_raw(legacy_compressed, &archive);
+        assert(archive_size > 4 && memcmp(archive, magic, sizeof(magic)) == 0);
+        munmap((void *)archive, archive_size);
+
+        Arguments decomp_args = {0};
+        decomp_args.extract_mode = true;
+        decomp_args.force = true;
+        decomp_args.input_file = legacy_compressed;
+        decomp_args.output_file = legacy_output;
+        int decomp_result = invoke_run_decompression(decomp_args);
+        assert(decomp_result == 0);
+        (void)comp_result;
+        (void)decomp_result;
+
+        const char *original_content = NULL;
+        const char *decompressed_content = NULL;
+        int orig_size = read_raw(legacy_input, &original_content);
+        int decomp_size = read_raw(legacy_output, &decompressed_content);
+        assert(orig_size == decomp_size);
+        assert(memcmp(original_content, decompressed_content, orig_size) == 0);
+        munmap((void *)original_content, orig_size);
+        munmap((void *)decompressed_content, decomp_size);
+        remove(legacy_input);
+        remove(legacy_compressed);
+        remove(legacy_output);
+
+        // A tree of several megabytes under the default allocator limit: the single-tree bitstream
+        // is mapped at its exact size rather than taken from the heap.
+        char legacy_dir[] = "test_legacy_dir";
+        char legacy_dir_output[] = "test_legacy_dir_out";
+        static const char *words[] = {"alpha", "beta", "gamma", "delta", "request", "error", "value", "index"};
+        mkdir(legacy_dir, 0755);
+        srand(16);
+        for (int m = 0; m < 4; m++) {
+            char path[64];
+            snprintf(path, sizeof(path), "test_legacy_dir/member%d.txt", m);
+            lf = fopen(path, "w");
+            assert(lf != NULL);
+            for (long written = 0; written < 1536 * 1024;) written += fprintf(lf, "%s %d\n", words[rand() % 8], rand() % 1000);
+            fclose(lf);
+        }
+        debugmalloc_max_block_size(1024 * 1024);
+        compress_args.directory = true;
+        compress_args.input_file = legacy_dir;
+        compress_args.output_file = legacy_compressed;
+        comp_result = invoke_run_compression(compress_args);
+        assert(comp_result == 0);
+        debugmalloc_max_block_size(10 * 1024 * 1024);
+        archive_size = read_raw(legacy_compressed, &archive);
+        assert(archive_size > 4 && memcmp(archive, magic, sizeof(magic)) == 0);
+        munmap((void *)archive, archive_size);
+
+        decomp_args.output_file = legacy_dir_output;
+        decomp_result = invoke_run_decompression(decomp_args);
+        assert(decomp_result == 0);
+        for (int m = 0; m < 4; m++) {
+            char path[64];
+            char restored_path[96];
+            snprintf(path, sizeof(path), "test_legacy_dir/member%d.txt", m);
+            snprintf(restored_path, sizeof(restored_path), "test_legacy_dir_out/test_legacy_dir/member%d.txt", m);
+            orig_size = read_raw(path, &original_content);
+            decomp_size = read_raw(restored_path, &decompressed_content);
+            assert(orig_size == decomp_size && orig_size >= 1536 * 1024);
+            assert(memcmp(original_content, decompressed_content, orig_size) == 0);
+            munmap((void *)original_content, orig_size);
+            munmap((void *)decompressed_content, decomp_size);
+            remove(restored_path);
+            remove(path);
+        }
+        rmdir("test_legacy_dir_out/test_legacy_dir");
+        rmdir(legacy_dir_output);
+        rmdir(legacy_dir);
+        remove(legacy_compressed);
+        printf("    Legacy format test passed.\n");
+    }
+
+    // Edge case 17: Interleaved lanes
+    printf("  Edge case 17: Lane block round-trip...\n");
+    {
+        // Skewed bytes give codes longer than the decode table; the length leaves a partial last round.
+        size_t content_size = 3 * LANE_SEGMENT_SYMBOLS + 1234;
+        char *content = malloc(content_size);
+        assert(content != NULL);
+        srand(17);
+        for (size_t i = 0; i < content_size; i++) {
+            content[i] = (i % 997 == 0) ? (char)rand() : (char)('a' + __builtin_ctz(rand() | 0x10000));
+        }
+
+        set_lanes(true);
+        Compressed_file blocks = {0};
+        int result = map_blocks(content, content_size, MIN_LEVEL, &blocks);
+        set_lanes(false);
+        assert(result == SUCCESS);
+        Block_header header;
+        memcpy(&header, blocks.block_data, sizeof(header));
+        assert(header.method == BLOCK_LANES && header.raw_size == content_size);
+
+        char *decoded = malloc(content_size);
+        assert(decoded != NULL);
+        blocks.original_size = content_size;
+        result = decompress(&blocks, decoded);
+        assert(result == 0);
+        assert(memcmp(decoded, content, content_size) == 0);
+
+        // Small output pieces stop the decoder inside rounds and segments.
+        char lanes_name[] = "lanes.bin";
+        blocks.original_file = lanes_name;
+        long image_size = compressed_file_size(&blocks);
+        unsigned char *image = malloc(image_size);
+        assert(image != NULL);
+        serialize_compressed(&blocks, image);
+        static Stream_decoder lane_decoder;
+        stream_decoder_init(&lane_decoder);
+        memset(decoded, 0, content_size);
+        size_t in_pos = 0;
+        size_t out_pos = 0;
+        int status = SUCCESS;
+        bool done = false;
+        while (status == SUCCESS && !done) {
+            size_t in_len = 1 + rand() % 4000;
+            size_t out_cap = 1 + rand() % 100;
+            if (in_len > image_size - in_pos) in_len = image_size - in_pos;
+            if (out_cap > content_size - out_pos) out_cap = content_size - out_pos;
+            size_t in_used = 0;
+            size_t out_len = 0;
+            status = stream_decode(&lane_decoder, (const char *)image + in_pos, in_len, &in_used, decoded + out_pos, out_cap, &out_len, &done);
+            in_pos += in_used;
+            out_pos += out_len;
+        }
+        assert(status == SUCCESS && done);
+        assert(in_pos == (size_t)image_size && out_pos == content_size);
+        assert(memcmp(decoded, content, content_size) == 0);
+
+        // A lane longer than a segment allows is rejected.
+        unsigned short too_long = LANE_SIZE_MAX + 1;
+        memcpy(blocks.block_data + sizeof(Block_header) + PACKED_LENGTHS_SIZE, &too_long, sizeof(too_long));
+        result = decompress(&blocks, decoded);
+        assert(result == DECOMPRESSION_ERROR);
+        (void)result;
+        (void)status;
+
+        free(image);
+        free(decoded);
+        unmap_blocks(&blocks);
+        free(content);
+        printf("    Lane block test passed.\n");
+    }
+
+    // Edge case 18: Context mixing
+    printf("  Edge case 18: Context-mixed block round-trip...\n");
+    {
+        // Sentences from a small vocabulary: redundancy a Huffman code cannot reach but contexts can.
+        static const char *words[] = {"block", "stream", "decoder", "model", "the", "of", "context", "bit", "mixer", "weight"};
+        size_t content_size = 200 * 1024;
+        char *content = malloc(content_size);
+        assert(content != NULL);
+        srand(18);
+        for (size_t i = 0; i < content_size;) {
+            const char *word = words[rand() % 10];
+            for (size_t j = 0; word[j] != '\0' && i < content_size; j++) content[i++] = word[j];
+            if (i < content_size) content[i++] = (rand() % 8 == 0) ? '\n' : ' ';
+        }
+
+        Compressed_file huffman = {0};
+        int result = map_blocks(content, content_size, DEFAULT_LEVEL, &huffman);
+        assert(result == SUCCESS);
+        Compressed_file blocks = {0};
+        result = map_blocks(content, content_size, CM_LEVEL, &blocks);
+        assert(result == SUCCESS);
+        Block_header header;
+        memcpy(&header, blocks.block_data, sizeof(header));
+        assert(header.method == BLOCK_CM && header.raw_size == content_size);
+        assert(blocks.block_data_size < huffman.block_data_size / 2);
+        unmap_blocks(&huffman);
+
+        char *decoded = malloc(content_size);
+        assert(decoded != NULL);
+        blocks.original_size = content_size;
+        result = decompress(&blocks, decoded);
+        assert(result == 0);
+        assert(memcmp(decoded, content, content_size) == 0);
+
+        // Any split of input and output must decode the same.
+        char cm_name[] = "cm.bin";
+        blocks.original_file = cm_name;
+        long image_size = compressed_file_size(&blocks);
+        unsigned char *image = malloc(image_size);
+        assert(image != NULL);
+        serialize_compressed(&blocks, image);
+        static Stream_decoder cm_decoder;
+        stream_decoder_init(&cm_decoder);
+        memset(decoded, 0, content_size);
+        size_t in_pos = 0;
+        size_t out_pos = 0;
+        int status = SUCCESS;
+        bool done = false;
+        while (status == SUCCESS && !done) {
+            size_t in_len = 1 + rand() % 100;
+            size_t out_cap = 1 + rand() % 300;
+            if (in_len > image_size - in_pos) in_len = image_size - in_pos;
+            if (out_cap > content_size - out_pos) out_cap = content_size - out_pos;
+            size_t in_used = 0;
+            size_t out_len = 0;
+            status = stream_decode(&cm_decoder, (const char *)image + in_pos, in_len, &in_used, decoded + out_pos, out_cap, &out_len, &done);
+            in_pos += in_used;
+            out_pos += out_len;
+        }
+        assert(status == SUCCESS && done);
+        assert(in_pos == (size_t)image_size && out_pos == content_size);
+        assert(memcmp(decoded, content, content_size) == 0);
+
+        // A decoder given up inside the block hands its model back.
+        stream_decoder_init(&cm_decoder);
+        size_t in_used = 0;
+        size_t out_len = 0;
+        status = stream_decode(&cm_decoder, (const char *)image, image_size, &in_used, decoded, 1000, &out_len, &done);
+        assert(status == SUCCESS && out_len == 1000 && cm_decoder.cm.model != NULL);
+        stream_decoder_release(&cm_decoder);
+        assert(cm_decoder.cm.model == NULL);
+
+        // A memory budget too small for a model codes the blocks another way, and they still decode.
+        assert(cm_model_limit(4) >= 1);
+        set_memory_budget(16 * 1024 * 1024);
+        assert(cm_model_limit(4) == 0);
+        Compressed_file small = {0};
+        result = map_blocks(content, content_size, CM_LEVEL, &small);
+        assert(result == SUCCESS);
+        for (size_t offset = 0; offset < small.block_data_size;) {
+            memcpy(&header, small.block_data + offset, sizeof(header));
+            assert(header.method != BLOCK_CM);
+            offset += sizeof(Block_header) + header.payload_size;
+        }
+        set_memory_budget(0);
+        small.original_size = content_size;
+        memset(decoded, 0, content_size);
+        result = decompress(&small, decoded);
+        assert(result == 0);
+        assert(memcmp(decoded, content, content_size) == 0);
+        unmap_blocks(&small);
+        (void)result;
+        (void)status;
+
+        free(image);
+        free(decoded);
+        unmap_blocks(&blocks);
+        free(content);
+        printf("    Context mixing test passed.\n");
+    }
+
     printf("All edge case tests passed!\n");
 
     return 0;
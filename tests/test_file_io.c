@@ -5,7 +5,9 @@
 #include <math.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <time.h>
 #include "../lib/file.h"
+#include "../lib/throttle.h"
 #include "../lib/data_types.h"
 #include "../lib/debugmalloc.h"
 
@@ -427,6 +429,42 @@ void test_file_io_very_large_compressed_data() {
     printf("test_file_io_very_large_compressed_data passed.\n");
 }
 
+void test_file_io_rate_limited_read() {
+    const char *name = "rate_limited.bin";
+    long size = 512 * 1024;
+    char *map = NULL;
+    int write_res = write_raw((char *)name, &map, size, true);
+    assert(write_res == size);
+    memset(map, 'R', size);
+    int sync_res = sync_raw(map, size);
+    assert(sync_res == SUCCESS);
+    munmap(map, size);
+
+    // 2 MB/s with a 204 KB burst: the 512 KB read must take at least ~0.15 s.
+    int limit_res = set_rate_limit(2.0);
+    assert(limit_res == SUCCESS);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const char *data = NULL;
+    int read_size = read_raw((char *)name, &data);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(read_size == size);
+    assert(data[size - 1] == 'R');
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    assert(elapsed >= 0.15);
+    limit_res = set_rate_limit(0);
+    assert(limit_res == SUCCESS);
+    assert(!throttle_enabled());
+    (void)elapsed;
+    (void)limit_res;
+    (void)write_res;
+    (void)sync_res;
+
+    munmap((void *)data, read_size);
+    remove(name);
+    printf("test_file_io_rate_limited_read passed.\n");
+}
+
 int main() {
     test_file_io();
     
@@ -440,6 +478,7 @@ int main() {
     test_file_io_special_chars_in_original_filename();
     test_file_io_read_nonexistent_file();
     test_file_io_very_large_compressed_data();
+    test_file_io_rate_limited_read();
     
     printf("\nAll edge case tests passed!\n");
     
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "../lib/filter.h"
+#include "../lib/block.h"
+#include "../lib/decompress.h"
+#include "../lib/stream.h"
+#include "../lib/file.h"
+#include "../lib/data_types.h"
+#include "test_helpers.h"
+#include "../lib/debugmalloc.h"
+
+static void put_le(unsigned char *p, unsigned long long value, int size) {
+    for (int i = 0; i < size; i++) p[i] = (unsigned char)(value >> (8 * i));
+}
+
+// x86-like code: filler bytes with calls and jumps to a handful of functions.
+static void fill_x86(unsigned char *code, size_t size, unsigned int seed) {
+    static const unsigned char filler[] = {0x48, 0x89, 0xC7, 0x8B, 0x45, 0xF8, 0x31, 0xC0, 0x5D, 0xC3};
+    srand(seed);
+    for (size_t i = 0; i < size;) {
+        if (rand() % 4 == 0 && i + 5 <= size) {
+            long target = (rand() % 8) * 4096;
+            code[i] = (rand() % 3 == 0) ? 0xE9 : 0xE8;
+            put_le(code + i + 1, (unsigned long long)(target - (long)(i + 5)), 4);
+            i += 5;
+        } else {
+            code[i++] = filler[rand() % sizeof(filler)];
+        }
+    }
+}
+
+// ARM64-like code: a few instruction words with BL to a handful of functions.
+static void fill_arm64(unsigned char *code, size_t size, unsigned int seed) {
+    static const unsigned int words[] = {0xD503201F, 0xF9400260, 0xAA1303E0, 0x910003FD, 0xA8C17BFD, 0xD65F03C0};
+    srand(seed);
+    for (size_t i = 0; i + 4 <= size; i += 4) {
+        unsigned int word = words[rand() % 6];
+        if (rand() % 4 == 0) word = 0x94000000 | ((unsigned int)((long)(rand() % 8) * 1024 - (long)(i / 4)) & 0x03FFFFFF);
+        put_le(code + i, word, 4);
+    }
+}
+
+/*
+ * A 64-bit ELF file of the given machine at out: header, code, and a section header table closing it.
+ * Returns its size.
+ */
+static size_t build_elf(unsigned char *out, unsigned int machine, size_t code_size, unsigned int seed) {
+    memset(out, 0, 64);
+    memcpy(out, "\177ELF\2\1\1", 7);
+    put_le(out + 16, 2, 2);
+    put_le(out + 18, machine, 2);
+    put_le(out + 0x28, 64 + code_size, 8);
+    put_le(out + 0x3A, 64, 2);
+    put_le(out + 0x3C, 2, 2);
+    if (machine == 62) fill_x86(out + 64, code_size, seed);
+    else fill_arm64(out + 64, code_size, seed);
+    memset(out + 64 + code_size, 0, 2 * 64);
+    return 64 + code_size + 2 * 64;
+}
+
+// Text that holds no ELF file.
+static size_t fill_text(unsigned char *out, size_t size) {
+    static const char text[] = "the directory archiver serializes every member behind its path. ";
+    for (size_t i = 0; i < size; i++) out[i] = text[i % (sizeof(text) - 1)];
+    return size;
+}
+
+void test_filters_invert() {
+    size_t size = 100003;
+    unsigned char *code = malloc(size);
+    unsigned char *filtered = malloc(size);
+    assert(code != NULL && filtered != NULL);
+
+    unsigned char filters[] = {BLOCK_FILTER_X86, BLOCK_FILTER_ARM64};
+    for (int f = 0; f < 2; f++) {
+        if (filters[f] == BLOCK_FILTER_X86) fill_x86(code, size, 1);
+        else fill_arm64(code, size, 1);
+        memcpy(filtered, code, size);
+        filter_block(filters[f], filtered, size, true);
+        assert(memcmp(filtered, code, size) != 0);
+        filter_block(filters[f], filtered, size, false);
+        assert(memcmp(filtered, code, size) == 0);
+    }
+
+    // Calls to one function look the same from every call site once filtered.
+    memset(code, 0x90, 64);
+    code[0] = 0xE8;
+    put_le(code + 1, 1000 - 5, 4);
+    code[30] = 0xE8;
+    put_le(code + 31, 1000 - 35, 4);
+    filter_block(BLOCK_FILTER_X86, code, 64, true);
+    assert(memcmp(code + 1, code + 31, 4) == 0);
+
+    // Every byte sequence comes back, whatever it holds.
+    srand(2);
+    for (size_t i = 0; i < size; i++) code[i] = (rand() % 2) ? 0xE8 : (unsigned char)rand();
+    for (int f = 0; f < 2; f++) {
+        memcpy(filtered, code, size);
+        filter_block(filters[f], filtered, size, true);
+        filter_block(filters[f], filtered, size, false);
+        assert(memcmp(filtered, code, size) == 0);
+    }
+
+    free(code);
+    free(filtered);
+    printf("test_filters_invert passed\n");
+}
+
+/*
+ * Text, an x86-64 ELF file, text and an ARM64 ELF file: the ELF files are found and their blocks are
+ * coded through their filter; the rest is not.
+ */
+void test_elf_round_trip() {
+    unsigned char *data = malloc(1024 * 1024);
+    assert(data != NULL);
+    size_t pos = fill_text(data, 20001);
+    size_t x86_offset = pos;
+    size_t x86_size = build_elf(data + pos, 62, 300 * 1024, 3);
+    pos += x86_size;
+    pos += fill_text(data + pos, 5000);
+    size_t arm_offset = pos;
+    size_t arm_size = build_elf(data + pos, 183, 200 * 1024, 4);
+    pos += arm_size;
+    size_t data_len = pos + fill_text(data + pos, 3000);
+
+    Elf_span span;
+    bool found = find_elf(data, 0, data_len, &span);
+    assert(found && span.offset == x86_offset && span.length == x86_size && span.filter == BLOCK_FILTER_X86);
+    found = find_elf(data, x86_offset + 1, data_len, &span);
+    assert(found && span.offset == arm_offset && span.length == arm_size && span.filter == BLOCK_FILTER_ARM64);
+    found = find_elf(data, arm_offset + 1, data_len, &span);
+    assert(!found);
+    (void)found;
+
+    int levels[] = {1, 6, 9, CM_LEVEL};
+    for (int l = 0; l < 4; l++) {
+        Compressed_file blocks = {0};
+        int result = map_blocks((const char *)data, data_len, levels[l], &blocks);
+        assert(result == SUCCESS);
+        size_t filtered = 0;
+        size_t offset = 0;
+        size_t produced = 0;
+        while (offset < blocks.block_data_size) {
+            Block_header header;
+            memcpy(&header, blocks.block_data + offset, sizeof(header));
+            bool in_x86 = produced >= x86_offset && produced < x86_offset + x86_size;
+            bool in_arm = produced >= arm_offset && produced < arm_offset + arm_size;
+            assert(header.flags == (in_x86 ? BLOCK_FILTER_X86 : in_arm ? BLOCK_FILTER_ARM64 : 0));
+            if (in_arm) assert((produced - arm_offset) % 4 == 0);
+            filtered += header.flags != 0;
+            produced += header.raw_size;
+            offset += sizeof(Block_header) + header.payload_size;
+        }
+        assert(filtered >= 2 && produced == data_len);
+
+        char *decoded = malloc(data_len);
+        assert(decoded != NULL);
+        blocks.original_size = data_len;
+        result = decompress(&blocks, decoded);
+        assert(result == 0);
+        assert(memcmp(decoded, data, data_len) == 0);
+
+        // Small pieces of input and output, so the decoder waits inside the filtered blocks.
+        char name[] = "filtered.bin";
+        blocks.original_file = name;
+        long image_size = compressed_file_size(&blocks);
+        unsigned char *image = malloc(image_size);
+        assert(image != NULL);
+        serialize_compressed(&blocks, image);
+        static Stream_decoder decoder;
+        stream_decoder_init(&decoder);
+        memset(decoded, 0, data_len);
+        size_t in_pos = 0;
+        size_t out_pos = 0;
+        int status = SUCCESS;
+        srand(5);
+        bool done = false;
+        while (status == SUCCESS && !done) {
+            size_t in_len = 1 + rand() % 5000;
+            size_t out_cap = 1 + rand() % 5000;
+            if (in_len > image_size - in_pos) in_len = image_size - in_pos;
+            if (out_cap > data_len - out_pos) out_cap = data_len - out_pos;
+            size_t in_used = 0;
+            size_t out_len = 0;
+            status = stream_decode(&decoder, (const char *)image + in_pos, in_len, &in_used, decoded + out_pos, out_cap, &out_len, &done);
+            in_pos += in_used;
+            out_pos += out_len;
+        }
+        assert(status == SUCCESS && done);
+        assert(in_pos == (size_t)image_size && out_pos == data_len);
+        assert(memcmp(decoded, data, data_len) == 0);
+
+        // A decoder given up inside a filtered block hands its buffers back.
+        stream_decoder_init(&decoder);
+        size_t in_used = 0;
+        size_t out_len = 0;
+        status = stream_decode(&decoder, (const char *)image, image_size, &in_used, decoded, x86_offset + 100, &out_len, &done);
+        assert(status == SUCCESS && decoder.whole_raw != NULL);
+        stream_decoder_release(&decoder);
+        assert(decoder.whole_raw == NULL && decoder.whole_payload == NULL);
+        (void)status;
+
+        // A filter this version does not know is an error.
+        offset = 0;
+        while (true) {
+            Block_header header;
+            memcpy(&header, blocks.block_data + offset, sizeof(header));
+            if (header.flags != 0) {
+                header.flags = 0x80;
+                memcpy(blocks.block_data + offset, &header, sizeof(header));
+                break;
+            }
+            offset += sizeof(Block_header) + header.payload_size;
+        }
+        result = decompress(&blocks, decoded);
+        assert(result == DECOMPRESSION_ERROR);
+        (void)result;
+
+        free(image);
+        free(decoded);
+        unmap_blocks(&blocks);
+    }
+
+    free(data);
+    printf("test_elf_round_trip passed\n");
+}
+
+int main() {
+    debugmalloc_max_block_size(8 * 1024 * 1024);
+    test_filters_invert();
+    test_elf_round_trip();
+    printf("All filter tests passed!\n");
+    return 0;
+}
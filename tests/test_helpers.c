@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "test_helpers.h"
+#include "../lib/compress.h"
+#include "../lib/block.h"
+#include "../lib/directory.h"
+#include "../lib/file.h"
+#include "../lib/data_types.h"
+
+/*
+ * Creates (or replaces) the file at path with the given text.
+ */
+void write_text(const char *path, const char *text) {
+    FILE *f = fopen(path, "w");
+    assert(f != NULL);
+    fputs(text, f);
+    fclose(f);
+}
+
+/*
+ * Compresses a file, or a directory with directory set, into output as the command line does,
+ * overwriting it. The input is mapped rather than read, so it may exceed the allocator limit.
+ * Returns the result of run_compression or a negative code if the input cannot be read.
+ */
+int compress_path(char *input, char *output, bool directory) {
+    Arguments args = {0};
+    args.compress_mode = true;
+    args.force = true;
+    args.directory = directory;
+    args.input_file = input;
+    args.output_file = output;
+
+    const char *data = NULL;
+    long data_len = 0;
+    long directory_size = 0;
+    if (directory) {
+        int directory_size_int = 0;
+        FILE *temp_file = prepare_directory(input, &directory_size_int);
+        if (temp_file == NULL) return FILE_WRITE_ERROR;
+        directory_size = directory_size_int;
+        data_len = map_from_file(temp_file, &data);
+        fclose(temp_file);
+    } else {
+        data_len = read_raw(input, &data);
+        directory_size = data_len;
+    }
+    if (data_len < 0) return data_len;
+    int result = run_compression(args, data, data_len, directory_size);
+    if (data_len > 0) munmap((void *)data, data_len);
+    return result;
+}
+
+/*
+ * Codes data as a block-format archive the way the command line does (write_blocks, into a scratch file)
+ * and maps a private copy of its blocks at compressed->block_data, so tests may inspect or alter them.
+ * The header fields are set for an unnamed file; release the blocks with unmap_blocks.
+ * Returns SUCCESS or the negative code from write_blocks.
+ */
+int map_blocks(const char *data, size_t data_len, int level, Compressed_file *compressed) {
+    static char scratch[64];
+    static char name[] = "blocks";
+    // Named per process, as the test executables may run side by side in one directory.
+    snprintf(scratch, sizeof(scratch), "test_blocks_%d.huff", (int)getpid());
+    memset(compressed, 0, sizeof(*compressed));
+    compressed->file_name = scratch;
+    compressed->original_file = name;
+    compressed->original_size = data_len;
+    long size = write_blocks(compressed, data, data_len, level, true, -1);
+    if (size < 0) return size;
+
+    long header_size = compressed_file_size(compressed);
+    compressed->block_data_size = size - header_size;
+    // At least a page is mapped so that empty block data is still a mapping to release.
+    compressed->block_data = mmap(NULL, compressed->block_data_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(compressed->block_data != MAP_FAILED);
+    int fd = open(scratch, O_RDONLY);
+    assert(fd != -1);
+    ssize_t read_size = pread(fd, compressed->block_data, compressed->block_data_size, header_size);
+    assert(read_size == (ssize_t)compressed->block_data_size);
+    (void)read_size;
+    close(fd);
+    unlink(scratch);
+    return SUCCESS;
+}
+
+/*
+ * Releases the blocks mapped by map_blocks.
+ */
+void unmap_blocks(Compressed_file *compressed) {
+    munmap(compressed->block_data, compressed->block_data_size + 1);
+    compressed->block_data = NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef TEST_HELPERS_H
+#define TEST_HELPERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "../lib/data_types.h"
+
+void write_text(const char *path, const char *text);
+int compress_path(char *input, char *output, bool directory);
+int map_blocks(const char *data, size_t data_len, int level, Compressed_file *compressed);
+void unmap_blocks(Compressed_file *compressed);
+
+#endif // TEST_HELPERS_H
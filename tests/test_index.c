@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include "../lib/index.h"
+#include "../lib/compress.h"
+#include "../lib/directory.h"
+#include "../lib/file.h"
+#include "../lib/data_types.h"
+#include "test_helpers.h"
+#include "../lib/debugmalloc.h"
+
+// Runs diff_indexes on two archives and returns what it printed.
+static long diff_files(char *old_file, char *new_file, char *listing, size_t listing_size) {
+    Member_index old_index;
+    Member_index new_index;
+    int result = read_index(old_file, &old_index);
+    assert(result == SUCCESS);
+    result = read_index(new_file, &new_index);
+    assert(result == SUCCESS);
+    (void)result;
+
+    memset(listing, 0, listing_size);
+    FILE *out = fmemopen(listing, listing_size, "w");
+    assert(out != NULL);
+    long differences = diff_indexes(&old_index, &new_index, out);
+    fclose(out);
+    free_index(&old_index);
+    free_index(&new_index);
+    return differences;
+}
+
+void test_index_lists_members() {
+    mkdir("index_test_dir", 0755);
+    mkdir("index_test_dir/sub", 0700);
+    write_text("index_test_dir/notes.txt", "first draft\n");
+    write_text("index_test_dir/sub/empty.txt", "");
+
+    int comp_result = compress_path("index_test_dir", "index_test.huff", true);
+    assert(comp_result >= 0);
+    (void)comp_result;
+
+    Member_index index;
+    int result = read_index("index_test.huff", &index);
+    assert(result == SUCCESS);
+    assert(index.count == 4);
+    bool found_notes = false;
+    bool found_sub = false;
+    for (size_t i = 0; i < index.count; i++) {
+        if (strcmp(index.entries[i].path, "index_test_dir/notes.txt") == 0) {
+            found_notes = !index.entries[i].is_dir && index.entries[i].size == strlen("first draft\n");
+        }
+        if (strcmp(index.entries[i].path, "index_test_dir/sub") == 0) {
+            found_sub = index.entries[i].is_dir && index.entries[i].perms == 0700;
+        }
+    }
+    assert(found_notes && found_sub);
+    free_index(&index);
+    (void)result;
+    (void)found_notes;
+    (void)found_sub;
+
+    // The archive still restores as before; the index trails the payload.
+    Compressed_file compressed = {0};
+    const char *mmap_ptr = NULL;
+    int mmap_size = read_compressed("index_test.huff", &compressed, &mmap_ptr);
+    assert(mmap_size > 0);
+    munmap((void *)mmap_ptr, mmap_size);
+    free(compressed.file_name);
+    free(compressed.original_file);
+
+    remove("index_test_dir/sub/empty.txt");
+    rmdir("index_test_dir/sub");
+    remove("index_test_dir/notes.txt");
+    rmdir("index_test_dir");
+    remove("index_test.huff");
+    printf("test_index_lists_members passed\n");
+}
+
+void test_index_diff() {
+    mkdir("index_diff_dir", 0755);
+    write_text("index_diff_dir/kept.txt", "unchanged content");
+    write_text("index_diff_dir/edited.txt", "version one");
+    write_text("index_diff_dir/removed.txt", "going away");
+    int comp_result = compress_path("index_diff_dir", "index_old.huff", true);
+    assert(comp_result >= 0);
+
+    // Same size, different content: only the checksum tells them apart.
+    write_text("index_diff_dir/edited.txt", "version two");
+    remove("index_diff_dir/removed.txt");
+    write_text("index_diff_dir/added.txt", "brand new");
+    comp_result = compress_path("index_diff_dir", "index_new.huff", true);
+    assert(comp_result >= 0);
+    (void)comp_result;
+
+    char listing[512];
+    long differences = diff_files("index_old.huff", "index_new.huff", listing, sizeof(listing));
+    assert(differences == 3);
+    assert(strcmp(listing, "A\tindex_diff_dir/added.txt\nM\tindex_diff_dir/edited.txt\nD\tindex_diff_dir/removed.txt\n") == 0);
+    differences = diff_files("index_new.huff", "index_new.huff", listing, sizeof(listing));
+    assert(differences == 0 && listing[0] == '\0');
+    (void)differences;
+
+    remove("index_diff_dir/kept.txt");
+    remove("index_diff_dir/edited.txt");
+    remove("index_diff_dir/added.txt");
+    rmdir("index_diff_dir");
+    remove("index_old.huff");
+    remove("index_new.huff");
+    printf("test_index_diff passed\n");
+}
+
+void test_index_missing() {
+    // An archive from before the index (or any other file) is reported as such, not misread.
+    write_text("index_none.huff", "HUFB this file has no index at its end");
+    Member_index index;
+    int result = read_index("index_none.huff", &index);
+    assert(result == NO_INDEX);
+    assert(index.entries == NULL && index.data == NULL);
+    result = read_index("index_absent.huff", &index);
+    assert(result == FILE_READ_ERROR);
+    (void)result;
+    remove("index_none.huff");
+    printf("test_index_missing passed\n");
+}
+
+int main() {
+    test_index_lists_members();
+    test_index_diff();
+    test_index_missing();
+    printf("All index tests passed!\n");
+    return 0;
+}
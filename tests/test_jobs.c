@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <assert.h>
+#include "../lib/jobs.h"
+#include "../lib/data_types.h"
+#include "../lib/debugmalloc.h"
+
+static char *make_text(size_t length, unsigned int seed) {
+    char *text = malloc(length);
+    assert(text != NULL);
+    srand(seed);
+    for (size_t i = 0; i < length; i++) text[i] = "the quick brown fox  \n"[rand() % 22];
+    return text;
+}
+
+// Waits on the queue's eventfd like an event loop would, then collects one finished job.
+static Job *wait_job(Job_queue *queue) {
+    while (true) {
+        Job *job = job_poll(queue);
+        if (job != NULL) return job;
+        struct pollfd ready = {job_queue_fd(queue), POLLIN, 0};
+        int polled = poll(&ready, 1, 10000);
+        assert(polled == 1);
+        (void)polled;
+    }
+}
+
+void test_jobs_buffer_round_trip() {
+    Job_queue *queue = NULL;
+    int result = job_queue_create(2, &queue);
+    assert(result == SUCCESS);
+
+    size_t length = 3 * 1024 * 1024 + 123;
+    char *text = make_text(length, 1);
+    size_t archive_cap = length + 64 * 1024;
+    char *archive = malloc(archive_cap);
+    char *restored = malloc(length);
+    assert(archive != NULL && restored != NULL);
+
+    Job compress = {0};
+    compress.kind = JOB_COMPRESS;
+    compress.name = "text.txt";
+    compress.in = text;
+    compress.in_len = length;
+    compress.out = archive;
+    compress.out_cap = archive_cap;
+    result = job_submit(queue, &compress);
+    assert(result == SUCCESS);
+    Job *done = wait_job(queue);
+    assert(done == &compress && done->state == JOB_DONE);
+    assert(compress.result > 0 && (size_t)compress.result < length);
+    assert(memcmp(archive, block_magic, sizeof(block_magic)) == 0);
+
+    Job decompress = {0};
+    decompress.kind = JOB_DECOMPRESS;
+    decompress.in = archive;
+    decompress.in_len = compress.result;
+    decompress.out = restored;
+    decompress.out_cap = length;
+    result = job_submit(queue, &decompress);
+    assert(result == SUCCESS);
+    done = wait_job(queue);
+    assert(done == &decompress);
+    assert(decompress.result == (long)length);
+    assert(memcmp(restored, text, length) == 0);
+
+    // An output buffer that cannot hold the result fails the job instead of overrunning.
+    decompress.out_cap = length / 2;
+    result = job_submit(queue, &decompress);
+    assert(result == SUCCESS);
+    done = wait_job(queue);
+    assert(done == &decompress && decompress.result == BUFFER_TOO_SMALL);
+    assert(job_poll(queue) == NULL);
+    (void)result;
+    (void)done;
+
+    job_queue_destroy(queue);
+    free(text);
+    free(archive);
+    free(restored);
+}
+
+void test_jobs_descriptors() {
+    Job_queue *queue = NULL;
+    int result = job_queue_create(0, &queue);
+    assert(result == SUCCESS);
+
+    // Compress from a pipe into a file, then decompress that file into a pipe.
+    size_t length = 40 * 1024;
+    char *text = make_text(length, 2);
+    int input[2];
+    result = pipe(input);
+    assert(result == 0);
+    ssize_t written = write(input[1], text, length);
+    assert(written == (ssize_t)length);
+    (void)written;
+    close(input[1]);
+
+    int archive_fd = open("jobs_test.huff", O_CREAT | O_TRUNC | O_RDWR, 0644);
+    assert(archive_fd != -1);
+    Job compress = {0};
+    compress.kind = JOB_COMPRESS;
+    compress.level = 1;
+    compress.in_fd = input[0];
+    compress.out_fd = archive_fd;
+    result = job_submit(queue, &compress);
+    assert(result == SUCCESS);
+    Job *done = wait_job(queue);
+    assert(done == &compress && compress.result > 0);
+    close(input[0]);
+    lseek(archive_fd, 0, SEEK_SET);
+
+    int output[2];
+    result = pipe(output);
+    assert(result == 0);
+    Job decompress = {0};
+    decompress.kind = JOB_DECOMPRESS;
+    decompress.in_fd = archive_fd;
+    decompress.out_fd = output[1];
+    result = job_submit(queue, &decompress);
+    assert(result == SUCCESS);
+
+    char *restored = malloc(length);
+    assert(restored != NULL);
+    size_t received = 0;
+    while (received < length) {
+        ssize_t n = read(output[0], restored + received, length - received);
+        assert(n > 0);
+        received += n;
+    }
+    done = wait_job(queue);
+    assert(done == &decompress && decompress.result == (long)length);
+    assert(memcmp(restored, text, length) == 0);
+    (void)done;
+    (void)result;
+
+    close(output[0]);
+    close(output[1]);
+    close(archive_fd);
+    remove("jobs_test.huff");
+    job_queue_destroy(queue);
+    free(text);
+    free(restored);
+}
+
+void test_jobs_cancel() {
+    Job_queue *queue = NULL;
+    int result = job_queue_create(1, &queue);
+    assert(result == SUCCESS);
+
+    size_t length = 16 * 1024 * 1024;
+    char *text = make_text(length, 3);
+    int sink = open("/dev/null", O_WRONLY);
+    assert(sink != -1);
+    Job jobs[3];
+    memset(jobs, 0, sizeof(jobs));
+    for (int i = 0; i < 3; i++) {
+        jobs[i].kind = JOB_COMPRESS;
+        jobs[i].level = MAX_LEVEL;
+        jobs[i].in = text;
+        jobs[i].in_len = length;
+        jobs[i].out_fd = sink;
+        result = job_submit(queue, &jobs[i]);
+        assert(result == SUCCESS);
+    }
+
+    // The single worker is busy with the first job, so the second is still queued.
+    job_cancel(queue, &jobs[1]);
+    job_cancel(queue, &jobs[0]);
+    assert(jobs[1].state == JOB_DONE && jobs[1].result == JOB_CANCELLED);
+    Job *first = wait_job(queue);
+    Job *second = wait_job(queue);
+    assert(first == &jobs[1] && second == &jobs[0]);
+    assert(jobs[0].result == JOB_CANCELLED);
+    (void)first;
+    (void)second;
+    (void)result;
+
+    // Destroying the queue stops whatever is left.
+    job_queue_destroy(queue);
+    assert(jobs[2].state == JOB_DONE);
+    close(sink);
+    free(text);
+}
+
+int main() {
+    debugmalloc_max_block_size(32 * 1024 * 1024);
+    test_jobs_buffer_round_trip();
+    test_jobs_descriptors();
+    test_jobs_cancel();
+    printf("All job queue tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <zlib.h>
+#include "../lib/recompress.h"
+#include "../lib/deflate.h"
+#include "../lib/block.h"
+#include "../lib/decompress.h"
+#include "../lib/stream.h"
+#include "../lib/file.h"
+#include "../lib/data_types.h"
+#include "test_helpers.h"
+#include "../lib/debugmalloc.h"
+
+// Text that compresses well once inflated.
+static size_t fill_text(char *out, size_t size, unsigned int seed) {
+    static const char *words[] = {"archive", "member", "deflate", "stream", "the", "of", "block", "zlib", "level", "window"};
+    srand(seed);
+    for (size_t i = 0; i < size;) {
+        const char *word = words[rand() % 10];
+        for (size_t j = 0; word[j] != '\0' && i < size; j++) out[i++] = word[j];
+        if (i < size) out[i++] = ' ';
+    }
+    return size;
+}
+
+// Deflates in into out with the system zlib (window_bits as for deflateInit2). Returns the size written.
+static size_t deflate_with(const char *in, size_t in_len, unsigned char *out, size_t out_cap, int level, int window_bits, int mem_level, int strategy) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    int ret = deflateInit2(&z, level, Z_DEFLATED, window_bits, mem_level, strategy);
+    assert(ret == Z_OK);
+    z.next_in = (Bytef *)in;
+    z.avail_in = in_len;
+    z.next_out = out;
+    z.avail_out = out_cap;
+    ret = deflate(&z, Z_FINISH);
+    assert(ret == Z_STREAM_END);
+    (void)ret;
+    size_t written = z.total_out;
+    deflateEnd(&z);
+    return written;
+}
+
+// Deflates in into out with deflate_exact, as a gzip member or (gzip false) a zlib stream. Returns the size written.
+static size_t deflate_pinned(const char *in, size_t in_len, unsigned char *out, size_t out_cap, int level, int strategy, bool gzip) {
+    static const unsigned char gzip_header[] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3};
+    static const unsigned char zlib_header[] = {0x78, 0x9C};
+    size_t pos = gzip ? sizeof(gzip_header) : sizeof(zlib_header);
+    memcpy(out, gzip ? gzip_header : zlib_header, pos);
+    Deflate_params params = {level, 8, MAX_WBITS, strategy, 0};
+    size_t size = deflate_exact(&params, (const unsigned char *)in, in_len, out + pos, out_cap - pos - 8, NULL);
+    assert(size > 0);
+    pos += size;
+    if (gzip) {
+        unsigned long trailer[] = {crc32(0, (const Bytef *)in, in_len), in_len};
+        for (int i = 0; i < 8; i++) out[pos++] = trailer[i / 4] >> (8 * (i % 4));
+    } else {
+        unsigned long adler = adler32(1, (const Bytef *)in, in_len);
+        for (int i = 0; i < 4; i++) out[pos++] = adler >> (24 - 8 * i);
+    }
+    return pos;
+}
+
+// Appends a PNG chunk of the given type around data.
+static size_t put_chunk(unsigned char *out, const char *type, const unsigned char *data, size_t size) {
+    out[0] = size >> 24;
+    out[1] = size >> 16;
+    out[2] = size >> 8;
+    out[3] = size;
+    memcpy(out + 4, type, 4);
+    memcpy(out + 8, data, size);
+    unsigned long crc = crc32(crc32(0, (const Bytef *)type, 4), data, size);
+    for (int i = 0; i < 4; i++) out[8 + size + i] = crc >> (24 - 8 * i);
+    return size + 12;
+}
+
+/*
+ * Input of plain text, a gzip member, more text, a PNG image chunk and a stream deflate_exact cannot
+ * reproduce with the parameters it is tried with (Huffman-only). Sets the offsets of the streams.
+ */
+static size_t build_input(unsigned char *data, size_t *gzip_offset, size_t *png_offset, size_t *other_offset) {
+    size_t text_size = 150 * 1024;
+    char *text = malloc(text_size);
+    unsigned char *deflated = malloc(text_size);
+    assert(text != NULL && deflated != NULL);
+    size_t pos = fill_text((char *)data, 4000, 1);
+
+    fill_text(text, text_size, 2);
+    size_t gzip_size = deflate_pinned(text, text_size, data + pos, text_size, 9, Z_DEFAULT_STRATEGY, true);
+    *gzip_offset = pos + 10; // The member has a plain 10-byte header.
+    pos += gzip_size;
+    pos += fill_text((char *)data + pos, 3000, 3);
+
+    fill_text(text, text_size, 4);
+    size_t zlib_size = deflate_pinned(text, text_size, deflated, text_size, 6, Z_FILTERED, false);
+    pos += put_chunk(data + pos, "IDAT", deflated, zlib_size);
+    *png_offset = pos - 12 - zlib_size + 8 + 2;
+
+    fill_text(text, text_size, 5);
+    *other_offset = pos + 10;
+    pos += deflate_with(text, text_size, data + pos, text_size, 6, 16 + MAX_WBITS, 8, Z_HUFFMAN_ONLY);
+    pos += fill_text((char *)data + pos, 1000, 6);
+    free(text);
+    free(deflated);
+    return pos;
+}
+
+void test_deflate_exact() {
+    size_t text_size = 100 * 1024;
+    char *text = malloc(text_size);
+    unsigned char *exact = malloc(text_size);
+    unsigned char *system = malloc(text_size);
+    char *inflated = malloc(text_size);
+    assert(text != NULL && exact != NULL && system != NULL && inflated != NULL);
+    fill_text(text, 80 * 1024, 8);
+    // Bytes no match covers, so some blocks are stored.
+    srand(9);
+    for (size_t i = 80 * 1024; i < text_size; i++) text[i] = (char)rand();
+
+    // Output that the system zlib can be held to only when it is the pinned release.
+    bool pinned = strcmp(zlibVersion(), DEFLATE_EXACT_VERSION) == 0;
+    // Every level and strategy, with both memory levels and small and full windows among them.
+    for (int level = 1; level <= 9; level++) {
+        for (int strategy = Z_DEFAULT_STRATEGY; strategy <= Z_FILTERED; strategy++) {
+            int mem_level = 8 + level % 2;
+            int window_bits = level % 3 == 0 ? 9 : 15;
+            Deflate_params params = {level, mem_level, window_bits, strategy, 0};
+            size_t size = deflate_exact(&params, (const unsigned char *)text, text_size, exact, text_size, NULL);
+            assert(size > 0);
+            if (pinned) {
+                size_t system_size = deflate_with(text, text_size, system, text_size, level, -window_bits, mem_level, strategy);
+                assert(system_size == size && memcmp(system, exact, size) == 0);
+            }
+            z_stream z;
+            memset(&z, 0, sizeof(z));
+            int ret = inflateInit2(&z, -MAX_WBITS);
+            z.next_in = exact;
+            z.avail_in = size;
+            z.next_out = (Bytef *)inflated;
+            z.avail_out = text_size;
+            ret = inflate(&z, Z_FINISH);
+            assert(ret == Z_STREAM_END && z.total_out == text_size && memcmp(inflated, text, text_size) == 0);
+            (void)ret;
+            inflateEnd(&z);
+            // Compared rather than written, it stops at the first byte that differs.
+            assert(deflate_exact(&params, (const unsigned char *)text, text_size, NULL, size, exact) == size);
+            exact[size / 2] ^= 1;
+            assert(deflate_exact(&params, (const unsigned char *)text, text_size, NULL, size, exact) == 0);
+            assert(deflate_exact(&params, (const unsigned char *)text, text_size, exact, size - 1, NULL) == 0);
+        }
+    }
+    // Parameters zlib rejects for raw deflate, or that deflate_exact does not cover.
+    Deflate_params small_window = {6, 8, 8, Z_DEFAULT_STRATEGY, 0};
+    Deflate_params huffman_only = {6, 8, 15, Z_HUFFMAN_ONLY, 0};
+    assert(deflate_exact(&small_window, (const unsigned char *)text, text_size, exact, text_size, NULL) == 0);
+    assert(deflate_exact(&huffman_only, (const unsigned char *)text, text_size, exact, text_size, NULL) == 0);
+    (void)small_window;
+    (void)huffman_only;
+    (void)pinned;
+
+    free(text);
+    free(exact);
+    free(system);
+    free(inflated);
+    printf("test_deflate_exact passed\n");
+}
+
+void test_find_streams() {
+    unsigned char *data = malloc(1024 * 1024);
+    assert(data != NULL);
+    size_t gzip_offset = 0;
+    size_t png_offset = 0;
+    size_t other_offset = 0;
+    size_t data_len = build_input(data, &gzip_offset, &png_offset, &other_offset);
+
+    Deflate_stream stream;
+    bool found = find_deflate_stream(data, 0, data_len, data_len, &stream);
+    assert(found && stream.offset == gzip_offset && stream.inflated_size == 150 * 1024);
+    assert(stream.params.level == 9 && stream.params.strategy == Z_DEFAULT_STRATEGY);
+    size_t from = stream.offset + stream.length;
+    found = find_deflate_stream(data, from, data_len, data_len, &stream);
+    assert(found && stream.offset == png_offset && stream.params.level == 6 && stream.params.strategy == Z_FILTERED);
+    // The Huffman-only stream inflates but is not reproduced, so nothing else is found.
+    from = stream.offset + stream.length;
+    assert(from < other_offset);
+    found = find_deflate_stream(data, from, data_len, data_len, &stream);
+    assert(!found);
+    // Nor is a stream longer than allowed.
+    found = find_deflate_stream(data, 0, data_len, 1000, &stream);
+    assert(!found);
+    (void)found;
+
+    free(data);
+    printf("test_find_streams passed\n");
+}
+
+void test_inflated_round_trip() {
+    unsigned char *data = malloc(1024 * 1024);
+    assert(data != NULL);
+    size_t gzip_offset = 0;
+    size_t png_offset = 0;
+    size_t other_offset = 0;
+    size_t data_len = build_input(data, &gzip_offset, &png_offset, &other_offset);
+
+    Compressed_file blocks = {0};
+    int result = map_blocks((const char *)data, data_len, CM_LEVEL, &blocks);
+    assert(result == SUCCESS);
+    size_t inflated_blocks = 0;
+    size_t offset = 0;
+    size_t produced = 0;
+    while (offset < blocks.block_data_size) {
+        Block_header header;
+        memcpy(&header, blocks.block_data + offset, sizeof(header));
+        if (header.method == BLOCK_INFLATED) {
+            assert(produced == gzip_offset || produced == png_offset);
+            inflated_blocks++;
+        }
+        produced += header.raw_size;
+        offset += sizeof(Block_header) + header.payload_size;
+    }
+    assert(inflated_blocks == 2 && produced == data_len);
+
+    char *decoded = malloc(data_len);
+    assert(decoded != NULL);
+    blocks.original_size = data_len;
+    result = decompress(&blocks, decoded);
+    assert(result == 0);
+    assert(memcmp(decoded, data, data_len) == 0);
+
+    // Small pieces of input and output, so the decoder waits inside the inflated blocks.
+    char name[] = "inflated.bin";
+    blocks.original_file = name;
+    long image_size = compressed_file_size(&blocks);
+    unsigned char *image = malloc(image_size);
+    assert(image != NULL);
+    serialize_compressed(&blocks, image);
+    static Stream_decoder decoder;
+    stream_decoder_init(&decoder);
+    memset(decoded, 0, data_len);
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    int status = SUCCESS;
+    srand(7);
+    bool done = false;
+    while (status == SUCCESS && !done) {
+        size_t in_len = 1 + rand() % 5000;
+        size_t out_cap = 1 + rand() % 5000;
+        if (in_len > image_size - in_pos) in_len = image_size - in_pos;
+        if (out_cap > data_len - out_pos) out_cap = data_len - out_pos;
+        size_t in_used = 0;
+        size_t out_len = 0;
+        status = stream_decode(&decoder, (const char *)image + in_pos, in_len, &in_used, decoded + out_pos, out_cap, &out_len, &done);
+        in_pos += in_used;
+        out_pos += out_len;
+    }
+    assert(status == SUCCESS && done);
+    assert(in_pos == (size_t)image_size && out_pos == data_len);
+    assert(memcmp(decoded, data, data_len) == 0);
+
+    // A decoder given up inside an inflated block hands its buffers back.
+    stream_decoder_init(&decoder);
+    size_t in_used = 0;
+    size_t out_len = 0;
+    status = stream_decode(&decoder, (const char *)image, image_size, &in_used, decoded, gzip_offset + 100, &out_len, &done);
+    assert(status == SUCCESS && decoder.whole_raw != NULL);
+    stream_decoder_release(&decoder);
+    assert(decoder.whole_raw == NULL && decoder.whole_payload == NULL);
+
+    // A stream that does not deflate back to its CRC is an error, not silently different data.
+    offset = 0;
+    while (true) {
+        Block_header header;
+        memcpy(&header, blocks.block_data + offset, sizeof(header));
+        if (header.method == BLOCK_INFLATED) break;
+        offset += sizeof(Block_header) + header.payload_size;
+    }
+    Deflate_params params;
+    memcpy(&params, blocks.block_data + offset + sizeof(Block_header), sizeof(params));
+    params.crc ^= 1;
+    memcpy(blocks.block_data + offset + sizeof(Block_header), &params, sizeof(params));
+    result = decompress(&blocks, decoded);
+    assert(result == DECOMPRESSION_ERROR);
+    (void)result;
+    (void)status;
+
+    free(image);
+    free(decoded);
+    unmap_blocks(&blocks);
+    free(data);
+    printf("test_inflated_round_trip passed\n");
+}
+
+int main() {
+    debugmalloc_max_block_size(8 * 1024 * 1024);
+    test_deflate_exact();
+    test_find_streams();
+    test_inflated_round_trip();
+    printf("All recompression tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include "../lib/search.h"
+#include "../lib/compress.h"
+#include "../lib/directory.h"
+#include "../lib/file.h"
+#include "../lib/data_types.h"
+#include "test_helpers.h"
+#include "../lib/debugmalloc.h"
+
+// Runs grep_archive and returns what it printed in listing.
+static long grep_file(char *file_name, char **patterns, int pattern_count, int worker_count, char *listing, size_t listing_size) {
+    memset(listing, 0, listing_size);
+    FILE *out = fmemopen(listing, listing_size, "w");
+    assert(out != NULL);
+    long matches = grep_archive(file_name, patterns, pattern_count, worker_count, out);
+    fclose(out);
+    return matches;
+}
+
+// Writes what the search must print for the text into expected: lines are searched in GREP_LINE_MAX pieces.
+static long expect_lines(const char *text, size_t text_len, char **patterns, int pattern_count, char *expected) {
+    size_t expected_len = 0;
+    long expected_matches = 0;
+    for (size_t start = 0; start < text_len;) {
+        const char *newline = memchr(text + start, '\n', text_len - start);
+        size_t length = (size_t)(newline - (text + start));
+        for (size_t piece = 0; piece < length || piece == 0; piece += GREP_LINE_MAX) {
+            size_t piece_len = (length - piece > GREP_LINE_MAX) ? GREP_LINE_MAX : length - piece;
+            bool found = false;
+            for (int p = 0; p < pattern_count && !found; p++) {
+                found = memmem(text + start + piece, piece_len, patterns[p], strlen(patterns[p])) != NULL;
+            }
+            if (!found) continue;
+            expected_len += sprintf(expected + expected_len, "search_test.txt:%zu:", start + piece);
+            memcpy(expected + expected_len, text + start + piece, piece_len);
+            expected_len += piece_len;
+            expected[expected_len++] = '\n';
+            expected_matches++;
+        }
+        start += length + 1;
+    }
+    expected[expected_len] = '\0';
+    return expected_matches;
+}
+
+void test_grep_across_blocks() {
+    // Several blocks of numbered lines, one of them longer than GREP_LINE_MAX.
+    size_t line_count = 150000;
+    size_t long_line = 77777;
+    size_t text_size = line_count * 24 + 2 * GREP_LINE_MAX;
+    char *text = malloc(text_size);
+    assert(text != NULL);
+    size_t text_len = 0;
+    for (size_t i = 0; i < line_count; i++) {
+        text_len += sprintf(text + text_len, (i % 997 == 0) ? "row %07zu needle\n" : "row %07zu hay\n", i);
+        if (i == long_line) {
+            memset(text + text_len, 'x', GREP_LINE_MAX + 100);
+            memcpy(text + text_len + GREP_LINE_MAX + 50, "needle", 6);
+            text_len += GREP_LINE_MAX + 100;
+            text[text_len++] = '\n';
+        }
+    }
+    FILE *f = fopen("search_test.txt", "w");
+    assert(f != NULL);
+    fwrite(text, 1, text_len, f);
+    fclose(f);
+    int comp_result = compress_path("search_test.txt", "search_test.huff", false);
+    assert(comp_result >= 0);
+    (void)comp_result;
+
+    size_t listing_size = 256 * 1024;
+    char *expected = malloc(listing_size);
+    char *listing = malloc(listing_size);
+    assert(expected != NULL && listing != NULL);
+    char *needle[] = {"needle"};
+    long expected_matches = expect_lines(text, text_len, needle, 1, expected);
+    for (int workers = 1; workers <= 4; workers++) {
+        long matches = grep_file("search_test.huff", needle, 1, workers, listing, listing_size);
+        assert(matches == expected_matches);
+        assert(strcmp(listing, expected) == 0);
+        (void)matches;
+    }
+    char *missing[] = {"no such text"};
+    long matches = grep_file("search_test.huff", missing, 1, 3, listing, listing_size);
+    assert(matches == 0 && listing[0] == '\0');
+
+    // Several patterns, two of them starting with the same byte: a line containing any of them is printed once.
+    char *several[] = {"row 00123", "needle", "row 0149999", "xneedle"};
+    expected_matches = expect_lines(text, text_len, several, 4, expected);
+    matches = grep_file("search_test.huff", several, 4, 3, listing, listing_size);
+    assert(matches == expected_matches && matches > 100);
+    assert(strcmp(listing, expected) == 0);
+    (void)matches;
+
+    free(text);
+    free(expected);
+    free(listing);
+    remove("search_test.txt");
+    remove("search_test.huff");
+    printf("test_grep_across_blocks passed\n");
+}
+
+void test_grep_directory_members() {
+    mkdir("search_test_dir", 0755);
+    // The first member ends without a newline, so its last line runs into the next item.
+    write_text("search_test_dir/a.txt", "first\nneedle one");
+    write_text("search_test_dir/b.txt", "needle two\nlast\n");
+
+    int comp_result = compress_path("search_test_dir", "search_dir.huff", true);
+    assert(comp_result >= 0);
+    (void)comp_result;
+
+    char listing[256];
+    char *needle[] = {"needle"};
+    long matches = grep_file("search_dir.huff", needle, 1, 2, listing, sizeof(listing));
+    assert(matches == 2);
+    assert(strstr(listing, "search_test_dir/a.txt:6:needle one\n") != NULL);
+    assert(strstr(listing, "search_test_dir/b.txt:0:needle two\n") != NULL);
+    assert(strlen(listing) == strlen("search_test_dir/a.txt:6:needle one\nsearch_test_dir/b.txt:0:needle two\n"));
+    (void)matches;
+
+    remove("search_test_dir/a.txt");
+    remove("search_test_dir/b.txt");
+    rmdir("search_test_dir");
+    remove("search_dir.huff");
+    printf("test_grep_directory_members passed\n");
+}
+
+int main() {
+    debugmalloc_max_block_size(8 * 1024 * 1024);
+    test_grep_across_blocks();
+    test_grep_directory_members();
+    printf("All search tests passed!\n");
+    return 0;
+}
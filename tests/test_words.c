@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "../lib/words.h"
+#include "../lib/block.h"
+#include "../lib/decompress.h"
+#include "../lib/stream.h"
+#include "../lib/file.h"
+#include "../lib/data_types.h"
+#include "test_helpers.h"
+#include "../lib/debugmalloc.h"
+
+// Log lines built from a small vocabulary, with numbers and an identifier longer than WORD_MAX_LENGTH.
+static size_t fill_log(char *out, size_t size, unsigned int seed) {
+    static const char *levels[] = {"INFO", "WARN", "ERROR", "DEBUG"};
+    static const char *messages[] = {
+        "connection accepted from", "request completed for", "cache miss on key",
+        "retrying upload of chunk", "worker_thread_pool_scheduler_with_a_rather_long_name_for_testing_limits finished",
+    };
+    srand(seed);
+    size_t pos = 0;
+    while (pos < size) {
+        char line[256];
+        int length = snprintf(line, sizeof(line), "2026-10-%02d 12:%02d:%02d [%s] %s client-%d (%d ms)\n",
+                              1 + rand() % 28, rand() % 60, rand() % 60, levels[rand() % 4], messages[rand() % 5],
+                              rand() % 50, rand() % 1000);
+        for (int i = 0; i < length && pos < size; i++) out[pos++] = line[i];
+    }
+    return size;
+}
+
+void test_encode_words() {
+    size_t size = 200 * 1024;
+    char *text = malloc(size);
+    unsigned char *payload = malloc(size);
+    char *decoded = malloc(size + 100);
+    assert(text != NULL && payload != NULL && decoded != NULL);
+    fill_log(text, size, 1);
+
+    size_t payload_size = encode_words((const unsigned char *)text, size, payload, size);
+    assert(payload_size > 0 && payload_size < size / 3);
+    int result = decode_words(payload, payload_size, decoded, size);
+    assert(result == 0);
+    assert(memcmp(decoded, text, size) == 0);
+
+    // Nothing is written when the payload would not fit.
+    size_t too_small = encode_words((const unsigned char *)text, size, payload, payload_size - 1);
+    assert(too_small == 0);
+    (void)too_small;
+
+    // A truncated payload or a wrong size is an error, not a short read.
+    result = decode_words(payload, payload_size / 2, decoded, size);
+    assert(result == DECOMPRESSION_ERROR);
+    result = decode_words(payload, payload_size, decoded, size + 100);
+    assert(result == DECOMPRESSION_ERROR);
+
+    // Bytes with no words in them leave nothing worth a dictionary.
+    srand(2);
+    for (size_t i = 0; i < size; i++) text[i] = (char)rand();
+    payload_size = encode_words((const unsigned char *)text, size, payload, size);
+    if (payload_size > 0) {
+        result = decode_words(payload, payload_size, decoded, size);
+        assert(result == 0 && memcmp(decoded, text, size) == 0);
+    }
+    (void)result;
+
+    free(text);
+    free(payload);
+    free(decoded);
+    printf("test_encode_words passed\n");
+}
+
+void test_words_round_trip() {
+    size_t data_len = 600 * 1024;
+    char *data = malloc(data_len);
+    assert(data != NULL);
+    fill_log(data, data_len, 3);
+
+    // Bytes-only coding first, for comparison.
+    Compressed_file plain = {0};
+    int result = map_blocks(data, data_len, DEFAULT_LEVEL, &plain);
+    assert(result == SUCCESS);
+
+    set_words(true);
+    Compressed_file blocks = {0};
+    result = map_blocks(data, data_len, DEFAULT_LEVEL, &blocks);
+    set_words(false);
+    assert(result == SUCCESS);
+    assert(blocks.block_data_size < plain.block_data_size * 2 / 3);
+    size_t word_blocks = 0;
+    size_t offset = 0;
+    while (offset < blocks.block_data_size) {
+        Block_header header;
+        memcpy(&header, blocks.block_data + offset, sizeof(header));
+        word_blocks += header.method == BLOCK_WORDS;
+        offset += sizeof(Block_header) + header.payload_size;
+    }
+    assert(word_blocks > 0);
+
+    char *decoded = malloc(data_len);
+    assert(decoded != NULL);
+    blocks.original_size = data_len;
+    result = decompress(&blocks, decoded);
+    assert(result == 0);
+    assert(memcmp(decoded, data, data_len) == 0);
+
+    // Small pieces of input and output, so the decoder waits inside the word-coded blocks.
+    char name[] = "words.log";
+    blocks.original_file = name;
+    long image_size = compressed_file_size(&blocks);
+    unsigned char *image = malloc(image_size);
+    assert(image != NULL);
+    serialize_compressed(&blocks, image);
+    static Stream_decoder decoder;
+    stream_decoder_init(&decoder);
+    memset(decoded, 0, data_len);
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    int status = SUCCESS;
+    srand(4);
+    bool done = false;
+    while (status == SUCCESS && !done) {
+        size_t in_len = 1 + rand() % 5000;
+        size_t out_cap = 1 + rand() % 5000;
+        if (in_len > image_size - in_pos) in_len = image_size - in_pos;
+        if (out_cap > data_len - out_pos) out_cap = data_len - out_pos;
+        size_t in_used = 0;
+        size_t out_len = 0;
+        status = stream_decode(&decoder, (const char *)image + in_pos, in_len, &in_used, decoded + out_pos, out_cap, &out_len, &done);
+        in_pos += in_used;
+        out_pos += out_len;
+    }
+    assert(status == SUCCESS && done);
+    assert(in_pos == (size_t)image_size && out_pos == data_len);
+    assert(memcmp(decoded, data, data_len) == 0);
+
+    // A decoder given up inside a word-coded block hands its buffers back.
+    stream_decoder_init(&decoder);
+    size_t in_used = 0;
+    size_t out_len = 0;
+    status = stream_decode(&decoder, (const char *)image, image_size, &in_used, decoded, 100, &out_len, &done);
+    assert(status == SUCCESS && decoder.whole_raw != NULL);
+    stream_decoder_release(&decoder);
+    assert(decoder.whole_raw == NULL && decoder.whole_payload == NULL);
+    (void)status;
+
+    // A dictionary word shorter than two bytes cannot come from the encoder.
+    offset = 0;
+    while (true) {
+        Block_header header;
+        memcpy(&header, blocks.block_data + offset, sizeof(header));
+        if (header.method == BLOCK_WORDS) break;
+        offset += sizeof(Block_header) + header.payload_size;
+    }
+    blocks.block_data[offset + sizeof(Block_header) + sizeof(unsigned short)] = 1;
+    result = decompress(&blocks, decoded);
+    assert(result == DECOMPRESSION_ERROR);
+    (void)result;
+
+    free(image);
+    free(decoded);
+    unmap_blocks(&blocks);
+    unmap_blocks(&plain);
+    free(data);
+    printf("test_words_round_trip passed\n");
+}
+
+int main() {
+    debugmalloc_max_block_size(8 * 1024 * 1024);
+    test_encode_words();
+    test_words_round_trip();
+    printf("All word coding tests passed!\n");
+    return 0;
+}